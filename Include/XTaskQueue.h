@@ -43,7 +43,9 @@ enum class XTaskQueueDispatchMode : uint32_t
     
     /// <summary>
     /// Callbacks are queued to the system thread pool and
-    /// will be processed one at a time.
+    /// will be processed one at a time. Queued callbacks are run
+    /// in batches, so a burst of small callbacks needs only a few
+    /// thread pool wakeups.
     /// </summary>
     SerializedThreadPool,
     
@@ -71,6 +73,31 @@ enum class XTaskQueuePort : uint32_t
     Completion
 };
 
+/// <summary>
+/// The priority lane a callback is queued in. Within a port, callbacks
+/// in a higher priority lane are dispatched before callbacks in a lower
+/// one; callbacks in the same lane are dispatched in order. A lower lane
+/// that keeps getting passed over is eventually given a turn so it is
+/// never starved.
+/// </summary>
+enum class XTaskQueuePriority : uint32_t
+{
+    /// <summary>
+    /// Latency sensitive callbacks that should jump ahead of other work.
+    /// </summary>
+    High,
+
+    /// <summary>
+    /// The default priority.
+    /// </summary>
+    Normal,
+
+    /// <summary>
+    /// Bulk work that should only run when nothing else is waiting.
+    /// </summary>
+    Background
+};
+
 /// <summary>
 /// A token returned when registering a callback to identify the registration. This token
 /// is later used to unregister the callback.
@@ -103,6 +130,56 @@ typedef void CALLBACK XTaskQueueMonitorCallback(_In_opt_ void* context, _In_ XTa
 /// <param name='context'>A context pointer that was passed during XTaskQueueTerminate.</param>
 typedef void CALLBACK XTaskQueueTerminatedCallback(_In_opt_ void* context);
 
+/// <summary>
+/// Controls the threads that service ThreadPool and SerializedThreadPool
+/// ports of a task queue.
+/// </summary>
+struct XTaskQueueThreadPoolOptions
+{
+    /// <summary>
+    /// Optional name of a shared pool. Ports created with the same pool name
+    /// share one set of threads, and the pool takes its settings from the
+    /// first queue that creates it. When null, each port gets its own pool.
+    /// </summary>
+    const char* poolName;
+
+    /// <summary>
+    /// Number of threads the pool keeps running. Zero uses the number of
+    /// processors.
+    /// </summary>
+    uint32_t minThreads;
+
+    /// <summary>
+    /// Number of threads the pool may grow to while all of its threads are
+    /// busy. Extra threads exit after being idle for a while. Zero, or a
+    /// value below minThreads, keeps the pool at minThreads.
+    /// </summary>
+    uint32_t maxThreads;
+
+    /// <summary>
+    /// Bit mask of the processors the pool's threads may run on. Zero lets
+    /// the OS place them. Ignored on platforms that don't support thread
+    /// affinity, and by the Windows system thread pool.
+    /// </summary>
+    uint64_t affinityMask;
+
+    /// <summary>
+    /// Maximum number of callbacks a SerializedThreadPool port runs on a
+    /// pool thread before yielding the thread and rescheduling itself. Zero
+    /// uses a default of 64. Unlike the thread settings this applies to
+    /// each port created with these options, even when the pool is shared.
+    /// </summary>
+    uint32_t maxBatchSize;
+
+    /// <summary>
+    /// Maximum time in milliseconds a SerializedThreadPool port keeps a
+    /// pool thread before yielding it and rescheduling itself. The callback
+    /// running when the time is up always completes. Zero uses a default
+    /// of 10 milliseconds.
+    /// </summary>
+    uint32_t batchTimeSliceMs;
+};
+
 /// <summary>
 /// Creates a Task Queue, which can be used to queue
 /// and dispatch calls.  Task Queues are
@@ -118,6 +195,21 @@ STDAPI XTaskQueueCreate(
     _Out_ XTaskQueueHandle* queue
     ) noexcept;
 
+/// <summary>
+/// Creates a Task Queue like XTaskQueueCreate, using the given options
+/// for the threads behind any ThreadPool or SerializedThreadPool ports.
+/// </summary>
+/// <param name='workDispatchMode'>The dispatch mode for the "work" port of the queue.</param>
+/// <param name='completionDispatchMode'>The dispatch mode for the "completion" port of the queue.</param>
+/// <param name='options'>Thread pool options. Passing null is the same as calling XTaskQueueCreate.</param>
+/// <param name='queue'>The newly created queue.</param>
+STDAPI XTaskQueueCreateWithOptions(
+    _In_ XTaskQueueDispatchMode workDispatchMode,
+    _In_ XTaskQueueDispatchMode completionDispatchMode,
+    _In_opt_ const XTaskQueueThreadPoolOptions* options,
+    _Out_ XTaskQueueHandle* queue
+    ) noexcept;
+
 /// <summary>
 /// Creates a task queue composed of ports of other
 /// task queues. A composite task queue will duplicate
@@ -131,6 +223,23 @@ STDAPI XTaskQueueCreateComposite(
     _Out_ XTaskQueueHandle* queue
     ) noexcept;
 
+/// <summary>
+/// Creates a composite task queue like XTaskQueueCreateComposite whose
+/// callbacks are queued at the given priority. Async calls that use
+/// this queue in their XAsyncBlock run their work and completion callbacks
+/// in that priority lane of the underlying ports.
+/// </summary>
+/// <param name='workPort'>The port to use for queuing work callbacks.</param>
+/// <param name='completionPort'>The port to use for queuing completion callbacks.</param>
+/// <param name='priority'>The priority of callbacks submitted through the new queue.</param>
+/// <param name='queue'>The newly created queue.</param>
+STDAPI XTaskQueueCreateCompositeWithPriority(
+    _In_ XTaskQueuePortHandle workPort,
+    _In_ XTaskQueuePortHandle completionPort,
+    _In_ XTaskQueuePriority priority,
+    _Out_ XTaskQueueHandle* queue
+    ) noexcept;
+
 /// <summary>
 /// Returns the task queue port handle for the given
 /// port. Task queue port handles are owned by the
@@ -211,6 +320,23 @@ STDAPI XTaskQueueSubmitCallback(
     _In_ XTaskQueueCallback* callback
     ) noexcept;
 
+/// <summary>
+/// Submits a callback to the queue for the given port at the given
+/// priority, overriding the priority of the queue.
+/// </summary>
+/// <param name='queue'>The queue to submit the callback to.</param>
+/// <param name='port'>The port to submit the callback to.</param>
+/// <param name='priority'>The priority lane to queue the callback in.</param>
+/// <param name='callbackContext'>An optional context pointer that will be passed to the callback.</param>
+/// <param name='callback'>A pointer to the callback function.</param>
+STDAPI XTaskQueueSubmitCallbackWithPriority(
+    _In_ XTaskQueueHandle queue,
+    _In_ XTaskQueuePort port,
+    _In_ XTaskQueuePriority priority,
+    _In_opt_ void* callbackContext,
+    _In_ XTaskQueueCallback* callback
+    ) noexcept;
+
 /// <summary>
 /// Submits a callback to the queue for the given port.  The callback will be added
 /// to the queue after delayMs milliseconds.
@@ -228,11 +354,33 @@ STDAPI XTaskQueueSubmitDelayedCallback(
     _In_ XTaskQueueCallback* callback
     ) noexcept;
 
+/// <summary>
+/// Submits a batch of callbacks to the queue for the given port.  The callbacks
+/// are added to the queue together, in order, and the queue is signaled and
+/// monitors are notified once for the whole batch rather than once per callback.
+/// Code that dispatches one callback per monitor notification should keep
+/// dispatching until XTaskQueueDispatch returns false.
+/// </summary>
+/// <param name='queue'>The queue to submit the callbacks to.</param>
+/// <param name='port'>The port to submit the callbacks to.</param>
+/// <param name='count'>The number of callbacks to submit.</param>
+/// <param name='callbackContexts'>An optional array of count context pointers, one passed to each callback.</param>
+/// <param name='callbacks'>An array of count callback pointers.</param>
+STDAPI XTaskQueueSubmitCallbacks(
+    _In_ XTaskQueueHandle queue,
+    _In_ XTaskQueuePort port,
+    _In_ uint32_t count,
+    _In_reads_opt_(count) void* const* callbackContexts,
+    _In_reads_(count) XTaskQueueCallback* const* callbacks
+    ) noexcept;
+
 /// <summary>
 /// Registers a wait handle with the task queue.  When the wait handle
 /// is satisfied the task queue will invoke the given callback. This
 /// provides an efficient way to add items to a task queue in 
-/// response to handles becoming signaled.
+/// response to handles becoming signaled. Wait handles are only
+/// supported on Windows; on Linux use XTaskQueueRegisterFileDescriptorWaiter.
+/// On Windows each port can monitor up to 60 handles at a time.
 /// </summary>
 /// <param name='queue'>The queue to submit the callback to.</param>
 /// <param name='port'>The port to invoke the callback on.</param>
@@ -249,6 +397,34 @@ STDAPI XTaskQueueRegisterWaiter(
     _Out_ XTaskQueueRegistrationToken* token
     ) noexcept;
 
+#if !defined(_WIN32)
+/// <summary>
+/// Registers a file descriptor with the task queue, such as a socket
+/// or an eventfd. Each time the descriptor becomes readable, or reports
+/// an error or hang up, the task queue invokes the given callback. The
+/// callback must consume what made the descriptor ready, for example by
+/// reading the eventfd, or it will be invoked again. All descriptors in
+/// the process are watched by one epoll thread, and there is no limit on
+/// the number of registrations. Remove the registration with
+/// XTaskQueueUnregisterWaiter before closing the descriptor. Returns
+/// E_NOTIMPL on platforms other than Linux.
+/// </summary>
+/// <param name='queue'>The queue to submit the callback to.</param>
+/// <param name='port'>The port to invoke the callback on.</param>
+/// <param name='fd'>The file descriptor to monitor.</param>
+/// <param name='callbackContext'>An optional context pointer that will be passed to the callback.</param>
+/// <param name='callback'>A pointer to the callback function.</param>
+/// <param name='token'>A registration token.</param>
+STDAPI XTaskQueueRegisterFileDescriptorWaiter(
+    _In_ XTaskQueueHandle queue,
+    _In_ XTaskQueuePort port,
+    _In_ int fd,
+    _In_opt_ void* callbackContext,
+    _In_ XTaskQueueCallback* callback,
+    _Out_ XTaskQueueRegistrationToken* token
+    ) noexcept;
+#endif
+
 /// <summary>
 /// Unregisters a previously registered task queue waiter.
 /// </summary>
@@ -247,6 +247,21 @@ STDAPI HCHttpCallCloseHandle(
     _In_ HCCallHandle call
     ) noexcept;
 
+/// <summary>
+/// Enables recycling of HCCallHandle objects.  Once pooling is enabled, a call whose ref count
+/// reaches 0 is kept instead of freed and handed back out by HCHttpCallCreate(), along with the
+/// capacity of its URL, request body and response body buffers.  A returned call gives up its
+/// buffers if keeping them would push the pool over maxRetainedBytes.
+/// Pooling is disabled by default and the limits are reset by HCCleanup().
+/// </summary>
+/// <param name="maxPooledCalls">The maximum number of unused calls to keep.  Pass 0 to disable pooling and free any pooled calls.</param>
+/// <param name="maxRetainedBytes">The maximum number of buffer bytes the pooled calls may hold on to.</param>
+/// <returns>Result code for this API operation.  Possible values are S_OK, E_HC_NOT_INITIALISED, E_OUTOFMEMORY, or E_FAIL.</returns>
+STDAPI HCHttpCallSetPoolLimits(
+    _In_ uint32_t maxPooledCalls,
+    _In_ size_t maxRetainedBytes
+    ) noexcept;
+
 /// <summary>
 /// Returns a unique uint64_t which identifies this HTTP call object
 /// </summary>
@@ -325,6 +340,58 @@ STDAPI HCHttpCallRequestSetRequestBodyString(
     _In_z_ const char* requestBodyString
     ) noexcept;
 
+/// <summary>
+/// Passed as the body size to HCHttpCallRequestSetRequestBodyReadFunction() when the length of
+/// the body isn't known up front.  Providers that support it send such bodies with chunked
+/// transfer encoding.
+/// </summary>
+#define HC_HTTP_REQUEST_BODY_SIZE_UNKNOWN UINT64_MAX
+
+/// <summary>
+/// A callback the provider invokes to pull the next part of the request body of an HTTP call
+/// that has a read function set with HCHttpCallRequestSetRequestBodyReadFunction().
+/// </summary>
+/// <param name="call">The handle of the HTTP call.</param>
+/// <param name="offset">The position in the body to read from.  This starts over at 0 if the request is sent again.</param>
+/// <param name="bytesAvailable">The size of destination.</param>
+/// <param name="context">The context passed to HCHttpCallRequestSetRequestBodyReadFunction().</param>
+/// <param name="destination">Receives the body data.</param>
+/// <param name="bytesWritten">The number of bytes written to destination.  Writing 0 bytes marks the end of the body.</param>
+/// <returns>S_OK on success.  Any failure aborts the call and becomes its network error code.</returns>
+typedef HRESULT
+(CALLBACK* HCHttpCallRequestBodyReadFunction)(
+    _In_ HCCallHandle call,
+    _In_ uint64_t offset,
+    _In_ size_t bytesAvailable,
+    _In_opt_ void* context,
+    _Out_writes_bytes_to_(bytesAvailable, *bytesWritten) uint8_t* destination,
+    _Out_ size_t* bytesWritten
+    );
+
+/// <summary>
+/// Sets a function that supplies the request body of the HTTP call on demand, so the body
+/// never has to be held in memory and can be larger than 4 GB.
+///
+/// Providers invoke readFunction from their own threads as they send the request, so it should
+/// return promptly.  If bodySize is known the provider reads exactly that many bytes, otherwise
+/// it reads until readFunction writes 0 bytes.  This replaces any body set with
+/// HCHttpCallRequestSetRequestBodyBytes() or HCHttpCallRequestSetRequestBodyString(), and
+/// setting either of those later replaces the read function.
+///
+/// This must be called prior to calling HCHttpCallPerformAsync.
+/// </summary>
+/// <param name="call">The handle of the HTTP call.</param>
+/// <param name="readFunction">The function that supplies the request body.</param>
+/// <param name="bodySize">The length of the body in bytes, or HC_HTTP_REQUEST_BODY_SIZE_UNKNOWN.</param>
+/// <param name="context">Client context to pass to readFunction.</param>
+/// <returns>Result code for this API operation.  Possible values are S_OK, E_INVALIDARG, E_HC_PERFORM_ALREADY_CALLED, or E_FAIL.</returns>
+STDAPI HCHttpCallRequestSetRequestBodyReadFunction(
+    _In_ HCCallHandle call,
+    _In_ HCHttpCallRequestBodyReadFunction readFunction,
+    _In_ uint64_t bodySize,
+    _In_opt_ void* context
+    ) noexcept;
+
 /// <summary>
 /// Set a request header for the HTTP call
 /// This must be called prior to calling HCHttpCallPerformAsync.
@@ -437,6 +504,47 @@ STDAPI HCHttpCallRequestSetTimeoutWindow(
     ) noexcept;
 
 
+/// <summary>
+/// A callback invoked with the next part of the response body of an HTTP call that has a
+/// write function set with HCHttpCallResponseSetResponseBodyWriteFunction().
+/// </summary>
+/// <param name="call">The handle of the HTTP call.</param>
+/// <param name="source">The response body data.  Only valid for the duration of the callback.</param>
+/// <param name="bytesAvailable">The length in bytes of the data.</param>
+/// <param name="context">The context passed to HCHttpCallResponseSetResponseBodyWriteFunction().</param>
+/// <returns>S_OK to keep receiving the body.  Any failure aborts the call and becomes its network error code.</returns>
+typedef HRESULT
+(CALLBACK* HCHttpCallResponseBodyWriteFunction)(
+    _In_ HCCallHandle call,
+    _In_reads_bytes_(bytesAvailable) const uint8_t* source,
+    _In_ size_t bytesAvailable,
+    _In_opt_ void* context
+    );
+
+/// <summary>
+/// Streams the response body to writeFunction instead of buffering it in the call.
+///
+/// The body is handed to writeFunction in order, one part at a time, as it arrives.  The callbacks
+/// run on the work port of the queue passed to HCHttpCallPerformAsync(), and the call only completes
+/// after the last of them has returned.  When writeFunction falls behind, providers that support it
+/// stop reading from the network until it catches up.
+///
+/// HCHttpCallResponseGetResponseString() and HCHttpCallResponseGetResponseBodyBytes() return an empty
+/// body for calls with a write function, and these calls are not retried automatically since part of
+/// the body may already have been consumed.
+///
+/// This must be called prior to calling HCHttpCallPerformAsync.
+/// </summary>
+/// <param name="call">The handle of the HTTP call.</param>
+/// <param name="writeFunction">The function that receives the response body.</param>
+/// <param name="context">Client context to pass to writeFunction.</param>
+/// <returns>Result code for this API operation.  Possible values are S_OK, E_INVALIDARG, E_OUTOFMEMORY, E_HC_PERFORM_ALREADY_CALLED, or E_FAIL.</returns>
+STDAPI HCHttpCallResponseSetResponseBodyWriteFunction(
+    _In_ HCCallHandle call,
+    _In_ HCHttpCallResponseBodyWriteFunction writeFunction,
+    _In_opt_ void* context
+    ) noexcept;
+
 /////////////////////////////////////////////////////////////////////////////////////////
 // HttpCallResponse Get APIs
 // 
@@ -619,6 +727,88 @@ typedef void
     _In_ void* functionContext
     );
 
+/// <summary>
+/// The type of a message sent with HCWebSocketSendMessageBuffer or HCWebSocketSendMessageFragment,
+/// or received in a message batch or fragment.
+/// </summary>
+enum class HCWebSocketMessageType : uint32_t
+{
+    Text = 0,
+    Binary = 1
+};
+
+/// <summary>
+/// A callback invoked when the library is done with a buffer passed to HCWebSocketSendMessageBuffer.
+/// </summary>
+/// <param name="websocket">Handle to the WebSocket the message was sent on</param>
+/// <param name="payloadBytes">The buffer passed to HCWebSocketSendMessageBuffer</param>
+/// <param name="payloadSize">The size of the buffer</param>
+/// <param name="result">S_OK if the message was sent, otherwise the reason it wasn't.</param>
+/// <param name="releaseContext">Client context passed to HCWebSocketSendMessageBuffer.</param>
+typedef void
+(CALLBACK* HCWebSocketSendBufferReleaseFunction)(
+    _In_ HCWebsocketHandle websocket,
+    _In_reads_bytes_(payloadSize) const uint8_t* payloadBytes,
+    _In_ uint32_t payloadSize,
+    _In_ HRESULT result,
+    _In_opt_ void* releaseContext
+    );
+
+/// <summary>
+/// A callback invoked with each piece of a received message as it arrives, when the WebSocket is set up
+/// with HCWebSocketSetMessageFragmentFunction. The pieces of a message come in order, one call at a time,
+/// and the last one has isFinalFragment set. Their boundaries needn't match the frames the server sent.
+/// </summary>
+/// <param name="websocket">Handle to the WebSocket the message is being received on</param>
+/// <param name="messageType">Whether the message is a UTF-8 text message or a binary message. A piece of a text message may end partway through a character.</param>
+/// <param name="payloadBytes">The next piece of the message, valid only for the duration of the call</param>
+/// <param name="payloadSize">The size of the piece, which may be 0</param>
+/// <param name="isFinalFragment">True if this piece completes the message</param>
+/// <param name="functionContext">Client context passed to HCWebSocketSetMessageFragmentFunction.</param>
+typedef void
+(CALLBACK* HCWebSocketMessageFragmentFunction)(
+    _In_ HCWebsocketHandle websocket,
+    _In_ HCWebSocketMessageType messageType,
+    _In_reads_bytes_(payloadSize) const uint8_t* payloadBytes,
+    _In_ uint32_t payloadSize,
+    _In_ bool isFinalFragment,
+    _In_opt_ void* functionContext
+    );
+
+/// <summary>
+/// A received message lent to a HCWebSocketMessageBatchFunction. The payload stays valid until
+/// the batch it arrived in is released with HCWebSocketReleaseMessageBatch.
+/// </summary>
+typedef struct HCWebSocketReceivedMessage
+{
+    /// <param name="messageType">Whether the payload is a UTF-8 text message or a binary message</param>
+    HCWebSocketMessageType messageType;
+
+    /// <param name="payloadBytes">The message payload. Text payloads are not null terminated.</param>
+    const uint8_t* payloadBytes;
+
+    /// <param name="payloadSize">The size of the payload</param>
+    uint32_t payloadSize;
+} HCWebSocketReceivedMessage;
+
+/// <summary>
+/// A callback invoked with the messages a WebSocket received since the previous batch, in the
+/// order they arrived, when the WebSocket is set up with HCWebSocketSetMessageBatchFunction.
+/// </summary>
+/// <param name="websocket">Handle to the WebSocket the messages were received on</param>
+/// <param name="batch">The batch to pass to HCWebSocketReleaseMessageBatch once done with the messages</param>
+/// <param name="messages">The received messages</param>
+/// <param name="messageCount">The number of messages, at least 1</param>
+/// <param name="functionContext">Client context passed to HCWebSocketSetMessageBatchFunction.</param>
+typedef void
+(CALLBACK* HCWebSocketMessageBatchFunction)(
+    _In_ HCWebsocketHandle websocket,
+    _In_ HCWebSocketMessageBatchHandle batch,
+    _In_reads_(messageCount) const HCWebSocketReceivedMessage* messages,
+    _In_ uint32_t messageCount,
+    _In_opt_ void* functionContext
+    );
+
 /// <summary>
 /// Creates an WebSocket handle
 ///
@@ -670,6 +860,73 @@ STDAPI HCWebSocketSetHeader(
     _In_z_ const char* headerValue
     ) noexcept;
 
+/// <summary>
+/// Switches the WebSocket to batched receive. Instead of calling the message functions passed to
+/// HCWebSocketCreate on the network thread, the library queues received messages and calls batchFunc
+/// on the completion port of queue with every message that arrived since the previous call. The
+/// messages are lent rather than copied where the platform allows, and stay valid until the batch is
+/// released. The close function passed to HCWebSocketCreate is called on the same queue, after the
+/// last batch. This must be called prior to calling HCWebSocketConnectAsync.
+/// </summary>
+/// <param name="websocket">The handle of the WebSocket</param>
+/// <param name="queue">The queue batchFunc is called on, or a null pointer to use the process task queue. The caller must dispatch it for as long as the WebSocket is connected.</param>
+/// <param name="batchFunc">The batch callback, or a null pointer to go back to the message functions passed to HCWebSocketCreate.</param>
+/// <param name="functionContext">Client context to pass to batchFunc.</param>
+/// <returns>Result code for this API operation.  Possible values are S_OK, E_INVALIDARG, E_NO_TASK_QUEUE, E_HC_CONNECT_ALREADY_CALLED, or E_FAIL.</returns>
+STDAPI HCWebSocketSetMessageBatchFunction(
+    _In_ HCWebsocketHandle websocket,
+    _In_opt_ XTaskQueueHandle queue,
+    _In_opt_ HCWebSocketMessageBatchFunction batchFunc,
+    _In_opt_ void* functionContext
+    ) noexcept;
+
+/// <summary>
+/// Limits how much a WebSocket in batched receive holds for the app, counting messages waiting to be
+/// delivered and messages in batches not yet released. Once either limit is reached, the library stops
+/// reading from the connection, which pushes back on the server, until the app has released enough to
+/// get down to half of each limit. On platforms whose WebSocket implementation can't stop reading, the
+/// limits are not enforced. By default there is no limit.
+/// This must be called prior to calling HCWebSocketConnectAsync.
+/// </summary>
+/// <param name="websocket">The handle of the WebSocket</param>
+/// <param name="maxMessages">The most messages to hold, or 0 for no limit</param>
+/// <param name="maxBytes">The most payload bytes to hold, or 0 for no limit</param>
+/// <returns>Result code for this API operation.  Possible values are S_OK, E_INVALIDARG, E_HC_CONNECT_ALREADY_CALLED, or E_FAIL.</returns>
+STDAPI HCWebSocketSetInboundQueueLimits(
+    _In_ HCWebsocketHandle websocket,
+    _In_ uint32_t maxMessages,
+    _In_ uint64_t maxBytes
+    ) noexcept;
+
+/// <summary>
+/// Hands a batch passed to a HCWebSocketMessageBatchFunction back to the library, which invalidates
+/// its messages. Every batch must be released exactly once, either from within the callback or later
+/// from any thread.
+/// </summary>
+/// <param name="batch">The batch to release</param>
+/// <returns>Result code for this API operation.  Possible values are S_OK, or E_INVALIDARG.</returns>
+STDAPI HCWebSocketReleaseMessageBatch(
+    _In_ HCWebSocketMessageBatchHandle batch
+    ) noexcept;
+
+/// <summary>
+/// Switches the WebSocket to receiving messages piece by piece, so large messages reach the app as they
+/// arrive instead of once they are complete. fragmentFunc is called on the network thread in place of the
+/// message functions passed to HCWebSocketCreate and of any batch function. Messages received this way
+/// are not buffered whole, so they are not subject to the size limit that applies to whole messages.
+/// On platforms whose WebSocket implementation only hands over complete messages, each message arrives as a
+/// single final fragment. This must be called prior to calling HCWebSocketConnectAsync.
+/// </summary>
+/// <param name="websocket">The handle of the WebSocket</param>
+/// <param name="fragmentFunc">The fragment callback, or a null pointer to receive whole messages again.</param>
+/// <param name="functionContext">Client context to pass to fragmentFunc.</param>
+/// <returns>Result code for this API operation.  Possible values are S_OK, E_INVALIDARG, E_HC_CONNECT_ALREADY_CALLED, or E_FAIL.</returns>
+STDAPI HCWebSocketSetMessageFragmentFunction(
+    _In_ HCWebsocketHandle websocket,
+    _In_opt_ HCWebSocketMessageFragmentFunction fragmentFunc,
+    _In_opt_ void* functionContext
+    ) noexcept;
+
 /// <summary>
 /// Gets the WebSocket functions to allow callers to respond to incoming messages and WebSocket close events.
 /// </summary>
@@ -767,6 +1024,60 @@ STDAPI HCWebSocketSendBinaryMessageAsync(
     _Inout_ XAsyncBlock* asyncBlock
     ) noexcept;
 
+/// <summary>
+/// Send a message to the WebSocket straight from a caller owned buffer, without an XAsyncBlock.
+/// The buffer must stay valid and unchanged until releaseFunc is called, which happens exactly
+/// once, when the library is done with the buffer, with the result of the send. releaseFunc may
+/// be called on any thread, including from within this call, and is not called if this call fails.
+/// Where the platform's WebSocket implementation copies the payload into a frame of its own, the
+/// buffer is handed back before this call returns, so releaseFunc mustn't take a lock the caller
+/// holds around this call. Messages sent with this function go out in the order they were queued.
+/// </summary>
+/// <param name="websocket">Handle to the WebSocket</param>
+/// <param name="messageType">Whether the payload is a UTF-8 text message or a binary message. Text payloads don't need to be null terminated.</param>
+/// <param name="payloadBytes">The message payload, which may be null if payloadSize is 0</param>
+/// <param name="payloadSize">The size of the payload, which may be 0 to send an empty message except on UWP, where that fails with E_INVALIDARG</param>
+/// <param name="releaseFunc">The callback that hands the buffer back</param>
+/// <param name="releaseContext">Client context to pass to releaseFunc.</param>
+/// <returns>Result code for this API operation.  Possible values are S_OK, E_INVALIDARG, E_OUTOFMEMORY, E_UNEXPECTED, E_HC_NOT_INITIALISED, or E_FAIL.</returns>
+STDAPI HCWebSocketSendMessageBuffer(
+    _In_ HCWebsocketHandle websocket,
+    _In_ HCWebSocketMessageType messageType,
+    _In_reads_bytes_opt_(payloadSize) const uint8_t* payloadBytes,
+    _In_ uint32_t payloadSize,
+    _In_ HCWebSocketSendBufferReleaseFunction releaseFunc,
+    _In_opt_ void* releaseContext
+    ) noexcept;
+
+/// <summary>
+/// Send one fragment of a message to the WebSocket, so a large message can go out piece by piece without
+/// being put together in memory first. The first fragment sent after a complete message begins a new
+/// message of the given type, later ones continue it, and the one with isFinalFragment set finishes it.
+/// Until then, no other message may be sent on the WebSocket. Each fragment's buffer is handed back through
+/// releaseFunc exactly as with HCWebSocketSendMessageBuffer. Fragmented messages are never compressed.
+/// On platforms whose WebSocket implementation only sends complete messages, the fragments are copied and
+/// the message is sent whole with its final fragment, whose releaseFunc reports the result. UWP's WebSocket
+/// doesn't send empty messages, so there an empty message fails with E_INVALIDARG, as it does with
+/// HCWebSocketSendMessageBuffer.
+/// </summary>
+/// <param name="websocket">Handle to the WebSocket</param>
+/// <param name="messageType">Whether the message is a UTF-8 text message or a binary message. Only the first fragment's type is used.</param>
+/// <param name="payloadBytes">The fragment payload. A text fragment may end partway through a character.</param>
+/// <param name="payloadSize">The size of the payload, which may be 0</param>
+/// <param name="isFinalFragment">True if this fragment finishes the message</param>
+/// <param name="releaseFunc">The callback that hands the buffer back</param>
+/// <param name="releaseContext">Client context to pass to releaseFunc.</param>
+/// <returns>Result code for this API operation.  Possible values are S_OK, E_INVALIDARG, E_OUTOFMEMORY, E_UNEXPECTED, E_HC_NOT_INITIALISED, or E_FAIL.</returns>
+STDAPI HCWebSocketSendMessageFragment(
+    _In_ HCWebsocketHandle websocket,
+    _In_ HCWebSocketMessageType messageType,
+    _In_reads_bytes_opt_(payloadSize) const uint8_t* payloadBytes,
+    _In_ uint32_t payloadSize,
+    _In_ bool isFinalFragment,
+    _In_ HCWebSocketSendBufferReleaseFunction releaseFunc,
+    _In_opt_ void* releaseContext
+    ) noexcept;
+
 /// <summary>
 /// Gets the result from HCWebSocketSendMessage 
 /// </summary>
@@ -807,6 +1118,21 @@ STDAPI HCWebSocketCloseHandle(
     _In_ HCWebsocketHandle websocket
     ) noexcept;
 
+/// <summary>
+/// Sets how many threads run the event loop shared by WebSocket connections on
+/// platforms whose provider multiplexes every connection over a small thread
+/// pool (websocketpp), instead of dedicating a thread to each connection.
+/// The pool starts with the first connect and its threads live until the process
+/// exits. Raising the count adds threads to a running pool; lowering it has no
+/// effect on threads already started. Providers that don't use a shared event loop
+/// ignore the setting. The default is 1 and the value is reset by HCCleanup().
+/// </summary>
+/// <param name="threadCount">The number of event loop threads, at least 1.</param>
+/// <returns>Result code for this API operation.  Possible values are S_OK, E_INVALIDARG, E_HC_NOT_INITIALISED, or E_FAIL.</returns>
+STDAPI HCWebSocketSetReactorThreadCount(
+    _In_ uint32_t threadCount
+    ) noexcept;
+
 #endif // !HC_NOWEBSOCKETS
 
 }
@@ -134,6 +134,24 @@ STDAPI HCHttpCallRequestGetRequestBodyString(
     _Outptr_ const char** requestBody
     ) noexcept;
 
+/// <summary>
+/// Get the function that supplies the request body of the HTTP call.
+/// If the body was set with HCHttpCallRequestSetRequestBodyBytes() or
+/// HCHttpCallRequestSetRequestBodyString(), this returns a function that reads from that buffer,
+/// so providers can use it for every call.
+/// </summary>
+/// <param name="call">The handle of the HTTP call</param>
+/// <param name="readFunction">The function to pull the body from.</param>
+/// <param name="bodySize">The length of the body in bytes, or HC_HTTP_REQUEST_BODY_SIZE_UNKNOWN.</param>
+/// <param name="context">The context to pass to readFunction.</param>
+/// <returns>Result code for this API operation.  Possible values are S_OK, E_INVALIDARG, or E_FAIL.</returns>
+STDAPI HCHttpCallRequestGetRequestBodyReadFunction(
+    _In_ HCCallHandle call,
+    _Out_ HCHttpCallRequestBodyReadFunction* readFunction,
+    _Out_ uint64_t* bodySize,
+    _Outptr_result_maybenull_ void** context
+    ) noexcept;
+
 /// <summary>
 /// Get a request header for the HTTP call for a given header name
 /// </summary>
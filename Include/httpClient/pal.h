@@ -246,6 +246,10 @@ typedef struct _LIST_ENTRY {
 #define _In_reads_bytes_(size) 
 #endif
 
+#ifndef _In_reads_opt_
+#define _In_reads_opt_(size) 
+#endif
+
 #ifndef _In_reads_bytes_opt_
 #define _In_reads_bytes_opt_(size) 
 #endif
@@ -431,6 +435,7 @@ typedef struct _LIST_ENTRY {
 
 typedef uint32_t HCMemoryType;
 typedef struct HC_WEBSOCKET* HCWebsocketHandle;
+typedef struct HC_WEBSOCKET_MESSAGE_BATCH* HCWebSocketMessageBatchHandle;
 typedef struct HC_CALL* HCCallHandle;
 typedef struct HC_CALL* HCMockCallHandle;
 typedef struct HC_PERFORM_ENV* HCPerformEnv;
@@ -30,9 +30,12 @@
 #endif
 
 // STL includes
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <chrono>
+#include <cmath>
+#include <cstdarg>
 #include <condition_variable>
 #include <cstdint>
 #include <map>
@@ -12,10 +12,155 @@
 
 using namespace xbox::httpclient;
 
-static std::shared_ptr<http_singleton> g_httpSingleton_atomicReadsOnly;
-
 NAMESPACE_XBOX_HTTP_CLIENT_BEGIN
 
+struct http_singleton_pin_slot
+{
+    std::atomic<int32_t> pins{ 0 };
+    std::atomic<bool> inUse{ false };
+    http_singleton_pin_slot* next = nullptr;
+
+    // Slots are heap allocated and not cache line aligned, so pad them to keep
+    // each thread's counter off its neighbours' lines
+    uint8_t padding[64];
+};
+
+// Returns a thread's slot to the list when the thread exits
+struct http_singleton_thread_slot
+{
+    ~http_singleton_thread_slot()
+    {
+        if (slot != nullptr)
+        {
+            slot->inUse.store(false, std::memory_order_release);
+        }
+    }
+
+    http_singleton_pin_slot* slot = nullptr;
+};
+
+static std::atomic<http_singleton*> g_httpSingleton{ nullptr };
+
+// Slots are never freed so they can be walked without a lock. They are
+// allocated outside the client's memory hooks because they outlive HCCleanup.
+static std::atomic<http_singleton_pin_slot*> g_pinSlots{ nullptr };
+static http_singleton_pin_slot g_fallbackPinSlot;
+// Kept trivially destructible so the hot path doesn't go through a TLS init
+// wrapper; t_pinSlotOwner is only touched when a slot is handed out.
+static thread_local http_singleton_pin_slot* t_pinSlot = nullptr;
+static thread_local http_singleton_thread_slot t_pinSlotOwner;
+
+static std::atomic<bool> g_pinWaiting{ false };
+static std::mutex g_pinWaitLock;
+static std::condition_variable g_pinWaitCondition;
+
+static http_singleton_pin_slot* current_pin_slot() noexcept
+{
+    if (t_pinSlot != nullptr)
+    {
+        return t_pinSlot;
+    }
+
+    http_singleton_pin_slot* slot = g_pinSlots.load(std::memory_order_acquire);
+    for (; slot != nullptr; slot = slot->next)
+    {
+        bool inUse = false;
+        if (!slot->inUse.load(std::memory_order_relaxed) &&
+            slot->inUse.compare_exchange_strong(inUse, true, std::memory_order_acquire))
+        {
+            break;
+        }
+    }
+
+    if (slot == nullptr)
+    {
+        slot = new (std::nothrow) http_singleton_pin_slot;
+        if (slot == nullptr)
+        {
+            // Shared by every thread that couldn't get a slot of its own
+            return &g_fallbackPinSlot;
+        }
+
+        slot->inUse.store(true, std::memory_order_relaxed);
+        slot->next = g_pinSlots.load(std::memory_order_relaxed);
+        while (!g_pinSlots.compare_exchange_weak(slot->next, slot, std::memory_order_release, std::memory_order_relaxed)) {}
+    }
+
+    t_pinSlotOwner.slot = slot;
+    t_pinSlot = slot;
+    return slot;
+}
+
+static int64_t outstanding_pins() noexcept
+{
+    int64_t pins = g_fallbackPinSlot.pins.load();
+    for (auto slot = g_pinSlots.load(std::memory_order_acquire); slot != nullptr; slot = slot->next)
+    {
+        pins += slot->pins.load();
+    }
+    return pins;
+}
+
+static void unpin(_In_ http_singleton_pin_slot* slot) noexcept
+{
+    slot->pins.fetch_sub(1);
+    if (g_pinWaiting.load())
+    {
+        std::lock_guard<std::mutex> lock(g_pinWaitLock);
+        g_pinWaitCondition.notify_all();
+    }
+}
+
+http_singleton_ref::http_singleton_ref(
+    _In_ http_singleton* singleton,
+    _In_ http_singleton_pin_slot* slot
+) noexcept :
+    m_singleton{ singleton },
+    m_slot{ slot }
+{
+}
+
+http_singleton_ref::http_singleton_ref(const http_singleton_ref& other) noexcept :
+    m_singleton{ other.m_singleton },
+    m_slot{ other.m_slot }
+{
+    if (m_slot != nullptr)
+    {
+        // Already pinned through other, so cleanup can't be past its wait
+        m_slot->pins.fetch_add(1);
+    }
+}
+
+http_singleton_ref::http_singleton_ref(http_singleton_ref&& other) noexcept :
+    m_singleton{ other.m_singleton },
+    m_slot{ other.m_slot }
+{
+    other.m_singleton = nullptr;
+    other.m_slot = nullptr;
+}
+
+http_singleton_ref& http_singleton_ref::operator=(http_singleton_ref other) noexcept
+{
+    std::swap(m_singleton, other.m_singleton);
+    std::swap(m_slot, other.m_slot);
+    return *this;
+}
+
+http_singleton_ref::~http_singleton_ref()
+{
+    release();
+}
+
+void http_singleton_ref::release() noexcept
+{
+    if (m_slot != nullptr)
+    {
+        unpin(m_slot);
+        m_slot = nullptr;
+        m_singleton = nullptr;
+    }
+}
+
 http_singleton::http_singleton(
     HttpPerformInfo const& httpPerformInfo,
     WebSocketPerformInfo const& websocketPerformInfo,
@@ -30,7 +175,6 @@ http_singleton::http_singleton(
 
 http_singleton::~http_singleton()
 {
-    g_httpSingleton_atomicReadsOnly = nullptr;
     for (auto& mockCall : m_mocks)
     {
         HCHttpCallCloseHandle(mockCall);
@@ -38,9 +182,26 @@ http_singleton::~http_singleton()
     m_mocks.clear();
 }
 
-std::shared_ptr<http_singleton> get_http_singleton(bool assertIfNull)
+http_singleton_ref get_http_singleton(bool assertIfNull)
 {
-    auto httpSingleton = std::atomic_load(&g_httpSingleton_atomicReadsOnly);
+    http_singleton_ref httpSingleton;
+    if (g_httpSingleton.load(std::memory_order_relaxed) != nullptr)
+    {
+        // The pin must be visible before the singleton is read again so that
+        // cleanup either sees it or this thread sees the singleton gone
+        http_singleton_pin_slot* slot = current_pin_slot();
+        slot->pins.fetch_add(1);
+        http_singleton* singleton = g_httpSingleton.load();
+        if (singleton != nullptr)
+        {
+            httpSingleton = http_singleton_ref{ singleton, slot };
+        }
+        else
+        {
+            unpin(slot);
+        }
+    }
+
     if (assertIfNull && httpSingleton == nullptr)
     {
         HC_TRACE_ERROR(HTTPCLIENT, "Call HCInitialize() fist");
@@ -55,29 +216,34 @@ HRESULT init_http_singleton(HCInitArgs* args)
     HRESULT hr = S_OK;
 
     // TODO do as a run once? to avoid platform code being inited twice?
-    auto httpSingleton = std::atomic_load(&g_httpSingleton_atomicReadsOnly);
-    if (!httpSingleton)
+    if (g_httpSingleton.load() == nullptr)
     {
         PerformEnv performEnv;
         hr = Internal_InitializeHttpPlatform(args, performEnv);
 
         if (SUCCEEDED(hr))
         {
-            auto newSingleton = http_allocate_shared<http_singleton>(
+            auto newSingleton = http_allocate_unique<http_singleton>(
                 GetUserHttpPerformHandler(),
                 GetUserWebSocketPerformHandlers(),
                 std::move(performEnv)
             );
-            std::atomic_compare_exchange_strong(
-                &g_httpSingleton_atomicReadsOnly,
-                &httpSingleton,
-                newSingleton
-            );
-
             if (newSingleton == nullptr)
             {
                 hr = E_OUTOFMEMORY;
             }
+            else
+            {
+                // Open the cache before the singleton is visible so calls
+                // started right after initialization can store contexts
+                shared_ptr_cache::open();
+
+                http_singleton* expected = nullptr;
+                if (g_httpSingleton.compare_exchange_strong(expected, newSingleton.get()))
+                {
+                    newSingleton.release();
+                }
+            }
             // At this point there is a singleton (ours or someone else's)
         }
     }
@@ -87,22 +253,102 @@ HRESULT init_http_singleton(HCInitArgs* args)
 
 void cleanup_http_singleton()
 {
-    std::shared_ptr<http_singleton> httpSingleton;
-    httpSingleton = std::atomic_exchange(&g_httpSingleton_atomicReadsOnly, httpSingleton);
-
+    http_singleton* httpSingleton = g_httpSingleton.exchange(nullptr);
     if (httpSingleton != nullptr)
     {
-        shared_ptr_cache::cleanup(httpSingleton);
+        shared_ptr_cache::cleanup();
 
-        // Wait for all other references to the singleton to go away
-        // Note that the use count check here is only valid because we never create
-        // a weak_ptr to the singleton. If we did that could cause the use count
-        // to increase even though we are the only strong reference
-        while (httpSingleton.use_count() > 1)
+        // Wait for all other references to the singleton to go away. Pins
+        // taken from here on see it unpublished and are dropped right away.
+        g_pinWaiting.store(true);
         {
-            std::this_thread::sleep_for(std::chrono::milliseconds{ 10 });
+            std::unique_lock<std::mutex> lock(g_pinWaitLock);
+            g_pinWaitCondition.wait(lock, [] { return outstanding_pins() == 0; });
         }
+        g_pinWaiting.store(false);
+
         // httpSingleton will be destroyed on this thread now
+        http_alloc_deleter<http_singleton>()(httpSingleton);
+    }
+}
+
+shared_ptr_cache::shard shared_ptr_cache::s_shards[shared_ptr_cache::SHARD_COUNT];
+
+shared_ptr_cache::shard& shared_ptr_cache::shard_for(void *rawContextPtr)
+{
+    // Contexts are heap allocations so the low bits carry no information
+    auto address = reinterpret_cast<uintptr_t>(rawContextPtr);
+    return s_shards[((address >> 4) ^ (address >> 12)) % SHARD_COUNT];
+}
+
+bool shared_ptr_cache::insert(void *rawContextPtr, std::shared_ptr<void>&& contextSharedPtr)
+{
+    shard& s = shard_for(rawContextPtr);
+    std::lock_guard<std::mutex> lock(s.lock);
+    if (!s.open)
+    {
+        return false;
+    }
+
+    try
+    {
+        s.entries[rawContextPtr] = std::move(contextSharedPtr);
+    }
+    catch (...)
+    {
+        return false;
+    }
+    return true;
+}
+
+std::shared_ptr<void> shared_ptr_cache::find(void *rawContextPtr)
+{
+    shard& s = shard_for(rawContextPtr);
+    std::lock_guard<std::mutex> lock(s.lock);
+    auto iter = s.entries.find(rawContextPtr);
+    if (iter == s.entries.end())
+    {
+        return std::shared_ptr<void>();
+    }
+    return iter->second;
+}
+
+void shared_ptr_cache::remove(void *rawContextPtr)
+{
+    // The context may be destroyed by this and its destructor is free to use
+    // the cache again, so release it outside the shard lock
+    std::shared_ptr<void> removed;
+    {
+        shard& s = shard_for(rawContextPtr);
+        std::lock_guard<std::mutex> lock(s.lock);
+        auto iter = s.entries.find(rawContextPtr);
+        if (iter != s.entries.end())
+        {
+            removed = std::move(iter->second);
+            s.entries.erase(iter);
+        }
+    }
+}
+
+void shared_ptr_cache::open()
+{
+    for (auto& s : s_shards)
+    {
+        std::lock_guard<std::mutex> lock(s.lock);
+        s.open = true;
+    }
+}
+
+void shared_ptr_cache::cleanup()
+{
+    for (auto& s : s_shards)
+    {
+        http_internal_unordered_map<void*, std::shared_ptr<void>> removed;
+        {
+            std::lock_guard<std::mutex> lock(s.lock);
+            s.open = false;
+            removed.swap(s.entries);
+        }
     }
 }
 
@@ -152,7 +398,17 @@ WebSocketPerformInfo& GetUserWebSocketPerformHandlers() noexcept
         Internal_HCWebSocketSendMessageAsync,
         Internal_HCWebSocketSendBinaryMessageAsync,
         Internal_HCWebSocketDisconnect,
+        nullptr,
+#if HC_WEBSOCKET_SEND_BUFFER_PROVIDER
+        Internal_HCWebSocketSendMessageBuffer,
+#else
+        nullptr,
+#endif
+#if HC_WEBSOCKET_SEND_FRAGMENT_PROVIDER
+        Internal_HCWebSocketSendMessageFragment
+#else
         nullptr
+#endif
     );
     return handlers;
 }
@@ -34,6 +34,7 @@ typedef struct http_retry_after_api_state
 static const uint32_t DEFAULT_TIMEOUT_WINDOW_IN_SECONDS = 20;
 static const uint32_t DEFAULT_HTTP_TIMEOUT_IN_SECONDS = 30;
 static const uint32_t DEFAULT_RETRY_DELAY_IN_SECONDS = 2;
+static const uint32_t DEFAULT_WEBSOCKET_REACTOR_THREAD_COUNT = 1;
 
 typedef struct http_singleton
 {
@@ -65,9 +66,11 @@ typedef struct http_singleton
     uint32_t m_timeoutInSeconds = DEFAULT_HTTP_TIMEOUT_IN_SECONDS;
     uint32_t m_timeoutWindowInSeconds = DEFAULT_TIMEOUT_WINDOW_IN_SECONDS;
     uint32_t m_retryDelayInSeconds = DEFAULT_RETRY_DELAY_IN_SECONDS;
+    http_call_pool m_callPool;
 
 #if !HC_NOWEBSOCKETS
     WebSocketPerformInfo const m_websocketPerform;
+    std::atomic<uint32_t> m_websocketReactorThreadCount{ DEFAULT_WEBSOCKET_REACTOR_THREAD_COUNT };
 #endif
 
     // Mock state
@@ -75,50 +78,72 @@ typedef struct http_singleton
     http_internal_vector<HC_CALL*> m_mocks;
     HC_CALL* m_lastMatchingMock = nullptr;
     bool m_mocksEnabled = false;
-
-    std::recursive_mutex m_sharedPtrsLock;
-    http_internal_unordered_map<void*, std::shared_ptr<void>> m_sharedPtrs;
 } http_singleton;
 
 
-std::shared_ptr<http_singleton> get_http_singleton(bool assertIfNull);
+struct http_singleton_pin_slot;
+
+// Keeps the http_singleton alive while in scope. Pins are counted per thread
+// so taking one only touches a cache line owned by the calling thread;
+// cleanup_http_singleton unpublishes the singleton and then waits for every
+// outstanding pin to be released before destroying it.
+class http_singleton_ref
+{
+public:
+    http_singleton_ref() noexcept = default;
+    http_singleton_ref(_In_ http_singleton* singleton, _In_ http_singleton_pin_slot* slot) noexcept;
+    http_singleton_ref(const http_singleton_ref& other) noexcept;
+    http_singleton_ref(http_singleton_ref&& other) noexcept;
+    http_singleton_ref& operator=(http_singleton_ref other) noexcept;
+    ~http_singleton_ref();
+
+    http_singleton* get() const noexcept { return m_singleton; }
+    http_singleton* operator->() const noexcept { return m_singleton; }
+    http_singleton& operator*() const noexcept { return *m_singleton; }
+    explicit operator bool() const noexcept { return m_singleton != nullptr; }
+
+private:
+    void release() noexcept;
+
+    http_singleton* m_singleton = nullptr;
+    http_singleton_pin_slot* m_slot = nullptr;
+};
+
+inline bool operator==(const http_singleton_ref& ref, std::nullptr_t) noexcept { return !ref; }
+inline bool operator==(std::nullptr_t, const http_singleton_ref& ref) noexcept { return !ref; }
+inline bool operator!=(const http_singleton_ref& ref, std::nullptr_t) noexcept { return !!ref; }
+inline bool operator!=(std::nullptr_t, const http_singleton_ref& ref) noexcept { return !!ref; }
+
+http_singleton_ref get_http_singleton(bool assertIfNull);
 HRESULT init_http_singleton(HCInitArgs* args);
 void cleanup_http_singleton();
 
 
+// Keeps shared_ptr contexts alive while their raw pointer is handed through
+// XAsync and platform callbacks. Entries are spread across independently
+// locked shards keyed by address so concurrent calls rarely contend, and
+// lookups do not touch the http_singleton. The cache only accepts entries
+// between HCInitialize and HCCleanup.
 class shared_ptr_cache
 {
 public:
     template<typename T>
     static void* store(std::shared_ptr<T> contextSharedPtr)
     {
-        auto httpSingleton = get_http_singleton(false);
-        if (nullptr == httpSingleton)
-            return nullptr;
-        std::lock_guard<std::recursive_mutex> lock(httpSingleton->m_sharedPtrsLock);
-
         void *rawVoidPtr = contextSharedPtr.get();
-        std::shared_ptr<void> voidSharedPtr(contextSharedPtr, rawVoidPtr);
-        httpSingleton->m_sharedPtrs.insert(std::make_pair(rawVoidPtr, voidSharedPtr));
+        std::shared_ptr<void> voidSharedPtr(std::move(contextSharedPtr), rawVoidPtr);
+        if (!insert(rawVoidPtr, std::move(voidSharedPtr)))
+        {
+            return nullptr;
+        }
         return rawVoidPtr;
     }
 
     template<typename T>
     static std::shared_ptr<T> fetch(void *rawContextPtr, bool assertIfNotFound)
     {
-        auto httpSingleton = get_http_singleton(false);
-        if (nullptr == httpSingleton)
-            return nullptr;
-
-        std::lock_guard<std::recursive_mutex> lock(httpSingleton->m_sharedPtrsLock);
-
-        auto iter = httpSingleton->m_sharedPtrs.find(rawContextPtr);
-        if (iter != httpSingleton->m_sharedPtrs.end())
-        {
-            auto returnPtr = std::shared_ptr<T>(iter->second, reinterpret_cast<T*>(iter->second.get()));
-            return returnPtr;
-        }
-        else
+        std::shared_ptr<void> voidSharedPtr = find(rawContextPtr);
+        if (voidSharedPtr == nullptr)
         {
             if (assertIfNotFound)
             {
@@ -126,33 +151,39 @@ public:
             }
             return std::shared_ptr<T>();
         }
-    }
-
-    static void remove(void *rawContextPtr)
-    {
-        auto httpSingleton = get_http_singleton(false);
-        if (nullptr == httpSingleton)
-            return;
-
-        std::lock_guard<std::recursive_mutex> lock(httpSingleton->m_sharedPtrsLock);
 
-        auto iter = httpSingleton->m_sharedPtrs.find(rawContextPtr);
-        if (iter != httpSingleton->m_sharedPtrs.end())
-        {
-            httpSingleton->m_sharedPtrs.erase(iter);
-        }
+        T* rawPtr = reinterpret_cast<T*>(voidSharedPtr.get());
+        return std::shared_ptr<T>(std::move(voidSharedPtr), rawPtr);
     }
 
-    static void cleanup(_In_ std::shared_ptr<http_singleton> httpSingleton)
-    {
-        std::lock_guard<std::recursive_mutex> lock(httpSingleton->m_sharedPtrsLock);
-        httpSingleton->m_sharedPtrs.clear();
-    }
+    static void remove(void *rawContextPtr);
+
+    // Called from init_http_singleton and cleanup_http_singleton. Cleanup
+    // drops every remaining entry.
+    static void open();
+    static void cleanup();
 
 private:
     shared_ptr_cache();
     shared_ptr_cache(const shared_ptr_cache&);
     shared_ptr_cache& operator=(const shared_ptr_cache&);
+
+    static bool insert(void *rawContextPtr, std::shared_ptr<void>&& contextSharedPtr);
+    static std::shared_ptr<void> find(void *rawContextPtr);
+
+#pragma warning(push)
+#pragma warning(disable: 4324) // structure was padded due to alignas
+    struct alignas(64) shard
+    {
+        std::mutex lock;
+        bool open = false;
+        http_internal_unordered_map<void*, std::shared_ptr<void>> entries;
+    };
+#pragma warning(pop)
+
+    static const size_t SHARD_COUNT = 64;
+    static shard& shard_for(void *rawContextPtr);
+    static shard s_shards[SHARD_COUNT];
 };
 
 HttpPerformInfo& GetUserHttpPerformHandler() noexcept;
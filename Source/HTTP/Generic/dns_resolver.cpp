@@ -0,0 +1,219 @@
+// Copyright (c) Microsoft Corporation
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+#include "pch.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <string.h>
+
+#include "dns_resolver.h"
+
+NAMESPACE_XBOX_HTTP_CLIENT_BEGIN
+
+dns_resolver::~dns_resolver()
+{
+    stop();
+}
+
+HRESULT dns_resolver::resolve(
+    _In_ const http_internal_string& host,
+    _In_ uint16_t port,
+    _Out_ http_internal_vector<resolved_address>* addresses,
+    _Out_ int* error,
+    _In_ socket_reactor& reactor,
+    _In_ socket_reactor_callback* callback,
+    _In_opt_ void* context
+    ) noexcept
+{
+    *error = 0;
+
+    try
+    {
+        if (lookup_cached(cache_key(host, port), addresses))
+        {
+            return reactor.post(callback, context);
+        }
+
+        std::lock_guard<std::mutex> lock(m_lock);
+        RETURN_HR_IF(E_UNEXPECTED, m_stopping);
+
+        m_queue.push_back(request{ host, port, addresses, error, &reactor, callback, context });
+
+        if (m_idleThreads > 0)
+        {
+            m_wake.notify_one();
+        }
+        else if (m_threads.size() < GENERIC_DNS_MAX_THREADS)
+        {
+            try
+            {
+                m_threads.reserve(GENERIC_DNS_MAX_THREADS);
+                m_threads.emplace_back([this]() { worker(); });
+            }
+            catch (...)
+            {
+                // Busy workers will get to it eventually; without any the
+                // request would never be answered.
+                if (m_threads.empty())
+                {
+                    m_queue.pop_back();
+                    return E_OUTOFMEMORY;
+                }
+            }
+        }
+    }
+    CATCH_RETURN();
+
+    return S_OK;
+}
+
+void dns_resolver::stop() noexcept
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if (m_stopping)
+        {
+            return;
+        }
+        m_stopping = true;
+    }
+    m_wake.notify_all();
+
+    for (auto& thread : m_threads)
+    {
+        thread.join();
+    }
+    m_threads.clear();
+}
+
+http_internal_string dns_resolver::cache_key(_In_ const http_internal_string& host, _In_ uint16_t port)
+{
+    http_internal_string key{ host };
+    key += ':';
+    key += std::to_string(port).c_str();
+    return key;
+}
+
+bool dns_resolver::lookup_cached(_In_ const http_internal_string& key, _Out_ http_internal_vector<resolved_address>* addresses) noexcept
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    auto it = m_cache.find(key);
+    if (it == m_cache.end() || it->second.expiry <= chrono_clock_t::now())
+    {
+        return false;
+    }
+
+    try
+    {
+        *addresses = it->second.addresses;
+        return true;
+    }
+    catch (...)
+    {
+        // Treated as a miss; the lookup reports its own failure
+        return false;
+    }
+}
+
+int dns_resolver::lookup(
+    _In_ const http_internal_string& host,
+    _In_ uint16_t port,
+    _Out_ http_internal_vector<resolved_address>* addresses
+    ) noexcept
+{
+    try
+    {
+        http_internal_string key = cache_key(host, port);
+
+        // Another request for the same host may have finished while this one
+        // was queued.
+        if (lookup_cached(key, addresses))
+        {
+            return 0;
+        }
+
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICSERV;
+
+        addrinfo* results = nullptr;
+        int error = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &results);
+        if (error != 0)
+        {
+            HC_TRACE_ERROR(HTTPCLIENT, "dns_resolver: failed to resolve %s: %s", host.c_str(), gai_strerror(error));
+            return error == EAI_SYSTEM ? errno : error;
+        }
+
+        cache_entry entry;
+        try
+        {
+            for (addrinfo* result = results; result != nullptr; result = result->ai_next)
+            {
+                resolved_address address{};
+                memcpy(&address.address, result->ai_addr, result->ai_addrlen);
+                address.length = result->ai_addrlen;
+                entry.addresses.push_back(address);
+            }
+        }
+        catch (...)
+        {
+            freeaddrinfo(results);
+            throw;
+        }
+        freeaddrinfo(results);
+
+        entry.expiry = chrono_clock_t::now() + std::chrono::milliseconds(GENERIC_DNS_CACHE_TTL_MS);
+        *addresses = entry.addresses;
+
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_cache[key] = std::move(entry);
+        return 0;
+    }
+    catch (...)
+    {
+        return ENOMEM;
+    }
+}
+
+void dns_resolver::worker() noexcept
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    for (;;)
+    {
+        if (m_queue.empty())
+        {
+            if (m_stopping)
+            {
+                return;
+            }
+
+            ++m_idleThreads;
+            m_wake.wait(lock);
+            --m_idleThreads;
+            continue;
+        }
+
+        request next = std::move(m_queue.front());
+        m_queue.pop_front();
+        bool canceled = m_stopping;
+        lock.unlock();
+
+        *next.error = canceled ? ECANCELED : lookup(next.host, next.port, next.addresses);
+        complete(next);
+
+        lock.lock();
+    }
+}
+
+void dns_resolver::complete(_In_ const request& request) noexcept
+{
+    HRESULT hr = request.reactor->post(request.callback, request.context);
+    if (FAILED(hr))
+    {
+        // Only possible if the reactor was stopped before the resolver
+        HC_TRACE_ERROR(HTTPCLIENT, "dns_resolver: failed to post a completed lookup for %s, hr=0x%08x", request.host.c_str(), hr);
+    }
+}
+
+NAMESPACE_XBOX_HTTP_CLIENT_END
@@ -0,0 +1,75 @@
+// Copyright (c) Microsoft Corporation
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+#pragma once
+
+#include "socket_reactor.h"
+
+NAMESPACE_XBOX_HTTP_CLIENT_BEGIN
+
+#define GENERIC_DNS_CACHE_TTL_MS 60000
+#define GENERIC_DNS_MAX_THREADS 4
+
+// Runs getaddrinfo on a few worker threads so that neither the thread calling
+// perform or connect nor the reactor ever blocks on a lookup. Answers are
+// cached for GENERIC_DNS_CACHE_TTL_MS.
+class dns_resolver
+{
+public:
+    dns_resolver() = default;
+    ~dns_resolver();
+
+    dns_resolver(const dns_resolver&) = delete;
+    dns_resolver& operator=(const dns_resolver&) = delete;
+
+    // Resolves host:port into addresses and error (0 or an errno/EAI value),
+    // then posts callback to reactor. A cached answer is posted straight away;
+    // anything else is looked up on a worker thread. addresses and error must
+    // stay valid until callback runs. On failure nothing is posted.
+    HRESULT resolve(
+        _In_ const http_internal_string& host,
+        _In_ uint16_t port,
+        _Out_ http_internal_vector<resolved_address>* addresses,
+        _Out_ int* error,
+        _In_ socket_reactor& reactor,
+        _In_ socket_reactor_callback* callback,
+        _In_opt_ void* context
+        ) noexcept;
+
+    // Waits for lookups already running and posts the queued ones with
+    // ECANCELED. Call before stopping any reactor callbacks are posted to.
+    void stop() noexcept;
+
+private:
+    struct request
+    {
+        http_internal_string host;
+        uint16_t port;
+        http_internal_vector<resolved_address>* addresses;
+        int* error;
+        socket_reactor* reactor;
+        socket_reactor_callback* callback;
+        void* context;
+    };
+
+    struct cache_entry
+    {
+        http_internal_vector<resolved_address> addresses;
+        chrono_clock_t::time_point expiry;
+    };
+
+    static http_internal_string cache_key(_In_ const http_internal_string& host, _In_ uint16_t port);
+    bool lookup_cached(_In_ const http_internal_string& key, _Out_ http_internal_vector<resolved_address>* addresses) noexcept;
+    int lookup(_In_ const http_internal_string& host, _In_ uint16_t port, _Out_ http_internal_vector<resolved_address>* addresses) noexcept;
+    void worker() noexcept;
+    static void complete(_In_ const request& request) noexcept;
+
+    std::mutex m_lock;
+    std::condition_variable m_wake;
+    http_internal_dequeue<request> m_queue;
+    http_internal_vector<std::thread> m_threads;
+    size_t m_idleThreads = 0;
+    bool m_stopping = false;
+    http_internal_map<http_internal_string, cache_entry> m_cache;
+};
+
+NAMESPACE_XBOX_HTTP_CLIENT_END
@@ -3,18 +3,24 @@
 #include <cassert>
 
 #include "../httpcall.h"
+#include "generic_http_connection.h"
 
 HRESULT Internal_InitializeHttpPlatform(
     HCInitArgs* initialContext,
     PerformEnv& performEnv
 ) noexcept
 {
+    UNREFERENCED_PARAMETER(initialContext);
+
+    performEnv.reset(new (std::nothrow) HC_PERFORM_ENV());
+    if (!performEnv) { return E_OUTOFMEMORY; }
+
     return S_OK;
 }
 
 void Internal_CleanupHttpPlatform(HC_PERFORM_ENV* performEnv) noexcept
 {
-    assert(!performEnv);
+    delete performEnv;
 }
 
 void Internal_HCHttpCallPerformAsync(
@@ -24,6 +30,12 @@ void Internal_HCHttpCallPerformAsync(
     _In_ HCPerformEnv env
 ) noexcept
 {
-    // Register a custom Http handler
-    assert(false);
+    assert(env != nullptr);
+    UNREFERENCED_PARAMETER(context);
+
+    HRESULT hr = env->engine.perform(call, asyncBlock);
+    if (FAILED(hr))
+    {
+        XAsyncComplete(asyncBlock, hr, 0);
+    }
 }
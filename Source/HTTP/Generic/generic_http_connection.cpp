@@ -0,0 +1,1568 @@
+// Copyright (c) Microsoft Corporation
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+#include "pch.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include "uri.h"
+#include "generic_http_connection.h"
+
+NAMESPACE_XBOX_HTTP_CLIENT_BEGIN
+
+#define GENERIC_HTTP_READ_BUFFER_SIZE (16 * 1024)
+#define GENERIC_HTTP_MAX_CHUNK_LINE 1024
+
+namespace
+{
+
+bool header_name_equals(_In_reads_(length) const char* name, _In_ size_t length, _In_z_ const char* expected)
+{
+    return strlen(expected) == length && strncasecmp(name, expected, length) == 0;
+}
+
+bool header_value_contains(_In_ const http_internal_string& value, _In_z_ const char* token)
+{
+    return strcasestr(value.c_str(), token) != nullptr;
+}
+
+} // anonymous namespace
+
+bool parse_unsigned(
+    _In_reads_(end - begin) const char* begin,
+    _In_ const char* end,
+    _In_ uint32_t base,
+    _Out_ uint64_t* value
+    ) noexcept
+{
+    *value = 0;
+    if (begin == end)
+    {
+        return false;
+    }
+
+    uint64_t result = 0;
+    for (const char* p = begin; p != end; ++p)
+    {
+        uint32_t digit = 0;
+        if (*p >= '0' && *p <= '9')
+        {
+            digit = static_cast<uint32_t>(*p - '0');
+        }
+        else if (base == 16 && *p >= 'a' && *p <= 'f')
+        {
+            digit = static_cast<uint32_t>(*p - 'a' + 10);
+        }
+        else if (base == 16 && *p >= 'A' && *p <= 'F')
+        {
+            digit = static_cast<uint32_t>(*p - 'A' + 10);
+        }
+        else
+        {
+            return false;
+        }
+
+        if (result > (UINT64_MAX - digit) / base)
+        {
+            return false;
+        }
+        result = result * base + digit;
+    }
+
+    *value = result;
+    return true;
+}
+
+//
+// http_response_parser
+//
+
+void http_response_parser::reset(_In_ HCCallHandle call, _In_ bool headRequest) noexcept
+{
+    m_call = call;
+    m_headRequest = headRequest;
+    m_state = state::status_line;
+    m_line.clear();
+    m_headerBytes = 0;
+    m_statusCode = 0;
+    m_interim = false;
+    m_http11 = true;
+    m_keepAlive = true;
+    m_chunked = false;
+    m_hasContentLength = false;
+    m_remaining = 0;
+}
+
+http_response_parser::result http_response_parser::parse(
+    _In_reads_bytes_(length) const char* data,
+    _In_ size_t length,
+    _Out_ size_t* consumed
+    ) noexcept
+{
+    size_t offset = 0;
+
+    while (offset < length && m_state != state::done)
+    {
+        switch (m_state)
+        {
+        case state::body_length:
+        case state::chunk_data:
+        {
+            size_t count = static_cast<size_t>(std::min<uint64_t>(m_remaining, length - offset));
+            if (FAILED(HCHttpCallResponseAppendResponseBodyBytes(m_call, reinterpret_cast<const uint8_t*>(data + offset), count)))
+            {
+                return result::failed;
+            }
+            offset += count;
+            m_remaining -= count;
+            if (m_remaining == 0)
+            {
+                m_state = m_state == state::body_length ? state::done : state::chunk_crlf;
+            }
+            break;
+        }
+
+        case state::body_until_close:
+            if (FAILED(HCHttpCallResponseAppendResponseBodyBytes(m_call, reinterpret_cast<const uint8_t*>(data + offset), length - offset)))
+            {
+                return result::failed;
+            }
+            offset = length;
+            break;
+
+        default:
+        {
+            // Line oriented states. Lines are usually complete within one read
+            // so m_line rarely holds more than the line being parsed.
+            const char* start = data + offset;
+            auto newline = static_cast<const char*>(memchr(start, '\n', length - offset));
+            size_t count = newline != nullptr ? static_cast<size_t>(newline - start + 1) : length - offset;
+
+            if (m_state == state::status_line || m_state == state::headers || m_state == state::trailers)
+            {
+                m_headerBytes += static_cast<uint32_t>(count);
+                if (m_headerBytes > GENERIC_HTTP_MAX_HEADER_BYTES)
+                {
+                    HC_TRACE_ERROR(HTTPCLIENT, "http_response_parser: response headers too large");
+                    return result::failed;
+                }
+            }
+            else if (m_line.size() + count > GENERIC_HTTP_MAX_CHUNK_LINE)
+            {
+                return result::failed;
+            }
+
+            try
+            {
+                m_line.append(start, count);
+            }
+            catch (...)
+            {
+                return result::failed;
+            }
+            offset += count;
+
+            if (newline != nullptr)
+            {
+                if (!process_line(m_line))
+                {
+                    return result::failed;
+                }
+                m_line.clear();
+            }
+            break;
+        }
+        }
+    }
+
+    *consumed = offset;
+    return m_state == state::done ? result::complete : result::need_more;
+}
+
+http_response_parser::result http_response_parser::on_eof() noexcept
+{
+    if (m_state == state::body_until_close)
+    {
+        m_state = state::done;
+        return result::complete;
+    }
+    return m_state == state::done ? result::complete : result::failed;
+}
+
+bool http_response_parser::process_line(_In_ http_internal_string& line) noexcept
+{
+    while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+    {
+        line.pop_back();
+    }
+
+    switch (m_state)
+    {
+    case state::status_line:
+        // Tolerate stray blank lines ahead of the status line
+        return line.empty() || process_status_line(line);
+
+    case state::headers:
+        if (line.empty())
+        {
+            end_of_headers();
+            return true;
+        }
+        return process_header(line);
+
+    case state::chunk_size:
+    {
+        // chunk-size [ BWS ; chunk-ext ]
+        uint64_t chunkSize = 0;
+        const char* begin = line.data();
+        const char* end = std::find(begin, begin + line.size(), ';');
+        while (end > begin && (end[-1] == ' ' || end[-1] == '\t'))
+        {
+            --end;
+        }
+        if (!parse_unsigned(begin, end, 16, &chunkSize))
+        {
+            return false;
+        }
+        if (chunkSize == 0)
+        {
+            m_state = state::trailers;
+        }
+        else
+        {
+            m_remaining = chunkSize;
+            m_state = state::chunk_data;
+        }
+        return true;
+    }
+
+    case state::chunk_crlf:
+        m_state = state::chunk_size;
+        return line.empty();
+
+    case state::trailers:
+        if (line.empty())
+        {
+            m_state = state::done;
+        }
+        return true;
+
+    default:
+        ASSERT(false);
+        return false;
+    }
+}
+
+bool http_response_parser::process_status_line(_In_ const http_internal_string& line) noexcept
+{
+    // HTTP/1.x SSS reason
+    if (line.size() < 12 || line.compare(0, 7, "HTTP/1.") != 0 || (line[7] != '0' && line[7] != '1') || line[8] != ' ' ||
+        (line.size() > 12 && line[12] != ' '))
+    {
+        HC_TRACE_ERROR(HTTPCLIENT, "http_response_parser: invalid status line");
+        return false;
+    }
+
+    uint64_t statusCode = 0;
+    if (!parse_unsigned(line.data() + 9, line.data() + 12, 10, &statusCode) || statusCode < 100)
+    {
+        HC_TRACE_ERROR(HTTPCLIENT, "http_response_parser: invalid status code");
+        return false;
+    }
+
+    m_http11 = line[7] != '0';
+    m_keepAlive = m_http11;
+    m_statusCode = static_cast<uint32_t>(statusCode);
+    m_interim = m_statusCode >= 100 && m_statusCode < 200 && m_statusCode != 101;
+    m_state = state::headers;
+
+    if (!m_interim)
+    {
+        return SUCCEEDED(HCHttpCallResponseSetStatusCode(m_call, m_statusCode));
+    }
+    return true;
+}
+
+bool http_response_parser::process_header(_In_ const http_internal_string& line) noexcept
+{
+    if (m_interim)
+    {
+        return true;
+    }
+
+    auto colon = line.find(':');
+    if (colon == http_internal_string::npos || colon == 0)
+    {
+        return false;
+    }
+
+    size_t nameLength = colon;
+    while (nameLength > 0 && (line[nameLength - 1] == ' ' || line[nameLength - 1] == '\t'))
+    {
+        --nameLength;
+    }
+
+    size_t valueStart = colon + 1;
+    size_t valueEnd = line.size();
+    while (valueStart < valueEnd && (line[valueStart] == ' ' || line[valueStart] == '\t'))
+    {
+        ++valueStart;
+    }
+    while (valueEnd > valueStart && (line[valueEnd - 1] == ' ' || line[valueEnd - 1] == '\t'))
+    {
+        --valueEnd;
+    }
+
+    const char* name = line.data();
+    const char* value = line.data() + valueStart;
+    size_t valueLength = valueEnd - valueStart;
+
+    if (header_name_equals(name, nameLength, "Content-Length"))
+    {
+        uint64_t contentLength = 0;
+        if (!parse_unsigned(value, value + valueLength, 10, &contentLength))
+        {
+            HC_TRACE_ERROR(HTTPCLIENT, "http_response_parser: invalid Content-Length");
+            return false;
+        }
+        m_hasContentLength = true;
+        m_remaining = contentLength;
+    }
+    else if (header_name_equals(name, nameLength, "Transfer-Encoding"))
+    {
+        m_chunked = header_value_contains(line, "chunked");
+    }
+    else if (header_name_equals(name, nameLength, "Connection"))
+    {
+        if (header_value_contains(line, "close"))
+        {
+            m_keepAlive = false;
+        }
+        else if (header_value_contains(line, "keep-alive"))
+        {
+            m_keepAlive = true;
+        }
+    }
+
+    return SUCCEEDED(HCHttpCallResponseSetHeaderWithLength(m_call, name, nameLength, value, valueLength));
+}
+
+void http_response_parser::end_of_headers() noexcept
+{
+    if (m_interim)
+    {
+        // 1xx responses are followed by the real one
+        m_interim = false;
+        m_hasContentLength = false;
+        m_chunked = false;
+        m_state = state::status_line;
+        return;
+    }
+
+    if (m_headRequest || m_statusCode == 204 || m_statusCode == 304)
+    {
+        m_state = state::done;
+    }
+    else if (m_chunked)
+    {
+        m_state = state::chunk_size;
+    }
+    else if (m_hasContentLength)
+    {
+        m_state = m_remaining == 0 ? state::done : state::body_length;
+    }
+    else
+    {
+        m_keepAlive = false;
+        m_state = state::body_until_close;
+    }
+}
+
+//
+// http_connection
+//
+
+http_connection::http_connection(_In_ http_connection_engine* engine, _In_ const http_internal_string& poolKey) noexcept :
+    m_engine{ engine },
+    m_poolKey{ poolKey }
+{
+}
+
+http_connection::~http_connection()
+{
+    close_socket();
+}
+
+void http_connection::connect(_In_ http_request_op* op) noexcept
+{
+    m_op = op;
+    m_reused = false;
+    m_paused = false;
+    m_nextAddress = 0;
+    m_lastConnectError = op->resolveError;
+
+    if (!try_next_address())
+    {
+        fail(m_lastConnectError, op->addresses.empty() ? "Failed to resolve host" : "Failed to connect");
+    }
+}
+
+void http_connection::reuse(_In_ http_request_op* op) noexcept
+{
+    ASSERT(m_state == state::idle);
+    m_op = op;
+    m_reused = true;
+    m_paused = false;
+    start_sending();
+}
+
+void http_connection::timeout() noexcept
+{
+    // A request that timed out must not be retried on another connection
+    m_reused = false;
+    fail(ETIMEDOUT, "Request timed out");
+}
+
+void http_connection::resume() noexcept
+{
+    if (m_paused && m_state == state::receiving && m_op != nullptr)
+    {
+        m_paused = false;
+        continue_receiving();
+    }
+}
+
+bool http_connection::try_next_address() noexcept
+{
+    close_socket();
+
+    while (m_nextAddress < m_op->addresses.size())
+    {
+        const resolved_address& address = m_op->addresses[m_nextAddress++];
+
+        int fd = socket(address.address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+        if (fd < 0)
+        {
+            m_lastConnectError = errno;
+            continue;
+        }
+
+        // Requests are written in one go; don't let Nagle hold back the tail.
+        int noDelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+        if (::connect(fd, reinterpret_cast<const sockaddr*>(&address.address), address.length) != 0 && errno != EINPROGRESS)
+        {
+            m_lastConnectError = errno;
+            close(fd);
+            continue;
+        }
+
+        if (FAILED(m_engine->reactor().add(fd, EPOLLOUT, this, &m_registration)))
+        {
+            m_lastConnectError = errno;
+            close(fd);
+            continue;
+        }
+
+        m_socket = fd;
+        m_registered = true;
+        m_interest = EPOLLOUT;
+        m_state = state::connecting;
+        return true;
+    }
+
+    return false;
+}
+
+void http_connection::on_socket_event(_In_ uint32_t events) noexcept
+{
+    switch (m_state)
+    {
+    case state::connecting:
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(m_socket, SOL_SOCKET, SO_ERROR, &error, &length) != 0)
+        {
+            error = errno;
+        }
+        if (error == 0 && (events & EPOLLERR) != 0)
+        {
+            error = ECONNREFUSED;
+        }
+
+        if (error != 0)
+        {
+            m_lastConnectError = error;
+            if (!try_next_address())
+            {
+                fail(m_lastConnectError, "Failed to connect");
+            }
+            return;
+        }
+
+        on_connected();
+        return;
+    }
+
+    case state::tls_handshake:
+        continue_handshake();
+        return;
+
+    case state::sending:
+        continue_sending();
+        return;
+
+    case state::receiving:
+        continue_receiving();
+        return;
+
+    case state::idle:
+        // Nothing is expected on an idle connection; this is the server
+        // closing it (or misbehaving). Either way it can't be reused.
+        m_engine->on_idle_connection_closed(this);
+        return;
+
+    default:
+        return;
+    }
+}
+
+void http_connection::on_connected() noexcept
+{
+    if (!m_op->secure)
+    {
+        start_sending();
+        return;
+    }
+
+    m_ssl = SSL_new(m_engine->ssl_context());
+    if (m_ssl == nullptr || SSL_set_fd(m_ssl, m_socket) != 1)
+    {
+        fail(0, "Failed to create TLS session");
+        return;
+    }
+
+    SSL_set_tlsext_host_name(m_ssl, m_op->host.c_str());
+    SSL_set1_host(m_ssl, m_op->host.c_str());
+
+    SSL_SESSION* session = m_engine->tls_session(m_poolKey);
+    if (session != nullptr)
+    {
+        SSL_set_session(m_ssl, session);
+    }
+
+    SSL_set_connect_state(m_ssl);
+    m_state = state::tls_handshake;
+    continue_handshake();
+}
+
+void http_connection::continue_handshake() noexcept
+{
+    ERR_clear_error();
+    int ret = SSL_do_handshake(m_ssl);
+    if (ret == 1)
+    {
+        start_sending();
+        return;
+    }
+
+    switch (SSL_get_error(m_ssl, ret))
+    {
+    case SSL_ERROR_WANT_READ:
+        update_interest(EPOLLIN);
+        return;
+
+    case SSL_ERROR_WANT_WRITE:
+        update_interest(EPOLLOUT);
+        return;
+
+    default:
+    {
+        long verifyResult = SSL_get_verify_result(m_ssl);
+        if (verifyResult != X509_V_OK)
+        {
+            HC_TRACE_ERROR(HTTPCLIENT, "http_connection: certificate verification failed: %s", X509_verify_cert_error_string(verifyResult));
+            fail(static_cast<int>(verifyResult), "TLS certificate verification failed");
+        }
+        else
+        {
+            fail(static_cast<int>(ERR_get_error()), "TLS handshake failed");
+        }
+        return;
+    }
+    }
+}
+
+void http_connection::start_sending() noexcept
+{
+    m_state = state::sending;
+    m_bytesSent = 0;
+    m_bodyOffset = 0;
+    m_bodyChunkStart = 0;
+    m_bodyChunkEnd = 0;
+    m_bodyComplete = false;
+    m_bytesReceived = 0;
+    m_parser.reset(m_op->call, m_op->headRequest);
+    continue_sending();
+}
+
+void http_connection::continue_sending() noexcept
+{
+    const http_internal_string& data = m_op->requestData;
+
+    while (m_bytesSent < data.size())
+    {
+        size_t written = 0;
+        switch (do_write(data.data() + m_bytesSent, data.size() - m_bytesSent, &written))
+        {
+        case io_result::ok:
+            m_bytesSent += written;
+            break;
+
+        case io_result::would_block:
+            update_interest(m_sslWantEvents);
+            return;
+
+        default:
+            fail(m_lastError, "Failed to send request");
+            return;
+        }
+    }
+
+    if (m_op->streamBody && !continue_sending_body())
+    {
+        return;
+    }
+
+    m_state = state::receiving;
+    update_interest(EPOLLIN);
+}
+
+bool http_connection::continue_sending_body() noexcept
+{
+    for (;;)
+    {
+        if (m_bodyChunkStart == m_bodyChunkEnd)
+        {
+            if (m_bodyComplete)
+            {
+                return true;
+            }
+            if (!read_body_chunk())
+            {
+                return false;
+            }
+            continue;
+        }
+
+        size_t written = 0;
+        switch (do_write(m_bodyBuffer.data() + m_bodyChunkStart, m_bodyChunkEnd - m_bodyChunkStart, &written))
+        {
+        case io_result::ok:
+            m_bodyChunkStart += written;
+            break;
+
+        case io_result::would_block:
+            update_interest(m_sslWantEvents);
+            return false;
+
+        default:
+            fail(m_lastError, "Failed to send request");
+            return false;
+        }
+    }
+}
+
+bool http_connection::read_body_chunk() noexcept
+{
+    // Chunk framing goes around the data in place: the size line is written
+    // into the headroom and the CRLF after it, so each chunk is one write.
+    static const size_t chunkHeadroom = 16;
+    static const char lastChunk[] = "0\r\n\r\n";
+
+    if (m_bodyBuffer.empty())
+    {
+        try
+        {
+            m_bodyBuffer.resize(chunkHeadroom + GENERIC_HTTP_BODY_CHUNK_SIZE + sizeof(lastChunk));
+        }
+        catch (...)
+        {
+            fail_body(E_OUTOFMEMORY, "Out of memory");
+            return false;
+        }
+    }
+
+    HCHttpCallRequestBodyReadFunction readFunction = m_op->bodyReadFunction;
+    uint64_t bodySize = m_op->bodySize;
+    size_t bytesAvailable = GENERIC_HTTP_BODY_CHUNK_SIZE;
+    if (!m_op->chunkedBody)
+    {
+        bytesAvailable = static_cast<size_t>(std::min<uint64_t>(bytesAvailable, bodySize - m_bodyOffset));
+        if (bytesAvailable == 0)
+        {
+            m_bodyComplete = true;
+            m_bodyChunkStart = m_bodyChunkEnd = 0;
+            return true;
+        }
+    }
+
+    char* data = m_bodyBuffer.data() + chunkHeadroom;
+    size_t bytesWritten = 0;
+    HRESULT hr = readFunction(m_op->call, m_bodyOffset, bytesAvailable, m_op->bodyReadContext, reinterpret_cast<uint8_t*>(data), &bytesWritten);
+    if (FAILED(hr))
+    {
+        fail_body(hr, "Request body read function failed");
+        return false;
+    }
+    if (bytesWritten > bytesAvailable || (bytesWritten == 0 && !m_op->chunkedBody))
+    {
+        fail_body(E_UNEXPECTED, "Request body read function returned the wrong number of bytes");
+        return false;
+    }
+
+    m_bodyOffset += bytesWritten;
+
+    if (!m_op->chunkedBody)
+    {
+        m_bodyChunkStart = chunkHeadroom;
+        m_bodyChunkEnd = chunkHeadroom + bytesWritten;
+        return true;
+    }
+
+    if (bytesWritten == 0)
+    {
+        memcpy(data, lastChunk, sizeof(lastChunk) - 1);
+        m_bodyChunkStart = chunkHeadroom;
+        m_bodyChunkEnd = chunkHeadroom + sizeof(lastChunk) - 1;
+        m_bodyComplete = true;
+        return true;
+    }
+
+    char sizeLine[chunkHeadroom];
+    int sizeLineLength = snprintf(sizeLine, sizeof(sizeLine), "%zx\r\n", bytesWritten);
+    memcpy(data - sizeLineLength, sizeLine, sizeLineLength);
+    memcpy(data + bytesWritten, "\r\n", 2);
+    m_bodyChunkStart = chunkHeadroom - sizeLineLength;
+    m_bodyChunkEnd = chunkHeadroom + bytesWritten + 2;
+    return true;
+}
+
+void http_connection::fail_body(_In_ HRESULT hr, _In_z_ const char* message) noexcept
+{
+    // The body source is at fault, not the connection, so don't retry
+    m_op->bodyError = hr;
+    m_reused = false;
+    fail(0, message);
+}
+
+void http_connection::continue_receiving() noexcept
+{
+    char buffer[GENERIC_HTTP_READ_BUFFER_SIZE];
+
+    for (;;)
+    {
+        size_t bytesRead = 0;
+        switch (do_read(buffer, sizeof(buffer), &bytesRead))
+        {
+        case io_result::ok:
+        {
+            m_bytesReceived += bytesRead;
+
+            size_t consumed = 0;
+            auto result = m_parser.parse(buffer, bytesRead, &consumed);
+            if (result == http_response_parser::result::failed)
+            {
+                auto& stream = m_op->call->responseBodyStream;
+                bool writeFailed = stream != nullptr && FAILED(stream->result());
+
+                m_reused = false;
+                fail(0, writeFailed ? "Response body write function failed" : "Invalid HTTP response");
+                return;
+            }
+            if (result == http_response_parser::result::complete)
+            {
+                // We never pipeline, so anything past the response means the
+                // connection is out of sync with the server.
+                bool reusable = m_parser.keep_alive() && !m_op->closeRequested && consumed == bytesRead &&
+                    (m_ssl == nullptr || SSL_pending(m_ssl) == 0);
+                finish_request(reusable);
+                return;
+            }
+            if (pause_if_body_stream_full())
+            {
+                return;
+            }
+            break;
+        }
+
+        case io_result::would_block:
+            update_interest(m_sslWantEvents);
+            return;
+
+        case io_result::eof:
+            if (m_parser.on_eof() == http_response_parser::result::complete)
+            {
+                finish_request(false);
+            }
+            else
+            {
+                fail(ECONNRESET, "Connection closed by server");
+            }
+            return;
+
+        default:
+            fail(m_lastError, "Failed to receive response");
+            return;
+        }
+    }
+}
+
+bool http_connection::pause_if_body_stream_full() noexcept
+{
+    auto& stream = m_op->call->responseBodyStream;
+    if (stream == nullptr || !stream->pause_if_full(&http_connection_engine::body_stream_resume_callback, m_engine))
+    {
+        return false;
+    }
+
+    // The write function is behind. Stop reading and let TCP flow control
+    // hold the server back until it catches up.
+    m_paused = true;
+    update_interest(0);
+    return true;
+}
+
+void http_connection::finish_request(_In_ bool reusable) noexcept
+{
+    auto op = m_op;
+    m_op = nullptr;
+
+    if (reusable)
+    {
+        if (m_ssl != nullptr)
+        {
+            m_engine->store_tls_session(m_poolKey, m_ssl);
+        }
+
+        m_state = state::idle;
+        m_idleDeadline = chrono_clock_t::now() + std::chrono::milliseconds(GENERIC_HTTP_IDLE_CONNECTION_TIMEOUT_MS);
+        update_interest(EPOLLIN | EPOLLRDHUP);
+    }
+    else
+    {
+        close_socket();
+    }
+
+    m_engine->on_request_complete(this, op, reusable);
+}
+
+void http_connection::fail(_In_ int platformError, _In_z_ const char* message) noexcept
+{
+    auto op = m_op;
+    m_op = nullptr;
+
+    // A kept-alive connection may have been closed by the server just as we
+    // reused it. If nothing came back the request never reached the server
+    // and can safely be sent again on a fresh connection.
+    bool retryable = m_reused && m_bytesReceived == 0 && op != nullptr && op->attempts == 0;
+
+    close_socket();
+    m_engine->on_connection_failed(this, op, retryable, platformError, message);
+}
+
+void http_connection::update_interest(_In_ uint32_t events) noexcept
+{
+    if (events != m_interest && m_registered)
+    {
+        m_engine->reactor().modify(m_socket, events, m_registration);
+        m_interest = events;
+    }
+}
+
+void http_connection::close_socket() noexcept
+{
+    m_paused = false;
+
+    if (m_registered)
+    {
+        m_engine->reactor().remove(m_socket, m_registration);
+        m_registered = false;
+    }
+
+    if (m_ssl != nullptr)
+    {
+        if (m_state == state::idle)
+        {
+            // Best effort close_notify; we don't wait for the reply
+            SSL_shutdown(m_ssl);
+        }
+        SSL_free(m_ssl);
+        m_ssl = nullptr;
+    }
+
+    if (m_socket >= 0)
+    {
+        close(m_socket);
+        m_socket = -1;
+    }
+
+    m_interest = 0;
+    m_state = state::closed;
+}
+
+http_connection::io_result http_connection::do_write(
+    _In_reads_bytes_(length) const char* data,
+    _In_ size_t length,
+    _Out_ size_t* written
+    ) noexcept
+{
+    *written = 0;
+
+    if (m_ssl != nullptr)
+    {
+        ERR_clear_error();
+        int ret = SSL_write(m_ssl, data, static_cast<int>(std::min<size_t>(length, INT32_MAX)));
+        if (ret > 0)
+        {
+            *written = static_cast<size_t>(ret);
+            return io_result::ok;
+        }
+
+        switch (SSL_get_error(m_ssl, ret))
+        {
+        case SSL_ERROR_WANT_READ: m_sslWantEvents = EPOLLIN; return io_result::would_block;
+        case SSL_ERROR_WANT_WRITE: m_sslWantEvents = EPOLLOUT; return io_result::would_block;
+        case SSL_ERROR_ZERO_RETURN: return io_result::eof;
+        default: m_lastError = errno; return io_result::failed;
+        }
+    }
+
+    for (;;)
+    {
+        ssize_t ret = send(m_socket, data, length, MSG_NOSIGNAL);
+        if (ret >= 0)
+        {
+            *written = static_cast<size_t>(ret);
+            return io_result::ok;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            m_sslWantEvents = EPOLLOUT;
+            return io_result::would_block;
+        }
+        m_lastError = errno;
+        return io_result::failed;
+    }
+}
+
+http_connection::io_result http_connection::do_read(
+    _Out_writes_bytes_(length) char* data,
+    _In_ size_t length,
+    _Out_ size_t* bytesRead
+    ) noexcept
+{
+    *bytesRead = 0;
+
+    if (m_ssl != nullptr)
+    {
+        ERR_clear_error();
+        int ret = SSL_read(m_ssl, data, static_cast<int>(std::min<size_t>(length, INT32_MAX)));
+        if (ret > 0)
+        {
+            *bytesRead = static_cast<size_t>(ret);
+            return io_result::ok;
+        }
+
+        switch (SSL_get_error(m_ssl, ret))
+        {
+        case SSL_ERROR_WANT_READ: m_sslWantEvents = EPOLLIN; return io_result::would_block;
+        case SSL_ERROR_WANT_WRITE: m_sslWantEvents = EPOLLOUT; return io_result::would_block;
+        case SSL_ERROR_ZERO_RETURN: return io_result::eof;
+        case SSL_ERROR_SYSCALL:
+            if (errno == 0)
+            {
+                // Peer closed without close_notify
+                return io_result::eof;
+            }
+            m_lastError = errno;
+            return io_result::failed;
+        default: m_lastError = errno; return io_result::failed;
+        }
+    }
+
+    for (;;)
+    {
+        ssize_t ret = recv(m_socket, data, length, 0);
+        if (ret > 0)
+        {
+            *bytesRead = static_cast<size_t>(ret);
+            return io_result::ok;
+        }
+        if (ret == 0)
+        {
+            return io_result::eof;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            m_sslWantEvents = EPOLLIN;
+            return io_result::would_block;
+        }
+        m_lastError = errno;
+        return io_result::failed;
+    }
+}
+
+//
+// http_connection_engine
+//
+
+http_connection_engine::http_connection_engine() noexcept
+{
+}
+
+http_connection_engine::~http_connection_engine()
+{
+    if (m_started)
+    {
+        // Lookups still queued are posted as canceled ahead of the shutdown
+        m_resolver.stop();
+
+        if (SUCCEEDED(m_reactor.post(shutdown_callback, this)))
+        {
+            m_reactor.stop();
+        }
+    }
+
+    if (m_sslContext != nullptr)
+    {
+        SSL_CTX_free(m_sslContext);
+    }
+}
+
+HRESULT http_connection_engine::ensure_started() noexcept
+{
+    std::lock_guard<std::mutex> lock(m_startLock);
+    if (m_started)
+    {
+        return S_OK;
+    }
+
+    m_sslContext = SSL_CTX_new(TLS_client_method());
+    RETURN_IF_NULL_ALLOC(m_sslContext);
+
+    SSL_CTX_set_default_verify_paths(m_sslContext);
+    SSL_CTX_set_verify(m_sslContext, SSL_VERIFY_PEER, nullptr);
+    SSL_CTX_set_min_proto_version(m_sslContext, TLS1_2_VERSION);
+    SSL_CTX_set_mode(m_sslContext, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_session_cache_mode(m_sslContext, SSL_SESS_CACHE_CLIENT);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    SSL_CTX_set_options(m_sslContext, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+    RETURN_IF_FAILED(m_reactor.start(tick_callback, this, GENERIC_HTTP_TICK_INTERVAL_MS));
+
+    m_started = true;
+    return S_OK;
+}
+
+HRESULT http_connection_engine::perform(_In_ HCCallHandle call, _Inout_ XAsyncBlock* asyncBlock) noexcept
+{
+    RETURN_IF_FAILED(ensure_started());
+
+    const char* method = nullptr;
+    const char* url = nullptr;
+    RETURN_IF_FAILED(HCHttpCallRequestGetUrl(call, &method, &url));
+
+    try
+    {
+        Uri uri{ url };
+        RETURN_HR_IF(E_INVALIDARG, !uri.IsValid() || (uri.Scheme() != "http" && uri.Scheme() != "https"));
+
+        auto op = http_allocate_unique<http_request_op>();
+        op->engine = this;
+        op->call = call;
+        op->asyncBlock = asyncBlock;
+        op->host = uri.Host();
+        op->secure = uri.IsSecure();
+        op->headRequest = strcmp(method, "HEAD") == 0;
+
+        uint16_t port = uri.IsPortDefault() ? (op->secure ? 443 : 80) : uri.Port();
+
+        op->poolKey = uri.Scheme();
+        op->poolKey += "://";
+        op->poolKey += op->host;
+        op->poolKey += ':';
+        op->poolKey += std::to_string(port).c_str();
+
+        uint32_t timeoutInSeconds = 0;
+        if (SUCCEEDED(HCHttpCallRequestGetTimeout(call, &timeoutInSeconds)) && timeoutInSeconds > 0)
+        {
+            op->deadline = chrono_clock_t::now() + std::chrono::seconds(timeoutInSeconds);
+        }
+
+        RETURN_IF_FAILED(HCHttpCallRequestGetRequestBodyReadFunction(call, &op->bodyReadFunction, &op->bodySize, &op->bodyReadContext));
+        op->chunkedBody = op->bodySize == HC_HTTP_REQUEST_BODY_SIZE_UNKNOWN;
+        op->streamBody = op->chunkedBody || op->bodySize > GENERIC_HTTP_INLINE_BODY_BYTES;
+
+        // Serialize the request up front so the reactor only moves bytes.
+        // Small bodies are included; larger ones are streamed after it.
+        http_internal_string& data = op->requestData;
+        data.reserve(256 + (op->streamBody ? 0 : static_cast<size_t>(op->bodySize)));
+
+        data += method;
+        data += ' ';
+        data += uri.Path().empty() ? "/" : uri.Path().c_str();
+        if (!uri.Query().empty())
+        {
+            data += '?';
+            data += uri.Query();
+        }
+        data += " HTTP/1.1\r\n";
+
+        bool hasHost = false;
+        uint32_t numHeaders = 0;
+        RETURN_IF_FAILED(HCHttpCallRequestGetNumHeaders(call, &numHeaders));
+        for (uint32_t i = 0; i < numHeaders; i++)
+        {
+            const char* name = nullptr;
+            const char* value = nullptr;
+            RETURN_IF_FAILED(HCHttpCallRequestGetHeaderAtIndex(call, i, &name, &value));
+
+            if (strcasecmp(name, "Content-Length") == 0 || strcasecmp(name, "Transfer-Encoding") == 0)
+            {
+                // Always derived from the body below
+                continue;
+            }
+            if (strcasecmp(name, "Host") == 0)
+            {
+                hasHost = true;
+            }
+            else if (strcasecmp(name, "Connection") == 0 && strcasestr(value, "close") != nullptr)
+            {
+                op->closeRequested = true;
+            }
+
+            data += name;
+            data += ": ";
+            data += value;
+            data += "\r\n";
+        }
+
+        if (!hasHost)
+        {
+            data += "Host: ";
+            data += op->host;
+            if (!uri.IsPortDefault())
+            {
+                data += ':';
+                data += std::to_string(port).c_str();
+            }
+            data += "\r\n";
+        }
+
+        if (op->chunkedBody)
+        {
+            data += "Transfer-Encoding: chunked\r\n";
+        }
+        else if (op->bodySize > 0 || strcmp(method, "POST") == 0 || strcmp(method, "PUT") == 0 || strcmp(method, "PATCH") == 0)
+        {
+            data += "Content-Length: ";
+            data += std::to_string(op->bodySize).c_str();
+            data += "\r\n";
+        }
+
+        data += "\r\n";
+        if (!op->streamBody && op->bodySize > 0)
+        {
+            size_t headerLength = data.size();
+            size_t bodySize = static_cast<size_t>(op->bodySize);
+            data.resize(headerLength + bodySize);
+
+            size_t offset = 0;
+            while (offset < bodySize)
+            {
+                size_t bytesWritten = 0;
+                RETURN_IF_FAILED(op->bodyReadFunction(call, offset, bodySize - offset, op->bodyReadContext, reinterpret_cast<uint8_t*>(&data[headerLength + offset]), &bytesWritten));
+                RETURN_HR_IF(E_UNEXPECTED, bytesWritten == 0 || bytesWritten > bodySize - offset);
+                offset += bytesWritten;
+            }
+        }
+
+        // Resolution is cached, so only the first call to a host pays for it,
+        // and it happens on a resolver thread rather than this one. A failure
+        // is only reported if the request actually needs a new connection; an
+        // idle pooled connection can still serve it.
+        RETURN_IF_FAILED(m_resolver.resolve(op->host, port, &op->addresses, &op->resolveError, m_reactor, submit_callback, op.get()));
+        op.release();
+    }
+    CATCH_RETURN();
+
+    return S_OK;
+}
+
+void http_connection_engine::submit_callback(_In_opt_ void* context) noexcept
+{
+    auto op = static_cast<http_request_op*>(context);
+    op->engine->submit(op);
+}
+
+void http_connection_engine::tick_callback(_In_opt_ void* context) noexcept
+{
+    static_cast<http_connection_engine*>(context)->tick();
+}
+
+void http_connection_engine::shutdown_callback(_In_opt_ void* context) noexcept
+{
+    static_cast<http_connection_engine*>(context)->shutdown();
+}
+
+void http_connection_engine::body_stream_resume_callback(_In_opt_ void* context) noexcept
+{
+    // Runs on the call's queue; the connections belong to the reactor thread
+    auto engine = static_cast<http_connection_engine*>(context);
+    engine->m_reactor.post(&http_connection_engine::resume_paused_callback, engine);
+}
+
+void http_connection_engine::resume_paused_callback(_In_opt_ void* context) noexcept
+{
+    static_cast<http_connection_engine*>(context)->resume_paused();
+}
+
+void http_connection_engine::resume_paused() noexcept
+{
+    http_internal_vector<http_connection*> paused;
+    try
+    {
+        for (auto& entry : m_connections)
+        {
+            if (entry.first->is_paused())
+            {
+                paused.push_back(entry.first);
+            }
+        }
+    }
+    catch (...)
+    {
+    }
+
+    // Resuming can complete a request and destroy connections, so look each
+    // one up again
+    for (auto connection : paused)
+    {
+        if (m_connections.find(connection) != m_connections.end())
+        {
+            connection->resume();
+        }
+    }
+}
+
+void http_connection_engine::submit(_In_ http_request_op* op) noexcept
+{
+    http_host_pool* pool = nullptr;
+    try
+    {
+        pool = &m_pools[op->poolKey];
+    }
+    catch (...)
+    {
+        complete_op(op, E_OUTOFMEMORY, 0, nullptr);
+        return;
+    }
+
+    if (!pool->idle.empty())
+    {
+        // Most recently used first; it's the least likely to have been
+        // closed by the server.
+        http_connection* connection = pool->idle.back();
+        pool->idle.pop_back();
+        connection->reuse(op);
+        return;
+    }
+
+    try
+    {
+        pool->pending.push(op);
+    }
+    catch (...)
+    {
+        complete_op(op, E_OUTOFMEMORY, 0, nullptr);
+        return;
+    }
+
+    dispatch_pending(*pool);
+}
+
+void http_connection_engine::dispatch_pending(_In_ http_host_pool& pool) noexcept
+{
+    // Connections can fail synchronously and call back into here; let the
+    // outermost call drain the queue instead of recursing.
+    if (m_dispatchingPending)
+    {
+        return;
+    }
+    m_dispatchingPending = true;
+
+    while (!pool.pending.empty() && pool.connectionCount < GENERIC_HTTP_MAX_CONNECTIONS_PER_HOST)
+    {
+        http_request_op* op = pool.pending.front();
+        pool.pending.pop();
+
+        http_connection* raw = nullptr;
+        try
+        {
+            auto connection = http_allocate_unique<http_connection>(this, op->poolKey);
+            raw = connection.get();
+            m_connections[raw] = std::move(connection);
+        }
+        catch (...)
+        {
+            complete_op(op, E_OUTOFMEMORY, 0, nullptr);
+            continue;
+        }
+
+        ++pool.connectionCount;
+        raw->connect(op);
+    }
+
+    m_dispatchingPending = false;
+}
+
+void http_connection_engine::on_request_complete(_In_ http_connection* connection, _In_ http_request_op* op, _In_ bool reusable) noexcept
+{
+    complete_op(op, S_OK, 0, nullptr);
+
+    http_host_pool& pool = m_pools[connection->pool_key()];
+    if (!reusable)
+    {
+        destroy_connection(connection);
+        dispatch_pending(pool);
+        return;
+    }
+
+    if (!pool.pending.empty())
+    {
+        http_request_op* next = pool.pending.front();
+        pool.pending.pop();
+        connection->reuse(next);
+        return;
+    }
+
+    try
+    {
+        pool.idle.push_back(connection);
+    }
+    catch (...)
+    {
+        destroy_connection(connection);
+    }
+}
+
+void http_connection_engine::on_connection_failed(
+    _In_ http_connection* connection,
+    _In_opt_ http_request_op* op,
+    _In_ bool retryable,
+    _In_ int platformError,
+    _In_z_ const char* message
+    ) noexcept
+{
+    http_host_pool& pool = m_pools[connection->pool_key()];
+    destroy_connection(connection);
+
+    if (op != nullptr)
+    {
+        if (retryable)
+        {
+            HC_TRACE_INFORMATION(HTTPCLIENT, "http_connection_engine: pooled connection was closed, retrying on a new connection");
+            ++op->attempts;
+            submit(op);
+        }
+        else
+        {
+            HC_TRACE_ERROR(HTTPCLIENT, "http_connection_engine: %s (%d)", message, platformError);
+            complete_op(op, FAILED(op->bodyError) ? op->bodyError : E_FAIL, platformError, message);
+        }
+    }
+
+    dispatch_pending(pool);
+}
+
+void http_connection_engine::on_idle_connection_closed(_In_ http_connection* connection) noexcept
+{
+    http_host_pool& pool = m_pools[connection->pool_key()];
+    auto it = std::find(pool.idle.begin(), pool.idle.end(), connection);
+    if (it != pool.idle.end())
+    {
+        pool.idle.erase(it);
+    }
+    destroy_connection(connection);
+}
+
+SSL_SESSION* http_connection_engine::tls_session(_In_ const http_internal_string& poolKey) noexcept
+{
+    auto it = m_pools.find(poolKey);
+    return it != m_pools.end() ? it->second.tlsSession : nullptr;
+}
+
+void http_connection_engine::store_tls_session(_In_ const http_internal_string& poolKey, _In_ SSL* ssl) noexcept
+{
+    auto it = m_pools.find(poolKey);
+    if (it == m_pools.end())
+    {
+        return;
+    }
+
+    SSL_SESSION* session = SSL_get1_session(ssl);
+    if (session == it->second.tlsSession)
+    {
+        SSL_SESSION_free(session);
+        return;
+    }
+
+    if (it->second.tlsSession != nullptr)
+    {
+        SSL_SESSION_free(it->second.tlsSession);
+    }
+    it->second.tlsSession = session;
+}
+
+void http_connection_engine::destroy_connection(_In_ http_connection* connection) noexcept
+{
+    auto pool = m_pools.find(connection->pool_key());
+    if (pool != m_pools.end())
+    {
+        ASSERT(pool->second.connectionCount > 0);
+        --pool->second.connectionCount;
+    }
+    m_connections.erase(connection);
+}
+
+void http_connection_engine::complete_op(
+    _In_ http_request_op* op,
+    _In_ HRESULT networkError,
+    _In_ int platformError,
+    _In_opt_z_ const char* message
+    ) noexcept
+{
+    HC_UNIQUE_PTR<http_request_op> owner{ op };
+
+    if (op->call->responseBodyStream != nullptr)
+    {
+        // The engine may be gone by the time the body stream drains
+        op->call->responseBodyStream->cancel_resume();
+    }
+
+    if (FAILED(networkError))
+    {
+        HCHttpCallResponseSetNetworkErrorCode(op->call, networkError, static_cast<uint32_t>(platformError));
+        if (message != nullptr)
+        {
+            HCHttpCallResponseSetPlatformNetworkErrorMessage(op->call, message);
+        }
+    }
+
+    XAsyncComplete(op->asyncBlock, S_OK, 0);
+}
+
+void http_connection_engine::tick() noexcept
+{
+    auto now = chrono_clock_t::now();
+
+    http_internal_vector<http_connection*> timedOut;
+    http_internal_vector<http_connection*> expired;
+
+    try
+    {
+        for (auto& entry : m_connections)
+        {
+            http_connection* connection = entry.first;
+            if (connection->current_op() != nullptr && connection->current_op()->deadline <= now)
+            {
+                timedOut.push_back(connection);
+            }
+            else if (connection->is_idle() && connection->idle_deadline() <= now)
+            {
+                expired.push_back(connection);
+            }
+        }
+
+        for (auto& entry : m_pools)
+        {
+            auto& pending = entry.second.pending;
+            for (size_t i = pending.size(); i > 0; i--)
+            {
+                http_request_op* op = pending.front();
+                pending.pop();
+                if (op->deadline <= now)
+                {
+                    complete_op(op, E_FAIL, ETIMEDOUT, "Request timed out");
+                }
+                else
+                {
+                    pending.push(op);
+                }
+            }
+        }
+    }
+    catch (...)
+    {
+        // Try again on the next tick
+    }
+
+    for (auto connection : timedOut)
+    {
+        connection->timeout();
+    }
+
+    for (auto connection : expired)
+    {
+        on_idle_connection_closed(connection);
+    }
+}
+
+void http_connection_engine::shutdown() noexcept
+{
+    for (auto& entry : m_connections)
+    {
+        http_request_op* op = entry.first->current_op();
+        entry.first->close_socket();
+        if (op != nullptr)
+        {
+            complete_op(op, E_ABORT, 0, "HTTP provider shut down");
+        }
+    }
+    m_connections.clear();
+
+    for (auto& entry : m_pools)
+    {
+        auto& pending = entry.second.pending;
+        while (!pending.empty())
+        {
+            complete_op(pending.front(), E_ABORT, 0, "HTTP provider shut down");
+            pending.pop();
+        }
+
+        if (entry.second.tlsSession != nullptr)
+        {
+            SSL_SESSION_free(entry.second.tlsSession);
+        }
+    }
+    m_pools.clear();
+}
+
+NAMESPACE_XBOX_HTTP_CLIENT_END
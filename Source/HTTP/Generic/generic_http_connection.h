@@ -0,0 +1,290 @@
+// Copyright (c) Microsoft Corporation
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+#pragma once
+
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+
+#include "../httpcall.h"
+#include "dns_resolver.h"
+#include "socket_reactor.h"
+
+NAMESPACE_XBOX_HTTP_CLIENT_BEGIN
+
+#define GENERIC_HTTP_MAX_CONNECTIONS_PER_HOST 16
+#define GENERIC_HTTP_IDLE_CONNECTION_TIMEOUT_MS 60000
+#define GENERIC_HTTP_TICK_INTERVAL_MS 250
+#define GENERIC_HTTP_MAX_HEADER_BYTES (64 * 1024)
+#define GENERIC_HTTP_INLINE_BODY_BYTES (64 * 1024)
+#define GENERIC_HTTP_BODY_CHUNK_SIZE (64 * 1024)
+
+class http_connection_engine;
+
+// Parses a run of decimal or hex digits and nothing else: no sign, prefix or
+// whitespace. Fails on an empty run or a value that overflows 64 bits.
+bool parse_unsigned(
+    _In_reads_(end - begin) const char* begin,
+    _In_ const char* end,
+    _In_ uint32_t base,
+    _Out_ uint64_t* value
+    ) noexcept;
+
+// A single request in flight. Owned by the engine from the time it is posted
+// to the reactor until XAsyncComplete is called for it.
+struct http_request_op
+{
+    http_connection_engine* engine = nullptr;
+    HCCallHandle call = nullptr;
+    XAsyncBlock* asyncBlock = nullptr;
+    http_internal_string poolKey;
+    http_internal_string host;
+    bool secure = false;
+    bool headRequest = false;
+    bool closeRequested = false;
+    http_internal_string requestData;
+
+    // Bodies too large to go in requestData are pulled from the read function
+    // on the reactor thread while sending.
+    bool streamBody = false;
+    bool chunkedBody = false;
+    HCHttpCallRequestBodyReadFunction bodyReadFunction = nullptr;
+    void* bodyReadContext = nullptr;
+    uint64_t bodySize = 0;
+    HRESULT bodyError = S_OK;
+
+    http_internal_vector<resolved_address> addresses;
+    int resolveError = 0;
+    chrono_clock_t::time_point deadline = chrono_clock_t::time_point::max();
+    uint32_t attempts = 0;
+};
+
+// Incremental HTTP/1.x response parser. Headers and body bytes are handed to
+// the HCCallHandle as they arrive so the body is never buffered twice.
+class http_response_parser
+{
+public:
+    enum class result
+    {
+        need_more,
+        complete,
+        failed
+    };
+
+    void reset(_In_ HCCallHandle call, _In_ bool headRequest) noexcept;
+
+    // Consumes data. On return *consumed tells how much of it belonged to the
+    // current response.
+    result parse(_In_reads_bytes_(length) const char* data, _In_ size_t length, _Out_ size_t* consumed) noexcept;
+
+    // Called when the peer closed the connection.
+    result on_eof() noexcept;
+
+    bool keep_alive() const noexcept { return m_keepAlive; }
+
+private:
+    enum class state
+    {
+        status_line,
+        headers,
+        body_length,
+        chunk_size,
+        chunk_data,
+        chunk_crlf,
+        trailers,
+        body_until_close,
+        done
+    };
+
+    bool process_line(_In_ http_internal_string& line) noexcept;
+    bool process_status_line(_In_ const http_internal_string& line) noexcept;
+    bool process_header(_In_ const http_internal_string& line) noexcept;
+    void end_of_headers() noexcept;
+
+    HCCallHandle m_call = nullptr;
+    bool m_headRequest = false;
+    state m_state = state::status_line;
+    http_internal_string m_line;
+    uint32_t m_headerBytes = 0;
+    uint32_t m_statusCode = 0;
+    bool m_interim = false;
+    bool m_http11 = true;
+    bool m_keepAlive = true;
+    bool m_chunked = false;
+    bool m_hasContentLength = false;
+    uint64_t m_remaining = 0;
+};
+
+// One TCP (optionally TLS) connection to a host. Connections serve one request
+// at a time and go back to their host pool when the server allows keep-alive.
+class http_connection : public socket_event_handler
+{
+public:
+    http_connection(_In_ http_connection_engine* engine, _In_ const http_internal_string& poolKey) noexcept;
+    ~http_connection();
+
+    const http_internal_string& pool_key() const noexcept { return m_poolKey; }
+    http_request_op* current_op() const noexcept { return m_op; }
+    bool is_idle() const noexcept { return m_state == state::idle; }
+    chrono_clock_t::time_point idle_deadline() const noexcept { return m_idleDeadline; }
+
+    // Opens a new connection and sends op once established.
+    void connect(_In_ http_request_op* op) noexcept;
+
+    // Sends op on an idle, already established connection.
+    void reuse(_In_ http_request_op* op) noexcept;
+
+    // Fails the current op with a timeout error.
+    void timeout() noexcept;
+
+    // Picks up reading again after the call's response body write function
+    // caught up.
+    bool is_paused() const noexcept { return m_paused; }
+    void resume() noexcept;
+
+    // Tears the socket down without touching the current op.
+    void close_socket() noexcept;
+
+    void on_socket_event(_In_ uint32_t events) noexcept override;
+
+private:
+    enum class state
+    {
+        closed,
+        connecting,
+        tls_handshake,
+        sending,
+        receiving,
+        idle
+    };
+
+    enum class io_result
+    {
+        ok,
+        would_block,
+        eof,
+        failed
+    };
+
+    bool try_next_address() noexcept;
+    void on_connected() noexcept;
+    void continue_handshake() noexcept;
+    void start_sending() noexcept;
+    void continue_sending() noexcept;
+    bool continue_sending_body() noexcept;
+    bool read_body_chunk() noexcept;
+    void fail_body(_In_ HRESULT hr, _In_z_ const char* message) noexcept;
+    void continue_receiving() noexcept;
+    bool pause_if_body_stream_full() noexcept;
+    void finish_request(_In_ bool reusable) noexcept;
+    void fail(_In_ int platformError, _In_z_ const char* message) noexcept;
+    void update_interest(_In_ uint32_t events) noexcept;
+
+    io_result do_write(_In_reads_bytes_(length) const char* data, _In_ size_t length, _Out_ size_t* written) noexcept;
+    io_result do_read(_Out_writes_bytes_(length) char* data, _In_ size_t length, _Out_ size_t* bytesRead) noexcept;
+
+    http_connection_engine* m_engine;
+    http_internal_string m_poolKey;
+    state m_state = state::closed;
+    int m_socket = -1;
+    SSL* m_ssl = nullptr;
+    bool m_registered = false;
+    socket_registration m_registration = 0;
+    uint32_t m_interest = 0;
+    uint32_t m_sslWantEvents = 0;
+    size_t m_nextAddress = 0;
+    int m_lastConnectError = 0;
+    int m_lastError = 0;
+
+    http_request_op* m_op = nullptr;
+    bool m_reused = false;
+    bool m_paused = false;
+    size_t m_bytesSent = 0;
+    http_internal_vector<char> m_bodyBuffer;
+    uint64_t m_bodyOffset = 0;
+    size_t m_bodyChunkStart = 0;
+    size_t m_bodyChunkEnd = 0;
+    bool m_bodyComplete = false;
+    uint64_t m_bytesReceived = 0;
+    http_response_parser m_parser;
+    chrono_clock_t::time_point m_idleDeadline;
+};
+
+struct http_host_pool
+{
+    http_internal_vector<http_connection*> idle;
+    http_internal_queue<http_request_op*> pending;
+    uint32_t connectionCount = 0;
+    SSL_SESSION* tlsSession = nullptr;
+};
+
+// Owns the reactor, the TLS context and the per-host keep-alive pools. Pool
+// state is only touched on the reactor thread.
+class http_connection_engine
+{
+public:
+    http_connection_engine() noexcept;
+    ~http_connection_engine();
+
+    HRESULT perform(_In_ HCCallHandle call, _Inout_ XAsyncBlock* asyncBlock) noexcept;
+
+    // Reactor thread callbacks from http_connection
+    socket_reactor& reactor() noexcept { return m_reactor; }
+    SSL_CTX* ssl_context() noexcept { return m_sslContext; }
+    void on_request_complete(_In_ http_connection* connection, _In_ http_request_op* op, _In_ bool reusable) noexcept;
+    void on_connection_failed(
+        _In_ http_connection* connection,
+        _In_opt_ http_request_op* op,
+        _In_ bool retryable,
+        _In_ int platformError,
+        _In_z_ const char* message
+        ) noexcept;
+    void on_idle_connection_closed(_In_ http_connection* connection) noexcept;
+    SSL_SESSION* tls_session(_In_ const http_internal_string& poolKey) noexcept;
+    void store_tls_session(_In_ const http_internal_string& poolKey, _In_ SSL* ssl) noexcept;
+
+    // Passed to http_response_body_stream::pause_if_full; resumes paused
+    // connections on the reactor thread.
+    static void body_stream_resume_callback(_In_opt_ void* context) noexcept;
+
+private:
+    HRESULT ensure_started() noexcept;
+
+    static void submit_callback(_In_opt_ void* context) noexcept;
+    static void tick_callback(_In_opt_ void* context) noexcept;
+    static void shutdown_callback(_In_opt_ void* context) noexcept;
+    static void resume_paused_callback(_In_opt_ void* context) noexcept;
+
+    void submit(_In_ http_request_op* op) noexcept;
+    void dispatch_pending(_In_ http_host_pool& pool) noexcept;
+    void destroy_connection(_In_ http_connection* connection) noexcept;
+    void complete_op(_In_ http_request_op* op, _In_ HRESULT networkError, _In_ int platformError, _In_opt_z_ const char* message) noexcept;
+    void tick() noexcept;
+    void shutdown() noexcept;
+    void resume_paused() noexcept;
+
+    std::mutex m_startLock;
+    bool m_started = false;
+    bool m_dispatchingPending = false;
+    socket_reactor m_reactor;
+    SSL_CTX* m_sslContext = nullptr;
+
+    dns_resolver m_resolver;
+
+    // Reactor thread only
+    http_internal_map<http_internal_string, http_host_pool> m_pools;
+    http_internal_unordered_map<http_connection*, HC_UNIQUE_PTR<http_connection>> m_connections;
+};
+
+NAMESPACE_XBOX_HTTP_CLIENT_END
+
+#if !HC_NOWEBSOCKETS
+#include "../../WebSocket/Generic/generic_websocket_connection.h"
+#endif
+
+struct HC_PERFORM_ENV
+{
+    xbox::httpclient::http_connection_engine engine;
+#if !HC_NOWEBSOCKETS
+    xbox::httpclient::websocket_engine websocketEngine;
+#endif
+};
@@ -0,0 +1,362 @@
+// Copyright (c) Microsoft Corporation
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+#include "pch.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "socket_reactor.h"
+
+NAMESPACE_XBOX_HTTP_CLIENT_BEGIN
+
+#define SOCKET_REACTOR_MAX_EVENTS 64
+
+struct socket_reactor::loop_state
+{
+    struct posted_callback
+    {
+        socket_reactor_callback* callback;
+        void* context;
+    };
+
+    ~loop_state()
+    {
+        close_descriptors();
+    }
+
+    // Callers hold lock, except on the start failure paths where the thread
+    // doesn't exist yet.
+    void close_descriptors() noexcept
+    {
+        if (wakeEvent >= 0)
+        {
+            close(wakeEvent);
+            wakeEvent = -1;
+        }
+        if (epoll >= 0)
+        {
+            close(epoll);
+            epoll = -1;
+        }
+    }
+
+    // Callers hold lock so the eventfd can't be closed underneath the write.
+    void wake() noexcept
+    {
+        if (wakeEvent >= 0)
+        {
+            uint64_t one = 1;
+            ssize_t written = write(wakeEvent, &one, sizeof(one));
+            UNREFERENCED_PARAMETER(written);
+        }
+    }
+
+    std::mutex lock;
+    int epoll = -1;
+    int wakeEvent = -1;
+    bool stopping = false;
+    std::thread thread;
+    std::thread::id threadId;
+
+    socket_reactor_callback* tick = nullptr;
+    void* tickContext = nullptr;
+    uint32_t tickIntervalMs = 0;
+
+    // Guarded by lock. Callbacks are taken one at a time from postedHead so a
+    // stop() on the reactor thread can finish the queue itself.
+    http_internal_vector<posted_callback> posted;
+    size_t postedHead = 0;
+
+    // Reactor thread only
+    http_internal_unordered_map<socket_registration, socket_event_handler*> handlers;
+    socket_registration nextRegistration = 1;
+};
+
+socket_reactor::~socket_reactor()
+{
+    stop();
+}
+
+HRESULT socket_reactor::start(
+    _In_opt_ socket_reactor_callback* tick,
+    _In_opt_ void* tickContext,
+    _In_ uint32_t tickIntervalMs
+    ) noexcept
+{
+    if (m_state != nullptr)
+    {
+        std::lock_guard<std::mutex> lock(m_state->lock);
+        RETURN_HR_IF(E_UNEXPECTED, m_state->stopping);
+        return S_OK;
+    }
+
+    std::shared_ptr<loop_state> state = http_allocate_shared<loop_state>();
+    RETURN_IF_NULL_ALLOC(state);
+
+    state->tick = tick;
+    state->tickContext = tickContext;
+    state->tickIntervalMs = tickIntervalMs;
+
+    state->epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (state->epoll < 0)
+    {
+        HC_TRACE_ERROR(HTTPCLIENT, "socket_reactor: epoll_create1 failed, errno=%d", errno);
+        return E_FAIL;
+    }
+
+    state->wakeEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (state->wakeEvent < 0)
+    {
+        HC_TRACE_ERROR(HTTPCLIENT, "socket_reactor: eventfd failed, errno=%d", errno);
+        return E_FAIL;
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    if (epoll_ctl(state->epoll, EPOLL_CTL_ADD, state->wakeEvent, &ev) != 0)
+    {
+        HC_TRACE_ERROR(HTTPCLIENT, "socket_reactor: epoll_ctl failed, errno=%d", errno);
+        return E_FAIL;
+    }
+
+    // The thread takes the lock before it looks at anything, so threadId is
+    // set by the time it runs.
+    std::lock_guard<std::mutex> lock(state->lock);
+    try
+    {
+        state->thread = std::thread([state]() { run(state); });
+    }
+    catch (...)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    state->threadId = state->thread.get_id();
+    m_state = std::move(state);
+    return S_OK;
+}
+
+void socket_reactor::stop() noexcept
+{
+    if (m_state == nullptr)
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_state->lock);
+        if (m_state->stopping)
+        {
+            return;
+        }
+        m_state->stopping = true;
+        m_state->wake();
+    }
+
+    if (is_reactor_thread())
+    {
+        // Can't join ourselves. Finish the queue and forget the handlers here
+        // since our owner may be gone by the time control returns to the
+        // loop; the loop then exits and closes the descriptors.
+        drain_posted(*m_state);
+        m_state->handlers.clear();
+        m_state->thread.detach();
+        return;
+    }
+
+    m_state->thread.join();
+}
+
+HRESULT socket_reactor::add(
+    _In_ int fd,
+    _In_ uint32_t events,
+    _In_ socket_event_handler* handler,
+    _Out_ socket_registration* registration
+    ) noexcept
+{
+    ASSERT(is_reactor_thread());
+    *registration = 0;
+
+    socket_registration token = m_state->nextRegistration++;
+    try
+    {
+        m_state->handlers.emplace(token, handler);
+    }
+    catch (...)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.u64 = token;
+    if (epoll_ctl(m_state->epoll, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+        HC_TRACE_ERROR(HTTPCLIENT, "socket_reactor: add failed, errno=%d", errno);
+        m_state->handlers.erase(token);
+        return E_FAIL;
+    }
+
+    *registration = token;
+    return S_OK;
+}
+
+HRESULT socket_reactor::modify(_In_ int fd, _In_ uint32_t events, _In_ socket_registration registration) noexcept
+{
+    ASSERT(is_reactor_thread());
+
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.u64 = registration;
+    if (epoll_ctl(m_state->epoll, EPOLL_CTL_MOD, fd, &ev) != 0)
+    {
+        HC_TRACE_ERROR(HTTPCLIENT, "socket_reactor: modify failed, errno=%d", errno);
+        return E_FAIL;
+    }
+    return S_OK;
+}
+
+void socket_reactor::remove(_In_ int fd, _In_ socket_registration registration) noexcept
+{
+    ASSERT(is_reactor_thread());
+
+    epoll_event ev{};
+    epoll_ctl(m_state->epoll, EPOLL_CTL_DEL, fd, &ev);
+    m_state->handlers.erase(registration);
+}
+
+HRESULT socket_reactor::post(_In_ socket_reactor_callback* callback, _In_opt_ void* context) noexcept
+{
+    RETURN_HR_IF(E_UNEXPECTED, m_state == nullptr);
+
+    std::lock_guard<std::mutex> lock(m_state->lock);
+    RETURN_HR_IF(E_UNEXPECTED, m_state->stopping);
+
+    try
+    {
+        m_state->posted.push_back(loop_state::posted_callback{ callback, context });
+    }
+    catch (...)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    m_state->wake();
+    return S_OK;
+}
+
+bool socket_reactor::is_reactor_thread() const noexcept
+{
+    return m_state != nullptr && std::this_thread::get_id() == m_state->threadId;
+}
+
+void socket_reactor::drain_posted(_In_ loop_state& state) noexcept
+{
+    for (;;)
+    {
+        loop_state::posted_callback next;
+        {
+            std::lock_guard<std::mutex> lock(state.lock);
+            if (state.postedHead == state.posted.size())
+            {
+                state.posted.clear();
+                state.postedHead = 0;
+                return;
+            }
+            next = state.posted[state.postedHead++];
+        }
+
+        next.callback(next.context);
+    }
+}
+
+void socket_reactor::run(_In_ std::shared_ptr<loop_state> state) noexcept
+{
+    // All socket writes happen on this thread. Blocking SIGPIPE here turns a
+    // write to a reset connection into EPIPE instead of killing the process,
+    // which matters for TLS where we don't control the write flags.
+    sigset_t pipeSet;
+    sigemptyset(&pipeSet);
+    sigaddset(&pipeSet, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipeSet, nullptr);
+
+    {
+        // Wait for start() to publish threadId
+        std::lock_guard<std::mutex> lock(state->lock);
+    }
+
+    epoll_event events[SOCKET_REACTOR_MAX_EVENTS];
+    auto nextTick = chrono_clock_t::now() + std::chrono::milliseconds(state->tickIntervalMs);
+
+    for (;;)
+    {
+        int timeout = -1;
+        if (state->tick != nullptr && !state->handlers.empty())
+        {
+            auto now = chrono_clock_t::now();
+            if (now >= nextTick)
+            {
+                timeout = 0;
+            }
+            else
+            {
+                timeout = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(nextTick - now).count()) + 1;
+            }
+        }
+
+        int count = epoll_wait(state->epoll, events, SOCKET_REACTOR_MAX_EVENTS, timeout);
+        if (count < 0 && errno != EINTR)
+        {
+            HC_TRACE_ERROR(HTTPCLIENT, "socket_reactor: epoll_wait failed, errno=%d", errno);
+            count = 0;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            socket_registration token = events[i].data.u64;
+            if (token == 0)
+            {
+                uint64_t value;
+                ssize_t bytesRead = read(state->wakeEvent, &value, sizeof(value));
+                UNREFERENCED_PARAMETER(bytesRead);
+                continue;
+            }
+
+            // Looked up per event: an earlier handler in this pass may have
+            // removed this registration.
+            auto it = state->handlers.find(token);
+            if (it != state->handlers.end())
+            {
+                it->second->on_socket_event(events[i].events);
+            }
+        }
+
+        drain_posted(*state);
+
+        bool stopping;
+        {
+            std::lock_guard<std::mutex> lock(state->lock);
+            stopping = state->stopping;
+            if (stopping && state->postedHead == state->posted.size())
+            {
+                state->close_descriptors();
+                break;
+            }
+        }
+
+        if (state->tick != nullptr && !stopping)
+        {
+            auto now = chrono_clock_t::now();
+            if (now >= nextTick)
+            {
+                state->tick(state->tickContext);
+                nextTick = now + std::chrono::milliseconds(state->tickIntervalMs);
+            }
+        }
+    }
+}
+
+NAMESPACE_XBOX_HTTP_CLIENT_END
@@ -0,0 +1,86 @@
+// Copyright (c) Microsoft Corporation
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+#pragma once
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+NAMESPACE_XBOX_HTTP_CLIENT_BEGIN
+
+// Receives readiness notifications for a file descriptor registered with a
+// socket_reactor. Callbacks are always invoked on the reactor thread.
+class socket_event_handler
+{
+public:
+    virtual ~socket_event_handler() = default;
+    virtual void on_socket_event(_In_ uint32_t events) noexcept = 0;
+};
+
+struct resolved_address
+{
+    sockaddr_storage address;
+    socklen_t length;
+};
+
+typedef void socket_reactor_callback(_In_opt_ void* context);
+
+// Identifies one add() of a descriptor. Tokens are never reused, so events
+// still queued for a removed registration can't reach a handler that was
+// later allocated at the same address.
+typedef uint64_t socket_registration;
+
+// A single epoll loop running on its own thread. Sockets registered with the
+// reactor are non-blocking and all I/O on them happens on the reactor thread,
+// so handlers never need their own locking.
+class socket_reactor
+{
+public:
+    socket_reactor() = default;
+    ~socket_reactor();
+
+    socket_reactor(const socket_reactor&) = delete;
+    socket_reactor& operator=(const socket_reactor&) = delete;
+
+    // Starts the reactor thread. tick, if provided, is invoked on the reactor
+    // thread roughly every tickIntervalMs while any socket is registered.
+    HRESULT start(
+        _In_opt_ socket_reactor_callback* tick,
+        _In_opt_ void* tickContext,
+        _In_ uint32_t tickIntervalMs
+        ) noexcept;
+
+    // Runs any remaining posted callbacks and joins the reactor thread. When
+    // called on the reactor thread the posted callbacks run before this
+    // returns and the loop exits without touching handlers or the tick again.
+    void stop() noexcept;
+
+    // add, modify and remove must be called on the reactor thread.
+    HRESULT add(
+        _In_ int fd,
+        _In_ uint32_t events,
+        _In_ socket_event_handler* handler,
+        _Out_ socket_registration* registration
+        ) noexcept;
+    HRESULT modify(_In_ int fd, _In_ uint32_t events, _In_ socket_registration registration) noexcept;
+
+    // Unregisters fd. Events already collected for the registration in the
+    // current dispatch pass are dropped, so the handler may be freed right after.
+    void remove(_In_ int fd, _In_ socket_registration registration) noexcept;
+
+    // Queues callback to run on the reactor thread.
+    HRESULT post(_In_ socket_reactor_callback* callback, _In_opt_ void* context) noexcept;
+
+    bool is_reactor_thread() const noexcept;
+
+private:
+    // Everything the loop touches lives here and is shared with the reactor
+    // thread, so a thread detached by stop() never outlives its state.
+    struct loop_state;
+
+    static void run(_In_ std::shared_ptr<loop_state> state) noexcept;
+    static void drain_posted(_In_ loop_state& state) noexcept;
+
+    std::shared_ptr<loop_state> m_state;
+};
+
+NAMESPACE_XBOX_HTTP_CLIENT_END
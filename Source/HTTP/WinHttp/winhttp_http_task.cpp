@@ -468,6 +468,21 @@ void winhttp_http_task::callback_status_read_complete(
     }
     else
     {
+        if (pRequestContext->m_call->responseBodyStream != nullptr)
+        {
+            // Hand each chunk over as it arrives instead of buffering the body
+            HRESULT hr = HCHttpCallResponseAppendResponseBodyBytes(pRequestContext->m_call,
+                pRequestContext->m_responseBuffer.data(),
+                bytesRead
+            );
+            pRequestContext->m_responseBuffer.clear();
+            if (FAILED(hr))
+            {
+                pRequestContext->complete_task(hr);
+                return;
+            }
+        }
+
         read_next_response_chunk(pRequestContext, bytesRead);
     }
 }
@@ -678,7 +693,7 @@ http_internal_wstring flatten_http_headers(_In_ const http_header_map& headers)
     bool foundUserAgent = false;
     for (const auto& header : headers)
     {
-        auto wHeaderName = utf16_from_utf8(header.first);
+        auto wHeaderName = utf16_from_utf8(header.name, header.nameLength);
         if (wHeaderName == L"User-Agent")
         {
             foundUserAgent = true;
@@ -686,7 +701,7 @@ http_internal_wstring flatten_http_headers(_In_ const http_header_map& headers)
 
         flattened_headers.append(wHeaderName);
         flattened_headers.push_back(L':');
-        flattened_headers.append(utf16_from_utf8(header.second));
+        flattened_headers.append(utf16_from_utf8(header.value, header.valueLength));
         flattened_headers.append(CRLF);
     }
 
@@ -22,6 +22,167 @@ HC_CALL::~HC_CALL()
     HC_TRACE_VERBOSE(HTTPCLIENT, "HCCallHandle dtor");
 }
 
+void HC_CALL::reset() noexcept
+{
+    method.clear();
+    url.clear();
+    requestBodyBytes.clear();
+    requestBodyString.clear();
+    requestBodyReadFunction = nullptr;
+    requestBodyReadFunctionSize = 0;
+    requestBodyReadFunctionContext = nullptr;
+    requestHeaders.clear();
+
+    responseString.clear();
+    responseBodyBytes.clear();
+    responseHeaders.clear();
+    responseBodyStream.reset();
+    statusCode = 0;
+    networkErrorCode = S_OK;
+    platformNetworkErrorCode = 0;
+    platformNetworkErrorMessage.clear();
+    task.reset();
+
+    id = 0;
+    traceCall = true;
+    context = nullptr;
+    refCount = 1;
+
+    firstRequestStartTime = chrono_clock_t::time_point();
+    delayBeforeRetry = std::chrono::milliseconds(0);
+    retryIterationNumber = 0;
+    retryAllowed = false;
+    retryAfterCacheId = 0;
+    timeoutInSeconds = 0;
+    timeoutWindowInSeconds = 0;
+    retryDelayInSeconds = 0;
+    performCalled = false;
+}
+
+void HC_CALL::release_buffers() noexcept
+{
+    http_internal_string().swap(method);
+    http_internal_string().swap(url);
+    http_internal_vector<uint8_t>().swap(requestBodyBytes);
+    http_internal_string().swap(requestBodyString);
+    requestHeaders.release_buffers();
+    http_internal_string().swap(responseString);
+    http_internal_vector<uint8_t>().swap(responseBodyBytes);
+    responseHeaders.release_buffers();
+    http_internal_string().swap(platformNetworkErrorMessage);
+}
+
+static size_t string_heap_bytes(_In_ const http_internal_string& s) noexcept
+{
+    // Short strings live inside the object and don't count
+    static const size_t inlineCapacity = http_internal_string().capacity();
+    return s.capacity() > inlineCapacity ? s.capacity() + 1 : 0;
+}
+
+size_t HC_CALL::retained_bytes() const noexcept
+{
+    return string_heap_bytes(method) +
+        string_heap_bytes(url) +
+        requestBodyBytes.capacity() +
+        string_heap_bytes(requestBodyString) +
+        requestHeaders.retained_bytes() +
+        string_heap_bytes(responseString) +
+        responseBodyBytes.capacity() +
+        responseHeaders.retained_bytes() +
+        string_heap_bytes(platformNetworkErrorMessage);
+}
+
+http_call_pool::~http_call_pool()
+{
+    for (auto call : m_calls)
+    {
+        delete call;
+    }
+}
+
+HRESULT http_call_pool::set_limits(_In_ uint32_t maxCalls, _In_ size_t maxRetainedBytes) noexcept
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    // Reserve up front so release never allocates
+    try
+    {
+        m_calls.reserve(maxCalls);
+    }
+    catch (...)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    m_maxCalls = maxCalls;
+    m_maxRetainedBytes = maxRetainedBytes;
+    trim();
+
+    if (maxCalls == 0)
+    {
+        http_internal_vector<HC_CALL*>().swap(m_calls);
+    }
+
+    return S_OK;
+}
+
+HC_CALL* http_call_pool::acquire() noexcept
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (m_calls.empty())
+    {
+        return nullptr;
+    }
+
+    HC_CALL* call = m_calls.back();
+    m_calls.pop_back();
+    m_retainedBytes -= call->retained_bytes();
+    return call;
+}
+
+bool http_call_pool::release(_In_ HC_CALL* call) noexcept
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if (m_calls.size() >= m_maxCalls)
+        {
+            return false;
+        }
+    }
+
+    // Clearing the call can run arbitrary destructors, so do it unlocked
+    call->reset();
+    size_t bytes = call->retained_bytes();
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (m_calls.size() >= m_maxCalls)
+    {
+        return false;
+    }
+
+    if (bytes > m_maxRetainedBytes - m_retainedBytes)
+    {
+        // Over budget; keep the object but not its buffers
+        call->release_buffers();
+        bytes = call->retained_bytes();
+    }
+
+    m_calls.push_back(call);
+    m_retainedBytes += bytes;
+    return true;
+}
+
+void http_call_pool::trim() noexcept
+{
+    while (!m_calls.empty() && (m_calls.size() > m_maxCalls || m_retainedBytes > m_maxRetainedBytes))
+    {
+        HC_CALL* call = m_calls.back();
+        m_calls.pop_back();
+        m_retainedBytes -= call->retained_bytes();
+        delete call;
+    }
+}
+
 STDAPI 
 HCHttpCallCreate(
     _Out_ HCCallHandle* callHandle
@@ -37,7 +198,11 @@ try
     if (nullptr == httpSingleton)
         return E_HC_NOT_INITIALISED;
 
-    HC_CALL* call = new HC_CALL();
+    HC_CALL* call = httpSingleton->m_callPool.acquire();
+    if (call == nullptr)
+    {
+        call = new HC_CALL();
+    }
 
     call->retryAllowed = httpSingleton->m_retryAllowed;
     call->timeoutInSeconds = httpSingleton->m_timeoutInSeconds;
@@ -86,22 +251,113 @@ try
     if (refCount <= 0)
     {
         ASSERT(refCount == 0); // should only fire at 0
-        delete call;
+        auto httpSingleton = get_http_singleton(false);
+        if (httpSingleton == nullptr || !httpSingleton->m_callPool.release(call))
+        {
+            delete call;
+        }
     }
 
     return S_OK;
 }
 CATCH_RETURN()
 
+STDAPI
+HCHttpCallSetPoolLimits(
+    _In_ uint32_t maxPooledCalls,
+    _In_ size_t maxRetainedBytes
+    ) noexcept
+try
+{
+    auto httpSingleton = get_http_singleton(true);
+    if (nullptr == httpSingleton)
+        return E_HC_NOT_INITIALISED;
+
+    return httpSingleton->m_callPool.set_limits(maxPooledCalls, maxRetainedBytes);
+}
+CATCH_RETURN()
+
+enum class http_call_attempt_state
+{
+    none,
+    running,
+    done
+};
+
+// State for one HCHttpCallPerformAsync, shared by every attempt. The outer
+// async operation is a small state machine: each DoWork either starts an
+// attempt or looks at the one that just finished, and attempts reuse one
+// async block on the caller's queue rather than a queue and block of their
+// own.
+typedef struct retry_context
+{
+    HC_CALL* call = nullptr;
+    XAsyncBlock* outerAsyncBlock = nullptr;
+
+    // Has no completion callback. When an attempt's async state is cleaned
+    // up the outer operation is scheduled again, which puts the result back
+    // on the caller's work port without another hop.
+    XAsyncBlock attemptBlock{};
+
+    // Guards the hand-off between the two operations. The context outlives
+    // the outer operation if it is canceled while an attempt is running.
+    std::recursive_mutex lock;
+    http_call_attempt_state attemptState = http_call_attempt_state::none;
+    bool outerCleanedUp = false;
+} retry_context;
+
+void release_retry_context(
+    _In_ retry_context* retryContext
+    )
+{
+    HCHttpCallCloseHandle(retryContext->call); // Call is done so remove internal keep alive ref
+    shared_ptr_cache::remove(retryContext);
+}
+
+void on_http_call_attempt_cleanup(
+    _In_ retry_context* retryContext
+    )
+{
+    std::unique_lock<std::recursive_mutex> lock(retryContext->lock);
+    if (!retryContext->outerCleanedUp)
+    {
+        retryContext->attemptState = http_call_attempt_state::done;
+        HRESULT hr = XAsyncSchedule(retryContext->outerAsyncBlock, 0);
+        if (SUCCEEDED(hr))
+        {
+            return;
+        }
+
+        // Keep the context alive in case this cleans up the outer operation
+        retryContext->attemptState = http_call_attempt_state::running;
+        XAsyncComplete(retryContext->outerAsyncBlock, hr, 0);
+    }
+
+    retryContext->attemptState = http_call_attempt_state::none;
+    bool release = retryContext->outerCleanedUp;
+    lock.unlock();
+
+    if (release)
+    {
+        release_retry_context(retryContext);
+    }
+}
+
 HRESULT perform_http_call(
-    _In_ std::shared_ptr<http_singleton> httpSingleton,
-    _In_ HCCallHandle call,
-    _Inout_ XAsyncBlock* asyncBlock
+    _In_ const http_singleton_ref& httpSingleton,
+    _In_ retry_context* retryContext
     )
 {
-    HRESULT hr = XAsyncBegin(asyncBlock, call, reinterpret_cast<void*>(perform_http_call), __FUNCTION__,
+    XAsyncBlock* asyncBlock = &retryContext->attemptBlock;
+    HRESULT hr = XAsyncBegin(asyncBlock, retryContext, reinterpret_cast<void*>(perform_http_call), __FUNCTION__,
         [](XAsyncOp opCode, const XAsyncProviderData* data)
     {
+        if (opCode == XAsyncOp::Cleanup)
+        {
+            on_http_call_attempt_cleanup(static_cast<retry_context*>(data->context));
+            return S_OK;
+        }
+
         auto httpSingleton = get_http_singleton(false);
         if (nullptr == httpSingleton)
         {
@@ -112,7 +368,7 @@ HRESULT perform_http_call(
         {
             case XAsyncOp::DoWork:
             {
-                HCCallHandle call = static_cast<HCCallHandle>(data->context);
+                HCCallHandle call = static_cast<retry_context*>(data->context)->call;
                 bool matchedMocks = false;
                 if (httpSingleton->m_mocksEnabled)
                 {
@@ -148,8 +404,16 @@ HRESULT perform_http_call(
 
     if (SUCCEEDED(hr))
     {
-        uint32_t delayInMilliseconds = static_cast<uint32_t>(call->delayBeforeRetry.count());
+        uint32_t delayInMilliseconds = static_cast<uint32_t>(retryContext->call->delayBeforeRetry.count());
         hr = XAsyncSchedule(asyncBlock, delayInMilliseconds);
+        if (FAILED(hr))
+        {
+            // Fail the attempt like a network error; its cleanup hands the
+            // result back to the outer operation.
+            HCHttpCallResponseSetNetworkErrorCode(retryContext->call, hr, 0);
+            XAsyncComplete(asyncBlock, hr, 0);
+            return S_OK;
+        }
     }
 
     return hr;
@@ -168,11 +432,11 @@ void clear_http_call_response(_In_ HCCallHandle call)
 
 std::chrono::seconds GetRetryAfterHeaderTime(_In_ HC_CALL* call)
 {
-    auto it = call->responseHeaders.find(RETRY_AFTER_HEADER);
-    if (it != call->responseHeaders.end())
+    auto header = call->responseHeaders.find(RETRY_AFTER_HEADER);
+    if (header != nullptr)
     {
         int value = 0;
-        http_internal_stringstream ss(it->second);
+        http_internal_stringstream ss(http_internal_string{ header->value, header->valueLength });
         ss >> value;
 
         if (!ss.fail())
@@ -195,7 +459,7 @@ bool http_call_should_retry(
     _In_ HCCallHandle call,
     _In_ const chrono_clock_t::time_point& responseReceivedTime)
 {
-    if (!call->retryAllowed)
+    if (!call->retryAllowed || call->responseBodyStream != nullptr)
     {
         return false;
     }
@@ -330,12 +594,30 @@ bool should_fast_fail(
     }
 }
 
-typedef struct retry_context
+void complete_http_call(
+    _In_ retry_context* retryContext
+    )
 {
-    HC_CALL* call;
-    XAsyncBlock* outerAsyncBlock;
-    XTaskQueueHandle outerQueue;
-} retry_context;
+    auto& stream = retryContext->call->responseBodyStream;
+    if (stream == nullptr)
+    {
+        XAsyncComplete(retryContext->outerAsyncBlock, S_OK, 0);
+        return;
+    }
+
+    // Complete only once the write function has seen the whole body
+    stream->flush([](void* context)
+    {
+        auto retryContext = static_cast<retry_context*>(context);
+        HC_CALL* call = retryContext->call;
+        HRESULT streamResult = call->responseBodyStream->result();
+        if (FAILED(streamResult))
+        {
+            HCHttpCallResponseSetNetworkErrorCode(call, streamResult, call->platformNetworkErrorCode);
+        }
+        XAsyncComplete(retryContext->outerAsyncBlock, S_OK, 0);
+    }, retryContext);
+}
 
 void retry_http_call_until_done(
     _In_ retry_context* retryContext
@@ -345,6 +627,7 @@ void retry_http_call_until_done(
     if (nullptr == httpSingleton)
     {
         XAsyncComplete(retryContext->outerAsyncBlock, S_OK, 0);
+        return;
     }
 
     auto requestStartTime = chrono_clock_t::now();
@@ -373,59 +656,49 @@ void retry_http_call_until_done(
         }
     }
 
-    XTaskQueueHandle nestedQueue = nullptr;
-    if (retryContext->outerQueue != nullptr)
     {
-        XTaskQueuePortHandle workPort;
-        XTaskQueueGetPort(retryContext->outerQueue, XTaskQueuePort::Work, &workPort);
-        XTaskQueueCreateComposite(workPort, workPort, &nestedQueue);
+        std::lock_guard<std::recursive_mutex> lock(retryContext->lock);
+        retryContext->attemptState = http_call_attempt_state::running;
     }
-    XAsyncBlock* nestedBlock = new XAsyncBlock{};
-    nestedBlock->queue = nestedQueue;
-    nestedBlock->context = retryContext;
 
-    nestedBlock->callback = [](XAsyncBlock* nestedAsyncBlock)
+    HRESULT hr = perform_http_call(httpSingleton, retryContext);
+    if (FAILED(hr))
     {
-        retry_context* retryContext = static_cast<retry_context*>(nestedAsyncBlock->context);
-        auto responseReceivedTime = chrono_clock_t::now();
-
-        uint32_t timeoutWindowInSeconds = 0;
-        HCHttpCallRequestGetTimeoutWindow(retryContext->call, &timeoutWindowInSeconds);
-
-        if (nestedAsyncBlock->queue != nullptr)
         {
-            XTaskQueueCloseHandle(nestedAsyncBlock->queue);
+            std::lock_guard<std::recursive_mutex> lock(retryContext->lock);
+            retryContext->attemptState = http_call_attempt_state::none;
         }
-        delete nestedAsyncBlock;
+        XAsyncComplete(retryContext->outerAsyncBlock, hr, 0);
+        return;
+    }
+}
 
-        if (http_call_should_retry(retryContext->call, responseReceivedTime))
-        {
-            if (retryContext->call->traceCall) { HC_TRACE_INFORMATION(HTTPCLIENT, "HCHttpCallPerformExecute [ID %llu] Retry after %lld ms", retryContext->call->id, retryContext->call->delayBeforeRetry.count()); }
+void on_http_call_attempt_done(
+    _In_ retry_context* retryContext
+    )
+{
+    auto responseReceivedTime = chrono_clock_t::now();
 
-            auto httpSingleton = get_http_singleton(false);
-            if (httpSingleton != nullptr)
-            {
-                std::lock_guard<std::recursive_mutex> lock(httpSingleton->m_callRoutedHandlersLock);
-                for (const auto& pair : httpSingleton->m_callRoutedHandlers)
-                {
-                    pair.second.first(retryContext->call, pair.second.second);
-                }
-            }
+    if (http_call_should_retry(retryContext->call, responseReceivedTime))
+    {
+        if (retryContext->call->traceCall) { HC_TRACE_INFORMATION(HTTPCLIENT, "HCHttpCallPerformExecute [ID %llu] Retry after %lld ms", retryContext->call->id, retryContext->call->delayBeforeRetry.count()); }
 
-            clear_http_call_response(retryContext->call);
-            retry_http_call_until_done(retryContext);
-        }
-        else
+        auto httpSingleton = get_http_singleton(false);
+        if (httpSingleton != nullptr)
         {
-            XAsyncComplete(retryContext->outerAsyncBlock, S_OK, 0);
+            std::lock_guard<std::recursive_mutex> lock(httpSingleton->m_callRoutedHandlersLock);
+            for (const auto& pair : httpSingleton->m_callRoutedHandlers)
+            {
+                pair.second.first(retryContext->call, pair.second.second);
+            }
         }
-    };
 
-    HRESULT hr = perform_http_call(httpSingleton, retryContext->call, nestedBlock);
-    if (FAILED(hr))
+        clear_http_call_response(retryContext->call);
+        retry_http_call_until_done(retryContext);
+    }
+    else
     {
-        XAsyncComplete(retryContext->outerAsyncBlock, hr, 0);
-        return;
+        complete_http_call(retryContext);
     }
 }
 
@@ -441,6 +714,11 @@ try
         return E_INVALIDARG;
     }
 
+    if (call->responseBodyStream != nullptr)
+    {
+        RETURN_IF_FAILED(call->responseBodyStream->set_queue(asyncBlock->queue));
+    }
+
     HCHttpCallDuplicateHandle(call); // Keep the HCCallHandle alive during HTTP call
 
     if (call->traceCall) { HC_TRACE_INFORMATION(HTTPCLIENT, "HCHttpCallPerform [ID %llu]", call->id); }
@@ -449,7 +727,8 @@ try
     std::shared_ptr<retry_context> retryContext = std::make_shared<retry_context>();
     retryContext->call = static_cast<HC_CALL*>(call);
     retryContext->outerAsyncBlock = asyncBlock;
-    retryContext->outerQueue = asyncBlock->queue;
+    retryContext->attemptBlock.queue = asyncBlock->queue;
+    retryContext->attemptBlock.context = retryContext.get();
     retry_context* rawRetryContext = static_cast<retry_context*>(shared_ptr_cache::store<retry_context>(retryContext));
     if (rawRetryContext == nullptr)
     {
@@ -470,8 +749,30 @@ try
         switch (op)
         {
             case XAsyncOp::DoWork:
-                retry_http_call_until_done(static_cast<retry_context*>(data->context));
+            {
+                auto context = static_cast<retry_context*>(data->context);
+                context->outerAsyncBlock = data->async;
+
+                bool attemptDone = false;
+                {
+                    std::lock_guard<std::recursive_mutex> lock(context->lock);
+                    if (context->attemptState == http_call_attempt_state::done)
+                    {
+                        context->attemptState = http_call_attempt_state::none;
+                        attemptDone = true;
+                    }
+                }
+
+                if (attemptDone)
+                {
+                    on_http_call_attempt_done(context);
+                }
+                else
+                {
+                    retry_http_call_until_done(context);
+                }
                 return E_PENDING;
+            }
 
             case XAsyncOp::GetResult:
                 break;
@@ -482,8 +783,18 @@ try
             case XAsyncOp::Cleanup:
             {
                 auto context = static_cast<retry_context*>(data->context);
-                HCHttpCallCloseHandle(context->call); // Call is done so remove internal keep alive ref
-                shared_ptr_cache::remove(data->context);
+                bool release = false;
+                {
+                    std::lock_guard<std::recursive_mutex> lock(context->lock);
+                    context->outerCleanedUp = true;
+                    context->outerAsyncBlock = nullptr;
+                    release = context->attemptState != http_call_attempt_state::running;
+                }
+
+                if (release)
+                {
+                    release_retry_context(context);
+                }
                 break;
             }
                 
@@ -586,9 +897,203 @@ try
 }
 CATCH_RETURN()
 
-bool http_header_compare::operator()(http_internal_string const& l, http_internal_string const& r) const
+static inline char fold_header_char(_In_ char c) noexcept
+{
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+}
+
+static uint32_t hash_header_name(_In_reads_(length) const char* name, _In_ size_t length) noexcept
+{
+    // FNV-1a over the case folded name
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= static_cast<uint8_t>(fold_header_char(name[i]));
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool header_names_equal(_In_reads_(length) const char* l, _In_reads_(length) const char* r, _In_ size_t length) noexcept
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        if (fold_header_char(l[i]) != fold_header_char(r[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+http_header_map::header* http_header_map::find_mutable(
+    _In_reads_(nameLength) const char* name,
+    _In_ size_t nameLength,
+    _In_ uint32_t hash
+    ) const noexcept
+{
+    for (auto& h : m_headers)
+    {
+        if (h.hash == hash && h.nameLength == nameLength && header_names_equal(h.name, name, nameLength))
+        {
+            return const_cast<header*>(&h);
+        }
+    }
+    return nullptr;
+}
+
+const http_header_map::header* http_header_map::find(_In_reads_(nameLength) const char* name, _In_ size_t nameLength) const noexcept
+{
+    return find_mutable(name, nameLength, hash_header_name(name, nameLength));
+}
+
+const http_header_map::header* http_header_map::find(_In_z_ const char* name) const noexcept
+{
+    return find(name, strlen(name));
+}
+
+const http_header_map::header& http_header_map::set(
+    _In_reads_(nameLength) const char* name,
+    _In_ size_t nameLength,
+    _In_reads_(valueLength) const char* value,
+    _In_ size_t valueLength
+    )
+{
+    uint32_t hash = hash_header_name(name, nameLength);
+    header* existing = find_mutable(name, nameLength, hash);
+    if (existing != nullptr)
+    {
+        // Overwrite in place when the new value fits, like a string assignment would
+        if (valueLength <= existing->valueLength)
+        {
+            char* storedValue = const_cast<char*>(existing->value);
+            memcpy(storedValue, value, valueLength);
+            storedValue[valueLength] = '\0';
+        }
+        else
+        {
+            existing->value = store(value, valueLength);
+        }
+        existing->valueLength = valueLength;
+        return *existing;
+    }
+
+    header h;
+    h.name = store(name, nameLength);
+    h.value = store(value, valueLength);
+    h.nameLength = nameLength;
+    h.valueLength = valueLength;
+    h.hash = hash;
+    m_headers.push_back(h);
+    return m_headers.back();
+}
+
+const http_header_map::header& http_header_map::set(_In_z_ const char* name, _In_z_ const char* value)
+{
+    return set(name, strlen(name), value, strlen(value));
+}
+
+const http_header_map::header& http_header_map::append(
+    _In_reads_(nameLength) const char* name,
+    _In_ size_t nameLength,
+    _In_reads_(valueLength) const char* value,
+    _In_ size_t valueLength
+    )
+{
+    header* existing = find_mutable(name, nameLength, hash_header_name(name, nameLength));
+    if (existing == nullptr)
+    {
+        return set(name, nameLength, value, valueLength);
+    }
+
+    size_t combinedLength = existing->valueLength + 2 + valueLength;
+    char* combined = nullptr;
+    if (is_last_allocation(existing->value, existing->valueLength) &&
+        m_blocks[m_block].size() - m_blockUsed >= valueLength + 2)
+    {
+        // Repeated headers usually arrive back to back, so the value can
+        // often grow where it is
+        combined = const_cast<char*>(existing->value);
+        m_blockUsed += valueLength + 2;
+    }
+    else
+    {
+        combined = allocate(combinedLength + 1);
+        memcpy(combined, existing->value, existing->valueLength);
+    }
+
+    memcpy(combined + existing->valueLength, ", ", 2);
+    memcpy(combined + existing->valueLength + 2, value, valueLength);
+    combined[combinedLength] = '\0';
+
+    existing->value = combined;
+    existing->valueLength = combinedLength;
+    return *existing;
+}
+
+void http_header_map::clear() noexcept
+{
+    m_headers.clear();
+    m_block = 0;
+    m_blockUsed = 0;
+}
+
+void http_header_map::release_buffers() noexcept
+{
+    http_internal_vector<header>().swap(m_headers);
+    http_internal_vector<http_internal_vector<char>>().swap(m_blocks);
+    m_block = 0;
+    m_blockUsed = 0;
+}
+
+size_t http_header_map::retained_bytes() const noexcept
+{
+    size_t bytes = m_headers.capacity() * sizeof(header);
+    for (auto& block : m_blocks)
+    {
+        bytes += block.size();
+    }
+    return bytes;
+}
+
+char* http_header_map::allocate(_In_ size_t length)
+{
+    // Use up blocks kept from before the last clear first
+    while (m_block < m_blocks.size())
+    {
+        auto& block = m_blocks[m_block];
+        if (block.size() - m_blockUsed >= length)
+        {
+            char* data = block.data() + m_blockUsed;
+            m_blockUsed += length;
+            return data;
+        }
+
+        if (m_block + 1 == m_blocks.size())
+        {
+            break;
+        }
+        ++m_block;
+        m_blockUsed = 0;
+    }
+
+    m_blocks.emplace_back(std::max<size_t>(length, HTTP_HEADER_BLOCK_SIZE));
+    m_block = m_blocks.size() - 1;
+    m_blockUsed = length;
+    return m_blocks.back().data();
+}
+
+char* http_header_map::store(_In_reads_(length) const char* data, _In_ size_t length)
+{
+    char* stored = allocate(length + 1);
+    memcpy(stored, data, length);
+    stored[length] = '\0';
+    return stored;
+}
+
+bool http_header_map::is_last_allocation(_In_ const char* data, _In_ size_t length) const noexcept
 {
-    return str_icmp(l, r) < 0;
+    return m_block < m_blocks.size() && data + length + 1 == m_blocks[m_block].data() + m_blockUsed;
 }
 
 void PerformEnvDeleter::operator()(HC_PERFORM_ENV* performEnv) noexcept
@@ -4,12 +4,143 @@
 #pragma once
 #include "pch.h"
 
-struct http_header_compare
+#define HTTP_HEADER_BLOCK_SIZE 1024
+
+// Case-insensitive header collection. Headers are kept in insertion order in a
+// flat array that can be indexed directly, and names are hashed once on
+// insert so lookups rarely compare strings. Names and values are stored NUL
+// terminated in blocks that never move, so the pointers handed out stay valid
+// until that header changes or the map is cleared. Clearing keeps the blocks.
+class http_header_map
 {
-    bool operator()(http_internal_string const& l, http_internal_string const& r) const;
+public:
+    struct header
+    {
+        const char* name;
+        const char* value;
+        size_t nameLength;
+        size_t valueLength;
+        uint32_t hash;
+    };
+
+    http_header_map() = default;
+    http_header_map(http_header_map&&) = default;
+    http_header_map& operator=(http_header_map&&) = default;
+
+    http_header_map(const http_header_map&) = delete;
+    http_header_map& operator=(const http_header_map&) = delete;
+
+    size_t size() const noexcept { return m_headers.size(); }
+    bool empty() const noexcept { return m_headers.empty(); }
+    const header& operator[](size_t index) const noexcept { return m_headers[index]; }
+    const header* begin() const noexcept { return m_headers.data(); }
+    const header* end() const noexcept { return m_headers.data() + m_headers.size(); }
+
+    // Returns nullptr if there is no header with this name.
+    const header* find(_In_reads_(nameLength) const char* name, _In_ size_t nameLength) const noexcept;
+    const header* find(_In_z_ const char* name) const noexcept;
+
+    // Adds the header or replaces the value of an existing one.
+    const header& set(
+        _In_reads_(nameLength) const char* name,
+        _In_ size_t nameLength,
+        _In_reads_(valueLength) const char* value,
+        _In_ size_t valueLength
+        );
+    const header& set(_In_z_ const char* name, _In_z_ const char* value);
+
+    // Adds the header or appends ", value" to an existing one.
+    const header& append(
+        _In_reads_(nameLength) const char* name,
+        _In_ size_t nameLength,
+        _In_reads_(valueLength) const char* value,
+        _In_ size_t valueLength
+        );
+
+    void clear() noexcept;
+    void release_buffers() noexcept;
+    size_t retained_bytes() const noexcept;
+
+private:
+    header* find_mutable(_In_reads_(nameLength) const char* name, _In_ size_t nameLength, _In_ uint32_t hash) const noexcept;
+    char* allocate(_In_ size_t length);
+    char* store(_In_reads_(length) const char* data, _In_ size_t length);
+    bool is_last_allocation(_In_ const char* data, _In_ size_t length) const noexcept;
+
+    http_internal_vector<header> m_headers;
+    http_internal_vector<http_internal_vector<char>> m_blocks;
+    size_t m_block = 0;
+    size_t m_blockUsed = 0;
 };
 
-using http_header_map = http_internal_map<http_internal_string, http_internal_string, http_header_compare>;
+#define HTTP_RESPONSE_BODY_STREAM_MAX_BUFFERED (1024 * 1024)
+#define HTTP_RESPONSE_BODY_STREAM_RESUME_BUFFERED (HTTP_RESPONSE_BODY_STREAM_MAX_BUFFERED / 2)
+#define HTTP_RESPONSE_BODY_STREAM_FREE_BUFFERS 4
+
+typedef void http_response_body_stream_callback(_In_opt_ void* context);
+
+// Hands response body data to the write function set with
+// HCHttpCallResponseSetResponseBodyWriteFunction. Data is copied and written in
+// order, one chunk at a time, on the work port of the queue the call was
+// performed on. Providers that can stop reading use pause_if_full for
+// backpressure; others just write.
+class http_response_body_stream
+{
+public:
+    http_response_body_stream(
+        _In_ HCCallHandle call,
+        _In_ HCHttpCallResponseBodyWriteFunction writeFunction,
+        _In_opt_ void* context
+        ) noexcept;
+    ~http_response_body_stream();
+
+    http_response_body_stream(const http_response_body_stream&) = delete;
+    http_response_body_stream& operator=(const http_response_body_stream&) = delete;
+
+    // Called when the call is performed. A null queue means the process queue.
+    HRESULT set_queue(_In_opt_ XTaskQueueHandle queue) noexcept;
+
+    // Queues data for the write function. Fails once the write function has
+    // failed or the queue was terminated.
+    HRESULT write(_In_reads_bytes_(size) const uint8_t* data, _In_ size_t size) noexcept;
+
+    // Returns true if more than HTTP_RESPONSE_BODY_STREAM_MAX_BUFFERED bytes
+    // are waiting. resume is then invoked once, from the queue, after the
+    // backlog drops below half of that.
+    bool pause_if_full(_In_ http_response_body_stream_callback* resume, _In_opt_ void* context) noexcept;
+
+    // Drops a pending resume and waits for one that is already running, so
+    // no resume is running once this returns. Not for use from resume itself.
+    void cancel_resume() noexcept;
+
+    // Invokes callback once everything written so far has been handed to the
+    // write function, or right away if that already happened.
+    void flush(_In_ http_response_body_stream_callback* callback, _In_opt_ void* context) noexcept;
+
+    HRESULT result() const noexcept;
+
+private:
+    static void CALLBACK drain_callback(_In_opt_ void* context, _In_ bool canceled) noexcept;
+    void drain(_In_ bool canceled) noexcept;
+
+    HCCallHandle const m_call;
+    HCHttpCallResponseBodyWriteFunction const m_writeFunction;
+    void* const m_context;
+    XTaskQueueHandle m_queue = nullptr;
+
+    mutable std::mutex m_lock;
+    http_internal_queue<http_internal_vector<uint8_t>> m_chunks;
+    http_internal_vector<http_internal_vector<uint8_t>> m_freeBuffers;
+    size_t m_buffered = 0;
+    bool m_draining = false;
+    HRESULT m_result = S_OK;
+    http_response_body_stream_callback* m_resume = nullptr;
+    void* m_resumeContext = nullptr;
+    bool m_resumeRunning = false;
+    std::condition_variable m_resumeDone;
+    http_response_body_stream_callback* m_flush = nullptr;
+    void* m_flushContext = nullptr;
+};
 
 struct HC_CALL
 {
@@ -19,15 +150,30 @@ struct HC_CALL
     }
     ~HC_CALL();
 
+    // Returns the call to the state it had when first constructed but keeps
+    // the capacity of its strings and buffers. Used by http_call_pool; update
+    // it along with any new member.
+    void reset() noexcept;
+
+    // Frees the storage behind the strings and buffers.
+    void release_buffers() noexcept;
+
+    // Approximate heap memory held by the strings and buffers.
+    size_t retained_bytes() const noexcept;
+
     http_internal_string method;
     http_internal_string url;
     http_internal_vector<uint8_t> requestBodyBytes;
     http_internal_string requestBodyString;
+    HCHttpCallRequestBodyReadFunction requestBodyReadFunction = nullptr;
+    uint64_t requestBodyReadFunctionSize = 0;
+    void* requestBodyReadFunctionContext = nullptr;
     http_header_map requestHeaders;
 
     http_internal_string responseString;
     http_internal_vector<uint8_t> responseBodyBytes;
     http_header_map responseHeaders;
+    HC_UNIQUE_PTR<http_response_body_stream> responseBodyStream;
     uint32_t statusCode = 0;
     HRESULT networkErrorCode = S_OK;
     uint32_t platformNetworkErrorCode = 0;
@@ -50,6 +196,37 @@ struct HC_CALL
     bool performCalled = false;
 };
 
+// Recycles closed HC_CALL objects so creating a call doesn't reallocate the
+// call or regrow its buffers. Disabled until set_limits is called with a non
+// zero call count.
+class http_call_pool
+{
+public:
+    http_call_pool() = default;
+    ~http_call_pool();
+
+    http_call_pool(const http_call_pool&) = delete;
+    http_call_pool& operator=(const http_call_pool&) = delete;
+
+    HRESULT set_limits(_In_ uint32_t maxCalls, _In_ size_t maxRetainedBytes) noexcept;
+
+    // Returns a reset call or nullptr if the pool is empty.
+    HC_CALL* acquire() noexcept;
+
+    // Takes ownership of call if it returns true. Otherwise the caller
+    // should delete it.
+    bool release(_In_ HC_CALL* call) noexcept;
+
+private:
+    void trim() noexcept;
+
+    std::mutex m_lock;
+    http_internal_vector<HC_CALL*> m_calls;
+    uint32_t m_maxCalls = 0;
+    size_t m_maxRetainedBytes = 0;
+    size_t m_retainedBytes = 0;
+};
+
 struct HttpPerformInfo
 {
     HttpPerformInfo(_In_ HCCallPerformFunction h, _In_opt_ void* ctx)
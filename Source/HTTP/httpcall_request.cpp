@@ -76,6 +76,9 @@ try
 
     call->requestBodyBytes.assign(requestBodyBytes, requestBodyBytes + requestBodySize);
     call->requestBodyString.clear();
+    call->requestBodyReadFunction = nullptr;
+    call->requestBodyReadFunctionSize = 0;
+    call->requestBodyReadFunctionContext = nullptr;
 
     if (call->traceCall) { HC_TRACE_INFORMATION(HTTPCLIENT, "HCHttpCallRequestSetRequestBodyBytes [ID %llu]: requestBodySize=%lu", call->id, requestBodySize); }
     return S_OK;
@@ -100,6 +103,128 @@ HCHttpCallRequestSetRequestBodyString(
     );
 }
 
+STDAPI
+HCHttpCallRequestSetRequestBodyReadFunction(
+    _In_ HCCallHandle call,
+    _In_ HCHttpCallRequestBodyReadFunction readFunction,
+    _In_ uint64_t bodySize,
+    _In_opt_ void* context
+    ) noexcept
+try
+{
+    if (call == nullptr || readFunction == nullptr)
+    {
+        return E_INVALIDARG;
+    }
+    RETURN_IF_PERFORM_CALLED(call);
+
+    auto httpSingleton = get_http_singleton(true);
+    if (nullptr == httpSingleton)
+        return E_HC_NOT_INITIALISED;
+
+    call->requestBodyBytes.clear();
+    call->requestBodyString.clear();
+    call->requestBodyReadFunction = readFunction;
+    call->requestBodyReadFunctionSize = bodySize;
+    call->requestBodyReadFunctionContext = context;
+
+    if (call->traceCall)
+    {
+        if (bodySize == HC_HTTP_REQUEST_BODY_SIZE_UNKNOWN)
+        {
+            HC_TRACE_INFORMATION(HTTPCLIENT, "HCHttpCallRequestSetRequestBodyReadFunction [ID %llu]: requestBodySize=unknown", call->id);
+        }
+        else
+        {
+            HC_TRACE_INFORMATION(HTTPCLIENT, "HCHttpCallRequestSetRequestBodyReadFunction [ID %llu]: requestBodySize=%llu", call->id, bodySize);
+        }
+    }
+    return S_OK;
+}
+CATCH_RETURN()
+
+static HRESULT CALLBACK read_request_body_bytes(
+    _In_ HCCallHandle call,
+    _In_ uint64_t offset,
+    _In_ size_t bytesAvailable,
+    _In_opt_ void* context,
+    _Out_writes_bytes_to_(bytesAvailable, *bytesWritten) uint8_t* destination,
+    _Out_ size_t* bytesWritten
+    )
+{
+    UNREFERENCED_PARAMETER(context);
+
+    const auto& body = call->requestBodyBytes;
+    *bytesWritten = 0;
+    if (offset < body.size())
+    {
+        *bytesWritten = std::min(bytesAvailable, static_cast<size_t>(body.size() - offset));
+        memcpy(destination, body.data() + offset, *bytesWritten);
+    }
+    return S_OK;
+}
+
+// Providers that can only send a buffer get the whole body read up front.
+// Afterwards the call behaves as if the body had been set as bytes.
+static HRESULT read_request_body_into_bytes(_In_ HCCallHandle call)
+{
+    const size_t chunkSize = 64 * 1024;
+    const uint64_t bodySize = call->requestBodyReadFunctionSize;
+    const bool knownSize = bodySize != HC_HTTP_REQUEST_BODY_SIZE_UNKNOWN;
+    RETURN_HR_IF(E_NOT_SUPPORTED, knownSize && bodySize > UINT32_MAX);
+
+    auto& body = call->requestBodyBytes;
+    body.clear();
+    if (knownSize)
+    {
+        body.reserve(static_cast<size_t>(bodySize));
+    }
+
+    for (;;)
+    {
+        size_t offset = body.size();
+        size_t bytesAvailable = knownSize ? std::min(chunkSize, static_cast<size_t>(bodySize - offset)) : chunkSize;
+        if (bytesAvailable == 0)
+        {
+            break;
+        }
+
+        body.resize(offset + bytesAvailable);
+        size_t bytesWritten = 0;
+        HRESULT hr = call->requestBodyReadFunction(call, offset, bytesAvailable, call->requestBodyReadFunctionContext, body.data() + offset, &bytesWritten);
+        if (SUCCEEDED(hr) && bytesWritten > bytesAvailable)
+        {
+            hr = E_UNEXPECTED;
+        }
+        else if (SUCCEEDED(hr) && bytesWritten == 0 && knownSize)
+        {
+            HC_TRACE_ERROR(HTTPCLIENT, "Request body read function ended after %llu of %llu bytes", static_cast<uint64_t>(offset), bodySize);
+            hr = E_UNEXPECTED;
+        }
+        else if (SUCCEEDED(hr) && offset + bytesWritten > UINT32_MAX)
+        {
+            hr = E_NOT_SUPPORTED;
+        }
+
+        if (FAILED(hr))
+        {
+            body.clear();
+            return hr;
+        }
+
+        body.resize(offset + bytesWritten);
+        if (bytesWritten == 0)
+        {
+            break;
+        }
+    }
+
+    call->requestBodyReadFunction = nullptr;
+    call->requestBodyReadFunctionSize = 0;
+    call->requestBodyReadFunctionContext = nullptr;
+    return S_OK;
+}
+
 
 STDAPI 
 HCHttpCallRequestGetRequestBodyBytes(
@@ -114,6 +239,11 @@ try
         return E_INVALIDARG;
     }
 
+    if (call->requestBodyReadFunction != nullptr)
+    {
+        RETURN_IF_FAILED(read_request_body_into_bytes(call));
+    }
+
     *requestBodySize = static_cast<uint32_t>(call->requestBodyBytes.size());
     if (*requestBodySize == 0)
     {
@@ -140,6 +270,11 @@ try
         return E_INVALIDARG;
     }
 
+    if (call->requestBodyReadFunction != nullptr)
+    {
+        RETURN_IF_FAILED(read_request_body_into_bytes(call));
+    }
+
     if (call->requestBodyString.empty())
     {
         call->requestBodyString = http_internal_string(reinterpret_cast<char const*>(call->requestBodyBytes.data()), call->requestBodyBytes.size());
@@ -149,6 +284,36 @@ try
 }
 CATCH_RETURN()
 
+STDAPI
+HCHttpCallRequestGetRequestBodyReadFunction(
+    _In_ HCCallHandle call,
+    _Out_ HCHttpCallRequestBodyReadFunction* readFunction,
+    _Out_ uint64_t* bodySize,
+    _Outptr_result_maybenull_ void** context
+    ) noexcept
+try
+{
+    if (call == nullptr || readFunction == nullptr || bodySize == nullptr || context == nullptr)
+    {
+        return E_INVALIDARG;
+    }
+
+    if (call->requestBodyReadFunction != nullptr)
+    {
+        *readFunction = call->requestBodyReadFunction;
+        *bodySize = call->requestBodyReadFunctionSize;
+        *context = call->requestBodyReadFunctionContext;
+    }
+    else
+    {
+        *readFunction = read_request_body_bytes;
+        *bodySize = call->requestBodyBytes.size();
+        *context = nullptr;
+    }
+    return S_OK;
+}
+CATCH_RETURN()
+
 STDAPI 
 HCHttpCallRequestSetHeader(
     _In_ HCCallHandle call,
@@ -164,7 +329,7 @@ try
     }
     RETURN_IF_PERFORM_CALLED(call);
 
-    call->requestHeaders[headerName] = headerValue;
+    call->requestHeaders.set(headerName, headerValue);
 
     if (allowTracing && call->traceCall) { HC_TRACE_INFORMATION(HTTPCLIENT, "HCHttpCallRequestSetHeader [ID %llu]: %s=%s", call->id, headerName, headerValue); }
     return S_OK;
@@ -184,10 +349,10 @@ try
         return E_INVALIDARG;
     }
 
-    auto it = call->requestHeaders.find(headerName);
-    if (it != call->requestHeaders.end())
+    auto header = call->requestHeaders.find(headerName);
+    if (header != nullptr)
     {
-        *headerValue = it->second.c_str();
+        *headerValue = header->value;
     }
     else
     {
@@ -228,17 +393,12 @@ try
         return E_INVALIDARG;
     }
 
-    uint32_t index = 0;
-    for (auto it = call->requestHeaders.cbegin(); it != call->requestHeaders.cend(); ++it)
+    if (headerIndex < call->requestHeaders.size())
     {
-        if (index == headerIndex)
-        {
-            *headerName = it->first.c_str();
-            *headerValue = it->second.c_str();
-            return S_OK;
-        }
-
-        index++;
+        auto& header = call->requestHeaders[headerIndex];
+        *headerName = header.name;
+        *headerValue = header.value;
+        return S_OK;
     }
 
     *headerName = nullptr;
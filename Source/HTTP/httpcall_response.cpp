@@ -6,6 +6,247 @@
 
 using namespace xbox::httpclient;
 
+http_response_body_stream::http_response_body_stream(
+    _In_ HCCallHandle call,
+    _In_ HCHttpCallResponseBodyWriteFunction writeFunction,
+    _In_opt_ void* context
+    ) noexcept :
+    m_call(call),
+    m_writeFunction(writeFunction),
+    m_context(context)
+{
+}
+
+http_response_body_stream::~http_response_body_stream()
+{
+    ASSERT(!m_draining);
+    if (m_queue != nullptr)
+    {
+        XTaskQueueCloseHandle(m_queue);
+    }
+}
+
+HRESULT http_response_body_stream::set_queue(_In_opt_ XTaskQueueHandle queue) noexcept
+{
+    XTaskQueueHandle newQueue = nullptr;
+    if (queue != nullptr)
+    {
+        RETURN_IF_FAILED(XTaskQueueDuplicateHandle(queue, &newQueue));
+    }
+    else
+    {
+        RETURN_HR_IF(E_NO_TASK_QUEUE, !XTaskQueueGetCurrentProcessTaskQueue(&newQueue));
+    }
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (m_queue != nullptr)
+    {
+        XTaskQueueCloseHandle(m_queue);
+    }
+    m_queue = newQueue;
+    return S_OK;
+}
+
+HRESULT http_response_body_stream::write(_In_reads_bytes_(size) const uint8_t* data, _In_ size_t size) noexcept
+try
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        RETURN_IF_FAILED(m_result);
+        RETURN_HR_IF(E_UNEXPECTED, m_queue == nullptr);
+
+        if (size == 0)
+        {
+            return S_OK;
+        }
+
+        http_internal_vector<uint8_t> chunk;
+        if (!m_freeBuffers.empty())
+        {
+            chunk = std::move(m_freeBuffers.back());
+            m_freeBuffers.pop_back();
+        }
+        chunk.assign(data, data + size);
+        m_chunks.push(std::move(chunk));
+        m_buffered += size;
+
+        if (m_draining)
+        {
+            return S_OK;
+        }
+        m_draining = true;
+    }
+
+    // Submitted without the lock: an immediate work port drains right here
+    HRESULT hr = XTaskQueueSubmitCallback(m_queue, XTaskQueuePort::Work, this, drain_callback);
+    if (FAILED(hr))
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_result = hr;
+        }
+
+        // Nothing will drain, so settle things the way a canceled drain
+        // does: drop the data and release any waiting flush or resume
+        drain(true);
+        return hr;
+    }
+
+    return S_OK;
+}
+CATCH_RETURN()
+
+bool http_response_body_stream::pause_if_full(_In_ http_response_body_stream_callback* resume, _In_opt_ void* context) noexcept
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (m_buffered <= HTTP_RESPONSE_BODY_STREAM_MAX_BUFFERED || FAILED(m_result))
+    {
+        return false;
+    }
+
+    m_resume = resume;
+    m_resumeContext = context;
+    return true;
+}
+
+void http_response_body_stream::cancel_resume() noexcept
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_resume = nullptr;
+    m_resumeContext = nullptr;
+    m_resumeDone.wait(lock, [this]() { return !m_resumeRunning; });
+}
+
+void http_response_body_stream::flush(_In_ http_response_body_stream_callback* callback, _In_opt_ void* context) noexcept
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if (m_draining)
+        {
+            ASSERT(m_flush == nullptr);
+            m_flush = callback;
+            m_flushContext = context;
+            return;
+        }
+    }
+
+    callback(context);
+}
+
+HRESULT http_response_body_stream::result() const noexcept
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_result;
+}
+
+void CALLBACK http_response_body_stream::drain_callback(_In_opt_ void* context, _In_ bool canceled) noexcept
+{
+    static_cast<http_response_body_stream*>(context)->drain(canceled);
+}
+
+void http_response_body_stream::drain(_In_ bool canceled) noexcept
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    if (canceled && SUCCEEDED(m_result))
+    {
+        m_result = E_ABORT;
+    }
+
+    for (;;)
+    {
+        if (FAILED(m_result))
+        {
+            // Nobody will read the rest; drop it so waiting providers see the failure
+            while (!m_chunks.empty())
+            {
+                m_chunks.pop();
+            }
+            m_buffered = 0;
+        }
+
+        if (m_resume != nullptr && m_buffered <= HTTP_RESPONSE_BODY_STREAM_RESUME_BUFFERED)
+        {
+            // Invoked without the lock so the provider can call back in;
+            // cancel_resume waits for it instead
+            auto resume = m_resume;
+            auto resumeContext = m_resumeContext;
+            m_resume = nullptr;
+            m_resumeContext = nullptr;
+            m_resumeRunning = true;
+
+            lock.unlock();
+            resume(resumeContext);
+            lock.lock();
+
+            m_resumeRunning = false;
+            m_resumeDone.notify_all();
+            continue;
+        }
+
+        if (m_chunks.empty())
+        {
+            break;
+        }
+
+        auto chunk = std::move(m_chunks.front());
+        m_chunks.pop();
+
+        lock.unlock();
+        HRESULT hr = m_writeFunction(m_call, chunk.data(), chunk.size(), m_context);
+        lock.lock();
+
+        if (FAILED(hr) && SUCCEEDED(m_result))
+        {
+            if (m_call->traceCall) { HC_TRACE_ERROR(HTTPCLIENT, "HCHttpCallResponseBodyWriteFunction [ID %llu]: failed 0x%08x", m_call->id, hr); }
+            m_result = hr;
+        }
+
+        m_buffered -= chunk.size();
+        if (m_freeBuffers.size() < HTTP_RESPONSE_BODY_STREAM_FREE_BUFFERS)
+        {
+            try
+            {
+                m_freeBuffers.push_back(std::move(chunk));
+            }
+            catch (...)
+            {
+            }
+        }
+    }
+
+    m_draining = false;
+    auto flush = m_flush;
+    auto flushContext = m_flushContext;
+    m_flush = nullptr;
+    lock.unlock();
+
+    // The flush callback may complete the call and free this stream
+    if (flush != nullptr)
+    {
+        flush(flushContext);
+    }
+}
+
+
+STDAPI
+HCHttpCallResponseSetResponseBodyWriteFunction(
+    _In_ HCCallHandle call,
+    _In_ HCHttpCallResponseBodyWriteFunction writeFunction,
+    _In_opt_ void* context
+    ) noexcept
+try
+{
+    if (call == nullptr || writeFunction == nullptr)
+    {
+        return E_INVALIDARG;
+    }
+    RETURN_IF_PERFORM_CALLED(call);
+
+    call->responseBodyStream = http_allocate_unique<http_response_body_stream>(call, writeFunction, context);
+    if (call->traceCall) { HC_TRACE_INFORMATION(HTTPCLIENT, "HCHttpCallResponseSetResponseBodyWriteFunction [ID %llu]", call->id); }
+    return S_OK;
+}
+CATCH_RETURN()
 
 STDAPI 
 HCHttpCallResponseGetResponseString(
@@ -85,6 +326,11 @@ try
         return E_INVALIDARG;
     }
 
+    if (call->responseBodyStream != nullptr)
+    {
+        return call->responseBodyStream->write(bodyBytes, bodySize);
+    }
+
     call->responseBodyBytes.assign(bodyBytes, bodyBytes + bodySize);
     call->responseString.clear();
 
@@ -106,6 +352,11 @@ try
         return E_INVALIDARG;
     }
 
+    if (call->responseBodyStream != nullptr)
+    {
+        return call->responseBodyStream->write(bodyBytes, bodySize);
+    }
+
     call->responseBodyBytes.insert(call->responseBodyBytes.end(), bodyBytes, bodyBytes + bodySize);
     call->responseString.clear();
 
@@ -242,10 +493,10 @@ try
         return E_INVALIDARG;
     }
 
-    auto it = call->responseHeaders.find(headerName);
-    if (it != call->responseHeaders.end())
+    auto header = call->responseHeaders.find(headerName);
+    if (header != nullptr)
     {
-        *headerValue = it->second.c_str();
+        *headerValue = header->value;
     }
     else
     {
@@ -286,17 +537,12 @@ try
         return E_INVALIDARG;
     }
 
-    uint32_t index = 0;
-    for (auto it = call->responseHeaders.cbegin(); it != call->responseHeaders.cend(); ++it)
+    if (headerIndex < call->responseHeaders.size())
     {
-        if (index == headerIndex)
-        {
-            *headerName = it->first.c_str();
-            *headerValue = it->second.c_str();
-            return S_OK;
-        }
-
-        index++;
+        auto& header = call->responseHeaders[headerIndex];
+        *headerName = header.name;
+        *headerValue = header.value;
+        return S_OK;
     }
 
     *headerName = nullptr;
@@ -340,25 +586,21 @@ try
         return E_INVALIDARG;
     }
 
-    http_internal_string name{ headerName, headerName + nameSize };
+    bool duplicate = call->traceCall && call->responseHeaders.find(headerName, nameSize) != nullptr;
 
-    auto it = call->responseHeaders.find(name);
-    if (it != call->responseHeaders.end())
-    {
-        // Duplicated response header found. We must concatenate it with the existing headers
-        http_internal_string& newHeaderValue = it->second;
-        newHeaderValue.append(", ");
-        newHeaderValue.append(headerValue, headerValue + valueSize);
+    // Duplicated response headers must be concatenated with the existing value
+    auto& header = call->responseHeaders.append(headerName, nameSize, headerValue, valueSize);
 
-        if (call->traceCall) { HC_TRACE_INFORMATION(HTTPCLIENT, "HCHttpCallResponseSetResponseHeader [ID %llu]: Duplicated header %s=%s", call->id, name.c_str(), newHeaderValue.c_str()); }
-    }
-    else
+    if (call->traceCall)
     {
-        http_internal_string value{ headerValue, headerValue + valueSize };
-
-        if (call->traceCall) { HC_TRACE_INFORMATION(HTTPCLIENT, "HCHttpCallResponseSetResponseHeader [ID %llu]: %s=%s", call->id, name.c_str(), value.c_str()); }
-
-        call->responseHeaders[name] = std::move(value);
+        if (duplicate)
+        {
+            HC_TRACE_INFORMATION(HTTPCLIENT, "HCHttpCallResponseSetResponseHeader [ID %llu]: Duplicated header %s=%s", call->id, header.name, header.value);
+        }
+        else
+        {
+            HC_TRACE_INFORMATION(HTTPCLIENT, "HCHttpCallResponseSetResponseHeader [ID %llu]: %s=%s", call->id, header.name, header.value);
+        }
     }
 
     return S_OK;
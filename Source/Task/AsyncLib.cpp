@@ -2,6 +2,8 @@
 // Licensed under the MIT license. See LICENSE file in the project root for full license information.
 
 #include "pch.h"
+#include "EventCount.h"
+#include "LocklessList.h"
 
 #define ASYNC_STATE_SIG 0x41535445
 
@@ -20,6 +22,11 @@ std::atomic<uint32_t> s_AsyncLibGlobalStateCount{ 0 };
 // opportunity to delete the user async block.  This would leave
 // the async provider callback with a dangling pointer.
 
+// States whose provider context fits are carved from this pool rather than
+// the heap; larger ones fall back to operator new.
+static const size_t ASYNC_STATE_BLOCK_SIZE = 512;
+using AsyncStatePool = BlockPool<ASYNC_STATE_BLOCK_SIZE>;
+
 struct AsyncState
 {
     uint32_t signature = ASYNC_STATE_SIG;
@@ -27,26 +34,42 @@ struct AsyncState
     std::atomic<bool> workScheduled{ false };
     bool canceled = false;
     bool valid = true;
+    bool pooled = false;
     XAsyncProvider* provider = nullptr;
     XAsyncProviderData providerData{ };
     XAsyncBlock asyncBlock { };
     XAsyncBlock* userAsyncBlock = nullptr;
     XTaskQueueHandle queue = nullptr;
-    std::mutex waitMutex;
-    std::condition_variable waitCondition;
-    bool waitSatisfied = false;
+    std::atomic<bool> waitSatisfied{ false };
+
+    // Created the first time someone blocks in XAsyncGetStatus. Most calls
+    // complete through a callback and never need one.
+    std::atomic<EventCount*> waiter{ nullptr };
 
     const void* identity = nullptr;
     const char* identityName = nullptr;
 
-    void* operator new(size_t size, size_t additional)
+    static AsyncState* Create(_In_ size_t contextSize) noexcept
     {
-        return ::operator new(size + additional);
-    }
+        void* ptr;
+        bool pooled = contextSize <= ASYNC_STATE_BLOCK_SIZE - sizeof(AsyncState);
+        if (pooled)
+        {
+            ptr = AsyncStatePool::Allocate();
+        }
+        else
+        {
+            ptr = ::operator new(sizeof(AsyncState) + contextSize, std::nothrow);
+        }
 
-    void operator delete(void* ptr)
-    {
-        ::operator delete(ptr);
+        if (ptr == nullptr)
+        {
+            return nullptr;
+        }
+
+        AsyncState* state = new (ptr) AsyncState;
+        state->pooled = pooled;
+        return state;
     }
 
     AsyncState() noexcept
@@ -63,7 +86,17 @@ struct AsyncState
     {
         if (--refs == 0)
         {
-            delete this;
+            bool wasPooled = pooled;
+            this->~AsyncState();
+
+            if (wasPooled)
+            {
+                AsyncStatePool::Free(this);
+            }
+            else
+            {
+                ::operator delete(this);
+            }
         }
     }
 
@@ -81,10 +114,15 @@ private:
             XTaskQueueCloseHandle(queue);
         }
 
+        delete waiter.load();
+
         --s_AsyncLibGlobalStateCount;
     }
 };
 
+static_assert(sizeof(AsyncState) + 128 <= ASYNC_STATE_BLOCK_SIZE,
+    "AsyncState pool blocks should leave room for small provider contexts");
+
 struct AsyncBlockInternal
 {
     AsyncState* state = nullptr;
@@ -305,7 +343,7 @@ static void CleanupState(_Inout_ AsyncStateRef&& state);
 static HRESULT AllocStateNoCompletion(_Inout_ XAsyncBlock* asyncBlock, _Inout_ AsyncBlockInternal* internal, _In_ size_t contextSize)
 {
     AsyncStateRef state;
-    state.Attach(new (contextSize) AsyncState);
+    state.Attach(AsyncState::Create(contextSize));
     RETURN_IF_NULL_ALLOC(state);
 
     if (contextSize != 0)
@@ -410,11 +448,15 @@ static void SignalCompletion(_In_ AsyncStateRef const& state)
 
 static void SignalWait(_In_ AsyncStateRef const& state)
 {
+    state->waitSatisfied = true;
+
+    // A waiter installed after this load checks waitSatisfied before
+    // sleeping, so it can't miss the signal.
+    EventCount* waiter = state->waiter.load();
+    if (waiter != nullptr)
     {
-        std::lock_guard<std::mutex> lock(state->waitMutex);
-        state->waitSatisfied = true;
+        waiter->Notify();
     }
-    state->waitCondition.notify_all();
 }
 
 static void CALLBACK CompletionCallback(
@@ -520,13 +562,33 @@ STDAPI XAsyncGetStatus(
         }
         else
         {
+            if (!state->waitSatisfied)
             {
-                std::unique_lock<std::mutex> lock(state->waitMutex);
+                EventCount* waiter = state->waiter.load();
+                if (waiter == nullptr)
+                {
+                    EventCount* newWaiter = new (std::nothrow) EventCount;
+                    RETURN_IF_NULL_ALLOC(newWaiter);
+
+                    if (state->waiter.compare_exchange_strong(waiter, newWaiter))
+                    {
+                        waiter = newWaiter;
+                    }
+                    else
+                    {
+                        delete newWaiter;
+                    }
+                }
 
-                if (!state->waitSatisfied)
+                while (true)
                 {
-                    AsyncState* s = state.Get();
-                    state->waitCondition.wait(lock, [s] { return s->waitSatisfied; });
+                    uint32_t key = waiter->PrepareWait();
+                    if (state->waitSatisfied)
+                    {
+                        waiter->CancelWait();
+                        break;
+                    }
+                    waiter->Wait(key, EventCount::Infinite);
                 }
             }
 
@@ -0,0 +1,184 @@
+// Copyright (c) Microsoft Corporation
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define EVENT_COUNT_USE_FUTEX 1
+#endif
+
+/*****************************************************************************
+
+ EventCount lets threads block until a condition becomes true without
+ putting a lock around the condition. A waiter takes a key, re-checks its
+ condition and only then waits on the key:
+
+     while (true)
+     {
+         uint32_t key = event.PrepareWait();
+         if (ConditionIsTrue())
+         {
+             event.CancelWait();
+             break;
+         }
+         event.Wait(key, timeout);
+     }
+
+ A signaler makes the condition true and calls Notify. When nobody is
+ waiting Notify is a single load, so it can sit on hot paths. Waiters spin
+ briefly in case the signal is imminent and then park on a futex on Linux
+ or a condition variable elsewhere.
+
+ ******************************************************************************/
+
+class EventCount
+{
+public:
+    static const uint32_t Infinite = UINT32_MAX;
+
+    EventCount() noexcept = default;
+    EventCount(const EventCount&) = delete;
+    EventCount& operator=(const EventCount&) = delete;
+
+    uint32_t PrepareWait() noexcept
+    {
+        m_waiters.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return m_epoch.load(std::memory_order_acquire);
+    }
+
+    void CancelWait() noexcept
+    {
+        m_waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Waits until Notify is called after the PrepareWait that returned key,
+    // or until timeoutMs elapses. Returns false on timeout. Either way the
+    // PrepareWait is consumed.
+    bool Wait(_In_ uint32_t key, _In_ uint32_t timeoutMs) noexcept
+    {
+        bool signaled = true;
+
+        if (SpinUntilChanged(key))
+        {
+            m_waiters.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+
+#if EVENT_COUNT_USE_FUTEX
+        while (m_epoch.load(std::memory_order_acquire) == key)
+        {
+            timespec relative;
+            timespec* relativePtr = nullptr;
+            if (timeoutMs != Infinite)
+            {
+                auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now()).count();
+                if (remaining <= 0)
+                {
+                    signaled = false;
+                    break;
+                }
+
+                relative.tv_sec = static_cast<time_t>(remaining / 1000000000);
+                relative.tv_nsec = static_cast<long>(remaining % 1000000000);
+                relativePtr = &relative;
+            }
+
+            syscall(SYS_futex, EpochAddress(), FUTEX_WAIT_PRIVATE, key, relativePtr, nullptr, 0);
+        }
+#else
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            auto changed = [this, key] { return m_epoch.load(std::memory_order_acquire) != key; };
+            if (timeoutMs == Infinite)
+            {
+                m_condition.wait(lock, changed);
+            }
+            else
+            {
+                signaled = m_condition.wait_until(lock, deadline, changed);
+            }
+        }
+#endif
+
+        m_waiters.fetch_sub(1, std::memory_order_relaxed);
+        return signaled;
+    }
+
+    // Wakes every thread blocked in Wait. Call after making the waited for
+    // condition true.
+    void Notify() noexcept
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_waiters.load(std::memory_order_relaxed) == 0)
+        {
+            return;
+        }
+
+        m_epoch.fetch_add(1, std::memory_order_release);
+
+#if EVENT_COUNT_USE_FUTEX
+        syscall(SYS_futex, EpochAddress(), FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+#else
+        {
+            // Orders the epoch change with a waiter that checked it under
+            // the lock but hasn't started waiting yet.
+            std::lock_guard<std::mutex> lock(m_lock);
+        }
+        m_condition.notify_all();
+#endif
+    }
+
+private:
+
+    // Spinning only pays off when the signaler can be running on another
+    // core at the same time.
+    static const uint32_t SPIN_COUNT = 128;
+
+    bool SpinUntilChanged(_In_ uint32_t key) noexcept
+    {
+        static const bool s_spin = std::thread::hardware_concurrency() > 1;
+        if (s_spin)
+        {
+            for (uint32_t spin = 0; spin < SPIN_COUNT; spin++)
+            {
+                if (m_epoch.load(std::memory_order_acquire) != key)
+                {
+                    return true;
+                }
+                Pause();
+            }
+        }
+        return false;
+    }
+
+    static void Pause() noexcept
+    {
+#if defined(_MSC_VER)
+        YieldProcessor();
+#elif defined(__i386__) || defined(__x86_64__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        __asm__ __volatile__("yield");
+#endif
+    }
+
+#if EVENT_COUNT_USE_FUTEX
+    uint32_t* EpochAddress() noexcept
+    {
+        static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex needs a plain 32 bit word");
+        return reinterpret_cast<uint32_t*>(&m_epoch);
+    }
+#else
+    std::mutex m_lock;
+    std::condition_variable m_condition;
+#endif
+
+    std::atomic<uint32_t> m_epoch{ 0 };
+    std::atomic<uint32_t> m_waiters{ 0 };
+};
@@ -49,6 +49,260 @@
  
  ******************************************************************************/
 
+/*****************************************************************************
+
+ BlockPool is a cache of fixed size, size-aligned memory blocks used for
+ LocklessList nodes and the entries task queues put in them, so submitting
+ a callback doesn't go to the heap in the steady state.
+
+ Each thread keeps a small free list of its own. When it grows past two
+ batches one batch moves to a shared depot, and a thread with an empty
+ free list takes a whole batch back from it. Depot slots are exchanged
+ atomically, so whoever takes a slot owns its chain outright and there is
+ no ABA hazard. When the depot is full, batches go back to the heap, which
+ bounds how much memory the pool retains.
+
+ ******************************************************************************/
+
+struct BlockPoolStats
+{
+    uint64_t blockSize;
+    uint64_t blocksOutstanding;  // Blocks obtained from the heap and not yet returned
+    uint64_t blocksHighWater;    // Largest blocksOutstanding has been
+    uint64_t blocksInDepot;      // Free blocks held in the shared depot
+    uint64_t heapAllocations;    // Total blocks ever obtained from the heap
+};
+
+template <size_t BlockSize>
+class BlockPool
+{
+public:
+
+    static void* Allocate() noexcept
+    {
+        ThreadCache& cache = Cache();
+        if (cache.head == nullptr)
+        {
+            cache.head = TakeBatch();
+            cache.count = cache.head != nullptr ? cache.head->count : 0;
+        }
+
+        if (cache.head != nullptr)
+        {
+            FreeBlock* block = cache.head;
+            cache.head = block->next;
+            cache.count--;
+            return block;
+        }
+
+        // Nothing cached anywhere. Refill a batch from the heap at once so
+        // the shared counters are touched once per batch, not per block.
+        void* ptr = AlignedMalloc(BlockSize, BlockSize);
+        if (ptr == nullptr)
+        {
+            return nullptr;
+        }
+
+        uint32_t allocated = 1;
+        for (; allocated < BLOCK_POOL_BATCH; allocated++)
+        {
+            FreeBlock* block = static_cast<FreeBlock*>(AlignedMalloc(BlockSize, BlockSize));
+            if (block == nullptr)
+            {
+                break;
+            }
+            block->next = cache.head;
+            cache.head = block;
+            cache.count++;
+        }
+
+        s_heapAllocations += allocated;
+        uint64_t outstanding = (s_outstanding += allocated);
+        uint64_t highWater = s_highWater;
+        while (outstanding > highWater && !s_highWater.compare_exchange_weak(highWater, outstanding)) {}
+
+        return ptr;
+    }
+
+    static void Free(_In_opt_ void* ptr) noexcept
+    {
+        if (ptr == nullptr)
+        {
+            return;
+        }
+
+        ThreadCache& cache = Cache();
+        FreeBlock* block = static_cast<FreeBlock*>(ptr);
+        block->next = cache.head;
+        cache.head = block;
+        cache.count++;
+
+        if (cache.count >= BLOCK_POOL_BATCH * 2)
+        {
+            // Split one batch off the front and hand it to the depot
+            FreeBlock* batch = cache.head;
+            FreeBlock* last = batch;
+            for (uint32_t i = 1; i < BLOCK_POOL_BATCH; i++)
+            {
+                last = last->next;
+            }
+
+            cache.head = last->next;
+            cache.count -= BLOCK_POOL_BATCH;
+
+            last->next = nullptr;
+            batch->count = BLOCK_POOL_BATCH;
+            ReturnBatch(batch);
+        }
+    }
+
+    static void GetStats(_Out_ BlockPoolStats* stats) noexcept
+    {
+        stats->blockSize = BlockSize;
+        stats->blocksOutstanding = s_outstanding;
+        stats->blocksHighWater = s_highWater;
+        stats->heapAllocations = s_heapAllocations;
+        stats->blocksInDepot = s_depotBlocks;
+    }
+
+    static void* AlignedMalloc(size_t size, size_t align) noexcept
+    {
+        void *result;
+        size_t bytes = (size + align - 1) & ~(align - 1);
+#ifdef _MSC_VER
+        result = _aligned_malloc(bytes, align);
+#else
+        if(posix_memalign(&result, align, bytes)) result = 0;
+#endif
+        return result;
+    }
+
+    static void AlignedFree(void *ptr) noexcept
+    {
+#ifdef _MSC_VER
+        _aligned_free(ptr);
+#else
+        free(ptr);
+#endif
+    }
+
+private:
+
+    static const uint32_t BLOCK_POOL_BATCH = 32;
+    static const uint32_t BLOCK_POOL_DEPOT_SLOTS = 64;
+
+    // Overlays a free block. count is the length of the chain and is
+    // only set on the first block of a batch in the depot.
+    struct FreeBlock
+    {
+        FreeBlock* next;
+        uint32_t count;
+    };
+
+    static_assert(sizeof(FreeBlock) <= BlockSize, "BlockSize too small");
+    static_assert((BlockSize & (BlockSize - 1)) == 0, "BlockSize must be a power of two");
+
+    struct ThreadCache
+    {
+        FreeBlock* head = nullptr;
+        uint32_t count = 0;
+
+        ~ThreadCache() noexcept
+        {
+            if (head != nullptr)
+            {
+                head->count = count;
+                ReturnBatch(head);
+            }
+        }
+    };
+
+    static ThreadCache& Cache() noexcept
+    {
+        static thread_local ThreadCache cache;
+        return cache;
+    }
+
+    static FreeBlock* TakeBatch() noexcept
+    {
+        if (s_depotBlocks == 0)
+        {
+            return nullptr;
+        }
+
+        for (uint32_t i = 0; i < BLOCK_POOL_DEPOT_SLOTS; i++)
+        {
+            std::atomic<FreeBlock*>& slot = s_depot[i];
+            if (slot.load(std::memory_order_relaxed) != nullptr)
+            {
+                FreeBlock* batch = slot.exchange(nullptr, std::memory_order_acquire);
+                if (batch != nullptr)
+                {
+                    s_depotBlocks -= batch->count;
+                    return batch;
+                }
+            }
+        }
+
+        return nullptr;
+    }
+
+    static void ReturnBatch(_In_ FreeBlock* batch) noexcept
+    {
+        uint32_t count = batch->count;
+
+        if (s_depotBlocks < BLOCK_POOL_BATCH * BLOCK_POOL_DEPOT_SLOTS)
+        {
+            for (uint32_t i = 0; i < BLOCK_POOL_DEPOT_SLOTS; i++)
+            {
+                std::atomic<FreeBlock*>& slot = s_depot[i];
+                FreeBlock* expected = nullptr;
+                if (slot.load(std::memory_order_relaxed) == nullptr &&
+                    slot.compare_exchange_strong(expected, batch, std::memory_order_release))
+                {
+                    s_depotBlocks += count;
+                    return;
+                }
+            }
+        }
+
+        // The depot is full; give the memory back.
+        while (batch != nullptr)
+        {
+            FreeBlock* next = batch->next;
+            AlignedFree(batch);
+            batch = next;
+        }
+
+        s_outstanding -= count;
+    }
+
+    static std::atomic<FreeBlock*> s_depot[BLOCK_POOL_DEPOT_SLOTS];
+    static std::atomic<uint64_t> s_depotBlocks;
+    static std::atomic<uint64_t> s_outstanding;
+    static std::atomic<uint64_t> s_highWater;
+    static std::atomic<uint64_t> s_heapAllocations;
+};
+
+template <size_t BlockSize>
+std::atomic<typename BlockPool<BlockSize>::FreeBlock*> BlockPool<BlockSize>::s_depot[BlockPool<BlockSize>::BLOCK_POOL_DEPOT_SLOTS];
+
+template <size_t BlockSize>
+std::atomic<uint64_t> BlockPool<BlockSize>::s_depotBlocks{ 0 };
+
+template <size_t BlockSize>
+std::atomic<uint64_t> BlockPool<BlockSize>::s_outstanding{ 0 };
+
+template <size_t BlockSize>
+std::atomic<uint64_t> BlockPool<BlockSize>::s_highWater{ 0 };
+
+template <size_t BlockSize>
+std::atomic<uint64_t> BlockPool<BlockSize>::s_heapAllocations{ 0 };
+
+// LocklessList nodes and task queue entries share one pool of blocks
+// sized and aligned for a node.
+using LocklessBlockPool = BlockPool<sizeof(std::uintptr_t) * 8>;
+
 template <typename TData>
 class alignas(sizeof(std::uintptr_t) * 8) LocklessList
 {
@@ -65,7 +319,9 @@ public:
         
         static void* operator new(size_t sz)
         {
-            void* ptr = aligned_malloc(sz, sizeof(std::uintptr_t) * 8);
+            ASSERT(sz <= sizeof(std::uintptr_t) * 8);
+            UNREFERENCED_PARAMETER(sz);
+            void* ptr = LocklessBlockPool::Allocate();
             if (ptr == nullptr)
             {
                 throw new std::bad_alloc;
@@ -75,23 +331,25 @@ public:
         
         static void* operator new(size_t sz, const std::nothrow_t&)
         {
-            return aligned_malloc(sz, sizeof(std::uintptr_t) * 8);
+            ASSERT(sz <= sizeof(std::uintptr_t) * 8);
+            UNREFERENCED_PARAMETER(sz);
+            return LocklessBlockPool::Allocate();
         }
         
         static void operator delete(void* ptr)
         {
-            aligned_free(ptr);
+            LocklessBlockPool::Free(ptr);
         }
 
         static void operator delete(void* ptr, const std::nothrow_t&)
         {
-            aligned_free(ptr);
+            LocklessBlockPool::Free(ptr);
         }
     };
     
     static void* operator new(size_t sz)
     {
-        void* ptr = aligned_malloc(sz, sizeof(std::uintptr_t) * 8);
+        void* ptr = LocklessBlockPool::AlignedMalloc(sz, sizeof(std::uintptr_t) * 8);
         if (ptr == nullptr)
         {
             throw new std::bad_alloc;
@@ -101,12 +359,12 @@ public:
     
     static void* operator new(size_t sz, const std::nothrow_t&)
     {
-        return aligned_malloc(sz, sizeof(std::uintptr_t) * 8);
+        return LocklessBlockPool::AlignedMalloc(sz, sizeof(std::uintptr_t) * 8);
     }
     
     static void operator delete(void* ptr)
     {
-        aligned_free(ptr);
+        LocklessBlockPool::AlignedFree(ptr);
     }
     
     LocklessList() noexcept
@@ -152,45 +410,56 @@ public:
 
         node->next = 0;
         node->data = data;
-        
-        std::uintptr_t localTail = 0;
-        std::uintptr_t localNext = 0;
-        
-        // we have to loop around until we successfully insert the node as the last element in the queue
-        for (;;)
+
+        append_chain(node, node);
+        return true;
+    }
+
+    // Pushes count elements, in order, with a single insertion at the
+    // tail so they become visible to poppers together. Nodes are
+    // allocated; returns false if out of memory, in which case nothing
+    // is pushed.
+    bool push_back_range(_In_reads_(count) TData* const* data, _In_ size_t count) noexcept
+    {
+        if (count == 0)
         {
-            localTail = m_tail;
+            return true;
+        }
 
-            if (!IsPtrLocked(localTail) && TryGetNextPtr(m_tail, localTail, localNext))
+        Node* first = nullptr;
+        Node* last = nullptr;
+
+        for (size_t idx = 0; idx < count; idx++)
+        {
+            Node* node = new (std::nothrow) Node;
+            if (node == nullptr)
             {
-                if (ToNode(localNext) == nullptr)
+                while (first != nullptr)
                 {
-                    // attempt to insert the element at the end of the queue
-                    // this is only valid if the tail of the queue is still pointing to the last element in the queue
-                    std::uintptr_t temp = ToPtr(localNext, node);
-                    if (ToNode(localTail)->next.compare_exchange_weak(localNext, temp))
-                    {
-                        // we were successful in inserting the element into the queue
-                        // we can now break out of the loop trying to insert the element
-                        // at this point m_tail->next is pointing to the new node
-                        // however m_tail is not pointing to the new node yet
-                        break;
-                    }
-                }
-                // m_tail not pointing to last node in list, so we need to try and move it along the list until it is
-                // we don't care if the interlock fails, we'll just catch it the next time around
-                else
-                {
-                    std::uintptr_t temp = ToPtr(localTail, ToNode(localNext));
-                    m_tail.compare_exchange_weak(localTail, temp);
+                    Node* next = ToNode(first->next);
+                    delete first;
+                    first = next;
                 }
+                return false;
+            }
+
+            ASSERT((reinterpret_cast<std::uintptr_t>(node) & 0x1F) == 0); // Alignment problem
+
+            node->next = 0;
+            node->data = data[idx];
+
+            if (last == nullptr)
+            {
+                first = node;
+            }
+            else
+            {
+                last->next = ToPtr(0, node);
             }
+            last = node;
         }
-        
-        // The node has been inserted into the last element in the list, we now need to update m_tail to point to it
-        // we don't care if the interlock fails, if so we'll just catch it next time around in either push or pop
-        std::uintptr_t temp = ToPtr(localTail, node);
-        m_tail.compare_exchange_weak(localTail, temp);
+
+        append_chain(first, last);
         return true;
     }
     
@@ -285,6 +554,50 @@ public:
     
 private:
     
+    // Links an already chained run of nodes, first through last, onto
+    // the end of the list.
+    void append_chain(_In_ Node* first, _In_ Node* last) noexcept
+    {
+        std::uintptr_t localTail = 0;
+        std::uintptr_t localNext = 0;
+        
+        // we have to loop around until we successfully insert the node as the last element in the queue
+        for (;;)
+        {
+            localTail = m_tail;
+
+            if (!IsPtrLocked(localTail) && TryGetNextPtr(m_tail, localTail, localNext))
+            {
+                if (ToNode(localNext) == nullptr)
+                {
+                    // attempt to insert the element at the end of the queue
+                    // this is only valid if the tail of the queue is still pointing to the last element in the queue
+                    std::uintptr_t temp = ToPtr(localNext, first);
+                    if (ToNode(localTail)->next.compare_exchange_weak(localNext, temp))
+                    {
+                        // we were successful in inserting the element into the queue
+                        // we can now break out of the loop trying to insert the element
+                        // at this point m_tail->next is pointing to the new node
+                        // however m_tail is not pointing to the new node yet
+                        break;
+                    }
+                }
+                // m_tail not pointing to last node in list, so we need to try and move it along the list until it is
+                // we don't care if the interlock fails, we'll just catch it the next time around
+                else
+                {
+                    std::uintptr_t temp = ToPtr(localTail, ToNode(localNext));
+                    m_tail.compare_exchange_weak(localTail, temp);
+                }
+            }
+        }
+        
+        // The node has been inserted into the last element in the list, we now need to update m_tail to point to it
+        // we don't care if the interlock fails, if so we'll just catch it next time around in either push or pop
+        std::uintptr_t temp = ToPtr(localTail, last);
+        m_tail.compare_exchange_weak(localTail, temp);
+    }
+
     // We keep a single additional node around
     Node m_initialNode = { };
     
@@ -347,27 +660,6 @@ private:
 
         return false;
     }
-    
-    static inline void* aligned_malloc(size_t size, size_t align)
-    {
-        void *result;
-        size_t bytes = (size + align - 1) & ~(align - 1);
-#ifdef _MSC_VER
-        result = _aligned_malloc(bytes, align);
-#else
-        if(posix_memalign(&result, align, bytes)) result = 0;
-#endif
-        return result;
-    }
-    
-    static inline void aligned_free(void *ptr)
-    {
-#ifdef _MSC_VER
-        _aligned_free(ptr);
-#else
-        free(ptr);
-#endif
-    }
 };
 
 #pragma warning(pop)
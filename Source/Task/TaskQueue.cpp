@@ -4,6 +4,13 @@
 #include "referenced_ptr.h"
 #include "TaskQueueP.h"
 #include "TaskQueueImpl.h"
+#include "XTaskQueuePriv.h"
+
+#if TASK_QUEUE_EPOLL_WAITS
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
 
 //
 // Note:  ApiDiag is only used for reference count validation during
@@ -31,6 +38,217 @@ namespace ProcessGlobals
     std::atomic<XTaskQueueHandle> g_processQueue = { g_invalidQueueHandle };
 }
 
+#if TASK_QUEUE_EPOLL_WAITS
+
+//
+// EpollWaitReactor
+//
+// Watches the file descriptors of every wait registration in the process
+// from a single thread, the way the Windows thread pool services
+// threadpool waits. Each registration is one shot: after its callback
+// fires it must be re-armed. The reactor is created on first use and
+// lives for the rest of the process.
+//
+
+class EpollWaitReactor
+{
+public:
+
+    using ReadyCallback = void(_In_ void* context);
+
+    static HRESULT Get(_Out_ EpollWaitReactor** reactor) noexcept;
+
+    // Starts watching a duplicate of fd. The callback is invoked on the
+    // reactor thread the next time fd is readable or fails.
+    HRESULT Register(
+        _In_ int fd,
+        _In_ ReadyCallback* callback,
+        _In_ void* context,
+        _Out_ uint64_t* key) noexcept;
+
+    // Watches the registration for one more readiness callback.
+    HRESULT Arm(_In_ uint64_t key) noexcept;
+
+    // Stops watching the registration. Once this returns its callback
+    // is not running and won't be called again, unless this is called
+    // from the callback itself.
+    void Unregister(_In_ uint64_t key) noexcept;
+
+private:
+
+    struct Registration
+    {
+        int fd;
+        ReadyCallback* callback;
+        void* context;
+    };
+
+    EpollWaitReactor() = default;
+    HRESULT Initialize() noexcept;
+    void Run() noexcept;
+    void Dispatch(_In_ uint64_t key) noexcept;
+
+    std::mutex m_lock;
+    std::condition_variable m_dispatchDone;
+    std::unordered_map<uint64_t, Registration> m_registrations;
+    uint64_t m_nextKey = 0;
+    uint64_t m_dispatching = 0;
+    int m_epoll = -1;
+    std::thread::id m_threadId;
+};
+
+HRESULT EpollWaitReactor::Get(_Out_ EpollWaitReactor** reactor) noexcept
+{
+    static std::mutex s_lock;
+    static EpollWaitReactor* s_reactor = nullptr;
+
+    std::lock_guard<std::mutex> lock(s_lock);
+    if (s_reactor == nullptr)
+    {
+        std::unique_ptr<EpollWaitReactor> newReactor(new (std::nothrow) EpollWaitReactor);
+        RETURN_IF_NULL_ALLOC(newReactor);
+        RETURN_IF_FAILED(newReactor->Initialize());
+        s_reactor = newReactor.release();
+    }
+
+    *reactor = s_reactor;
+    return S_OK;
+}
+
+HRESULT EpollWaitReactor::Initialize() noexcept
+{
+    m_epoll = epoll_create1(EPOLL_CLOEXEC);
+    RETURN_HR_IF(E_FAIL, m_epoll == -1);
+
+    try
+    {
+        std::thread thread([this] { Run(); });
+        m_threadId = thread.get_id();
+        thread.detach();
+    }
+    catch (...)
+    {
+        close(m_epoll);
+        m_epoll = -1;
+        RETURN_HR(E_OUTOFMEMORY);
+    }
+
+    return S_OK;
+}
+
+HRESULT EpollWaitReactor::Register(
+    _In_ int fd,
+    _In_ ReadyCallback* callback,
+    _In_ void* context,
+    _Out_ uint64_t* key) noexcept
+{
+    // Watching a duplicate lets the same descriptor be registered more
+    // than once, and keeps a descriptor the caller closes from silently
+    // staying in the epoll set.
+    int watched = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    RETURN_HR_IF(errno == EBADF ? E_INVALIDARG : E_FAIL, watched == -1);
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    uint64_t newKey = ++m_nextKey;
+
+    try
+    {
+        m_registrations[newKey] = Registration{ watched, callback, context };
+    }
+    catch (...)
+    {
+        close(watched);
+        RETURN_HR(E_OUTOFMEMORY);
+    }
+
+    epoll_event event = {};
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.u64 = newKey;
+    if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, watched, &event) == -1)
+    {
+        // EPERM means the descriptor can't be polled, like a regular file.
+        HRESULT hr = (errno == EPERM ? E_INVALIDARG : E_FAIL);
+        m_registrations.erase(newKey);
+        close(watched);
+        RETURN_HR(hr);
+    }
+
+    *key = newKey;
+    return S_OK;
+}
+
+HRESULT EpollWaitReactor::Arm(_In_ uint64_t key) noexcept
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    auto it = m_registrations.find(key);
+    if (it == m_registrations.end())
+    {
+        return S_OK;
+    }
+
+    epoll_event event = {};
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.u64 = key;
+    RETURN_HR_IF(E_FAIL, epoll_ctl(m_epoll, EPOLL_CTL_MOD, it->second.fd, &event) == -1);
+    return S_OK;
+}
+
+void EpollWaitReactor::Unregister(_In_ uint64_t key) noexcept
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    auto it = m_registrations.find(key);
+    if (it != m_registrations.end())
+    {
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, it->second.fd, nullptr);
+        close(it->second.fd);
+        m_registrations.erase(it);
+    }
+
+    if (std::this_thread::get_id() != m_threadId)
+    {
+        m_dispatchDone.wait(lock, [this, key] { return m_dispatching != key; });
+    }
+}
+
+void EpollWaitReactor::Run() noexcept
+{
+    epoll_event events[64];
+
+    while (true)
+    {
+        int count = epoll_wait(m_epoll, events, ARRAYSIZE(events), -1);
+        for (int idx = 0; idx < count; idx++)
+        {
+            Dispatch(events[idx].data.u64);
+        }
+    }
+}
+
+// Events are looked up by key rather than carrying the registration,
+// so an event collected just before Unregister is simply dropped.
+void EpollWaitReactor::Dispatch(_In_ uint64_t key) noexcept
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    auto it = m_registrations.find(key);
+    if (it == m_registrations.end())
+    {
+        return;
+    }
+
+    Registration registration = it->second;
+    m_dispatching = key;
+    lock.unlock();
+
+    registration.callback(registration.context);
+
+    lock.lock();
+    m_dispatching = 0;
+    lock.unlock();
+    m_dispatchDone.notify_all();
+}
+
+#endif
+
 //
 // SubmitCallback
 //
@@ -39,8 +257,11 @@ SubmitCallback::SubmitCallback(
     _In_ XTaskQueueHandle queue)
     : m_queue(queue)
 {
-    memset(m_buffer1, 0, sizeof(m_buffer1));
-    memset(m_buffer2, 0, sizeof(m_buffer2));
+}
+
+SubmitCallback::~SubmitCallback()
+{
+    delete m_registrations.load();
 }
 
 HRESULT SubmitCallback::Register(_In_opt_ void* context, _In_ XTaskQueueMonitorCallback* callback, _Out_ XTaskQueueRegistrationToken* token)
@@ -50,91 +271,133 @@ HRESULT SubmitCallback::Register(_In_opt_ void* context, _In_ XTaskQueueMonitorC
     token->token = 0;
 
     std::lock_guard<std::mutex> lock(m_lock);
-    uint32_t bufferReadIdx = (m_indexAndRef & 0x80000000 ? 1 : 0);
-    uint32_t bufferWriteIdx = 1 - bufferReadIdx;
+    Registrations* current = m_registrations.load();
+    uint32_t count = (current != nullptr ? current->Count : 0);
+
+    std::unique_ptr<Registrations> registrations(new (std::nothrow) Registrations);
+    RETURN_IF_NULL_ALLOC(registrations);
 
-    for(uint32_t idx = 0; idx < ARRAYSIZE(m_buffer1); idx++)
+    registrations->Entries.reset(new (std::nothrow) CallbackRegistration[count + 1]);
+    RETURN_IF_NULL_ALLOC(registrations->Entries);
+
+    for (uint32_t idx = 0; idx < count; idx++)
     {
-        if (token->token == 0 && m_buffers[bufferReadIdx][idx].Callback == nullptr)
-        {
-            token->token = ++m_nextToken;
-            m_buffers[bufferWriteIdx][idx].Token = token->token;
-            m_buffers[bufferWriteIdx][idx].Context = context;
-            m_buffers[bufferWriteIdx][idx].Callback = callback;
-        }
-        else
-        {
-            m_buffers[bufferWriteIdx][idx] = m_buffers[bufferReadIdx][idx];
-        }
+        registrations->Entries[idx].CopyFrom(current->Entries[idx]);
     }
 
-    RETURN_HR_IF(E_OUTOFMEMORY, token->token == 0);
+    token->token = ++m_nextToken;
+    registrations->Entries[count].Token = token->token;
+    registrations->Entries[count].Context = context;
+    registrations->Entries[count].Callback.store(callback, std::memory_order_relaxed);
+    registrations->Count = count + 1;
 
-    // Now spin wait to swap the active buffer.
-    uint32_t expected = bufferReadIdx << 31;
-    uint32_t desired = bufferWriteIdx << 31;
+    Publish(registrations.release());
+    return S_OK;
+}
+
+void SubmitCallback::Unregister(_In_ XTaskQueueRegistrationToken token)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    Registrations* current = m_registrations.load();
+    if (current == nullptr)
+    {
+        return;
+    }
 
-    for (;;)
+    uint32_t found = current->Count;
+    for (uint32_t idx = 0; idx < current->Count; idx++)
     {
-        uint32_t expectedSwap = expected;
-        if (m_indexAndRef.compare_exchange_weak(expectedSwap, desired))
+        if (current->Entries[idx].Token == token.token)
         {
+            found = idx;
             break;
         }
     }
-    
-    return S_OK;
-}
 
-void SubmitCallback::Unregister(_In_ XTaskQueueRegistrationToken token)
-{
-    std::lock_guard<std::mutex> lock(m_lock);
-    uint32_t bufferReadIdx = (m_indexAndRef & 0x80000000 ? 1 : 0);
-    uint32_t bufferWriteIdx = 1 - bufferReadIdx;
+    if (found == current->Count)
+    {
+        return;
+    }
 
-    for(uint32_t idx = 0; idx < ARRAYSIZE(m_buffer1); idx++)
+    Registrations* registrations = nullptr;
+    if (current->Count > 1)
     {
-        if (m_buffers[bufferReadIdx][idx].Token == token.token)
+        // If we can't allocate a smaller set, keep the current one with
+        // the callback removed in place; Invoke skips empty entries.
+        registrations = new (std::nothrow) Registrations;
+        if (registrations != nullptr)
         {
-            m_buffers[bufferWriteIdx][idx].Callback = nullptr;
+            registrations->Entries.reset(new (std::nothrow) CallbackRegistration[current->Count - 1]);
         }
-        else
+
+        if (registrations == nullptr || registrations->Entries == nullptr)
+        {
+            delete registrations;
+            current->Entries[found].Callback.store(nullptr, std::memory_order_release);
+            WaitForInvokes();
+            return;
+        }
+
+        uint32_t count = 0;
+        for (uint32_t idx = 0; idx < current->Count; idx++)
         {
-            m_buffers[bufferWriteIdx][idx] = m_buffers[bufferReadIdx][idx];
+            if (idx != found)
+            {
+                registrations->Entries[count++].CopyFrom(current->Entries[idx]);
+            }
         }
+        registrations->Count = count;
     }
 
-    // Now spin wait to swap the active buffer.
-    uint32_t expected = bufferReadIdx << 31;
-    uint32_t desired = bufferWriteIdx << 31;
+    Publish(registrations);
+}
+
+void SubmitCallback::Publish(_In_opt_ Registrations* registrations)
+{
+    Registrations* previous = m_registrations.exchange(registrations);
+    WaitForInvokes();
+    delete previous;
+}
 
-    for (;;)
+void SubmitCallback::WaitForInvokes()
+{
+    // An Invoke can read the generation just before it is flipped and
+    // count itself against the old one after the wait below has
+    // passed, so flip and drain twice.
+    for (uint32_t pass = 0; pass < 2; pass++)
     {
-        uint32_t expectedSwap = expected;
-        if (m_indexAndRef.compare_exchange_weak(expectedSwap, desired))
+        uint32_t generation = m_generation.fetch_add(1) & 1;
+        while (m_invoking[generation].load() != 0)
         {
-            break;
+            std::this_thread::yield();
         }
     }
 }
 
 void SubmitCallback::Invoke(_In_ XTaskQueuePort port)
 {
-    uint32_t indexAndRef = ++m_indexAndRef;
-    uint32_t bufferIdx = (indexAndRef & 0x80000000 ? 1 : 0);
+    if (m_registrations.load(std::memory_order_relaxed) == nullptr)
+    {
+        return;
+    }
+
+    uint32_t generation = m_generation.load() & 1;
+    m_invoking[generation]++;
 
-    for(uint32_t idx = 0; idx < ARRAYSIZE(m_buffer1); idx++)
+    Registrations* registrations = m_registrations.load();
+    if (registrations != nullptr)
     {
-        if (m_buffers[bufferIdx][idx].Callback != nullptr)
+        for (uint32_t idx = 0; idx < registrations->Count; idx++)
         {
-            m_buffers[bufferIdx][idx].Callback(
-                m_buffers[bufferIdx][idx].Context,
-                m_queue,
-                port);
+            XTaskQueueMonitorCallback* callback = registrations->Entries[idx].Callback.load(std::memory_order_acquire);
+            if (callback != nullptr)
+            {
+                callback(registrations->Entries[idx].Context, m_queue, port);
+            }
         }
     }
 
-    m_indexAndRef--;
+    m_invoking[generation]--;
 }
 
 //
@@ -146,17 +409,23 @@ HRESULT QueueWaitRegistry::Register(
     _In_ const XTaskQueueRegistrationToken& portToken,
     _Out_ XTaskQueueRegistrationToken* token)
 {
-    RETURN_HR_IF(E_OUTOFMEMORY, m_callbacks.capacity() == 0);
-
     std::lock_guard<std::mutex> lock(m_lock);
 
     WaitRegistration reg = { };
     reg.Port = port;
     reg.Token = ++m_nextToken;
     reg.PortToken = portToken.token;
-    token->token = reg.Token;
-    m_callbacks.append(reg);
 
+    try
+    {
+        m_callbacks.emplace(reg.Token, reg);
+    }
+    catch (...)
+    {
+        RETURN_HR(E_OUTOFMEMORY);
+    }
+
+    token->token = reg.Token;
     return S_OK;
 }
 
@@ -169,15 +438,12 @@ std::pair<XTaskQueuePort, XTaskQueueRegistrationToken> QueueWaitRegistry::Unregi
 
     std::lock_guard<std::mutex> lock(m_lock);
 
-    for(uint32_t idx = 0; idx < m_callbacks.count(); idx++)
+    auto it = m_callbacks.find(token.token);
+    if (it != m_callbacks.end())
     {
-        if (m_callbacks[idx].Token == token.token)
-        {
-            port = m_callbacks[idx].Port;
-            portToken.token = m_callbacks[idx].PortToken;
-            m_callbacks.removeAt(idx);
-            break;
-        }
+        port = it->second.Port;
+        portToken.token = it->second.PortToken;
+        m_callbacks.erase(it);
     }
 
     return std::pair<XTaskQueuePort, XTaskQueueRegistrationToken>(port, portToken);
@@ -199,9 +465,25 @@ TaskQueuePortImpl::~TaskQueuePortImpl()
 {
     m_timer.Cancel();
 
-    EraseQueue(m_queueList.get());
+    for (auto& lane : m_queueLanes)
+    {
+        EraseQueue(lane.get());
+    }
     EraseQueue(m_pendingList.get());
 
+    PendingNode* pending = FlattenPending(m_pendingHeap.load());
+    while (pending != nullptr)
+    {
+        PendingNode* next = pending->sibling;
+        ASSERT(pending->entry->portContext != nullptr);
+        pending->entry->portContext->Release();
+        delete pending->entry;
+        delete ToQueueEntryNode(pending);
+        pending = next;
+    }
+
+    delete m_spareNode;
+
 #ifdef _WIN32
     StaticArray<WaitRegistration*, PORT_WAIT_MAX> waits;
 
@@ -231,6 +513,21 @@ TaskQueuePortImpl::~TaskQueuePortImpl()
         }
     }
 
+#elif TASK_QUEUE_EPOLL_WAITS
+    std::unordered_map<uint64_t, WaitRegistration*> waits;
+
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        waits.swap(m_waits);
+    }
+
+    for (auto& pair : waits)
+    {
+        CloseWaitRegistration(pair.second);
+        delete pair.second->queueEntry;
+        delete pair.second;
+    }
+
 #endif
 
     m_threadPool.Terminate();
@@ -245,16 +542,35 @@ TaskQueuePortImpl::~TaskQueuePortImpl()
 }
 
 HRESULT TaskQueuePortImpl::Initialize(
-    _In_ XTaskQueueDispatchMode mode)
+    _In_ XTaskQueueDispatchMode mode,
+    _In_opt_ const XTaskQueueThreadPoolOptions* options)
 {
     m_dispatchMode = mode;
 
-    m_queueList.reset(new (std::nothrow) LocklessList<QueueEntry>);
-    RETURN_IF_NULL_ALLOC(m_queueList);
+    if (options != nullptr)
+    {
+        if (options->maxBatchSize != 0)
+        {
+            m_batchSize = options->maxBatchSize;
+        }
+        if (options->batchTimeSliceMs != 0)
+        {
+            m_batchTimeSliceMs = options->batchTimeSliceMs;
+        }
+    }
+
+    for (auto& lane : m_queueLanes)
+    {
+        lane.reset(new (std::nothrow) LocklessList<QueueEntry>);
+        RETURN_IF_NULL_ALLOC(lane);
+    }
 
     m_pendingList.reset(new (std::nothrow) LocklessList<QueueEntry>);
     RETURN_IF_NULL_ALLOC(m_pendingList);
 
+    m_spareNode = new (std::nothrow) QueueEntryNode;
+    RETURN_IF_NULL_ALLOC(m_spareNode);
+
     m_terminationList.reset(new (std::nothrow) LocklessList<TerminationEntry>);
     RETURN_IF_NULL_ALLOC(m_terminationList);
 
@@ -282,7 +598,7 @@ HRESULT TaskQueuePortImpl::Initialize(
         {
             TaskQueuePortImpl* pthis = static_cast<TaskQueuePortImpl*>(context);
             pthis->ProcessThreadPoolCallback(complete);
-        }));
+        }, options));
         break;
           
     case XTaskQueueDispatchMode::Immediate:
@@ -295,10 +611,12 @@ HRESULT TaskQueuePortImpl::Initialize(
 
 HRESULT __stdcall TaskQueuePortImpl::QueueItem(
     _In_ ITaskQueuePortContext* portContext,
+    _In_ XTaskQueuePriority priority,
     _In_ uint32_t waitMs,
     _In_opt_ void* callbackContext,
     _In_ XTaskQueueCallback* callback)
 {
+    RETURN_HR_IF(E_INVALIDARG, static_cast<uint32_t>(priority) >= PORT_PRIORITY_LANES);
     RETURN_IF_FAILED(VerifyNotTerminated(portContext));
 
     std::unique_ptr<QueueEntry> entry(new (std::nothrow) QueueEntry);
@@ -310,6 +628,7 @@ HRESULT __stdcall TaskQueuePortImpl::QueueItem(
     entry->callbackContext = callbackContext;
     entry->waitRegistration = nullptr;
     entry->refs = 1;
+    entry->priority = priority;
 
     if (waitMs == 0)
     {
@@ -345,6 +664,58 @@ HRESULT __stdcall TaskQueuePortImpl::QueueItem(
     return S_OK;
 }
 
+HRESULT __stdcall TaskQueuePortImpl::QueueItems(
+    _In_ ITaskQueuePortContext* portContext,
+    _In_ uint32_t count,
+    _In_reads_opt_(count) void* const* callbackContexts,
+    _In_reads_(count) XTaskQueueCallback* const* callbacks)
+{
+    RETURN_IF_FAILED(VerifyNotTerminated(portContext));
+
+    if (count == 0)
+    {
+        return S_OK;
+    }
+
+    std::unique_ptr<QueueEntry*[]> entries(new (std::nothrow) QueueEntry*[count]);
+    RETURN_IF_NULL_ALLOC(entries);
+
+    for (uint32_t idx = 0; idx < count; idx++)
+    {
+        QueueEntry* entry = new (std::nothrow) QueueEntry;
+        if (entry == nullptr)
+        {
+            for (uint32_t prev = 0; prev < idx; prev++)
+            {
+                ReleaseEntry(entries[prev]);
+            }
+            RETURN_HR(E_OUTOFMEMORY);
+        }
+
+        entry->portContext = portContext;
+        entry->portContext->AddRef();
+        entry->callback = callbacks[idx];
+        entry->callbackContext = callbackContexts != nullptr ? callbackContexts[idx] : nullptr;
+        entry->waitRegistration = nullptr;
+        entry->enqueueTime = 0;
+        entry->refs = 1;
+        entry->priority = portContext->GetPriority();
+        entries[idx] = entry;
+    }
+
+    if (!LaneFor(entries[0])->push_back_range(entries.get(), count))
+    {
+        for (uint32_t idx = 0; idx < count; idx++)
+        {
+            ReleaseEntry(entries[idx]);
+        }
+        RETURN_HR(E_OUTOFMEMORY);
+    }
+
+    ItemsAppended(count, true);
+    return S_OK;
+}
+
 HRESULT __stdcall TaskQueuePortImpl::RegisterWaitHandle(
     _In_ ITaskQueuePortContext* portContext,
     _In_ HANDLE waitHandle,
@@ -370,6 +741,7 @@ HRESULT __stdcall TaskQueuePortImpl::RegisterWaitHandle(
     entry->callbackContext = callbackContext;
     entry->waitRegistration = waitReg.get();
     entry->refs = 1;
+    entry->priority = portContext->GetPriority();
 
     // Port context on waitReg is not add-ref'd because a registered
     // waiter does not keep the queue alive.
@@ -400,6 +772,59 @@ HRESULT __stdcall TaskQueuePortImpl::RegisterWaitHandle(
     // fetch it again.
     SignalQueue();
 
+    return S_OK;
+#elif TASK_QUEUE_EPOLL_WAITS
+    RETURN_HR_IF(E_INVALIDARG, WaitHandleToFileDescriptor(waitHandle) < 0);
+
+    std::unique_ptr<WaitRegistration> waitReg(new (std::nothrow) WaitRegistration);
+    RETURN_IF_NULL_ALLOC(waitReg);
+
+    std::unique_ptr<QueueEntry> entry(new (std::nothrow) QueueEntry);
+    RETURN_IF_NULL_ALLOC(entry);
+
+    // Entry gets its port context and an addref on it when it
+    // is added to the queue
+    entry->portContext = nullptr;
+    entry->callback = callback;
+    entry->callbackContext = callbackContext;
+    entry->waitRegistration = waitReg.get();
+    entry->refs = 1;
+    entry->priority = portContext->GetPriority();
+
+    // Port context on waitReg is not add-ref'd because a registered
+    // waiter does not keep the queue alive.
+    waitReg->waitHandle = waitHandle;
+    waitReg->reactorKey = 0;
+    waitReg->nextCanceled = nullptr;
+    waitReg->portContext = portContext;
+    waitReg->port = this;
+    waitReg->queueEntry = entry.get();
+    waitReg->appended.clear();
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    waitReg->token = ++m_nextWaitToken;
+
+    try
+    {
+        m_waits[waitReg->token] = waitReg.get();
+    }
+    catch (...)
+    {
+        RETURN_HR(E_OUTOFMEMORY);
+    }
+
+    HRESULT hr = InitializeWaitRegistration(waitReg.get());
+    if (FAILED(hr))
+    {
+        m_waits.erase(waitReg->token);
+        RETURN_HR(hr);
+    }
+
+    token->token = waitReg->token;
+
+    entry.release();
+    waitReg.release();
+
     return S_OK;
 #else
     return E_NOTIMPL;
@@ -456,6 +881,30 @@ void __stdcall TaskQueuePortImpl::UnregisterWaitHandle(
     // fetch it again.
     SignalQueue();
 
+#elif TASK_QUEUE_EPOLL_WAITS
+    WaitRegistration* toDelete = nullptr;
+
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        auto it = m_waits.find(token.token);
+        if (it != m_waits.end())
+        {
+            toDelete = it->second;
+            m_waits.erase(it);
+
+            // Any running entry will look for this and re-register,
+            // so clear it under the lock.
+            toDelete->queueEntry->waitRegistration = nullptr;
+        }
+    }
+
+    if (toDelete != nullptr)
+    {
+        CloseWaitRegistration(toDelete);
+        ReleaseEntry(toDelete->queueEntry);
+        delete toDelete;
+    }
+
 #else
     UNREFERENCED_PARAMETER(token);
 #endif
@@ -529,6 +978,9 @@ void __stdcall TaskQueuePortImpl::Terminate(
     switch (m_dispatchMode)
     {
     case XTaskQueueDispatchMode::SerializedThreadPool:
+        ScheduleBatch();
+        break;
+
     case XTaskQueueDispatchMode::ThreadPool:
         m_threadPool.Submit();
         break;
@@ -561,7 +1013,7 @@ void __stdcall TaskQueuePortImpl::Detach(
 bool __stdcall TaskQueuePortImpl::DrainOneItem()
 {
     m_processingCallback++;
-    QueueEntry* entry = m_queueList->pop_front();
+    QueueEntry* entry = PopEntry();
     if (entry == nullptr)
     {
         m_processingCallback--;
@@ -576,7 +1028,7 @@ bool __stdcall TaskQueuePortImpl::DrainOneItem()
         entry->callback(entry->callbackContext, IsCallCanceled(entry));
         m_processingCallback--;
 
-#ifdef _WIN32
+#if defined(_WIN32) || TASK_QUEUE_EPOLL_WAITS
         // If this entry has a wait registration, it needs
         // to be reinitialized as we mark it to only execute
         // once.
@@ -592,7 +1044,7 @@ bool __stdcall TaskQueuePortImpl::DrainOneItem()
         ReleaseEntry(entry);
     }
 
-    if (m_queueList->empty())
+    if (LanesEmpty())
     {
         SignalQueue();
         SignalTerminations();
@@ -639,7 +1091,7 @@ bool __stdcall TaskQueuePortImpl::Wait(
             // We are using event 0 like a condition variable.  It's
             // auto reset, so if nothing is in the queue we continue
             // waiting.
-            if (portContext->GetStatus() == TaskQueuePortStatus::Terminated || !m_queueList->empty())
+            if (portContext->GetStatus() == TaskQueuePortStatus::Terminated || !LanesEmpty())
             {
                 break;
             }
@@ -651,24 +1103,44 @@ bool __stdcall TaskQueuePortImpl::Wait(
     }
 
 #else
-    while (m_queueList->empty() && portContext->GetStatus() != TaskQueuePortStatus::Terminated)
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    while (true)
     {
-        std::unique_lock<std::mutex> lock(m_lock);
-        if (m_event.wait_for(lock, std::chrono::milliseconds(timeout)) == std::cv_status::timeout)
+        uint32_t key = m_event.PrepareWait();
+        if (!LanesEmpty() || portContext->GetStatus() == TaskQueuePortStatus::Terminated)
         {
+            m_event.CancelWait();
             break;
         }
+
+        // Spurious wake ups don't restart the full timeout
+        uint32_t remaining = timeout;
+        if (timeout != EventCount::Infinite)
+        {
+            auto now = std::chrono::steady_clock::now();
+            if (now >= deadline)
+            {
+                m_event.CancelWait();
+                break;
+            }
+            // Round up so the wait never ends before the caller's timeout
+            auto left = deadline - now + std::chrono::milliseconds(1) - std::chrono::nanoseconds(1);
+            remaining = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(left).count());
+        }
+
+        m_event.Wait(key, remaining);
     }
 #endif
 
-    return !m_queueList->empty() || !m_terminationList->empty();
+    return !LanesEmpty() || !m_terminationList->empty();
 }
 
 bool __stdcall TaskQueuePortImpl::IsEmpty()
 {
     bool empty =
-        (m_queueList->empty()) &&
+        (LanesEmpty()) &&
         (m_pendingList->empty()) &&
+        (m_pendingHeap.load() == nullptr) &&
         (m_processingCallback == 0);
 
     return empty;
@@ -689,6 +1161,65 @@ bool TaskQueuePortImpl::IsCallCanceled(_In_ QueueEntry* entry)
     return entry->portContext->GetStatus() != TaskQueuePortStatus::Active;
 }
 
+LocklessList<TaskQueuePortImpl::QueueEntry>* TaskQueuePortImpl::LaneFor(
+    _In_ QueueEntry* entry)
+{
+    return m_queueLanes[static_cast<uint32_t>(entry->priority)].get();
+}
+
+bool TaskQueuePortImpl::LanesEmpty()
+{
+    for (auto& lane : m_queueLanes)
+    {
+        if (!lane->empty())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Lanes are served strictly in priority order, except that a lower lane
+// that has been passed over PORT_PRIORITY_AGING_LIMIT times while it had
+// work is served next, so a steady stream of high priority callbacks
+// can't starve the rest of the port. The skip counts are advisory; a
+// race between dispatching threads only shifts when a lane ages.
+TaskQueuePortImpl::QueueEntry* TaskQueuePortImpl::PopEntry()
+{
+    QueueEntry* entry = nullptr;
+    uint32_t served = 0;
+
+    for (uint32_t lane = PORT_PRIORITY_LANES - 1; lane > 0 && entry == nullptr; lane--)
+    {
+        if (m_laneSkips[lane].load(std::memory_order_relaxed) >= PORT_PRIORITY_AGING_LIMIT)
+        {
+            m_laneSkips[lane].store(0, std::memory_order_relaxed);
+            entry = m_queueLanes[lane]->pop_front();
+            served = lane;
+        }
+    }
+
+    for (uint32_t lane = 0; lane < PORT_PRIORITY_LANES && entry == nullptr; lane++)
+    {
+        entry = m_queueLanes[lane]->pop_front();
+        served = lane;
+    }
+
+    if (entry != nullptr)
+    {
+        m_laneSkips[served].store(0, std::memory_order_relaxed);
+        for (uint32_t lane = served + 1; lane < PORT_PRIORITY_LANES; lane++)
+        {
+            if (!m_queueLanes[lane]->empty())
+            {
+                m_laneSkips[lane].fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    return entry;
+}
+
 // Appends the given entry to the active queue.  The entry should already
 // be add-refd. This will return false on failure.
 bool TaskQueuePortImpl::AppendEntry(
@@ -696,11 +1227,21 @@ bool TaskQueuePortImpl::AppendEntry(
     _In_opt_ QueueEntryNode* node,
     _In_ bool signal)
 {
-    if (!m_queueList->push_back(entry, node))
+    if (!LaneFor(entry)->push_back(entry, node))
     {
         return false;
     }
 
+    ItemsAppended(1, signal);
+    return true;
+}
+
+// Signals and dispatches after count entries have been
+// added to the queue list.
+void TaskQueuePortImpl::ItemsAppended(
+    _In_ uint32_t count,
+    _In_ bool signal)
+{
     if (signal)
     {
         SignalQueue();
@@ -713,8 +1254,11 @@ bool TaskQueuePortImpl::AppendEntry(
         break;
 
     case XTaskQueueDispatchMode::SerializedThreadPool:
+        ScheduleBatch();
+        break;
+
     case XTaskQueueDispatchMode::ThreadPool:
-        m_threadPool.Submit();
+        m_threadPool.Submit(count);
         break;
 
     case XTaskQueueDispatchMode::Immediate:
@@ -730,10 +1274,11 @@ bool TaskQueuePortImpl::AppendEntry(
     
     if (m_dispatchMode == XTaskQueueDispatchMode::Immediate)
     {
-        DrainOneItem();
+        for (uint32_t idx = 0; idx < count; idx++)
+        {
+            DrainOneItem();
+        }
     }
-
-    return true;
 }
 
 // Releases the entry and the ref on the port context.
@@ -760,37 +1305,58 @@ void TaskQueuePortImpl::CancelPendingEntries(
     
     m_timer.Cancel();
     m_timerDue = UINT64_MAX;
-    
-    QueueEntryNode* queueEntryNode;
-    QueueEntry* queueEntry = m_pendingList->pop_front(&queueEntryNode);
-    QueueEntry* initialPushedEntry = nullptr;
-    while(queueEntry != nullptr)
+
+    PendingNode* canceled = nullptr;
     {
-        if (queueEntry == initialPushedEntry)
+        std::lock_guard<std::mutex> lock(m_pendingLock);
+        MovePendingListToHeap();
+
+        PendingNode* pending = FlattenPending(m_pendingHeap.load());
+        PendingNode* heap = nullptr;
+        while (pending != nullptr)
         {
-            m_pendingList->push_back(queueEntry, queueEntryNode);
-            break;
+            PendingNode* next = pending->sibling;
+            pending->sibling = nullptr;
+
+            if (pending->entry->portContext == portContext)
+            {
+                pending->sibling = canceled;
+                canceled = pending;
+            }
+            else
+            {
+                heap = MeldPending(heap, pending);
+            }
+            pending = next;
         }
-        
-        if (queueEntry->portContext == portContext)
+        m_pendingHeap = heap;
+    }
+
+    uint32_t appended = 0;
+    while (canceled != nullptr)
+    {
+        PendingNode* next = canceled->sibling;
+        QueueEntry* queueEntry = canceled->entry;
+        QueueEntryNode* queueEntryNode = ToQueueEntryNode(canceled);
+
+        if (appendToQueue)
         {
-            if (!appendToQueue || !AppendEntry(queueEntry, queueEntryNode))
-            {
-                ReleaseEntry(queueEntry);
-                delete queueEntryNode;
-            }
+            LaneFor(queueEntry)->push_back(queueEntry, queueEntryNode);
+            appended++;
         }
         else
         {
-            if (initialPushedEntry == nullptr)
-            {
-                 initialPushedEntry = queueEntry;
-            }
-            m_pendingList->push_back(queueEntry, queueEntryNode);
+            ReleaseEntry(queueEntry);
+            delete queueEntryNode;
         }
-        queueEntry = m_pendingList->pop_front(&queueEntryNode);
+        canceled = next;
     }
-    
+
+    if (appended != 0)
+    {
+        ItemsAppended(appended, true);
+    }
+
     SubmitPendingCallback();
     
 #ifdef _WIN32
@@ -822,6 +1388,62 @@ void TaskQueuePortImpl::CancelPendingEntries(
     }
     lock.unlock();
     
+#elif TASK_QUEUE_EPOLL_WAITS
+
+    // Abort any registered waits and promote their entries too.
+    // Closing a registration waits out a readiness callback that
+    // may need our lock, so collect them first.
+    WaitRegistration* canceledWaits = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        for (auto it = m_waits.begin(); it != m_waits.end();)
+        {
+            WaitRegistration* waitReg = it->second;
+            if (waitReg->portContext == portContext)
+            {
+                waitReg->queueEntry->waitRegistration = nullptr;
+                waitReg->nextCanceled = canceledWaits;
+                canceledWaits = waitReg;
+                it = m_waits.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    while (canceledWaits != nullptr)
+    {
+        WaitRegistration* waitReg = canceledWaits;
+        canceledWaits = waitReg->nextCanceled;
+
+        CloseWaitRegistration(waitReg);
+
+        // If the entry is already queued or running it keeps the queue's
+        // reference; either way the registration's reference goes.
+        QueueEntry* entry = waitReg->queueEntry;
+        bool appended = false;
+        if (appendToQueue && !waitReg->appended.test_and_set())
+        {
+            entry->portContext = waitReg->portContext;
+            entry->portContext->AddRef();
+            appended = AppendEntry(entry);
+            if (!appended)
+            {
+                entry->portContext->Release();
+                entry->portContext = nullptr;
+            }
+        }
+
+        if (!appended)
+        {
+            ReleaseEntry(entry);
+        }
+
+        delete waitReg;
+    }
+
 #endif
 }
 
@@ -841,93 +1463,228 @@ void TaskQueuePortImpl::EraseQueue(
     }
 }
 
-// Examines the pending callback list, optionally popping the entry off the
-// list that matches m_timerDue, and schedules the timer for the next entry.
-void TaskQueuePortImpl::ScheduleNextPendingCallback(
-    _In_ uint64_t dueTime,
-    _Out_ QueueEntry** dueEntry,
-    _Out_ QueueEntryNode** dueEntryNode)
+TaskQueuePortImpl::PendingNode* TaskQueuePortImpl::ToPendingNode(
+    _In_ QueueEntry* entry,
+    _In_ QueueEntryNode* node)
+{
+    node->~QueueEntryNode();
+    return ::new (static_cast<void*>(node)) PendingNode{ entry->enqueueTime, entry, nullptr, nullptr };
+}
+
+TaskQueuePortImpl::QueueEntryNode* TaskQueuePortImpl::ToQueueEntryNode(
+    _In_ PendingNode* node)
 {
-    QueueEntry* nextItem = nullptr;
-    *dueEntry = nullptr;
-    *dueEntryNode = nullptr;
+    node->~PendingNode();
+    return ::new (static_cast<void*>(node)) QueueEntryNode();
+}
 
-    // We pop items off the pending list till it is empty, looking for 
-    // our due time.  We can do this without a lock because we only call
-    // this once the timer has come due, so there will be nothing else competing
-    // and messing with this list.  We must not rely on a lock here because 
-    // we need to allow QueueItem to remain lock free.
+// Melds two heaps and returns the root. Both roots must have no siblings.
+TaskQueuePortImpl::PendingNode* TaskQueuePortImpl::MeldPending(
+    _In_opt_ PendingNode* first,
+    _In_opt_ PendingNode* second)
+{
+    if (first == nullptr)
+    {
+        return second;
+    }
 
-    LocklessList<QueueEntry> pendingList;
-    QueueEntryNode* node;
-    QueueEntry* entry = m_pendingList->pop_front(&node);
-    while (entry != nullptr)
+    if (second == nullptr)
     {
-        if ((*dueEntry) == nullptr && entry->enqueueTime == dueTime)
+        return first;
+    }
+
+    if (second->dueTime < first->dueTime)
+    {
+        std::swap(first, second);
+    }
+
+    second->sibling = first->child;
+    first->child = second;
+    return first;
+}
+
+// Standard two pass pairing heap merge of a list of sibling heaps: meld
+// them in pairs left to right, then fold the pairs together right to left.
+TaskQueuePortImpl::PendingNode* TaskQueuePortImpl::MergePendingPairs(
+    _In_opt_ PendingNode* first)
+{
+    PendingNode* pairs = nullptr;
+    while (first != nullptr)
+    {
+        PendingNode* a = first;
+        PendingNode* b = a->sibling;
+        first = b != nullptr ? b->sibling : nullptr;
+
+        a->sibling = nullptr;
+        if (b != nullptr)
         {
-            *dueEntry = entry;
-            *dueEntryNode = node;
+            b->sibling = nullptr;
         }
-        else if (nextItem == nullptr || nextItem->enqueueTime > entry->enqueueTime)
+
+        PendingNode* pair = MeldPending(a, b);
+        pair->sibling = pairs;
+        pairs = pair;
+    }
+
+    PendingNode* root = nullptr;
+    while (pairs != nullptr)
+    {
+        PendingNode* next = pairs->sibling;
+        pairs->sibling = nullptr;
+        root = MeldPending(root, pairs);
+        pairs = next;
+    }
+
+    return root;
+}
+
+// Unlinks every node in the heap and returns them as a list chained
+// through sibling.
+TaskQueuePortImpl::PendingNode* TaskQueuePortImpl::FlattenPending(
+    _In_opt_ PendingNode* root)
+{
+    PendingNode* result = nullptr;
+    PendingNode* work = root;
+    while (work != nullptr)
+    {
+        PendingNode* node = work;
+        work = node->sibling;
+
+        PendingNode* child = node->child;
+        while (child != nullptr)
         {
-            nextItem = entry;
-            pendingList.push_back(entry, node);
+            PendingNode* next = child->sibling;
+            child->sibling = work;
+            work = child;
+            child = next;
         }
-        else
+
+        node->child = nullptr;
+        node->sibling = result;
+        result = node;
+    }
+
+    return result;
+}
+
+// Removes and returns the entry with the earliest due time.  Requires
+// m_pendingLock.
+TaskQueuePortImpl::PendingNode* TaskQueuePortImpl::PopPending()
+{
+    PendingNode* root = m_pendingHeap;
+    if (root != nullptr)
+    {
+        m_pendingHeap = MergePendingPairs(root->child);
+        root->child = nullptr;
+    }
+    return root;
+}
+
+// Moves delayed entries queued since the last call from the lock free
+// pending list into the heap.  Requires m_pendingLock.
+void TaskQueuePortImpl::MovePendingListToHeap()
+{
+    PendingNode* heap = m_pendingHeap;
+    QueueEntryNode* node;
+    QueueEntry* entry = m_pendingList->pop_front(&node);
+    while (entry != nullptr)
+    {
+        if (node == nullptr)
         {
-            pendingList.push_back(entry, node);
+            // The very first pop from a list hands back the list's built-in
+            // node rather than one we can reuse.
+            ASSERT(m_spareNode != nullptr);
+            node = m_spareNode;
+            m_spareNode = nullptr;
         }
 
+        heap = MeldPending(heap, ToPendingNode(entry, node));
         entry = m_pendingList->pop_front(&node);
     }
+    m_pendingHeap = heap;
+}
 
-    entry = pendingList.pop_front(&node);
-    while (entry != nullptr)
+// Starts the timer for the next due entry unless a QueueItem call has
+// already started it for an earlier one.
+void TaskQueuePortImpl::ScheduleNextPendingCallback(
+    _In_ uint64_t nextDueTime)
+{
+    uint64_t due = UINT64_MAX;
+    while (nextDueTime < due)
     {
-        m_pendingList->push_back(entry, node);
-        entry = pendingList.pop_front(&node);
+        if (m_timerDue.compare_exchange_weak(due, nextDueTime))
+        {
+            m_timer.Start(nextDueTime);
+            break;
+        }
     }
+}
+
+void TaskQueuePortImpl::SubmitPendingCallback()
+{
+    // Clear the due time before looking at the pending list.  A QueueItem
+    // call racing with us either pushes its entry before we drain the list
+    // or sees no due time and starts the timer itself.
+    m_timerDue = UINT64_MAX;
+
+    PendingNode* dueFirst = nullptr;
+    PendingNode* dueLast = nullptr;
+    uint64_t nextDueTime = UINT64_MAX;
 
-    if (nextItem != nullptr)
     {
-        while (true)
+        std::lock_guard<std::mutex> lock(m_pendingLock);
+        MovePendingListToHeap();
+
+        // Release everything that has come due in one pass, in due order.
+        uint64_t now = m_timer.GetAbsoluteTime(0);
+        while (m_pendingHeap.load() != nullptr && m_pendingHeap.load()->dueTime <= now)
         {
-            if (m_timerDue.compare_exchange_weak(dueTime, nextItem->enqueueTime))
+            PendingNode* node = PopPending();
+            if (dueLast == nullptr)
             {
-                m_timer.Start(nextItem->enqueueTime);
-                break;
+                dueFirst = node;
             }
-
-            dueTime = m_timerDue.load();
-
-            if (dueTime <= nextItem->enqueueTime)
+            else
             {
-                break;
+                dueLast->sibling = node;
             }
+            dueLast = node;
         }
-    }
-    else
-    {
-        uint64_t noDueTime = UINT64_MAX;
-        if (m_timerDue.compare_exchange_strong(dueTime, noDueTime))
+
+        if (m_pendingHeap.load() != nullptr)
         {
-            m_timer.Cancel();
+            nextDueTime = m_pendingHeap.load()->dueTime;
         }
     }
+
+    ScheduleNextPendingCallback(nextDueTime);
+
+    uint32_t count = 0;
+    while (dueFirst != nullptr)
+    {
+        PendingNode* next = dueFirst->sibling;
+        QueueEntry* entry = dueFirst->entry;
+
+        // Can't fail; the node is supplied.
+        LaneFor(entry)->push_back(entry, ToQueueEntryNode(dueFirst));
+        count++;
+        dueFirst = next;
+    }
+
+    if (count != 0)
+    {
+        ItemsAppended(count, true);
+    }
 }
 
-void TaskQueuePortImpl::SubmitPendingCallback()
+// Submits a thread pool callback to run a batch unless one is already
+// submitted or running. Appends that happen while a batch is outstanding
+// don't wake another thread; the batch picks them up or reschedules.
+void TaskQueuePortImpl::ScheduleBatch()
 {
-    QueueEntry* dueEntry;
-    QueueEntryNode* dueEntryNode;
-    ScheduleNextPendingCallback(m_timerDue.load(), &dueEntry, &dueEntryNode);
-
-    if (dueEntry != nullptr)
+    if (!m_batchScheduled.exchange(true))
     {
-        if (!AppendEntry(dueEntry, dueEntryNode))
-        {
-            ReleaseEntry(dueEntry);
-        }
+        m_threadPool.Submit();
     }
 }
 
@@ -935,12 +1692,30 @@ void TaskQueuePortImpl::SubmitPendingCallback()
 void TaskQueuePortImpl::ProcessThreadPoolCallback(_In_ ThreadPoolActionComplete& complete)
 {
     referenced_ptr<ITaskQueuePort> ref(this);
-    uint32_t wasProcessing = m_processingCallback++;
+    m_processingCallback++;
     if (m_dispatchMode == XTaskQueueDispatchMode::SerializedThreadPool)
     {
-        if (wasProcessing == 0)
+        // Run callbacks until the queue is empty or the batch is used
+        // up, then give the thread back to the pool. Only one batch is
+        // outstanding at a time so callbacks still run one at a time.
+        uint64_t sliceEnd = m_timer.GetAbsoluteTime(m_batchTimeSliceMs);
+        uint32_t drained = 0;
+        while (drained < m_batchSize && DrainOneItem())
+        {
+            drained++;
+            if (m_timer.GetAbsoluteTime(0) >= sliceEnd)
+            {
+                break;
+            }
+        }
+
+        // Clearing the flag before looking at the queue pairs with
+        // ScheduleBatch after an append or terminate, so neither can
+        // be left behind with no batch scheduled.
+        m_batchScheduled = false;
+        if (!LanesEmpty() || !m_terminationList->empty())
         {
-            while (DrainOneItem());
+            ScheduleBatch();
         }
     }
     else
@@ -958,8 +1733,9 @@ void TaskQueuePortImpl::SignalQueue()
 {
 #ifdef _WIN32
     SetEvent(m_events[0]);
+#else
+    m_event.Notify();
 #endif
-    m_event.notify_all();
 }
 
 void TaskQueuePortImpl::SignalTerminations()
@@ -994,6 +1770,7 @@ void TaskQueuePortImpl::SignalTerminations()
     }
 }
 
+#if defined(_WIN32) || TASK_QUEUE_EPOLL_WAITS
 #ifdef _WIN32
 void CALLBACK TaskQueuePortImpl::WaitCallback(
     _In_ PTP_CALLBACK_INSTANCE instance,
@@ -1032,6 +1809,55 @@ HRESULT TaskQueuePortImpl::InitializeWaitRegistration(
 
     return S_OK;
 }
+#else
+// Called on the epoll reactor thread when a descriptor is ready
+void TaskQueuePortImpl::WaitCallback(
+    _In_ void* context)
+{
+    WaitRegistration* waitReg = static_cast<WaitRegistration*>(context);
+    waitReg->port->ProcessWaitCallback(waitReg);
+}
+
+HRESULT TaskQueuePortImpl::InitializeWaitRegistration(
+    _In_ WaitRegistration* waitReg)
+{
+    if (waitReg->queueEntry->portContext != nullptr)
+    {
+        waitReg->queueEntry->portContext->Release();
+        waitReg->queueEntry->portContext = nullptr;
+    }
+
+    waitReg->appended.clear();
+
+    EpollWaitReactor* reactor;
+    RETURN_IF_FAILED(EpollWaitReactor::Get(&reactor));
+
+    if (waitReg->reactorKey == 0)
+    {
+        return reactor->Register(
+            WaitHandleToFileDescriptor(waitReg->waitHandle),
+            WaitCallback,
+            waitReg,
+            &waitReg->reactorKey);
+    }
+
+    return reactor->Arm(waitReg->reactorKey);
+}
+
+void TaskQueuePortImpl::CloseWaitRegistration(
+    _In_ WaitRegistration* waitReg)
+{
+    if (waitReg->reactorKey != 0)
+    {
+        EpollWaitReactor* reactor;
+        if (SUCCEEDED(EpollWaitReactor::Get(&reactor)))
+        {
+            reactor->Unregister(waitReg->reactorKey);
+        }
+        waitReg->reactorKey = 0;
+    }
+}
+#endif
 
 // Appends the queue entry of the wait registration to the queue
 // if it has not already been done. This can addref the queue
@@ -1145,6 +1971,11 @@ ITaskQueuePort* __stdcall TaskQueuePortContextImpl::GetPort()
     return Port.get();
 }
 
+XTaskQueuePriority __stdcall TaskQueuePortContextImpl::GetPriority()
+{
+    return Priority;
+}
+
 bool __stdcall TaskQueuePortContextImpl::TrySetStatus(
     _In_ TaskQueuePortStatus expectedStatus,
     _In_ TaskQueuePortStatus status)
@@ -1189,18 +2020,19 @@ HRESULT TaskQueueImpl::Initialize(
     _In_ XTaskQueueDispatchMode workMode,
     _In_ XTaskQueueDispatchMode completionMode,
     _In_ bool allowTermination,
-    _In_ bool allowClose)
+    _In_ bool allowClose,
+    _In_opt_ const XTaskQueueThreadPoolOptions* options)
 {
     m_termination.allowed = allowTermination;
     m_allowClose = allowClose;
 
     referenced_ptr<TaskQueuePortImpl> work(new (std::nothrow) TaskQueuePortImpl);
     RETURN_IF_NULL_ALLOC(work);
-    RETURN_IF_FAILED(work->Initialize(workMode));
+    RETURN_IF_FAILED(work->Initialize(workMode, options));
 
     referenced_ptr<TaskQueuePortImpl> completion(new (std::nothrow) TaskQueuePortImpl);
     RETURN_IF_NULL_ALLOC(completion);
-    RETURN_IF_FAILED(completion->Initialize(completionMode));
+    RETURN_IF_FAILED(completion->Initialize(completionMode, options));
     
     work->GetHandle()->m_queue = this;
     completion->GetHandle()->m_queue = this;
@@ -1224,15 +2056,19 @@ HRESULT TaskQueueImpl::Initialize(
 
 HRESULT TaskQueueImpl::Initialize(
     _In_ XTaskQueuePortHandle workPort,
-    _In_ XTaskQueuePortHandle completionPort)
+    _In_ XTaskQueuePortHandle completionPort,
+    _In_ XTaskQueuePriority priority)
 {
     RETURN_HR_IF(E_INVALIDARG, workPort== nullptr || workPort->m_signature != TASK_QUEUE_PORT_SIGNATURE);
     RETURN_HR_IF(E_INVALIDARG, completionPort == nullptr || completionPort->m_signature != TASK_QUEUE_PORT_SIGNATURE);
+    RETURN_HR_IF(E_INVALIDARG, static_cast<uint32_t>(priority) >= PORT_PRIORITY_LANES);
     
     m_work.Port = referenced_ptr<ITaskQueuePort>(workPort->m_port);
     m_completion.Port = referenced_ptr<ITaskQueuePort>(completionPort->m_port);
     m_work.Source = referenced_ptr<ITaskQueue>(workPort->m_queue);
     m_completion.Source = referenced_ptr<ITaskQueue>(completionPort->m_queue);
+    m_work.Priority = priority;
+    m_completion.Priority = priority;
 
     m_termination.allowed = true;
     m_allowClose = true;
@@ -1447,6 +2283,29 @@ STDAPI XTaskQueueCreate(
     return S_OK;
 }
 
+//
+// Creates a Task Queue whose thread pool ports use
+// the given sizing, affinity and pool sharing options.
+//
+STDAPI XTaskQueueCreateWithOptions(
+    _In_ XTaskQueueDispatchMode workDispatchMode,
+    _In_ XTaskQueueDispatchMode completionDispatchMode,
+    _In_opt_ const XTaskQueueThreadPoolOptions* options,
+    _Out_ XTaskQueueHandle* queue
+    ) noexcept
+{
+    referenced_ptr<TaskQueueImpl> aq(new (std::nothrow) TaskQueueImpl);
+    RETURN_IF_NULL_ALLOC(aq);
+    RETURN_IF_FAILED(aq->Initialize(
+        workDispatchMode, 
+        completionDispatchMode, 
+        true, /* can terminate */ 
+        true, /* can close */
+        options));
+    *queue = aq.release()->GetHandle();
+    return S_OK;
+}
+
 /// <summary>
 /// Returns the task queue port handle for the given
 /// port. Task queue port handles are owned by the
@@ -1495,6 +2354,24 @@ STDAPI XTaskQueueCreateComposite(
     return S_OK;
 }
 
+//
+// Creates a composite task queue whose callbacks are queued
+// at the given priority on the underlying ports.
+//
+STDAPI XTaskQueueCreateCompositeWithPriority(
+     _In_ XTaskQueuePortHandle workPort,
+     _In_ XTaskQueuePortHandle completionPort,
+     _In_ XTaskQueuePriority priority,
+     _Out_ XTaskQueueHandle* queue
+     ) noexcept
+{
+    referenced_ptr<TaskQueueImpl> aq(new (std::nothrow) TaskQueueImpl);
+    RETURN_IF_NULL_ALLOC(aq);
+    RETURN_IF_FAILED(aq->Initialize(workPort, completionPort, priority));
+    *queue = aq.release()->GetHandle();
+    return S_OK;
+}
+
 //
 // Processes items in the task queue of the given type. If an item
 // is processed this will return TRUE. If there are no items to process
@@ -1554,6 +2431,25 @@ STDAPI_(bool) XTaskQueueIsEmpty(
     return portContext->GetPort()->IsEmpty();
 }
 
+//
+// Returns statistics for the pool task queue entries and
+// list nodes are allocated from.  Like XTaskQueueIsEmpty this
+// is only used for testing and diagnostics.
+//
+STDAPI_(void) XTaskQueueGetAllocatorStats(
+    _Out_ XTaskQueueAllocatorStats* stats
+    ) noexcept
+{
+    BlockPoolStats poolStats;
+    LocklessBlockPool::GetStats(&poolStats);
+
+    stats->blockSize = poolStats.blockSize;
+    stats->blocksOutstanding = poolStats.blocksOutstanding;
+    stats->blocksHighWater = poolStats.blocksHighWater;
+    stats->blocksInDepot = poolStats.blocksInDepot;
+    stats->heapAllocations = poolStats.heapAllocations;
+}
+
 //
 // Closes the task queue.  A queue can only be closed if it
 // is not in use by a task or is empty.  If not true, the queue
@@ -1599,6 +2495,27 @@ STDAPI XTaskQueueSubmitCallback(
     return XTaskQueueSubmitDelayedCallback(queue, port, 0, callbackContext, callback);
 }
 
+//
+// Submits either a work or completion callback immediately
+// at the given priority.
+//
+STDAPI XTaskQueueSubmitCallbackWithPriority(
+    _In_ XTaskQueueHandle queue,
+    _In_ XTaskQueuePort port,
+    _In_ XTaskQueuePriority priority,
+    _In_opt_ void* callbackContext,
+    _In_ XTaskQueueCallback* callback
+    ) noexcept
+{
+    referenced_ptr<ITaskQueue> aq(GetQueue(queue));
+    RETURN_HR_IF(E_INVALIDARG, aq == nullptr);
+
+    referenced_ptr<ITaskQueuePortContext> portContext;
+    RETURN_IF_FAILED(aq->GetPortContext(port, portContext.address_of()));
+
+    RETURN_HR(portContext->GetPort()->QueueItem(portContext.get(), priority, 0, callbackContext, callback));
+}
+
 //
 // Submits either a work or completion callback.
 //
@@ -1616,7 +2533,36 @@ STDAPI XTaskQueueSubmitDelayedCallback(
     referenced_ptr<ITaskQueuePortContext> portContext;
     RETURN_IF_FAILED(aq->GetPortContext(port, portContext.address_of()));
 
-    RETURN_HR(portContext->GetPort()->QueueItem(portContext.get(), delayMs, callbackContext, callback));
+    RETURN_HR(portContext->GetPort()->QueueItem(portContext.get(), portContext->GetPriority(), delayMs, callbackContext, callback));
+}
+
+//
+// Submits a batch of callbacks to the queue for the given port.
+// The callbacks are appended together and the queue is signaled
+// and monitors notified once for the batch.
+//
+STDAPI XTaskQueueSubmitCallbacks(
+    _In_ XTaskQueueHandle queue,
+    _In_ XTaskQueuePort port,
+    _In_ uint32_t count,
+    _In_reads_opt_(count) void* const* callbackContexts,
+    _In_reads_(count) XTaskQueueCallback* const* callbacks
+    ) noexcept
+{
+    RETURN_HR_IF(E_INVALIDARG, count != 0 && callbacks == nullptr);
+
+    for (uint32_t idx = 0; idx < count; idx++)
+    {
+        RETURN_HR_IF(E_INVALIDARG, callbacks[idx] == nullptr);
+    }
+
+    referenced_ptr<ITaskQueue> aq(GetQueue(queue));
+    RETURN_HR_IF(E_INVALIDARG, aq == nullptr);
+
+    referenced_ptr<ITaskQueuePortContext> portContext;
+    RETURN_IF_FAILED(aq->GetPortContext(port, portContext.address_of()));
+
+    RETURN_HR(portContext->GetPort()->QueueItems(portContext.get(), count, callbackContexts, callbacks));
 }
 
 //
@@ -1634,11 +2580,55 @@ STDAPI XTaskQueueRegisterWaiter(
     _Out_ XTaskQueueRegistrationToken* token
     ) noexcept
 {
+#if TASK_QUEUE_EPOLL_WAITS
+    // Wait handles aren't defined on Linux; see
+    // XTaskQueueRegisterFileDescriptorWaiter.
+    UNREFERENCED_PARAMETER(queue);
+    UNREFERENCED_PARAMETER(port);
+    UNREFERENCED_PARAMETER(waitHandle);
+    UNREFERENCED_PARAMETER(callbackContext);
+    UNREFERENCED_PARAMETER(callback);
+    UNREFERENCED_PARAMETER(token);
+    return E_NOTIMPL;
+#else
     referenced_ptr<ITaskQueue> aq(GetQueue(queue));
     RETURN_HR_IF(E_INVALIDARG, aq == nullptr);
     RETURN_IF_FAILED(aq->RegisterWaitHandle(port, waitHandle, callbackContext, callback, token));
     return S_OK;
+#endif
+}
+
+#ifndef _WIN32
+//
+// Registers a file descriptor with the task queue.  Each time the
+// descriptor becomes readable the task queue invokes the given callback.
+//
+STDAPI XTaskQueueRegisterFileDescriptorWaiter(
+    _In_ XTaskQueueHandle queue,
+    _In_ XTaskQueuePort port,
+    _In_ int fd,
+    _In_opt_ void* callbackContext,
+    _In_ XTaskQueueCallback* callback,
+    _Out_ XTaskQueueRegistrationToken* token
+    ) noexcept
+{
+#if TASK_QUEUE_EPOLL_WAITS
+    RETURN_HR_IF(E_INVALIDARG, fd < 0);
+    referenced_ptr<ITaskQueue> aq(GetQueue(queue));
+    RETURN_HR_IF(E_INVALIDARG, aq == nullptr);
+    RETURN_IF_FAILED(aq->RegisterWaitHandle(port, FileDescriptorToWaitHandle(fd), callbackContext, callback, token));
+    return S_OK;
+#else
+    UNREFERENCED_PARAMETER(queue);
+    UNREFERENCED_PARAMETER(port);
+    UNREFERENCED_PARAMETER(fd);
+    UNREFERENCED_PARAMETER(callbackContext);
+    UNREFERENCED_PARAMETER(callback);
+    UNREFERENCED_PARAMETER(token);
+    return E_NOTIMPL;
+#endif
 }
+#endif
 
 //
 // Unregisters a previously registered task queue waiter.
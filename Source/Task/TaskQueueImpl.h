@@ -4,6 +4,7 @@
 #pragma once
 
 #include "AtomicVector.h"
+#include "EventCount.h"
 #include "LocklessList.h"
 #include "StaticArray.h"
 #include "ThreadPool.h"
@@ -88,13 +89,16 @@ private:
     std::atomic_flag m_deleting;
 };
 
-static uint32_t const SUBMIT_CALLBACK_MAX = 32;
-
+// Holds the monitors registered on a queue. Registrations are kept in an
+// immutable array that Register and Unregister replace as a whole, so
+// Invoke never takes a lock, only visits live registrations, and costs a
+// single load when nothing is registered.
 class SubmitCallback
 {
 public:
 
     SubmitCallback(_In_ XTaskQueueHandle queue);
+    ~SubmitCallback();
 
     HRESULT Register(_In_opt_ void* context, _In_ XTaskQueueMonitorCallback* callback, _Out_ XTaskQueueRegistrationToken* token);
     void Unregister(_In_ XTaskQueueRegistrationToken token);
@@ -104,23 +108,74 @@ private:
 
     struct CallbackRegistration
     {
-        uint64_t Token;
-        void* Context;
-        XTaskQueueMonitorCallback* Callback;
+        uint64_t Token = 0;
+        void* Context = nullptr;
+
+        // Atomic because an unregister that can't allocate a smaller set
+        // clears it in the published set while Invoke may be reading it.
+        std::atomic<XTaskQueueMonitorCallback*> Callback{ nullptr };
+
+        void CopyFrom(_In_ const CallbackRegistration& other)
+        {
+            Token = other.Token;
+            Context = other.Context;
+            Callback.store(other.Callback.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+    };
+
+    struct Registrations
+    {
+        uint32_t Count = 0;
+        std::unique_ptr<CallbackRegistration[]> Entries;
     };
 
+    // Publishes a new set of registrations and frees the one it
+    // replaces. Must hold m_lock.
+    void Publish(_In_opt_ Registrations* registrations);
+
+    // Waits for every Invoke that may have seen the previous set of
+    // registrations to finish. Invokes that start meanwhile count
+    // against the other generation, so a steady stream of submits
+    // can't hold this up. Must hold m_lock.
+    void WaitForInvokes();
+
     std::atomic<uint64_t> m_nextToken{ 0 };
     std::mutex m_lock;
-    CallbackRegistration m_buffer1[SUBMIT_CALLBACK_MAX];
-    CallbackRegistration m_buffer2[SUBMIT_CALLBACK_MAX];
-    CallbackRegistration* m_buffers[2]= { m_buffer1, m_buffer2 };
-    std::atomic<uint32_t> m_indexAndRef { 0 };
+    std::atomic<Registrations*> m_registrations{ nullptr };
+    std::atomic<uint32_t> m_generation{ 0 };
+    std::atomic<uint32_t> m_invoking[2] = { };
     XTaskQueueHandle m_queue;
 };
 
+#if defined(__linux__)
+// Linux ports wait on file descriptors through epoll. A wait handle
+// carries the descriptor offset by one so descriptor zero isn't mistaken
+// for a null handle.
+#define TASK_QUEUE_EPOLL_WAITS 1
+
+inline HANDLE FileDescriptorToWaitHandle(_In_ int fd) noexcept
+{
+    return reinterpret_cast<HANDLE>(static_cast<intptr_t>(fd) + 1);
+}
+
+inline int WaitHandleToFileDescriptor(_In_ HANDLE waitHandle) noexcept
+{
+    return static_cast<int>(reinterpret_cast<intptr_t>(waitHandle) - 1);
+}
+#endif
+
 #define PORT_WAIT_MAX 60
 #define PORT_EVENT_MAX (PORT_WAIT_MAX + 1)
-#define QUEUE_WAIT_MAX (PORT_WAIT_MAX * 2)
+
+// One lane per XTaskQueuePriority value. A lower lane that has work but
+// has been passed over this many times in a row is served next.
+#define PORT_PRIORITY_LANES 3
+#define PORT_PRIORITY_AGING_LIMIT 8
+
+// Defaults for how long a SerializedThreadPool port holds a pool
+// thread before rescheduling itself.
+#define PORT_DEFAULT_BATCH_SIZE 64
+#define PORT_DEFAULT_BATCH_TIME_SLICE_MS 10
 
 class QueueWaitRegistry
 {
@@ -143,8 +198,9 @@ private:
         XTaskQueuePort Port;
     };
 
+    // Grows as needed; how many waits a port can hold is up to the port.
     std::atomic<uint64_t> m_nextToken{ 0 };
-    StaticArray<WaitRegistration, QUEUE_WAIT_MAX> m_callbacks;
+    std::unordered_map<uint64_t, WaitRegistration> m_callbacks;
     std::mutex m_lock;
 };
 
@@ -156,16 +212,24 @@ public:
     virtual ~TaskQueuePortImpl();
 
     HRESULT Initialize(
-        _In_ XTaskQueueDispatchMode mode);
+        _In_ XTaskQueueDispatchMode mode,
+        _In_opt_ const XTaskQueueThreadPoolOptions* options = nullptr);
 
     XTaskQueuePortHandle __stdcall GetHandle() { return &m_header; }
 
     HRESULT __stdcall QueueItem(
         _In_ ITaskQueuePortContext* portContext,
+        _In_ XTaskQueuePriority priority,
         _In_ uint32_t waitMs,
         _In_opt_ void* callbackContext,
         _In_ XTaskQueueCallback* callback);
 
+    HRESULT __stdcall QueueItems(
+        _In_ ITaskQueuePortContext* portContext,
+        _In_ uint32_t count,
+        _In_reads_opt_(count) void* const* callbackContexts,
+        _In_reads_(count) XTaskQueueCallback* const* callbacks);
+
     HRESULT __stdcall RegisterWaitHandle(
         _In_ ITaskQueuePortContext* portContext,
         _In_ HANDLE waitHandle,
@@ -214,10 +278,45 @@ private:
         WaitRegistration* waitRegistration;
         uint64_t enqueueTime;
         std::atomic<uint32_t> refs;
+        XTaskQueuePriority priority;
+
+        // Entries come from the same block pool as list nodes; one of
+        // each is needed for every submitted callback.
+        static void* operator new(size_t sz, const std::nothrow_t&) noexcept
+        {
+            UNREFERENCED_PARAMETER(sz);
+            return LocklessBlockPool::Allocate();
+        }
+
+        static void operator delete(void* ptr) noexcept
+        {
+            LocklessBlockPool::Free(ptr);
+        }
+
+        static void operator delete(void* ptr, const std::nothrow_t&) noexcept
+        {
+            LocklessBlockPool::Free(ptr);
+        }
     };
 
+    static_assert(sizeof(QueueEntry) <= sizeof(std::uintptr_t) * 8, "QueueEntry must fit in a LocklessBlockPool block");
+
     typedef LocklessList<QueueEntry>::Node QueueEntryNode;
 
+    // Delayed entries wait for their due time in a pairing heap. A heap node
+    // is built in the memory of the list node that carried the entry, and
+    // turned back into one when the entry comes due, so moving entries
+    // between the lists and the heap never allocates.
+    struct PendingNode
+    {
+        uint64_t dueTime;
+        QueueEntry* entry;
+        PendingNode* child;
+        PendingNode* sibling;
+    };
+
+    static_assert(sizeof(PendingNode) <= sizeof(QueueEntryNode), "PendingNode must fit in a list node");
+
     struct TerminationEntry
     {
         ITaskQueuePortContext* portContext;
@@ -228,12 +327,17 @@ private:
 
     typedef LocklessList<TerminationEntry>::Node TerminationEntryNode;
 
-#ifdef _WIN32
+#if defined(_WIN32) || TASK_QUEUE_EPOLL_WAITS
     struct WaitRegistration
     {
         uint64_t token;
         HANDLE waitHandle;
+#ifdef _WIN32
         PTP_WAIT threadpoolWait;
+#else
+        uint64_t reactorKey;
+        WaitRegistration* nextCanceled;
+#endif
         ITaskQueuePortContext* portContext;
         TaskQueuePortImpl* port;
         QueueEntry* queueEntry;
@@ -245,25 +349,45 @@ private:
     XTaskQueueDispatchMode m_dispatchMode = XTaskQueueDispatchMode::Manual;
     AtomicVector<ITaskQueuePortContext*> m_attachedContexts;
     std::atomic<uint32_t> m_processingCallback{ 0 };
-    std::condition_variable_any m_event;
+#ifndef _WIN32
+    EventCount m_event;
+#endif
     std::mutex m_lock;
-    std::unique_ptr<LocklessList<QueueEntry>> m_queueList;
+    std::unique_ptr<LocklessList<QueueEntry>> m_queueLanes[PORT_PRIORITY_LANES];
+    std::atomic<uint32_t> m_laneSkips[PORT_PRIORITY_LANES] = { };
     std::unique_ptr<LocklessList<QueueEntry>> m_pendingList;
+    std::mutex m_pendingLock;
+    std::atomic<PendingNode*> m_pendingHeap{ nullptr };
+    QueueEntryNode* m_spareNode = nullptr;
     std::unique_ptr<LocklessList<TerminationEntry>> m_terminationList;
     WaitTimer m_timer;
     ThreadPool m_threadPool;
     std::atomic<uint64_t> m_timerDue = { UINT64_MAX };
+    std::atomic<bool> m_batchScheduled{ false };
+    uint32_t m_batchSize = PORT_DEFAULT_BATCH_SIZE;
+    uint32_t m_batchTimeSliceMs = PORT_DEFAULT_BATCH_TIME_SLICE_MS;
 
 #ifdef _WIN32
     StaticArray<WaitRegistration*, PORT_WAIT_MAX> m_waits;
     StaticArray<HANDLE, PORT_EVENT_MAX> m_events;
     uint64_t m_nextWaitToken = 0;
+#elif TASK_QUEUE_EPOLL_WAITS
+    std::unordered_map<uint64_t, WaitRegistration*> m_waits;
+    uint64_t m_nextWaitToken = 0;
 #endif
 
     HRESULT VerifyNotTerminated(_In_ ITaskQueuePortContext* portContext);
     
     bool IsCallCanceled(_In_ QueueEntry* entry);
 
+    LocklessList<QueueEntry>* LaneFor(
+        _In_ QueueEntry* entry);
+
+    bool LanesEmpty();
+
+    // Pops the next entry to dispatch across the priority lanes.
+    QueueEntry* PopEntry();
+
     // Appends the given entry to the active queue.  The entry should already
     // be add-refd.
     bool AppendEntry(
@@ -271,6 +395,10 @@ private:
         _In_opt_ QueueEntryNode* node = nullptr,
         _In_ bool signal = true);
 
+    void ItemsAppended(
+        _In_ uint32_t count,
+        _In_ bool signal);
+
     // Releases the entry.
     void ReleaseEntry(
         _In_ QueueEntry* entry);
@@ -282,10 +410,29 @@ private:
     static void EraseQueue(
         _In_opt_ LocklessList<QueueEntry>* queue);
 
+    static PendingNode* ToPendingNode(
+        _In_ QueueEntry* entry,
+        _In_ QueueEntryNode* node);
+
+    static QueueEntryNode* ToQueueEntryNode(
+        _In_ PendingNode* node);
+
+    static PendingNode* MeldPending(
+        _In_opt_ PendingNode* first,
+        _In_opt_ PendingNode* second);
+
+    static PendingNode* MergePendingPairs(
+        _In_opt_ PendingNode* first);
+
+    static PendingNode* FlattenPending(
+        _In_opt_ PendingNode* root);
+
+    PendingNode* PopPending();
+
+    void MovePendingListToHeap();
+
     void ScheduleNextPendingCallback(
-        _In_ uint64_t dueTime,
-        _Out_ QueueEntry** dueEntry,
-        _Out_ QueueEntryNode** dueEntryNode);
+        _In_ uint64_t nextDueTime);
 
     void SubmitPendingCallback();
 
@@ -293,9 +440,11 @@ private:
 
     void SignalQueue();
 
+    void ScheduleBatch();
+
     void ProcessThreadPoolCallback(_In_ ThreadPoolActionComplete& complete);
 
-#ifdef _WIN32
+#if defined(_WIN32) || TASK_QUEUE_EPOLL_WAITS
     HRESULT InitializeWaitRegistration(
         _In_ WaitRegistration* waitReg);
 
@@ -307,11 +456,21 @@ private:
     void ProcessWaitCallback(
         _In_ WaitRegistration* waitReg);
 
+#ifdef _WIN32
     static void CALLBACK WaitCallback(
         _In_ PTP_CALLBACK_INSTANCE instance,
         _Inout_opt_ void* context,
         _Inout_ PTP_WAIT wait,
         _In_ TP_WAIT_RESULT waitResult);
+#else
+    static void WaitCallback(
+        _In_ void* context);
+
+    // Stops watching the registration's descriptor and waits for a
+    // readiness callback in flight to finish.
+    void CloseWaitRegistration(
+        _In_ WaitRegistration* waitReg);
+#endif
 #endif
 };
 
@@ -332,6 +491,7 @@ public:
     TaskQueuePortStatus __stdcall GetStatus() override;
     ITaskQueue* __stdcall GetQueue() override;
     ITaskQueuePort* __stdcall GetPort() override;
+    XTaskQueuePriority __stdcall GetPriority() override;
     
     bool __stdcall TrySetStatus(
         _In_ TaskQueuePortStatus expectedStatus,
@@ -344,6 +504,7 @@ public:
 
     referenced_ptr<ITaskQueuePort> Port;
     referenced_ptr<ITaskQueue> Source;
+    XTaskQueuePriority Priority = XTaskQueuePriority::Normal;
 
 private:
     
@@ -364,11 +525,13 @@ public:
         _In_ XTaskQueueDispatchMode workMode,
         _In_ XTaskQueueDispatchMode completionMode,
         _In_ bool allowTermination,
-        _In_ bool allowClose);
+        _In_ bool allowClose,
+        _In_opt_ const XTaskQueueThreadPoolOptions* options = nullptr);
     
     HRESULT Initialize(
         _In_ XTaskQueuePortHandle workPort,
-        _In_ XTaskQueuePortHandle completionPort);
+        _In_ XTaskQueuePortHandle completionPort,
+        _In_ XTaskQueuePriority priority = XTaskQueuePriority::Normal);
     
     XTaskQueueHandle __stdcall GetHandle() override { return &m_header; }
 
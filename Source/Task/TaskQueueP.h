@@ -34,10 +34,17 @@ struct ITaskQueuePort: IApi
 
     virtual HRESULT __stdcall QueueItem(
         _In_ ITaskQueuePortContext* portContext,
+        _In_ XTaskQueuePriority priority,
         _In_ uint32_t waitMs,
         _In_opt_ void* callbackContext,
         _In_ XTaskQueueCallback* callback) = 0;
 
+    virtual HRESULT __stdcall QueueItems(
+        _In_ ITaskQueuePortContext* portContext,
+        _In_ uint32_t count,
+        _In_reads_opt_(count) void* const* callbackContexts,
+        _In_reads_(count) XTaskQueueCallback* const* callbacks) = 0;
+
     virtual HRESULT __stdcall RegisterWaitHandle(
         _In_ ITaskQueuePortContext* portContext,
         _In_ HANDLE waitHandle,
@@ -93,6 +100,10 @@ struct ITaskQueuePortContext : IApi
     virtual TaskQueuePortStatus __stdcall GetStatus() = 0;
     virtual ITaskQueue* __stdcall GetQueue() = 0;
     virtual ITaskQueuePort* __stdcall GetPort() = 0;
+
+    // The priority callbacks submitted through this context
+    // are queued at unless the caller picks one.
+    virtual XTaskQueuePriority __stdcall GetPriority() = 0;
     
     virtual bool __stdcall TrySetStatus(
         _In_ TaskQueuePortStatus expectedStatus,
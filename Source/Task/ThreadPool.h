@@ -7,6 +7,8 @@ struct ThreadPoolActionComplete
 
 using ThreadPoolCallback = void(_In_opt_ void*, _In_ ThreadPoolActionComplete& complete);
 
+struct XTaskQueueThreadPoolOptions;
+
 class ThreadPoolImpl;
 
 // A thread pool will invoke its callback on a pool of threads.
@@ -16,17 +18,21 @@ public:
     ThreadPool() noexcept;
     ~ThreadPool() noexcept;
 
-    // Initializes the thread pool.
-    HRESULT Initialize(_In_opt_ void* context, _In_ ThreadPoolCallback* callback) noexcept;
+    // Initializes the thread pool. Options may name a pool shared with
+    // other ThreadPool instances; when null a private pool is used.
+    HRESULT Initialize(
+        _In_opt_ void* context,
+        _In_ ThreadPoolCallback* callback,
+        _In_opt_ const XTaskQueueThreadPoolOptions* options = nullptr) noexcept;
 
     // Terminates the thread pool, waiting for any outstanding calls to drain
     // and and canceling any pending calls.
     void Terminate() noexcept;
 
-    // Submits a new callback to the thread pool.  The callback passed to Initialize will
-    // be invoked on a thread pool thread. May throw / crash if called after termination
-    // or before init.
-    void Submit();
+    // Submits count callbacks to the thread pool.  The callback passed to Initialize will
+    // be invoked on a thread pool thread once for each. May throw / crash if called after
+    // termination or before init.
+    void Submit(_In_ uint32_t count = 1);
 
 private:
     ThreadPoolImpl* m_impl;
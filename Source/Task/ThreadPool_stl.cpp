@@ -5,6 +5,189 @@
 #include <httpClient/async_jvm.h>
 #endif
 
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "LocklessList.h"
+
+// Threads above the pool minimum exit after being idle this long
+#define THREAD_POOL_IDLE_RETIRE_MS 30000
+
+namespace
+{
+
+// Bounded Chase-Lev work stealing deque. The owning worker pushes and takes
+// from the bottom; other workers steal from the top. Based on
+// "Correct and Efficient Work-Stealing for Weak Memory Models" (Le et al.)
+class WorkStealingDeque
+{
+public:
+    static constexpr int64_t Capacity = 256;
+
+    // Owner only. Returns false if the deque is full.
+    bool Push(_In_ ThreadPoolImpl* work) noexcept
+    {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_acquire);
+        if (b - t >= Capacity)
+        {
+            return false;
+        }
+
+        m_items[b & (Capacity - 1)].store(work, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Owner only. LIFO so recently submitted work runs while still warm.
+    ThreadPoolImpl* Take() noexcept
+    {
+        int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+
+        if (t > b)
+        {
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        ThreadPoolImpl* work = m_items[b & (Capacity - 1)].load(std::memory_order_relaxed);
+        if (t == b)
+        {
+            // Last item; race any thieves for it.
+            if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            {
+                work = nullptr;
+            }
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return work;
+    }
+
+    // Any thread.
+    ThreadPoolImpl* Steal() noexcept
+    {
+        int64_t t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = m_bottom.load(std::memory_order_acquire);
+
+        if (t >= b)
+        {
+            return nullptr;
+        }
+
+        ThreadPoolImpl* work = m_items[t & (Capacity - 1)].load(std::memory_order_relaxed);
+        if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        {
+            return nullptr;
+        }
+        return work;
+    }
+
+    bool Empty() const noexcept
+    {
+        return m_top.load(std::memory_order_acquire) >= m_bottom.load(std::memory_order_acquire);
+    }
+
+private:
+    alignas(64) std::atomic<int64_t> m_top{ 0 };
+    alignas(64) std::atomic<int64_t> m_bottom{ 0 };
+    std::atomic<ThreadPoolImpl*> m_items[Capacity];
+};
+
+} // anonymous namespace
+
+// A set of worker threads. A private set backs a single ThreadPool; a named
+// set is shared by every ThreadPool created with the same pool name. Work
+// items are the ThreadPoolImpl that submitted them.
+class ThreadPoolWorkers
+{
+public:
+
+    static HRESULT Acquire(
+        _In_opt_ const XTaskQueueThreadPoolOptions* options,
+        _Out_ ThreadPoolWorkers** workers) noexcept;
+
+    void AddRef() noexcept
+    {
+        m_refs++;
+    }
+
+    void Release() noexcept;
+
+    void Submit(_In_ ThreadPoolImpl* client, _In_ uint32_t count) noexcept;
+
+private:
+
+    struct Worker
+    {
+        ThreadPoolWorkers* owner = nullptr;
+        uint32_t index = 0;
+        bool retired = false;
+        WorkStealingDeque deque;
+        std::thread thread;
+
+        std::mutex wakeLock;
+        std::condition_variable wake;
+        bool signaled = false;
+    };
+
+    ~ThreadPoolWorkers() noexcept;
+
+    HRESULT Initialize(_In_opt_ const XTaskQueueThreadPoolOptions* options) noexcept;
+    void Shutdown() noexcept;
+    HRESULT StartWorker() noexcept;
+    void WorkerThread(_In_ Worker* worker) noexcept;
+    ThreadPoolImpl* FindWork(_In_ Worker* worker) noexcept;
+    bool HasWork() noexcept;
+    bool Park(_In_ Worker* worker) noexcept;
+    void WakeOne() noexcept;
+    void ApplyAffinity(_In_ std::thread& thread) noexcept;
+
+    std::atomic<uint32_t> m_refs{ 1 };
+    std::string m_name;
+
+    uint32_t m_minThreads = 0;
+    uint32_t m_maxThreads = 0;
+    uint64_t m_affinityMask = 0;
+
+    // Slots are created up to m_maxThreads and never removed, so thieves
+    // can walk them without locking. Retired slots have empty deques.
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::atomic<uint32_t> m_workerSlots{ 0 };
+    std::atomic<uint32_t> m_liveThreads{ 0 };
+    std::mutex m_spawnLock;
+
+    std::unique_ptr<LocklessList<ThreadPoolImpl>> m_injected;
+    std::atomic<bool> m_shutdown{ false };
+    std::thread::id m_deletingThread;
+
+    std::mutex m_idleLock;
+    std::vector<Worker*> m_idle;
+    std::atomic<uint32_t> m_idleCount{ 0 };
+
+    static thread_local Worker* s_currentWorker;
+
+    static std::mutex s_registryLock;
+    static std::vector<ThreadPoolWorkers*> s_namedPools;
+
+#if defined(HC_PLATFORM) && HC_PLATFORM == HC_PLATFORM_ANDROID
+public:
+    static std::atomic<JavaVM*> s_javaVm;
+#endif
+};
+
+thread_local ThreadPoolWorkers::Worker* ThreadPoolWorkers::s_currentWorker = nullptr;
+std::mutex ThreadPoolWorkers::s_registryLock;
+std::vector<ThreadPoolWorkers*> ThreadPoolWorkers::s_namedPools;
+
+// The per-ThreadPool state. Each submit queues a reference to this object
+// on the worker set; the callback is skipped once the pool is terminated.
 class ThreadPoolImpl
 {
 public:
@@ -12,6 +195,11 @@ public:
     ~ThreadPoolImpl() noexcept
     {
         Terminate();
+
+        if (m_workers != nullptr)
+        {
+            m_workers->Release();
+        }
     }
 
     void AddRef()
@@ -29,212 +217,640 @@ public:
 
     HRESULT Initialize(
         _In_opt_ void* context,
-        _In_ ThreadPoolCallback* callback) noexcept
+        _In_ ThreadPoolCallback* callback,
+        _In_opt_ const XTaskQueueThreadPoolOptions* options) noexcept
     {
         m_context = context;
         m_callback = callback;
+        return ThreadPoolWorkers::Acquire(options, &m_workers);
+    }
+
+    void Terminate() noexcept
+    {
+        m_terminate = true;
+
+        // Wait for the active call count
+        // to go to zero.
+        std::unique_lock<std::mutex> activeLock(m_activeLock);
+        while (m_activeCalls != 0)
+        {
+            m_active.wait(activeLock);
+        }
+    }
+
+    void Submit(_In_ uint32_t count) noexcept
+    {
+        // Released by Run once a worker picks each item up
+        m_refs += count;
+        m_workers->Submit(this, count);
+    }
 
-        uint32_t numThreads = std::thread::hardware_concurrency();
-        if (numThreads == 0)
+    // Called on a worker thread for each submitted item.
+    void Run() noexcept
+    {
+        // ActionComplete is an optional call
+        // the callback can make to indicate 
+        // all portions of the call have finished
+        // and it is safe to release the
+        // thread pool, even if the callback has
+        // not totally unwound.  This is neccessary
+        // to allow users to close a task queue from
+        // within a callback.  Task queue guards with an 
+        // extra ref to ensure a safe point where 
+        // member state is no longer accessed, but the
+        // final release does need to wait on outstanding
+        // calls.
+
+        // Count ourselves active before checking for termination so
+        // Terminate can't return while we go on to call back.
+        m_activeCalls++;
+
+        ActionCompleteImpl ac(this);
+
+        if (!m_terminate)
+        {
+            m_callback(m_context, ac);
+        }
+
+        if (!ac.Invoked)
+        {
+            ac();
+        }
+
+        Release(); // May delete this
+    }
+
+private:
+
+    struct ActionCompleteImpl : ThreadPoolActionComplete
+    {
+        ActionCompleteImpl(ThreadPoolImpl* owner) :
+            m_owner(owner)
         {
-            numThreads = 1;
         }
 
-        try
+        bool Invoked = false;
+
+        void operator()() override
         {
-            while(numThreads != 0)
+            Invoked = true;
+
+            // Terminate only waits once m_terminate is set, so only then is
+            // the lock needed.
+            if (--m_owner->m_activeCalls == 0 && m_owner->m_terminate)
             {
-                numThreads--;
-                m_pool.emplace_back(std::thread([this]
-                {
-#if defined(HC_PLATFORM) && HC_PLATFORM == HC_PLATFORM_ANDROID
-                    JNIEnv* jniEnv = nullptr;
-                    JavaVM* jvm = nullptr;
-#endif
+                std::lock_guard<std::mutex> lock(m_owner->m_activeLock);
+                m_owner->m_active.notify_all();
+            }
+        }
 
-                    std::unique_lock<std::mutex> lock(m_wakeLock);
-                    while(true)
-                    {
-                        if (m_calls == 0)
-                        {
-                            m_wake.wait(lock);
-                        }
+    private:
+        ThreadPoolImpl * m_owner = nullptr;
+    };
 
-                        if (m_terminate)
-                        {
-                            break;
-                        }
+    std::atomic<uint32_t> m_refs{ 1 };
+    ThreadPoolWorkers* m_workers = nullptr;
+    void* m_context = nullptr;
+    ThreadPoolCallback* m_callback = nullptr;
+    std::atomic<bool> m_terminate{ false };
 
-#if defined(HC_PLATFORM) && HC_PLATFORM == HC_PLATFORM_ANDROID
-                        // lazy check for the JavaVM, we do it here so that we
-                        // will attach even if the thread pool is initialized
-                        // before we're given the jvm
-                        if (!jniEnv)
-                        {
-                            jvm = s_javaVm;
-                            if (jvm)
-                            {
-                                jvm->AttachCurrentThread(&jniEnv, nullptr);
-                            }
-                        }
-#endif
+    std::mutex m_activeLock;
+    std::condition_variable m_active;
+    std::atomic<uint32_t> m_activeCalls{ 0 };
+};
 
-                        if (m_calls != 0)
-                        {
-                            m_calls--;
-
-                            // ActionComplete is an optional call
-                            // the callback can make to indicate 
-                            // all portions of the call have finished
-                            // and it is safe to release the
-                            // thread pool, even if the callback has
-                            // not totally unwound.  This is neccessary
-                            // to allow users to close a task queue from
-                            // within a callback.  Task queue guards with an 
-                            // extra ref to ensure a safe point where 
-                            // member state is no longer accessed, but the
-                            // final release does need to wait on outstanding
-                            // calls.
-
-                            {
-                                std::unique_lock<std::mutex> lock(m_activeLock);
-                                m_activeCalls++;
-                            }
-
-                            ActionCompleteImpl ac(this);
-
-                            lock.unlock();
-                            AddRef();
-                            m_callback(m_context, ac);
-                            lock.lock();
-
-                            if (!ac.Invoked)
-                            {
-                                ac();
-                            }
-
-                            if (m_terminate)
-                            {
-                                lock.unlock();
-                                Release(); // This could destroy us
-                                break;
-                            }
-                            else
-                            {
-                                Release();
-                            }
-                        }
-                    }
+HRESULT ThreadPoolWorkers::Acquire(
+    _In_opt_ const XTaskQueueThreadPoolOptions* options,
+    _Out_ ThreadPoolWorkers** workers) noexcept
+{
+    *workers = nullptr;
 
-#if defined(HC_PLATFORM) && HC_PLATFORM == HC_PLATFORM_ANDROID
-                    if (jniEnv && jvm)
-                    {
-                        jvm->DetachCurrentThread();
-                    }
-#endif
-                }));
+    bool named = options != nullptr && options->poolName != nullptr && options->poolName[0] != 0;
+    std::unique_lock<std::mutex> registryLock(s_registryLock, std::defer_lock);
+
+    if (named)
+    {
+        registryLock.lock();
+        for (auto pool : s_namedPools)
+        {
+            if (pool->m_name == options->poolName)
+            {
+                pool->AddRef();
+                *workers = pool;
+                return S_OK;
             }
         }
-        catch (const std::bad_alloc&)
+    }
+
+    ThreadPoolWorkers* pool = new (std::nothrow) ThreadPoolWorkers;
+    RETURN_IF_NULL_ALLOC(pool);
+
+    HRESULT hr = S_OK;
+
+    try
+    {
+        if (named)
         {
-            return E_OUTOFMEMORY;
+            pool->m_name = options->poolName;
+            s_namedPools.reserve(s_namedPools.size() + 1);
         }
+    }
+    catch (const std::bad_alloc&)
+    {
+        hr = E_OUTOFMEMORY;
+    }
 
-        return S_OK;
+    if (SUCCEEDED(hr))
+    {
+        hr = pool->Initialize(options);
     }
 
-    void Terminate() noexcept
+    if (FAILED(hr))
+    {
+        delete pool;
+        return hr;
+    }
+
+    if (named)
     {
+        s_namedPools.push_back(pool);
+    }
+
+    *workers = pool;
+    return S_OK;
+}
+
+void ThreadPoolWorkers::Release() noexcept
+{
+    // Named pools are found through the registry, so the final release has
+    // to happen under its lock. Anything else can drop a ref without it.
+    uint32_t refs = m_refs.load();
+    while (refs > 1)
+    {
+        if (m_refs.compare_exchange_weak(refs, refs - 1))
         {
-            std::unique_lock<std::mutex> wakeLock(m_wakeLock); // Must lock before m_activeLock
-            m_terminate = true;
+            return;
         }
-        m_wake.notify_all();
+    }
 
-        std::unique_lock<std::mutex> activeLock(m_activeLock);
+    {
+        std::unique_lock<std::mutex> registryLock(s_registryLock, std::defer_lock);
+        if (!m_name.empty())
+        {
+            registryLock.lock();
+        }
 
-        // Wait for the active call count
-        // to go to zero.
-        while (m_activeCalls != 0)
+        if (--m_refs != 0)
         {
-            m_active.wait(activeLock);
+            return;
         }
-        activeLock.unlock();
 
-        for (auto &t : m_pool)
+        if (!m_name.empty())
         {
-            if (t.get_id() == std::this_thread::get_id())
-            {
-                t.detach();
-            }
-            else
+            s_namedPools.erase(std::find(s_namedPools.begin(), s_namedPools.end(), this));
+        }
+    }
+
+    if (s_currentWorker != nullptr && s_currentWorker->owner == this)
+    {
+        // The last reference went away inside one of our own callbacks.
+        // Stop the other threads now; this one deletes us on its way out.
+        m_deletingThread = std::this_thread::get_id();
+        Shutdown();
+    }
+    else
+    {
+        delete this;
+    }
+}
+
+ThreadPoolWorkers::~ThreadPoolWorkers() noexcept
+{
+    Shutdown();
+
+    // Items left behind are references on terminated pools.
+    if (m_injected != nullptr)
+    {
+        ThreadPoolImpl* client;
+        while ((client = m_injected->pop_front()) != nullptr)
+        {
+            client->Run();
+        }
+    }
+
+    for (auto& worker : m_workers)
+    {
+        ThreadPoolImpl* client;
+        while ((client = worker->deque.Take()) != nullptr)
+        {
+            client->Run();
+        }
+    }
+}
+
+HRESULT ThreadPoolWorkers::Initialize(_In_opt_ const XTaskQueueThreadPoolOptions* options) noexcept
+{
+    uint32_t processors = std::thread::hardware_concurrency();
+    if (processors == 0)
+    {
+        processors = 1;
+    }
+
+    m_minThreads = processors;
+    m_maxThreads = processors;
+
+    if (options != nullptr)
+    {
+        if (options->minThreads != 0)
+        {
+            m_minThreads = options->minThreads;
+        }
+        m_maxThreads = std::max(options->maxThreads, m_minThreads);
+        m_affinityMask = options->affinityMask;
+    }
+
+    m_injected.reset(new (std::nothrow) LocklessList<ThreadPoolImpl>);
+    RETURN_IF_NULL_ALLOC(m_injected);
+
+    try
+    {
+        m_workers.reserve(m_maxThreads);
+        m_idle.reserve(m_maxThreads);
+    }
+    catch (const std::bad_alloc&)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    std::lock_guard<std::mutex> lock(m_spawnLock);
+    for (uint32_t i = 0; i < m_minThreads; i++)
+    {
+        RETURN_IF_FAILED(StartWorker());
+    }
+
+    return S_OK;
+}
+
+void ThreadPoolWorkers::Shutdown() noexcept
+{
+    m_shutdown = true;
+
+    std::lock_guard<std::mutex> spawnLock(m_spawnLock);
+    uint32_t slots = m_workerSlots;
+
+    for (uint32_t i = 0; i < slots; i++)
+    {
+        Worker* worker = m_workers[i].get();
+        {
+            std::lock_guard<std::mutex> lock(worker->wakeLock);
+            worker->signaled = true;
+        }
+        worker->wake.notify_one();
+    }
+
+    for (uint32_t i = 0; i < slots; i++)
+    {
+        std::thread& thread = m_workers[i]->thread;
+        if (!thread.joinable())
+        {
+            continue;
+        }
+
+        if (thread.get_id() == std::this_thread::get_id())
+        {
+            thread.detach();
+        }
+        else
+        {
+            thread.join();
+        }
+    }
+}
+
+// Requires m_spawnLock.
+HRESULT ThreadPoolWorkers::StartWorker() noexcept
+{
+    Worker* worker = nullptr;
+
+    // Reuse a slot whose thread has retired before adding a new one
+    uint32_t slots = m_workerSlots;
+    for (uint32_t i = 0; i < slots; i++)
+    {
+        if (m_workers[i]->retired)
+        {
+            worker = m_workers[i].get();
+            if (worker->thread.joinable())
             {
-                t.join();
+                worker->thread.join();
             }
+            worker->retired = false;
+            worker->signaled = false;
+            break;
         }
+    }
+
+    if (worker == nullptr)
+    {
+        RETURN_HR_IF(E_UNEXPECTED, slots >= m_maxThreads);
 
-        m_pool.clear();
+        std::unique_ptr<Worker> newWorker(new (std::nothrow) Worker);
+        RETURN_IF_NULL_ALLOC(newWorker);
+        newWorker->owner = this;
+        newWorker->index = slots;
+        worker = newWorker.get();
+
+        // Capacity was reserved up front, so this doesn't reallocate
+        // underneath thieves reading other slots.
+        m_workers.push_back(std::move(newWorker));
     }
 
-    void Submit() noexcept
+    m_liveThreads++;
+
+    try
+    {
+        worker->thread = std::thread([this, worker] { WorkerThread(worker); });
+    }
+    catch (...)
     {
+        m_liveThreads--;
+        worker->retired = true;
+        if (worker->index == slots)
         {
-            std::unique_lock<std::mutex> lock(m_wakeLock);
-            m_calls++;
+            m_workerSlots = slots + 1;
         }
+        return E_FAIL;
+    }
+
+    ApplyAffinity(worker->thread);
 
-        // Release lock before notify_all to optimize immediate awakes
-        m_wake.notify_all();
+    if (worker->index == slots)
+    {
+        m_workerSlots = slots + 1;
     }
 
-private:
+    return S_OK;
+}
 
-    struct ActionCompleteImpl : ThreadPoolActionComplete
+void ThreadPoolWorkers::ApplyAffinity(_In_ std::thread& thread) noexcept
+{
+#if defined(__linux__)
+    if (m_affinityMask == 0)
     {
-        ActionCompleteImpl(ThreadPoolImpl* owner) :
-            m_owner(owner)
+        return;
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (uint32_t cpu = 0; cpu < 64 && cpu < CPU_SETSIZE; cpu++)
+    {
+        if ((m_affinityMask & (1ull << cpu)) != 0)
         {
+            CPU_SET(cpu, &cpus);
         }
+    }
 
-        bool Invoked = false;
+    pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+#else
+    UNREFERENCED_PARAMETER(thread);
+#endif
+}
 
-        void operator()() override
-        {
-            Invoked = true;
+void ThreadPoolWorkers::Submit(_In_ ThreadPoolImpl* client, _In_ uint32_t count) noexcept
+{
+    // Work submitted from one of our own workers goes on its deque: no
+    // contention, and it will likely run on the same core. Everything
+    // else goes through the shared injection list.
+    Worker* worker = s_currentWorker;
+    bool local = worker != nullptr && worker->owner == this;
 
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (!local || !worker->deque.Push(client))
+        {
+            while (!m_injected->push_back(client))
             {
-                std::unique_lock<std::mutex> lock(m_owner->m_activeLock);
-                m_owner->m_activeCalls--;
+                // Out of memory for a list node. Dropping the submit would
+                // strand queued work, so wait for memory to free up.
+                std::this_thread::yield();
             }
+        }
+    }
 
-            // Release lock before notify_all to optimize immediate awakes
-            m_owner->m_active.notify_all();
+    // Pairs with the fence in Park: either a parked worker is visible
+    // here or the parking worker sees the new work.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    uint32_t woken = 0;
+    while (woken < count && m_idleCount.load(std::memory_order_relaxed) != 0)
+    {
+        WakeOne();
+        woken++;
+    }
+
+    if (woken < count && m_liveThreads.load(std::memory_order_relaxed) < m_maxThreads)
+    {
+        // Everyone is busy and we're allowed to grow
+        std::unique_lock<std::mutex> lock(m_spawnLock, std::try_to_lock);
+        if (lock.owns_lock() && !m_shutdown && m_liveThreads < m_maxThreads && m_idleCount == 0)
+        {
+            LOG_IF_FAILED(StartWorker());
         }
+    }
+}
 
-    private:
-        ThreadPoolImpl * m_owner = nullptr;
-    };
+void ThreadPoolWorkers::WorkerThread(_In_ Worker* worker) noexcept
+{
+    s_currentWorker = worker;
 
-    std::atomic<uint32_t> m_refs{ 1 };
+#if defined(HC_PLATFORM) && HC_PLATFORM == HC_PLATFORM_ANDROID
+    JNIEnv* jniEnv = nullptr;
+    JavaVM* jvm = nullptr;
+#endif
 
-    std::mutex m_wakeLock;
-    std::condition_variable m_wake;
-    uint32_t m_calls{ 0 };
-    bool m_terminate{ false };
+    while (!m_shutdown)
+    {
+        ThreadPoolImpl* client = FindWork(worker);
+        if (client == nullptr)
+        {
+            if (!Park(worker))
+            {
+                // Idle above the minimum for too long
+                break;
+            }
+            continue;
+        }
 
-    std::mutex m_activeLock;
-    std::condition_variable m_active;
-    uint32_t m_activeCalls{ 0 };
+#if defined(HC_PLATFORM) && HC_PLATFORM == HC_PLATFORM_ANDROID
+        // lazy check for the JavaVM, we do it here so that we
+        // will attach even if the thread pool is initialized
+        // before we're given the jvm
+        if (!jniEnv)
+        {
+            jvm = s_javaVm;
+            if (jvm)
+            {
+                jvm->AttachCurrentThread(&jniEnv, nullptr);
+            }
+        }
+#endif
 
-    std::vector<std::thread> m_pool;
-    void* m_context = nullptr;
-    ThreadPoolCallback* m_callback = nullptr;
+        // A worker that picked up work may have left more behind; make
+        // sure another sleeper takes it rather than waiting for us.
+        if (m_idleCount.load(std::memory_order_relaxed) != 0 && HasWork())
+        {
+            WakeOne();
+        }
+
+        client->Run();
+    }
+
+    s_currentWorker = nullptr;
 
 #if defined(HC_PLATFORM) && HC_PLATFORM == HC_PLATFORM_ANDROID
-public:
-    static std::atomic<JavaVM*> s_javaVm;
+    if (jniEnv && jvm)
+    {
+        jvm->DetachCurrentThread();
+    }
 #endif
-};
+
+    if (m_deletingThread == std::this_thread::get_id())
+    {
+        delete this;
+    }
+}
+
+ThreadPoolImpl* ThreadPoolWorkers::FindWork(_In_ Worker* worker) noexcept
+{
+    ThreadPoolImpl* client = worker->deque.Take();
+    if (client != nullptr)
+    {
+        return client;
+    }
+
+    client = m_injected->pop_front();
+    if (client != nullptr)
+    {
+        return client;
+    }
+
+    // Steal, starting with our neighbor so thieves spread out
+    uint32_t count = m_workerSlots;
+    for (uint32_t i = 1; i < count; i++)
+    {
+        Worker* victim = m_workers[(worker->index + i) % count].get();
+        client = victim->deque.Steal();
+        if (client != nullptr)
+        {
+            return client;
+        }
+    }
+
+    return nullptr;
+}
+
+bool ThreadPoolWorkers::HasWork() noexcept
+{
+    if (!m_injected->empty())
+    {
+        return true;
+    }
+
+    uint32_t count = m_workerSlots;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (!m_workers[i]->deque.Empty())
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Returns false if the calling worker should exit.
+bool ThreadPoolWorkers::Park(_In_ Worker* worker) noexcept
+{
+    {
+        std::lock_guard<std::mutex> lock(m_idleLock);
+        m_idle.push_back(worker);
+        m_idleCount.store(static_cast<uint32_t>(m_idle.size()), std::memory_order_relaxed);
+    }
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    auto leaveIdleList = [this, worker]
+    {
+        std::lock_guard<std::mutex> lock(m_idleLock);
+        auto it = std::find(m_idle.begin(), m_idle.end(), worker);
+        if (it == m_idle.end())
+        {
+            // A submitter already took us off to wake us
+            return false;
+        }
+        m_idle.erase(it);
+        m_idleCount.store(static_cast<uint32_t>(m_idle.size()), std::memory_order_relaxed);
+        return true;
+    };
+
+    if (HasWork() || m_shutdown)
+    {
+        // Work raced in while we were registering. If a submitter already
+        // popped us its wake is harmless.
+        leaveIdleList();
+        return true;
+    }
+
+    std::unique_lock<std::mutex> lock(worker->wakeLock);
+    while (!worker->signaled && !m_shutdown)
+    {
+        if (m_liveThreads <= m_minThreads)
+        {
+            worker->wake.wait(lock);
+            continue;
+        }
+
+        if (worker->wake.wait_for(lock, std::chrono::milliseconds(THREAD_POOL_IDLE_RETIRE_MS)) == std::cv_status::timeout &&
+            !worker->signaled)
+        {
+            lock.unlock();
+
+            std::lock_guard<std::mutex> spawnLock(m_spawnLock);
+            if (m_liveThreads > m_minThreads && leaveIdleList())
+            {
+                m_liveThreads--;
+                worker->retired = true;
+                return false;
+            }
+
+            lock.lock();
+        }
+    }
+    worker->signaled = false;
+    return true;
+}
+
+void ThreadPoolWorkers::WakeOne() noexcept
+{
+    Worker* worker = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(m_idleLock);
+        if (m_idle.empty())
+        {
+            return;
+        }
+
+        // Most recently parked first; its caches are the warmest.
+        worker = m_idle.back();
+        m_idle.pop_back();
+        m_idleCount.store(static_cast<uint32_t>(m_idle.size()), std::memory_order_relaxed);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(worker->wakeLock);
+        worker->signaled = true;
+    }
+    worker->wake.notify_one();
+}
 
 ThreadPool::ThreadPool() noexcept :
     m_impl(nullptr)
@@ -246,14 +862,17 @@ ThreadPool::~ThreadPool() noexcept
     Terminate();
 }
 
-HRESULT ThreadPool::Initialize(_In_opt_ void* context, _In_ ThreadPoolCallback* callback) noexcept
+HRESULT ThreadPool::Initialize(
+    _In_opt_ void* context,
+    _In_ ThreadPoolCallback* callback,
+    _In_opt_ const XTaskQueueThreadPoolOptions* options) noexcept
 {
     RETURN_HR_IF(E_UNEXPECTED, m_impl != nullptr);
 
     std::unique_ptr<ThreadPoolImpl> impl(new (std::nothrow) ThreadPoolImpl);
     RETURN_IF_NULL_ALLOC(impl);
 
-    RETURN_IF_FAILED(impl->Initialize(context, callback));
+    RETURN_IF_FAILED(impl->Initialize(context, callback, options));
 
     m_impl = impl.release();
     return S_OK;
@@ -269,18 +888,18 @@ void ThreadPool::Terminate() noexcept
     }
 }
 
-void ThreadPool::Submit()
+void ThreadPool::Submit(_In_ uint32_t count)
 {
-    m_impl->Submit();
+    m_impl->Submit(count);
 }
 
 #if defined(HC_PLATFORM) && HC_PLATFORM == HC_PLATFORM_ANDROID
 STDAPI XTaskQueueSetJvm(_In_ JavaVM* jvm) noexcept
 {
-    assert(ThreadPoolImpl::s_javaVm == nullptr || ThreadPoolImpl::s_javaVm == jvm);
-    ThreadPoolImpl::s_javaVm = jvm;
+    assert(ThreadPoolWorkers::s_javaVm == nullptr || ThreadPoolWorkers::s_javaVm == jvm);
+    ThreadPoolWorkers::s_javaVm = jvm;
     return S_OK;
 }
 
-std::atomic<JavaVM*> ThreadPoolImpl::s_javaVm;
+std::atomic<JavaVM*> ThreadPoolWorkers::s_javaVm;
 #endif
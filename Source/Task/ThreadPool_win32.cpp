@@ -1,6 +1,128 @@
 #include "pch.h"
 #include "ThreadPool.h"
 
+// A PTP_POOL created for XTaskQueueThreadPoolOptions. Named pools are shared
+// by every ThreadPool created with the same name. CPU affinity is not
+// supported by the Win32 thread pool and is ignored.
+class ThreadPoolWorkers
+{
+public:
+
+    static HRESULT Acquire(
+        _In_ const XTaskQueueThreadPoolOptions* options,
+        _Out_ ThreadPoolWorkers** workers) noexcept
+    {
+        *workers = nullptr;
+
+        bool named = options->poolName != nullptr && options->poolName[0] != 0;
+        std::unique_lock<std::mutex> registryLock(s_registryLock, std::defer_lock);
+
+        if (named)
+        {
+            registryLock.lock();
+            for (auto pool : s_namedPools)
+            {
+                if (pool->m_name == options->poolName)
+                {
+                    pool->m_refs++;
+                    *workers = pool;
+                    return S_OK;
+                }
+            }
+        }
+
+        std::unique_ptr<ThreadPoolWorkers> pool(new (std::nothrow) ThreadPoolWorkers);
+        RETURN_IF_NULL_ALLOC(pool);
+
+        try
+        {
+            if (named)
+            {
+                pool->m_name = options->poolName;
+                s_namedPools.reserve(s_namedPools.size() + 1);
+            }
+        }
+        catch (const std::bad_alloc&)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        pool->m_pool = CreateThreadpool(nullptr);
+        RETURN_LAST_ERROR_IF_NULL(pool->m_pool);
+
+        if (options->maxThreads != 0)
+        {
+            SetThreadpoolThreadMaximum(pool->m_pool, std::max(options->maxThreads, options->minThreads));
+        }
+
+        if (options->minThreads != 0)
+        {
+            RETURN_IF_WIN32_BOOL_FALSE(SetThreadpoolThreadMinimum(pool->m_pool, options->minThreads));
+        }
+
+        InitializeThreadpoolEnvironment(&pool->m_environment);
+        SetThreadpoolCallbackPool(&pool->m_environment, pool->m_pool);
+
+        if (named)
+        {
+            s_namedPools.push_back(pool.get());
+        }
+
+        *workers = pool.release();
+        return S_OK;
+    }
+
+    void Release() noexcept
+    {
+        {
+            std::unique_lock<std::mutex> registryLock(s_registryLock, std::defer_lock);
+            if (!m_name.empty())
+            {
+                registryLock.lock();
+            }
+
+            if (--m_refs != 0)
+            {
+                return;
+            }
+
+            if (!m_name.empty())
+            {
+                s_namedPools.erase(std::find(s_namedPools.begin(), s_namedPools.end(), this));
+            }
+        }
+
+        delete this;
+    }
+
+    PTP_CALLBACK_ENVIRON Environment() noexcept
+    {
+        return &m_environment;
+    }
+
+    ~ThreadPoolWorkers() noexcept
+    {
+        if (m_pool != nullptr)
+        {
+            DestroyThreadpoolEnvironment(&m_environment);
+            CloseThreadpool(m_pool);
+        }
+    }
+
+private:
+
+    std::atomic<uint32_t> m_refs{ 1 };
+    std::string m_name;
+    PTP_POOL m_pool = nullptr;
+    TP_CALLBACK_ENVIRON m_environment;
+
+    static std::mutex s_registryLock;
+    static std::vector<ThreadPoolWorkers*> s_namedPools;
+};
+
+std::mutex ThreadPoolWorkers::s_registryLock;
+std::vector<ThreadPoolWorkers*> ThreadPoolWorkers::s_namedPools;
+
 class ThreadPoolImpl
 {
 public:
@@ -8,6 +130,11 @@ public:
     ~ThreadPoolImpl() noexcept
     {
         Terminate();
+
+        if (m_workers != nullptr)
+        {
+            m_workers->Release();
+        }
     }
 
     void AddRef()
@@ -25,11 +152,19 @@ public:
 
     HRESULT Initialize(
         _In_opt_ void* context,
-        _In_ ThreadPoolCallback* callback) noexcept
+        _In_ ThreadPoolCallback* callback,
+        _In_opt_ const XTaskQueueThreadPoolOptions* options) noexcept
     {
         m_context = context;
         m_callback = callback;
-        m_work = CreateThreadpoolWork(TPCallback, this, nullptr);
+
+        // Without options work goes to the process default pool
+        if (options != nullptr)
+        {
+            RETURN_IF_FAILED(ThreadPoolWorkers::Acquire(options, &m_workers));
+        }
+
+        m_work = CreateThreadpoolWork(TPCallback, this, m_workers != nullptr ? m_workers->Environment() : nullptr);
         RETURN_LAST_ERROR_IF_NULL(m_work);
 
         InitializeCriticalSection(&m_cs);
@@ -61,10 +196,13 @@ public:
         }
     }
 
-    void Submit() noexcept
+    void Submit(_In_ uint32_t count) noexcept
     {
-        m_activeCalls++;
-        SubmitThreadpoolWork(m_work);
+        m_activeCalls += count;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            SubmitThreadpoolWork(m_work);
+        }
     }
 
 private:
@@ -123,6 +261,7 @@ private:
     CONDITION_VARIABLE m_cv;
     CRITICAL_SECTION m_cs;
     PTP_WORK m_work = nullptr;
+    ThreadPoolWorkers* m_workers = nullptr;
     void* m_context = nullptr;
     std::atomic<uint32_t> m_activeCalls { 0 };
     ThreadPoolCallback* m_callback = nullptr;
@@ -138,14 +277,17 @@ ThreadPool::~ThreadPool() noexcept
     Terminate();
 }
 
-HRESULT ThreadPool::Initialize(_In_opt_ void* context, _In_ ThreadPoolCallback* callback) noexcept
+HRESULT ThreadPool::Initialize(
+    _In_opt_ void* context,
+    _In_ ThreadPoolCallback* callback,
+    _In_opt_ const XTaskQueueThreadPoolOptions* options) noexcept
 {
     RETURN_HR_IF(E_UNEXPECTED, m_impl != nullptr);
     
     std::unique_ptr<ThreadPoolImpl> impl(new (std::nothrow) ThreadPoolImpl);
     RETURN_IF_NULL_ALLOC(impl);
 
-    RETURN_IF_FAILED(impl->Initialize(context, callback));
+    RETURN_IF_FAILED(impl->Initialize(context, callback, options));
 
     m_impl = impl.release();
     return S_OK;
@@ -161,7 +303,7 @@ void ThreadPool::Terminate() noexcept
     }
 }
 
-void ThreadPool::Submit()
+void ThreadPool::Submit(_In_ uint32_t count)
 {
-    m_impl->Submit();
+    m_impl->Submit(count);
 }
@@ -3,9 +3,13 @@
 
 using Deadline = std::chrono::high_resolution_clock::time_point;
 
+class TimerQueue;
+
 class WaitTimerImpl
 {
 public:
+    ~WaitTimerImpl();
+
     HRESULT Initialize(_In_opt_ void* context, _In_ WaitTimerCallback* callback);
     void Start(_In_ uint64_t absoluteTime);
     void Cancel();
@@ -13,24 +17,38 @@ public:
 
 private:
 
+    friend class TimerQueue;
+
     void* m_context;
     WaitTimerCallback* m_callback;
-};
 
-struct TimerEntry
-{
-    Deadline When;
-    WaitTimerImpl* Timer;
-    TimerEntry(Deadline d, WaitTimerImpl* t) : When{ d }, Timer{ t } {}
+    // Wheel linkage, owned by the timer queue and guarded by its lock.
+    // A timer is in at most one slot list at a time.
+    WaitTimerImpl* m_prev = nullptr;
+    WaitTimerImpl* m_next = nullptr;
+    uint64_t m_expires = 0;
+    uint32_t m_slot = 0;
+    bool m_armed = false;
 };
 
-struct TimerEntryComparator
-{
-    bool operator()(TimerEntry const& l, TimerEntry const& r) noexcept
-    {
-        return l.When > r.When;
-    }
-};
+// Timers are kept in a hierarchical timing wheel with 1ms ticks. Level 0
+// has a slot per tick for the current 256ms span; each level above covers
+// 256 times the span of the one below, and timers cascade down a level
+// as their span comes up. Arming and canceling a timer is O(1) list
+// surgery, and the worker jumps straight to the next occupied slot using
+// the per-level occupancy bitmaps.
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_LEVEL_BITS 8
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_LEVEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+// Slots past the wheel proper: timers beyond the top level's range,
+// and timers that are due and waiting for the worker to invoke them.
+#define TIMER_WHEEL_OVERFLOW_SLOT (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS)
+#define TIMER_WHEEL_DUE_SLOT (TIMER_WHEEL_OVERFLOW_SLOT + 1)
+#define TIMER_WHEEL_TOTAL_SLOTS (TIMER_WHEEL_DUE_SLOT + 1)
+
+#define TIMER_WHEEL_NO_EVENT UINT64_MAX
 
 class TimerQueue
 {
@@ -41,18 +59,51 @@ public:
     void Set(WaitTimerImpl* timer, Deadline deadline) noexcept;
     void Remove(WaitTimerImpl const* timer) noexcept;
 
+    // Removes the timer and waits for any callback running for it on
+    // another thread to return.
+    void RemoveAndWait(WaitTimerImpl* timer) noexcept;
+
 private:
+    struct Slot
+    {
+        WaitTimerImpl* head = nullptr;
+        WaitTimerImpl* tail = nullptr;
+    };
+
     void Worker() noexcept;
 
-    TimerEntry const& Peek() const noexcept;
-    TimerEntry Pop() noexcept;
+    static uint64_t ToTick(Deadline deadline) noexcept;
+    static uint64_t NowTick() noexcept;
+
+    void Link(WaitTimerImpl* timer, uint32_t slot) noexcept;
+    void Unlink(WaitTimerImpl* timer) noexcept;
+    void Place(WaitTimerImpl* timer) noexcept;
+    void Cascade(uint32_t slot) noexcept;
+    void ProcessTick(uint64_t tick) noexcept;
+    void Advance(uint64_t tick) noexcept;
+    uint64_t NextEvent() const noexcept;
+    uint32_t FindOccupied(uint32_t level, uint32_t first) const noexcept;
 
     std::mutex m_mutex;
     std::condition_variable m_cv;
-    std::vector<TimerEntry> m_queue; // used as a heap
+    std::condition_variable m_invokeComplete;
     std::thread m_t;
     bool m_exitThread = false;
     bool m_initialized = false;
+
+    Slot m_slots[TIMER_WHEEL_TOTAL_SLOTS];
+    uint64_t m_occupied[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS / 64] = {};
+    uint32_t m_overflowCount = 0;
+
+    // Every tick up to and including m_now has been processed.
+    uint64_t m_now = 0;
+
+    // Tick the worker is sleeping until, so Set only wakes it for
+    // timers that are due sooner.
+    uint64_t m_sleepUntil = 0;
+
+    WaitTimerImpl* m_invoking = nullptr;
+    std::thread::id m_workerId;
 };
 
 namespace
@@ -80,6 +131,9 @@ bool TimerQueue::LazyInit() noexcept
     m_exitThread = false;
     std::call_once(g_timerQueueLazyInit, [this]()
     {
+        m_now = NowTick();
+        m_sleepUntil = m_now;
+
         try
         {
             m_t = std::thread([this]()
@@ -99,35 +153,65 @@ bool TimerQueue::LazyInit() noexcept
 
 void TimerQueue::Set(WaitTimerImpl* timer, Deadline deadline) noexcept
 {
+    bool wake;
     {
         std::lock_guard<std::mutex> lock{ m_mutex };
 
-        for (auto& entry : m_queue)
+        if (timer->m_armed)
         {
-            if (entry.Timer == timer)
-            {
-                entry.Timer = nullptr;
-            }
+            Unlink(timer);
         }
 
-        m_queue.emplace_back(deadline, timer);
-        std::push_heap(m_queue.begin(), m_queue.end(), TimerEntryComparator{});
+        timer->m_expires = ToTick(deadline);
+        timer->m_armed = true;
+
+        if (timer->m_expires <= m_now)
+        {
+            Link(timer, TIMER_WHEEL_DUE_SLOT);
+        }
+        else
+        {
+            Place(timer);
+        }
+
+        wake = timer->m_expires < m_sleepUntil;
+        if (wake)
+        {
+            m_sleepUntil = timer->m_expires;
+        }
+    }
+
+    if (wake)
+    {
+        m_cv.notify_all();
     }
-    m_cv.notify_all();
 }
 
 void TimerQueue::Remove(WaitTimerImpl const* timer) noexcept
 {
     std::lock_guard<std::mutex> lock{ m_mutex };
 
-    // since m_queue is a heap, removing elements is non trivial, instead we
-    // just clean the timer pointer and the entry will be popped eventually
+    if (timer->m_armed)
+    {
+        Unlink(const_cast<WaitTimerImpl*>(timer));
+    }
+}
 
-    for (auto& entry : m_queue)
+void TimerQueue::RemoveAndWait(WaitTimerImpl* timer) noexcept
+{
+    std::unique_lock<std::mutex> lock{ m_mutex };
+
+    if (timer->m_armed)
     {
-        if (entry.Timer == timer)
+        Unlink(timer);
+    }
+
+    // A timer may be destroyed from within its own callback
+    if (std::this_thread::get_id() != m_workerId)
+    {
+        while (m_invoking == timer)
         {
-            entry.Timer = nullptr;
+            m_invokeComplete.wait(lock);
         }
     }
 }
@@ -135,32 +219,47 @@ void TimerQueue::Remove(WaitTimerImpl const* timer) noexcept
 void TimerQueue::Worker() noexcept
 {
     std::unique_lock<std::mutex> lock{ m_mutex };
+    m_workerId = std::this_thread::get_id();
+
     while (!m_exitThread)
     {
-        while (!m_queue.empty())
-        {
-            Deadline next = Peek().When;
-            if (std::chrono::high_resolution_clock::now() < next)
-            {
-                break;
-            }
+        Advance(NowTick());
 
-            TimerEntry entry = Pop();
+        Slot& due = m_slots[TIMER_WHEEL_DUE_SLOT];
+        while (due.head != nullptr && !m_exitThread)
+        {
+            WaitTimerImpl* timer = due.head;
+            Unlink(timer);
+            m_invoking = timer;
 
             // release the lock while invoking the callback, just in case timer
             // gets destroyed on this thread or re-adds itself in the callback
             lock.unlock();
-            if (entry.Timer) // Timer is set to nullptr if the entry is removed
-            {
-                entry.Timer->InvokeCallback();
-            }
+            timer->InvokeCallback();
             lock.lock();
+
+            m_invoking = nullptr;
+            m_invokeComplete.notify_all();
         }
 
-        if (!m_queue.empty())
+        if (m_exitThread)
         {
-            Deadline next = Peek().When;
-            m_cv.wait_until(lock, next);
+            break;
+        }
+
+        // Callbacks may have run for a while; pick up anything that came
+        // due in the meantime before sleeping.
+        if (NowTick() > m_now)
+        {
+            continue;
+        }
+
+        uint64_t next = NextEvent();
+        m_sleepUntil = next;
+
+        if (next != TIMER_WHEEL_NO_EVENT)
+        {
+            m_cv.wait_until(lock, Deadline(std::chrono::milliseconds(next)));
         }
         else
         {
@@ -169,19 +268,229 @@ void TimerQueue::Worker() noexcept
     }
 }
 
-TimerEntry const& TimerQueue::Peek() const noexcept
+uint64_t TimerQueue::ToTick(Deadline deadline) noexcept
+{
+    // Round up so a timer never fires before its deadline
+    auto sinceEpoch = deadline.time_since_epoch();
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(sinceEpoch);
+    if (ms < sinceEpoch)
+    {
+        ms += std::chrono::milliseconds(1);
+    }
+    return ms.count() < 0 ? 0 : static_cast<uint64_t>(ms.count());
+}
+
+uint64_t TimerQueue::NowTick() noexcept
+{
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::high_resolution_clock::now().time_since_epoch());
+    return static_cast<uint64_t>(ms.count());
+}
+
+void TimerQueue::Link(WaitTimerImpl* timer, uint32_t slot) noexcept
+{
+    // assume lock is held
+    Slot& s = m_slots[slot];
+    timer->m_slot = slot;
+    timer->m_next = nullptr;
+    timer->m_prev = s.tail;
+
+    if (s.tail != nullptr)
+    {
+        s.tail->m_next = timer;
+    }
+    else
+    {
+        s.head = timer;
+        if (slot < TIMER_WHEEL_OVERFLOW_SLOT)
+        {
+            m_occupied[slot / TIMER_WHEEL_SLOTS][(slot & TIMER_WHEEL_MASK) / 64] |= 1ull << (slot % 64);
+        }
+    }
+    s.tail = timer;
+
+    if (slot == TIMER_WHEEL_OVERFLOW_SLOT)
+    {
+        m_overflowCount++;
+    }
+}
+
+void TimerQueue::Unlink(WaitTimerImpl* timer) noexcept
+{
+    // assume lock is held
+    uint32_t slot = timer->m_slot;
+    Slot& s = m_slots[slot];
+
+    if (timer->m_prev != nullptr)
+    {
+        timer->m_prev->m_next = timer->m_next;
+    }
+    else
+    {
+        s.head = timer->m_next;
+    }
+
+    if (timer->m_next != nullptr)
+    {
+        timer->m_next->m_prev = timer->m_prev;
+    }
+    else
+    {
+        s.tail = timer->m_prev;
+    }
+
+    if (s.head == nullptr && slot < TIMER_WHEEL_OVERFLOW_SLOT)
+    {
+        m_occupied[slot / TIMER_WHEEL_SLOTS][(slot & TIMER_WHEEL_MASK) / 64] &= ~(1ull << (slot % 64));
+    }
+
+    if (slot == TIMER_WHEEL_OVERFLOW_SLOT)
+    {
+        m_overflowCount--;
+    }
+
+    timer->m_prev = nullptr;
+    timer->m_next = nullptr;
+    timer->m_armed = false;
+}
+
+void TimerQueue::Place(WaitTimerImpl* timer) noexcept
+{
+    // assume lock is held; the timer expires at or after m_now. It goes
+    // on the lowest level whose span it shares with m_now.
+    uint64_t expires = timer->m_expires;
+
+    for (uint32_t level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        uint32_t shift = TIMER_WHEEL_LEVEL_BITS * (level + 1);
+        if ((expires >> shift) == (m_now >> shift))
+        {
+            uint32_t index = static_cast<uint32_t>(expires >> (shift - TIMER_WHEEL_LEVEL_BITS)) & TIMER_WHEEL_MASK;
+            Link(timer, level * TIMER_WHEEL_SLOTS + index);
+            return;
+        }
+    }
+
+    Link(timer, TIMER_WHEEL_OVERFLOW_SLOT);
+}
+
+void TimerQueue::Cascade(uint32_t slot) noexcept
 {
     // assume lock is held
-    return m_queue.front();
+    WaitTimerImpl* timer = m_slots[slot].head;
+    while (timer != nullptr)
+    {
+        WaitTimerImpl* next = timer->m_next;
+        Unlink(timer);
+        timer->m_armed = true;
+        Place(timer);
+        timer = next;
+    }
 }
 
-TimerEntry TimerQueue::Pop() noexcept
+void TimerQueue::ProcessTick(uint64_t tick) noexcept
 {
     // assume lock is held
-    TimerEntry e = m_queue.front();
-    std::pop_heap(m_queue.begin(), m_queue.end(), TimerEntryComparator{});
-    m_queue.pop_back();
-    return e;
+    m_now = tick;
+
+    // Spans that begin at this tick move down a level, top down, so a
+    // timer can fall through several levels in one pass.
+    if (m_overflowCount != 0 && (tick & ((1ull << (TIMER_WHEEL_LEVEL_BITS * TIMER_WHEEL_LEVELS)) - 1)) == 0)
+    {
+        Cascade(TIMER_WHEEL_OVERFLOW_SLOT);
+    }
+
+    for (uint32_t level = TIMER_WHEEL_LEVELS - 1; level > 0; level--)
+    {
+        uint32_t shift = TIMER_WHEEL_LEVEL_BITS * level;
+        if ((tick & ((1ull << shift) - 1)) == 0)
+        {
+            uint32_t index = static_cast<uint32_t>(tick >> shift) & TIMER_WHEEL_MASK;
+            Cascade(level * TIMER_WHEEL_SLOTS + index);
+        }
+    }
+
+    // Everything in this tick's level 0 slot is due
+    uint32_t slot = static_cast<uint32_t>(tick) & TIMER_WHEEL_MASK;
+    WaitTimerImpl* timer = m_slots[slot].head;
+    while (timer != nullptr)
+    {
+        WaitTimerImpl* next = timer->m_next;
+        Unlink(timer);
+        timer->m_armed = true;
+        Link(timer, TIMER_WHEEL_DUE_SLOT);
+        timer = next;
+    }
+}
+
+void TimerQueue::Advance(uint64_t tick) noexcept
+{
+    // assume lock is held
+    while (m_now < tick)
+    {
+        uint64_t next = NextEvent();
+        if (next > tick)
+        {
+            // Nothing happens between here and tick, so skip straight to it
+            m_now = tick;
+            break;
+        }
+
+        ProcessTick(next);
+    }
+}
+
+uint64_t TimerQueue::NextEvent() const noexcept
+{
+    // assume lock is held. Returns the first tick after m_now at which a
+    // slot expires or cascades.
+    uint64_t next = TIMER_WHEEL_NO_EVENT;
+
+    for (uint32_t level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        uint32_t shift = TIMER_WHEEL_LEVEL_BITS * level;
+        uint32_t current = static_cast<uint32_t>(m_now >> shift) & TIMER_WHEEL_MASK;
+        uint32_t index = FindOccupied(level, current + 1);
+        if (index < TIMER_WHEEL_SLOTS)
+        {
+            uint64_t span = (m_now >> (shift + TIMER_WHEEL_LEVEL_BITS)) << (shift + TIMER_WHEEL_LEVEL_BITS);
+            next = std::min(next, span | (static_cast<uint64_t>(index) << shift));
+        }
+    }
+
+    if (m_overflowCount != 0)
+    {
+        uint32_t shift = TIMER_WHEEL_LEVEL_BITS * TIMER_WHEEL_LEVELS;
+        next = std::min(next, ((m_now >> shift) + 1) << shift);
+    }
+
+    return next;
+}
+
+uint32_t TimerQueue::FindOccupied(uint32_t level, uint32_t first) const noexcept
+{
+    // assume lock is held. Returns TIMER_WHEEL_SLOTS if no slot at or
+    // after first is occupied.
+    for (uint32_t word = first / 64; word < TIMER_WHEEL_SLOTS / 64; word++)
+    {
+        uint64_t bits = m_occupied[level][word];
+        if (word == first / 64)
+        {
+            bits &= ~0ull << (first % 64);
+        }
+
+        if (bits != 0)
+        {
+            return word * 64 + static_cast<uint32_t>(__builtin_ctzll(bits));
+        }
+    }
+
+    return TIMER_WHEEL_SLOTS;
+}
+
+WaitTimerImpl::~WaitTimerImpl()
+{
+    g_timerQueue.RemoveAndWait(this);
 }
 
 HRESULT WaitTimerImpl::Initialize(_In_opt_ void* context, _In_ WaitTimerCallback* callback)
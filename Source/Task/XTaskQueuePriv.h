@@ -14,4 +14,26 @@
 /// <param name='port'>The port to check.</param>
 STDAPI_(bool) XTaskQueueIsEmpty(
     _In_ XTaskQueueHandle queue,
-    _In_ XTaskQueuePort port);
+    _In_ XTaskQueuePort port) noexcept;
+
+/// <summary>
+/// Statistics for the block pool that task queue entries and
+/// list nodes are allocated from.
+/// </summary>
+struct XTaskQueueAllocatorStats
+{
+    uint64_t blockSize;
+    uint64_t blocksOutstanding;
+    uint64_t blocksHighWater;
+    uint64_t blocksInDepot;
+    uint64_t heapAllocations;
+};
+
+/// <summary>
+/// Returns statistics for the task queue entry allocator.
+/// blocksOutstanding counts blocks taken from the heap that
+/// have not been given back, whether in use or cached.
+/// </summary>
+/// <param name='stats'>Receives the statistics.</param>
+STDAPI_(void) XTaskQueueGetAllocatorStats(
+    _Out_ XTaskQueueAllocatorStats* stats) noexcept;
@@ -1,33 +1,45 @@
 #include "pch.h"
 
-#include <cassert>
-
 #include "../hcwebsocket.h"
+#include "../../HTTP/Generic/generic_http_connection.h"
+
+using namespace xbox::httpclient;
 
 HRESULT CALLBACK Internal_HCWebSocketConnectAsync(
     _In_z_ const char* uri,
     _In_z_ const char* subProtocol,
     _In_ HCWebsocketHandle websocket,
     _Inout_ XAsyncBlock* asyncBlock,
-    _In_opt_ void* context,
-    _In_ HCPerformEnv /*env*/
+    _In_opt_ void* /*context*/,
+    _In_ HCPerformEnv env
 )
 {
-    // Register custom websocket handlers
-    assert(false);
-    return E_UNEXPECTED;
+    if (websocket == nullptr || env == nullptr)
+    {
+        return E_INVALIDARG;
+    }
+
+    return env->websocketEngine.connect(websocket, uri, subProtocol, asyncBlock);
 }
 
 HRESULT CALLBACK Internal_HCWebSocketSendMessageAsync(
     _In_ HCWebsocketHandle websocket,
     _In_z_ const char* message,
     _Inout_ XAsyncBlock* asyncBlock,
-    _In_opt_ void* context
+    _In_opt_ void* /*context*/
 )
 {
-    // Register custom websocket handlers
-    assert(false);
-    return E_UNEXPECTED;
+    if (websocket == nullptr || message == nullptr)
+    {
+        return E_INVALIDARG;
+    }
+
+    std::shared_ptr<websocket_connection> connection = std::dynamic_pointer_cast<websocket_connection>(websocket->impl);
+    if (connection == nullptr)
+    {
+        return E_UNEXPECTED;
+    }
+    return connection->send(asyncBlock, websocket_opcode::text, reinterpret_cast<const uint8_t*>(message), strlen(message));
 }
 
 HRESULT CALLBACK Internal_HCWebSocketSendBinaryMessageAsync(
@@ -35,21 +47,78 @@ HRESULT CALLBACK Internal_HCWebSocketSendBinaryMessageAsync(
     _In_reads_bytes_(payloadSize) const uint8_t* payloadBytes,
     _In_ uint32_t payloadSize,
     _Inout_ XAsyncBlock* asyncBlock,
-    _In_opt_ void* context
+    _In_opt_ void* /*context*/
 )
 {
-    // Register custom websocket handlers
-    assert(false);
-    return E_UNEXPECTED;
+    if (websocket == nullptr || (payloadBytes == nullptr && payloadSize > 0))
+    {
+        return E_INVALIDARG;
+    }
+
+    std::shared_ptr<websocket_connection> connection = std::dynamic_pointer_cast<websocket_connection>(websocket->impl);
+    if (connection == nullptr)
+    {
+        return E_UNEXPECTED;
+    }
+    return connection->send(asyncBlock, websocket_opcode::binary, payloadBytes, payloadSize);
+}
+
+HRESULT CALLBACK Internal_HCWebSocketSendMessageBuffer(
+    _In_ HCWebsocketHandle websocket,
+    _In_ HCWebSocketMessageType messageType,
+    _In_reads_bytes_opt_(payloadSize) const uint8_t* payloadBytes,
+    _In_ uint32_t payloadSize,
+    _In_ HCWebSocketSendBufferReleaseFunction releaseFunc,
+    _In_opt_ void* releaseContext
+)
+{
+    std::shared_ptr<websocket_connection> connection = std::dynamic_pointer_cast<websocket_connection>(websocket->impl);
+    if (connection == nullptr)
+    {
+        return E_UNEXPECTED;
+    }
+
+    auto opcode = messageType == HCWebSocketMessageType::Text ? websocket_opcode::text : websocket_opcode::binary;
+    return connection->send_buffer(opcode, payloadBytes, payloadSize, releaseFunc, releaseContext);
+}
+
+HRESULT CALLBACK Internal_HCWebSocketSendMessageFragment(
+    _In_ HCWebsocketHandle websocket,
+    _In_ HCWebSocketMessageType messageType,
+    _In_reads_bytes_opt_(payloadSize) const uint8_t* payloadBytes,
+    _In_ uint32_t payloadSize,
+    _In_ bool isFinalFragment,
+    _In_ HCWebSocketSendBufferReleaseFunction releaseFunc,
+    _In_opt_ void* releaseContext
+)
+{
+    std::shared_ptr<websocket_connection> connection = std::dynamic_pointer_cast<websocket_connection>(websocket->impl);
+    if (connection == nullptr)
+    {
+        return E_UNEXPECTED;
+    }
+
+    auto opcode = messageType == HCWebSocketMessageType::Text ? websocket_opcode::text : websocket_opcode::binary;
+    return connection->send_fragment(opcode, payloadBytes, payloadSize, isFinalFragment, releaseFunc, releaseContext);
 }
 
 HRESULT CALLBACK Internal_HCWebSocketDisconnect(
     _In_ HCWebsocketHandle websocket,
     _In_ HCWebSocketCloseStatus closeStatus,
-    _In_opt_ void* context
+    _In_opt_ void* /*context*/
 )
 {
-    // Register custom websocket handlers
-    assert(false);
-    return E_UNEXPECTED;
+    if (websocket == nullptr)
+    {
+        return E_INVALIDARG;
+    }
+
+    std::shared_ptr<websocket_connection> connection = std::dynamic_pointer_cast<websocket_connection>(websocket->impl);
+    if (connection == nullptr)
+    {
+        return E_UNEXPECTED;
+    }
+
+    HC_TRACE_INFORMATION(WEBSOCKET, "Websocket [ID %llu]: disconnecting", websocket->id);
+    return connection->disconnect(closeStatus);
 }
@@ -0,0 +1,2358 @@
+// Copyright (c) Microsoft Corporation
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+#include "pch.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <openssl/x509v3.h>
+
+#include "uri.h"
+#include "generic_websocket_connection.h"
+
+NAMESPACE_XBOX_HTTP_CLIENT_BEGIN
+
+#define WEBSOCKET_ACCEPT_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define SUB_PROTOCOL_HEADER "Sec-WebSocket-Protocol"
+
+namespace
+{
+
+http_internal_string base64_encode(_In_reads_bytes_(length) const uint8_t* data, _In_ size_t length)
+{
+    http_internal_string encoded(4 * ((length + 2) / 3) + 1, '\0');
+    int encodedLength = EVP_EncodeBlock(reinterpret_cast<unsigned char*>(&encoded[0]), data, static_cast<int>(length));
+    encoded.resize(static_cast<size_t>(encodedLength));
+    return encoded;
+}
+
+void trim(_Inout_ const char** begin, _Inout_ const char** end)
+{
+    while (*begin < *end && (**begin == ' ' || **begin == '\t'))
+    {
+        ++*begin;
+    }
+    while (*end > *begin && ((*end)[-1] == ' ' || (*end)[-1] == '\t'))
+    {
+        --*end;
+    }
+}
+
+bool header_name_equals(_In_reads_(length) const char* name, _In_ size_t length, _In_z_ const char* expected)
+{
+    return strlen(expected) == length && strncasecmp(name, expected, length) == 0;
+}
+
+} // anonymous namespace
+
+//
+// websocket_connection
+//
+
+websocket_connection::websocket_connection(_In_ websocket_engine* engine, _In_ HCWebsocketHandle websocket) noexcept :
+    m_engine{ engine },
+    m_websocket{ websocket }
+{
+}
+
+websocket_connection::~websocket_connection()
+{
+    // Sends that raced with the engine shutting down
+    release_inbox(E_ABORT);
+    hand_off_read_buffer();
+    close_socket();
+}
+
+HRESULT websocket_connection::connect(
+    _In_z_ const char* uri,
+    _In_z_ const char* subProtocol,
+    _Inout_ XAsyncBlock* asyncBlock
+    ) noexcept
+{
+    HCWebSocketGetEventFunctions(m_websocket, &m_messageFunc, &m_binaryMessageFunc, &m_closeFunc, &m_callbackContext);
+    m_receiveFragments = m_websocket->ReceivesFragments();
+    m_receiveBatches = m_websocket->ReceivesBatches();
+    m_connectAsyncBlock = asyncBlock;
+
+    void* context = shared_ptr_cache::store(shared_from_this());
+    RETURN_HR_IF(E_HC_NOT_INITIALISED, context == nullptr);
+
+    HRESULT hr = XAsyncBegin(asyncBlock, context, (void*)HCWebSocketConnectAsync, __FUNCTION__,
+        [](XAsyncOp op, const XAsyncProviderData* data)
+    {
+        if (op == XAsyncOp::GetResult)
+        {
+            auto connection = shared_ptr_cache::fetch<websocket_connection>(data->context, true);
+            auto result = reinterpret_cast<WebSocketCompletionResult*>(data->buffer);
+            result->websocket = connection->m_websocket;
+            result->errorCode = connection->m_connectResult;
+            result->platformErrorCode = connection->m_connectPlatformError;
+        }
+        else if (op == XAsyncOp::Cleanup)
+        {
+            shared_ptr_cache::remove(data->context);
+        }
+        return S_OK;
+    });
+    if (FAILED(hr))
+    {
+        shared_ptr_cache::remove(context);
+        return hr;
+    }
+
+    // From here on failures are reported on the reactor like any other failed
+    // connect, so the close callback still releases the provider's reference.
+    // The host is looked up on a resolver thread, never on the caller's.
+    m_connectResult = prepare_connect(uri, subProtocol);
+
+    hr = SUCCEEDED(m_connectResult) ?
+        resolve_then_post(&websocket_connection::start) :
+        post(&websocket_connection::start);
+    if (FAILED(hr))
+    {
+        m_connectResult = hr;
+        m_connectAsyncBlock = nullptr;
+        XAsyncComplete(asyncBlock, S_OK, sizeof(WebSocketCompletionResult));
+        return hr;
+    }
+
+    return S_OK;
+}
+
+HRESULT websocket_connection::prepare_connect(_In_z_ const char* uri, _In_z_ const char* subProtocol) noexcept
+{
+    try
+    {
+        Uri parsed{ uri };
+        if (!parsed.IsValid() || (parsed.Scheme() != "ws" && parsed.Scheme() != "wss"))
+        {
+            HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: invalid uri", m_websocket->id);
+            return E_INVALIDARG;
+        }
+
+        if (!m_websocket->proxyUri.empty())
+        {
+            HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: proxies are not supported on this platform", m_websocket->id);
+            return E_NOTIMPL;
+        }
+
+        m_host = parsed.Host();
+        m_secure = parsed.IsSecure();
+        m_port = parsed.IsPortDefault() ? (m_secure ? 443 : 80) : parsed.Port();
+
+        uint8_t nonce[16];
+        RETURN_HR_IF(E_FAIL, RAND_bytes(nonce, sizeof(nonce)) != 1);
+        http_internal_string key = base64_encode(nonce, sizeof(nonce));
+
+        http_internal_string acceptInput{ key };
+        acceptInput += WEBSOCKET_ACCEPT_GUID;
+        uint8_t digest[SHA_DIGEST_LENGTH];
+        SHA1(reinterpret_cast<const unsigned char*>(acceptInput.data()), acceptInput.size(), digest);
+        m_expectedAccept = base64_encode(digest, sizeof(digest));
+
+        http_internal_string& data = m_handshakeRequest;
+        data.reserve(512);
+
+        data += "GET ";
+        data += parsed.Path().empty() ? "/" : parsed.Path().c_str();
+        if (!parsed.Query().empty())
+        {
+            data += '?';
+            data += parsed.Query();
+        }
+        data += " HTTP/1.1\r\n";
+
+        bool hasHost = false;
+        for (const auto& header : m_websocket->connectHeaders)
+        {
+            // Subprotocols come from the connect call
+            if (strcasecmp(header.name, SUB_PROTOCOL_HEADER) == 0)
+            {
+                continue;
+            }
+            if (strcasecmp(header.name, "Host") == 0)
+            {
+                hasHost = true;
+            }
+
+            data += header.name;
+            data += ": ";
+            data += header.value;
+            data += "\r\n";
+        }
+
+        if (!hasHost)
+        {
+            data += "Host: ";
+            data += m_host;
+            if (!parsed.IsPortDefault())
+            {
+                data += ':';
+                data += std::to_string(m_port).c_str();
+            }
+            data += "\r\n";
+        }
+
+        data += "Upgrade: websocket\r\n";
+        data += "Connection: Upgrade\r\n";
+        data += "Sec-WebSocket-Version: 13\r\n";
+        data += "Sec-WebSocket-Key: ";
+        data += key;
+        data += "\r\n";
+        data += "Sec-WebSocket-Extensions: " WEBSOCKET_DEFLATE_OFFER "\r\n";
+        if (subProtocol[0] != '\0')
+        {
+            data += SUB_PROTOCOL_HEADER ": ";
+            data += subProtocol;
+            data += "\r\n";
+        }
+        data += "\r\n";
+    }
+    CATCH_RETURN();
+
+    return S_OK;
+}
+
+HRESULT websocket_connection::send(
+    _Inout_ XAsyncBlock* asyncBlock,
+    _In_ websocket_opcode opcode,
+    _In_reads_bytes_(length) const uint8_t* data,
+    _In_ size_t length
+    ) noexcept
+{
+    if (m_state != state::open)
+    {
+        HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: send called while not connected", m_websocket->id);
+        return E_UNEXPECTED;
+    }
+
+    websocket_send_op* op = nullptr;
+    try
+    {
+        // The async block doesn't keep the caller's payload alive, so this is
+        // the one copy. Compression and masking work from it.
+        auto newOp = http_allocate_unique<websocket_send_op>();
+        newOp->websocket = m_websocket;
+        newOp->asyncBlock = asyncBlock;
+        newOp->opcode = opcode;
+        newOp->buffer.assign(data, data + length);
+        newOp->payload = newOp->buffer.data();
+        newOp->payloadLength = length;
+
+        RETURN_IF_FAILED(XAsyncBegin(asyncBlock, newOp.get(), (void*)HCWebSocketSendMessageAsync, __FUNCTION__,
+            [](XAsyncOp asyncOp, const XAsyncProviderData* data)
+        {
+            auto op = static_cast<websocket_send_op*>(data->context);
+            if (asyncOp == XAsyncOp::GetResult)
+            {
+                auto result = reinterpret_cast<WebSocketCompletionResult*>(data->buffer);
+                result->websocket = op->websocket;
+                result->errorCode = op->result;
+                result->platformErrorCode = op->platformError;
+            }
+            else if (asyncOp == XAsyncOp::Cleanup)
+            {
+                HC_UNIQUE_PTR<websocket_send_op> reclaim{ op };
+            }
+            return S_OK;
+        }));
+
+        // The async block owns the op from here on
+        op = newOp.release();
+    }
+    CATCH_RETURN();
+
+    enqueue(op);
+    return S_OK;
+}
+
+HRESULT websocket_connection::send_buffer(
+    _In_ websocket_opcode opcode,
+    _In_reads_bytes_opt_(length) const uint8_t* data,
+    _In_ uint32_t length,
+    _In_ HCWebSocketSendBufferReleaseFunction releaseFunc,
+    _In_opt_ void* releaseContext
+    ) noexcept
+{
+    return send_lent(opcode, data, length, false, false, releaseFunc, releaseContext);
+}
+
+HRESULT websocket_connection::send_fragment(
+    _In_ websocket_opcode opcode,
+    _In_reads_bytes_opt_(length) const uint8_t* data,
+    _In_ uint32_t length,
+    _In_ bool finalFragment,
+    _In_ HCWebSocketSendBufferReleaseFunction releaseFunc,
+    _In_opt_ void* releaseContext
+    ) noexcept
+{
+    return send_lent(opcode, data, length, true, finalFragment, releaseFunc, releaseContext);
+}
+
+HRESULT websocket_connection::send_lent(
+    _In_ websocket_opcode opcode,
+    _In_reads_bytes_opt_(length) const uint8_t* data,
+    _In_ uint32_t length,
+    _In_ bool fragment,
+    _In_ bool finalFragment,
+    _In_ HCWebSocketSendBufferReleaseFunction releaseFunc,
+    _In_opt_ void* releaseContext
+    ) noexcept
+{
+    if (m_state != state::open)
+    {
+        HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: send called while not connected", m_websocket->id);
+        return E_UNEXPECTED;
+    }
+
+    websocket_send_op* op = nullptr;
+    try
+    {
+        auto newOp = http_allocate_unique<websocket_send_op>();
+        newOp->websocket = m_websocket;
+        newOp->releaseFunc = releaseFunc;
+        newOp->releaseContext = releaseContext;
+        newOp->lentBytes = data;
+        newOp->lentSize = length;
+        newOp->opcode = opcode;
+        newOp->fragment = fragment;
+        newOp->finalFragment = finalFragment;
+        newOp->payload = data;
+        newOp->payloadLength = length;
+        op = newOp.release();
+    }
+    CATCH_RETURN();
+
+    enqueue(op);
+    return S_OK;
+}
+
+void websocket_connection::enqueue(_In_ websocket_send_op* op) noexcept
+{
+    websocket_send_op* head = m_inbox.load();
+    do
+    {
+        op->next = head;
+    } while (!m_inbox.compare_exchange_weak(head, op));
+
+    if (m_state == state::closed)
+    {
+        // finish() may have emptied the inbox just before the push
+        release_inbox(E_FAIL);
+        return;
+    }
+
+    if (!m_flushPosted.exchange(true) && FAILED(post(&websocket_connection::flush_inbox)))
+    {
+        // Only happens once the engine is shutting down, and shutdown fails
+        // everything left in the inbox.
+        HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: failed to schedule send", m_websocket->id);
+        m_flushPosted = false;
+    }
+}
+
+websocket_send_op* websocket_connection::take_inbox() noexcept
+{
+    // The stack holds the newest op first
+    websocket_send_op* op = m_inbox.exchange(nullptr);
+    websocket_send_op* ordered = nullptr;
+    while (op != nullptr)
+    {
+        websocket_send_op* next = op->next;
+        op->next = ordered;
+        ordered = op;
+        op = next;
+    }
+    return ordered;
+}
+
+void websocket_connection::release_inbox(_In_ HRESULT result) noexcept
+{
+    websocket_send_op* op = take_inbox();
+    while (op != nullptr)
+    {
+        websocket_send_op* next = op->next;
+        op->next = nullptr;
+        release_op(op, result);
+        op = next;
+    }
+}
+
+HRESULT websocket_connection::disconnect(_In_ HCWebSocketCloseStatus status) noexcept
+{
+    if (m_state == state::closed || m_state == state::created)
+    {
+        return S_OK;
+    }
+
+    m_requestedCloseStatus = status;
+    m_disconnectRequested = true;
+
+    if (!m_flushPosted.exchange(true))
+    {
+        HRESULT hr = post(&websocket_connection::flush_inbox);
+        if (FAILED(hr))
+        {
+            m_flushPosted = false;
+            return hr;
+        }
+    }
+    return S_OK;
+}
+
+HRESULT websocket_connection::post(_In_ void (websocket_connection::*method)()) noexcept
+{
+    try
+    {
+        auto call = http_allocate_unique<posted_call>();
+        call->connection = shared_from_this();
+        call->method = method;
+
+        RETURN_IF_FAILED(m_engine->reactor().post(posted_callback, call.get()));
+        call.release();
+    }
+    CATCH_RETURN();
+
+    return S_OK;
+}
+
+HRESULT websocket_connection::resolve_then_post(_In_ void (websocket_connection::*method)()) noexcept
+{
+    try
+    {
+        auto call = http_allocate_unique<posted_call>();
+        call->connection = shared_from_this();
+        call->method = method;
+
+        RETURN_IF_FAILED(m_engine->resolver().resolve(m_host, m_port, &m_addresses, &m_resolveError, m_engine->reactor(), posted_callback, call.get()));
+        call.release();
+    }
+    CATCH_RETURN();
+
+    return S_OK;
+}
+
+void websocket_connection::posted_callback(_In_opt_ void* context) noexcept
+{
+    HC_UNIQUE_PTR<posted_call> call{ static_cast<posted_call*>(context) };
+    ((*call->connection).*(call->method))();
+}
+
+void websocket_connection::resume_receiving() noexcept
+{
+    post(&websocket_connection::resume_reading);
+}
+
+void websocket_connection::resume_reading()
+{
+    if (!m_receivePaused || (m_state != state::open && m_state != state::closing))
+    {
+        return;
+    }
+
+    m_receivePaused = false;
+    m_readWants = EPOLLIN;
+    continue_receiving();
+    if (m_state == state::open || m_state == state::closing)
+    {
+        continue_sending();
+    }
+}
+
+void websocket_connection::start()
+{
+    m_state = state::connecting;
+    m_connectDeadline = chrono_clock_t::now() + std::chrono::milliseconds(GENERIC_WEBSOCKET_CONNECT_TIMEOUT_MS);
+
+    if (SUCCEEDED(m_connectResult) && m_resolveError != 0)
+    {
+        m_connectResult = E_FAIL;
+        m_connectPlatformError = static_cast<uint32_t>(m_resolveError);
+    }
+
+    if (SUCCEEDED(m_connectResult))
+    {
+        m_connectResult = m_engine->on_connection_started(shared_from_this());
+    }
+
+    if (FAILED(m_connectResult))
+    {
+        finish(HCWebSocketCloseStatus::AbnormalClose, static_cast<int>(m_connectPlatformError));
+        return;
+    }
+
+    m_nextAddress = 0;
+    if (!try_next_address())
+    {
+        HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: failed to connect to %s", m_websocket->id, m_host.c_str());
+        finish(HCWebSocketCloseStatus::AbnormalClose, m_lastError);
+    }
+}
+
+void websocket_connection::flush_inbox()
+{
+    // Cleared first so a send that misses this flush posts another
+    m_flushPosted = false;
+    websocket_send_op* op = take_inbox();
+    bool disconnectRequested = m_disconnectRequested.exchange(false);
+    HCWebSocketCloseStatus closeStatus = m_requestedCloseStatus;
+
+    while (op != nullptr)
+    {
+        websocket_send_op* next = op->next;
+        op->next = nullptr;
+
+        if (m_state != state::open || m_closeQueued)
+        {
+            release_op(op, E_UNEXPECTED);
+            op = next;
+            continue;
+        }
+
+        HRESULT hr = frame(op);
+        if (SUCCEEDED(hr))
+        {
+            try
+            {
+                m_dataQueue.push_back(op);
+            }
+            catch (...)
+            {
+                hr = E_OUTOFMEMORY;
+            }
+        }
+        if (FAILED(hr))
+        {
+            release_op(op, hr);
+        }
+        op = next;
+    }
+
+    if (disconnectRequested)
+    {
+        switch (m_state)
+        {
+        case state::connecting:
+        case state::tls_handshake:
+        case state::upgrading:
+            m_connectResult = E_ABORT;
+            finish(closeStatus, 0);
+            return;
+
+        case state::open:
+            start_close(closeStatus, false);
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    if (m_state == state::open || m_state == state::closing)
+    {
+        continue_sending();
+    }
+}
+
+bool websocket_connection::try_next_address() noexcept
+{
+    close_socket();
+
+    while (m_nextAddress < m_addresses.size())
+    {
+        const resolved_address& address = m_addresses[m_nextAddress++];
+
+        int fd = socket(address.address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+        if (fd < 0)
+        {
+            m_lastError = errno;
+            continue;
+        }
+
+        // Frames are written whole; don't let Nagle hold back small messages.
+        int noDelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+        if (::connect(fd, reinterpret_cast<const sockaddr*>(&address.address), address.length) != 0 && errno != EINPROGRESS)
+        {
+            m_lastError = errno;
+            close(fd);
+            continue;
+        }
+
+        if (FAILED(m_engine->reactor().add(fd, EPOLLOUT, this, &m_registration)))
+        {
+            m_lastError = errno;
+            close(fd);
+            continue;
+        }
+
+        m_socket = fd;
+        m_registered = true;
+        m_interest = EPOLLOUT;
+        m_state = state::connecting;
+        return true;
+    }
+
+    return false;
+}
+
+void websocket_connection::on_socket_event(_In_ uint32_t events) noexcept
+{
+    // Callbacks and completions below may drop every other reference
+    auto self = shared_from_this();
+
+    switch (m_state)
+    {
+    case state::connecting:
+    {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(m_socket, SOL_SOCKET, SO_ERROR, &error, &length) != 0)
+        {
+            error = errno;
+        }
+        if (error == 0 && (events & EPOLLERR) != 0)
+        {
+            error = ECONNREFUSED;
+        }
+
+        if (error != 0)
+        {
+            m_lastError = error;
+            if (!try_next_address())
+            {
+                HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: failed to connect to %s", m_websocket->id, m_host.c_str());
+                finish(HCWebSocketCloseStatus::AbnormalClose, m_lastError);
+            }
+            return;
+        }
+
+        on_connected();
+        return;
+    }
+
+    case state::tls_handshake:
+        continue_handshake();
+        return;
+
+    case state::upgrading:
+        continue_upgrade();
+        return;
+
+    case state::open:
+    case state::closing:
+        if (m_receivePaused && (events & (EPOLLHUP | EPOLLERR)) != 0)
+        {
+            // Nothing left to push back on; read what the server sent
+            // before it went away regardless of the limits
+            m_receivePaused = false;
+            m_readWants = EPOLLIN;
+        }
+        continue_receiving();
+        if (m_state == state::open || m_state == state::closing)
+        {
+            continue_sending();
+        }
+        return;
+
+    default:
+        return;
+    }
+}
+
+void websocket_connection::on_connected() noexcept
+{
+    if (!m_secure)
+    {
+        start_upgrade();
+        return;
+    }
+
+    m_ssl = SSL_new(m_engine->ssl_context());
+    if (m_ssl == nullptr || SSL_set_fd(m_ssl, m_socket) != 1)
+    {
+        HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: failed to create TLS session", m_websocket->id);
+        finish(HCWebSocketCloseStatus::AbnormalClose, 0);
+        return;
+    }
+
+    SSL_set_tlsext_host_name(m_ssl, m_host.c_str());
+    SSL_set1_host(m_ssl, m_host.c_str());
+    SSL_set_connect_state(m_ssl);
+
+    m_state = state::tls_handshake;
+    continue_handshake();
+}
+
+void websocket_connection::continue_handshake() noexcept
+{
+    ERR_clear_error();
+    int ret = SSL_do_handshake(m_ssl);
+    if (ret == 1)
+    {
+        start_upgrade();
+        return;
+    }
+
+    switch (SSL_get_error(m_ssl, ret))
+    {
+    case SSL_ERROR_WANT_READ:
+        update_interest(EPOLLIN);
+        return;
+
+    case SSL_ERROR_WANT_WRITE:
+        update_interest(EPOLLOUT);
+        return;
+
+    default:
+    {
+        long verifyResult = SSL_get_verify_result(m_ssl);
+        if (verifyResult != X509_V_OK)
+        {
+            HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: certificate verification failed: %s", m_websocket->id, X509_verify_cert_error_string(verifyResult));
+            finish(HCWebSocketCloseStatus::AbnormalClose, static_cast<int>(verifyResult));
+        }
+        else
+        {
+            HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: TLS handshake failed", m_websocket->id);
+            finish(HCWebSocketCloseStatus::AbnormalClose, static_cast<int>(ERR_get_error()));
+        }
+        return;
+    }
+    }
+}
+
+void websocket_connection::start_upgrade() noexcept
+{
+    try
+    {
+        m_readBuffer.resize(GENERIC_WEBSOCKET_READ_BUFFER_SIZE + 1);
+        m_gather.resize(GENERIC_WEBSOCKET_GATHER_BUFFER_SIZE);
+    }
+    catch (...)
+    {
+        finish(HCWebSocketCloseStatus::AbnormalClose, ENOMEM);
+        return;
+    }
+
+    m_readStart = 0;
+    m_readEnd = 0;
+    m_handshakeSent = 0;
+    m_state = state::upgrading;
+    continue_upgrade();
+}
+
+void websocket_connection::continue_upgrade() noexcept
+{
+    while (m_handshakeSent < m_handshakeRequest.size())
+    {
+        size_t written = 0;
+        switch (do_write(reinterpret_cast<const uint8_t*>(m_handshakeRequest.data()) + m_handshakeSent, m_handshakeRequest.size() - m_handshakeSent, &written))
+        {
+        case io_result::ok:
+            m_handshakeSent += written;
+            break;
+
+        case io_result::would_block:
+            update_interest(m_sslWantEvents);
+            return;
+
+        default:
+            HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: failed to send upgrade request", m_websocket->id);
+            finish(HCWebSocketCloseStatus::AbnormalClose, m_lastError);
+            return;
+        }
+    }
+
+    for (;;)
+    {
+        const char* response = reinterpret_cast<const char*>(m_readBuffer.data());
+        auto end = static_cast<const char*>(memmem(response, m_readEnd, "\r\n\r\n", 4));
+        if (end != nullptr)
+        {
+            size_t headerLength = static_cast<size_t>(end - response) + 4;
+            if (process_upgrade_response(response, headerLength))
+            {
+                // Anything after the headers is already frame data
+                m_readStart = headerLength;
+                on_open();
+            }
+            return;
+        }
+
+        if (m_readEnd + 1 == m_readBuffer.size())
+        {
+            if (m_readBuffer.size() > GENERIC_WEBSOCKET_MAX_HANDSHAKE_BYTES)
+            {
+                HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: upgrade response too large", m_websocket->id);
+                finish(HCWebSocketCloseStatus::AbnormalClose, 0);
+                return;
+            }
+
+            try
+            {
+                m_readBuffer.resize(m_readBuffer.size() * 2);
+            }
+            catch (...)
+            {
+                finish(HCWebSocketCloseStatus::AbnormalClose, ENOMEM);
+                return;
+            }
+        }
+
+        size_t bytesRead = 0;
+        switch (do_read(m_readBuffer.data() + m_readEnd, m_readBuffer.size() - m_readEnd - 1, &bytesRead))
+        {
+        case io_result::ok:
+            m_readEnd += bytesRead;
+            break;
+
+        case io_result::would_block:
+            update_interest(m_sslWantEvents);
+            return;
+
+        case io_result::eof:
+            HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: connection closed during upgrade", m_websocket->id);
+            finish(HCWebSocketCloseStatus::AbnormalClose, ECONNRESET);
+            return;
+
+        default:
+            HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: failed to receive upgrade response", m_websocket->id);
+            finish(HCWebSocketCloseStatus::AbnormalClose, m_lastError);
+            return;
+        }
+    }
+}
+
+bool websocket_connection::process_upgrade_response(_In_reads_(length) const char* response, _In_ size_t length) noexcept
+{
+    const char* position = response;
+    const char* end = response + length - 2;
+
+    uint64_t statusCode = 0;
+    bool upgrade = false;
+    bool connection = false;
+    bool accepted = false;
+    bool extensionSeen = false;
+    bool subProtocolSeen = false;
+
+    bool statusLine = true;
+    while (position < end)
+    {
+        auto lineEnd = static_cast<const char*>(memmem(position, static_cast<size_t>(end - position), "\r\n", 2));
+        if (lineEnd == nullptr)
+        {
+            lineEnd = end;
+        }
+
+        if (statusLine)
+        {
+            statusLine = false;
+
+            // HTTP/1.1 101 Switching Protocols
+            const char* code = static_cast<const char*>(memchr(position, ' ', static_cast<size_t>(lineEnd - position)));
+            if (strncmp(position, "HTTP/1.", 7) != 0 || code == nullptr || lineEnd - code < 4 ||
+                !StringToUint4(code + 1, code + 4, statusCode, 10))
+            {
+                HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: invalid upgrade response", m_websocket->id);
+                finish(HCWebSocketCloseStatus::AbnormalClose, 0);
+                return false;
+            }
+
+            if (statusCode != 101)
+            {
+                HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: server rejected upgrade with status %llu", m_websocket->id, statusCode);
+                finish(HCWebSocketCloseStatus::AbnormalClose, static_cast<int>(statusCode));
+                return false;
+            }
+        }
+        else
+        {
+            const char* colon = static_cast<const char*>(memchr(position, ':', static_cast<size_t>(lineEnd - position)));
+            if (colon != nullptr)
+            {
+                const char* nameBegin = position;
+                const char* nameEnd = colon;
+                const char* valueBegin = colon + 1;
+                const char* valueEnd = lineEnd;
+                trim(&nameBegin, &nameEnd);
+                trim(&valueBegin, &valueEnd);
+
+                size_t nameLength = static_cast<size_t>(nameEnd - nameBegin);
+                http_internal_string value{ valueBegin, static_cast<size_t>(valueEnd - valueBegin) };
+
+                if (header_name_equals(nameBegin, nameLength, "Upgrade"))
+                {
+                    upgrade = strcasestr(value.c_str(), "websocket") != nullptr;
+                }
+                else if (header_name_equals(nameBegin, nameLength, "Connection"))
+                {
+                    connection = strcasestr(value.c_str(), "upgrade") != nullptr;
+                }
+                else if (header_name_equals(nameBegin, nameLength, "Sec-WebSocket-Accept"))
+                {
+                    accepted = value == m_expectedAccept;
+                }
+                else if (header_name_equals(nameBegin, nameLength, "Sec-WebSocket-Extensions"))
+                {
+                    websocket_deflate_options options;
+                    bool negotiated = false;
+                    if (extensionSeen || FAILED(websocket_parse_deflate_response(value.c_str(), &negotiated, &options)) ||
+                        (negotiated && FAILED(m_deflate.initialize(options))))
+                    {
+                        HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: unsupported extensions: %s", m_websocket->id, value.c_str());
+                        finish(HCWebSocketCloseStatus::AbnormalClose, 0);
+                        return false;
+                    }
+                    extensionSeen = true;
+                    m_deflateEnabled = negotiated;
+                }
+                else if (header_name_equals(nameBegin, nameLength, SUB_PROTOCOL_HEADER))
+                {
+                    subProtocolSeen = true;
+                }
+            }
+        }
+
+        position = lineEnd + 2;
+    }
+
+    if (!upgrade || !connection || !accepted || (subProtocolSeen && m_handshakeRequest.find(SUB_PROTOCOL_HEADER) == http_internal_string::npos))
+    {
+        HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: invalid upgrade response headers", m_websocket->id);
+        finish(HCWebSocketCloseStatus::AbnormalClose, 0);
+        return false;
+    }
+
+    return true;
+}
+
+void websocket_connection::on_open() noexcept
+{
+    // The request is no longer needed
+    http_internal_string{}.swap(m_handshakeRequest);
+
+    m_readWants = EPOLLIN;
+    m_writeWants = 0;
+    m_state = state::open;
+    complete_connect(S_OK, 0);
+
+    continue_receiving();
+    if (m_state == state::open || m_state == state::closing)
+    {
+        continue_sending();
+    }
+}
+
+void websocket_connection::continue_sending() noexcept
+{
+    while (m_state == state::open || m_state == state::closing)
+    {
+        if (m_segmentIndex == m_segmentCount)
+        {
+            fill_batch();
+            if (m_segmentCount == 0)
+            {
+                break;
+            }
+        }
+
+        size_t written = 0;
+        switch (do_write_segments(m_segments + m_segmentIndex, m_segmentCount - m_segmentIndex, &written))
+        {
+        case io_result::ok:
+            m_batchWritten += written;
+            while (written > 0)
+            {
+                iovec& segment = m_segments[m_segmentIndex];
+                size_t consumed = std::min(written, segment.iov_len);
+                segment.iov_base = static_cast<uint8_t*>(segment.iov_base) + consumed;
+                segment.iov_len -= consumed;
+                written -= consumed;
+                if (segment.iov_len == 0)
+                {
+                    ++m_segmentIndex;
+                }
+            }
+
+            if (!complete_written())
+            {
+                return;
+            }
+            continue;
+
+        case io_result::would_block:
+            m_writeWants = m_sslWantEvents;
+            update_interest(m_readWants | m_writeWants);
+            return;
+
+        default:
+            HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: send failed", m_websocket->id);
+            finish(HCWebSocketCloseStatus::AbnormalClose, m_lastError);
+            return;
+        }
+    }
+
+    m_writeWants = 0;
+    update_interest(m_readWants);
+}
+
+bool websocket_connection::next_op() noexcept
+{
+    // Nothing follows the close frame
+    if (m_closeSent || (m_closeQueued && m_closeOp == nullptr))
+    {
+        return false;
+    }
+
+    // Control frames may go between the frames of other messages, but never
+    // into the middle of one.
+    if (!m_controlQueue.empty())
+    {
+        m_currentOp = m_controlQueue.front();
+        m_controlQueue.pop_front();
+    }
+    else if (!m_dataQueue.empty())
+    {
+        m_currentOp = m_dataQueue.front();
+        m_dataQueue.pop_front();
+    }
+    else if (m_closeOp != nullptr)
+    {
+        m_currentOp = m_closeOp;
+        m_closeOp = nullptr;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+void websocket_connection::fill_batch() noexcept
+{
+    reset_batch();
+
+    // Headers and small or lent payloads are masked into the gather buffer,
+    // so a run of small messages goes out in one write. A payload too big for
+    // what's left of it continues in the next batch.
+    while (m_currentOp != nullptr || next_op())
+    {
+        websocket_send_op* op = m_currentOp;
+
+        if (!op->headerQueued)
+        {
+            if (GENERIC_WEBSOCKET_GATHER_BUFFER_SIZE - m_gatherUsed < op->headerLength)
+            {
+                return;
+            }
+            memcpy(m_gather.data() + m_gatherUsed, op->header, op->headerLength);
+            if (!add_gathered(op->headerLength))
+            {
+                return;
+            }
+            op->headerQueued = true;
+        }
+
+        while (op->payloadQueued < op->payloadLength)
+        {
+            size_t remaining = op->payloadLength - op->payloadQueued;
+            if (op->maskedInPlace)
+            {
+                if (!add_segment(op->payload + op->payloadQueued, remaining))
+                {
+                    return;
+                }
+                op->payloadQueued += remaining;
+            }
+            else
+            {
+                size_t length = std::min(remaining, GENERIC_WEBSOCKET_GATHER_BUFFER_SIZE - m_gatherUsed);
+                if (length == 0)
+                {
+                    return;
+                }
+                websocket_mask_copy(m_gather.data() + m_gatherUsed, op->payload + op->payloadQueued, length, op->maskKey, op->payloadQueued);
+                if (!add_gathered(length))
+                {
+                    return;
+                }
+                op->payloadQueued += length;
+            }
+        }
+
+        // The whole frame is in the batch; it completes once written
+        m_currentOp = nullptr;
+        op->batchEnd = m_batchLength;
+        if (m_batchTail != nullptr)
+        {
+            m_batchTail->next = op;
+        }
+        else
+        {
+            m_batchHead = op;
+        }
+        m_batchTail = op;
+
+        if (op->opcode == websocket_opcode::close)
+        {
+            return;
+        }
+    }
+}
+
+bool websocket_connection::add_segment(_In_reads_bytes_(length) const uint8_t* data, _In_ size_t length) noexcept
+{
+    if (m_segmentCount == GENERIC_WEBSOCKET_MAX_WRITE_SEGMENTS)
+    {
+        return false;
+    }
+
+    m_segments[m_segmentCount].iov_base = const_cast<uint8_t*>(data);
+    m_segments[m_segmentCount].iov_len = length;
+    ++m_segmentCount;
+    m_batchLength += length;
+    m_lastSegmentGathered = false;
+    return true;
+}
+
+bool websocket_connection::add_gathered(_In_ size_t length) noexcept
+{
+    if (m_lastSegmentGathered)
+    {
+        m_segments[m_segmentCount - 1].iov_len += length;
+        m_batchLength += length;
+    }
+    else if (!add_segment(m_gather.data() + m_gatherUsed, length))
+    {
+        return false;
+    }
+
+    m_lastSegmentGathered = true;
+    m_gatherUsed += length;
+    return true;
+}
+
+bool websocket_connection::complete_written() noexcept
+{
+    while (m_batchHead != nullptr && m_batchHead->batchEnd <= m_batchWritten)
+    {
+        websocket_send_op* op = m_batchHead;
+        m_batchHead = op->next;
+        if (m_batchHead == nullptr)
+        {
+            m_batchTail = nullptr;
+        }
+        op->next = nullptr;
+
+        bool closeFrame = op->opcode == websocket_opcode::close;
+        release_op(op, S_OK);
+        if (closeFrame)
+        {
+            m_closeSent = true;
+            if (m_closeReceived || m_failAfterClose)
+            {
+                finish(m_closeStatus, 0);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void websocket_connection::reset_batch() noexcept
+{
+    m_segmentCount = 0;
+    m_segmentIndex = 0;
+    m_batchLength = 0;
+    m_batchWritten = 0;
+    m_gatherUsed = 0;
+    m_lastSegmentGathered = false;
+}
+
+void websocket_connection::continue_receiving() noexcept
+{
+    while (m_state == state::open || m_state == state::closing)
+    {
+        process_frames();
+        if (m_state != state::open && m_state != state::closing)
+        {
+            return;
+        }
+
+        if (m_receivePaused)
+        {
+            // The app is over its inbound limits. Unread data backs up into
+            // the socket and on to the server until resume_reading.
+            m_readWants = 0;
+            update_interest(m_writeWants);
+            return;
+        }
+
+        if (!prepare_read_buffer())
+        {
+            finish(HCWebSocketCloseStatus::AbnormalClose, ENOMEM);
+            return;
+        }
+
+        size_t bytesRead = 0;
+        switch (do_read(m_readBuffer.data() + m_readEnd, m_readBuffer.size() - m_readEnd - 1, &bytesRead))
+        {
+        case io_result::ok:
+            m_readEnd += bytesRead;
+            break;
+
+        case io_result::would_block:
+            m_readWants = m_sslWantEvents;
+            update_interest(m_readWants | m_writeWants);
+            return;
+
+        case io_result::eof:
+            // A server that completed the close handshake closes the socket
+            // before we get to; anything else is an abnormal close.
+            finish(m_closeReceived ? m_closeStatus : HCWebSocketCloseStatus::AbnormalClose, 0);
+            return;
+
+        default:
+            HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: receive failed", m_websocket->id);
+            finish(HCWebSocketCloseStatus::AbnormalClose, m_lastError);
+            return;
+        }
+    }
+}
+
+bool websocket_connection::prepare_read_buffer() noexcept
+{
+    try
+    {
+        size_t buffered = m_readEnd - m_readStart;
+        if (m_lentReadBuffer != nullptr)
+        {
+            // Messages were lent from this buffer, so it goes with them and
+            // whatever is left of it moves to a new one
+            http_internal_vector<uint8_t> readBuffer(std::max<size_t>(buffered, GENERIC_WEBSOCKET_READ_BUFFER_SIZE) + 1);
+            if (buffered > 0)
+            {
+                memcpy(readBuffer.data(), m_readBuffer.data() + m_readStart, buffered);
+            }
+            hand_off_read_buffer();
+            m_readBuffer.swap(readBuffer);
+            m_readStart = 0;
+            m_readEnd = buffered;
+        }
+        else if (m_readStart > 0)
+        {
+            memmove(m_readBuffer.data(), m_readBuffer.data() + m_readStart, buffered);
+            m_readStart = 0;
+            m_readEnd = buffered;
+        }
+
+        if (buffered == 0 && m_readBuffer.size() > 4 * GENERIC_WEBSOCKET_READ_BUFFER_SIZE)
+        {
+            // Give back the room a large frame needed
+            http_internal_vector<uint8_t>(GENERIC_WEBSOCKET_READ_BUFFER_SIZE + 1).swap(m_readBuffer);
+        }
+
+        // One spare byte so a text payload at the very end can be NUL
+        // terminated in place
+        size_t required = std::max<size_t>(m_frameBytesNeeded, GENERIC_WEBSOCKET_READ_BUFFER_SIZE) + 1;
+        if (m_readBuffer.size() < required)
+        {
+            m_readBuffer.resize(required);
+        }
+        return true;
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
+
+void websocket_connection::process_frames() noexcept
+{
+    while (m_state == state::open || m_state == state::closing)
+    {
+        if (m_closeReceived || m_failAfterClose)
+        {
+            // Nothing after a close frame, or on a failed connection, is
+            // processed
+            m_readStart = m_readEnd;
+            m_frameBytesNeeded = 0;
+            return;
+        }
+        if (m_receivePaused)
+        {
+            return;
+        }
+
+        uint8_t* data = m_readBuffer.data() + m_readStart;
+        size_t available = m_readEnd - m_readStart;
+
+        if (m_streamingFrame)
+        {
+            // Whatever has arrived of the frame goes to the app now
+            size_t length = static_cast<size_t>(std::min<uint64_t>(m_streamFrameRemaining, available));
+            if (length == 0 && m_streamFrameRemaining > 0)
+            {
+                return;
+            }
+            m_readStart += length;
+            m_streamFrameRemaining -= length;
+            m_streamingFrame = m_streamFrameRemaining > 0;
+            stream_payload(data, length, !m_streamingFrame && m_streamFrameFin);
+            continue;
+        }
+
+        websocket_frame_header header;
+        if (!websocket_parse_frame_header(data, available, &header))
+        {
+            m_frameBytesNeeded = 0;
+            return;
+        }
+
+        if (m_receiveFragments &&
+            (header.opcode == websocket_opcode::text || header.opcode == websocket_opcode::binary || header.opcode == websocket_opcode::continuation))
+        {
+            // Only the header is consumed here; the payload is streamed above
+            // as it arrives, so the message size limit doesn't apply
+            m_frameBytesNeeded = 0;
+            m_readStart += header.headerLength;
+            if (!check_frame(header))
+            {
+                continue;
+            }
+            if (header.opcode != websocket_opcode::continuation)
+            {
+                if (m_messageInProgress)
+                {
+                    fail_connection(HCWebSocketCloseStatus::ProtocolError, "new message before the previous one finished");
+                    continue;
+                }
+                m_messageInProgress = true;
+                m_messageCompressed = header.rsv1;
+                m_messageOpcode = header.opcode;
+                m_utf8.reset();
+            }
+            else if (!m_messageInProgress)
+            {
+                fail_connection(HCWebSocketCloseStatus::ProtocolError, "unexpected continuation frame");
+                continue;
+            }
+            m_streamingFrame = true;
+            m_streamFrameFin = header.fin;
+            m_streamFrameRemaining = header.payloadLength;
+            continue;
+        }
+
+        if (header.payloadLength > GENERIC_WEBSOCKET_MAX_MESSAGE_BYTES)
+        {
+            fail_connection(HCWebSocketCloseStatus::TooLarge, "frame too large");
+            continue;
+        }
+
+        size_t frameLength = header.headerLength + static_cast<size_t>(header.payloadLength);
+        if (available < frameLength)
+        {
+            m_frameBytesNeeded = frameLength;
+            return;
+        }
+
+        m_frameBytesNeeded = 0;
+        m_readStart += frameLength;
+        handle_frame(header, data + header.headerLength);
+    }
+}
+
+bool websocket_connection::check_frame(_In_ const websocket_frame_header& header) noexcept
+{
+    bool control = (static_cast<uint8_t>(header.opcode) & 0x8) != 0;
+
+    if (header.reservedBits || header.masked)
+    {
+        fail_connection(HCWebSocketCloseStatus::ProtocolError, "invalid frame header");
+        return false;
+    }
+    if (control && (!header.fin || header.payloadLength > WEBSOCKET_MAX_CONTROL_PAYLOAD_BYTES))
+    {
+        fail_connection(HCWebSocketCloseStatus::ProtocolError, "invalid control frame");
+        return false;
+    }
+    if (header.rsv1 && (!m_deflateEnabled || control || header.opcode == websocket_opcode::continuation))
+    {
+        fail_connection(HCWebSocketCloseStatus::ProtocolError, "unexpected compressed frame");
+        return false;
+    }
+    return true;
+}
+
+void websocket_connection::stream_payload(
+    _In_reads_bytes_(length) const uint8_t* data,
+    _In_ size_t length,
+    _In_ bool last
+    ) noexcept
+{
+    if (m_messageCompressed)
+    {
+        // Inflated a piece at a time; the limit only guards against a piece
+        // that expands without end
+        m_message.clear();
+        HRESULT hr = m_deflate.decompress(data, length, last, GENERIC_WEBSOCKET_MAX_MESSAGE_BYTES, m_message);
+        if (hr == E_BOUNDS)
+        {
+            fail_connection(HCWebSocketCloseStatus::TooLarge, "message too large");
+            return;
+        }
+        if (FAILED(hr))
+        {
+            fail_connection(HCWebSocketCloseStatus::InconsistentDatatype, "invalid compressed message");
+            return;
+        }
+        data = m_message.data();
+        length = m_message.size();
+    }
+
+    if (m_messageOpcode == websocket_opcode::text &&
+        (!m_utf8.append(data, length) || (last && !m_utf8.complete())))
+    {
+        fail_connection(HCWebSocketCloseStatus::InconsistentDatatype, "invalid UTF-8 in text message");
+        return;
+    }
+
+    if (length > 0 || last)
+    {
+        auto messageType = m_messageOpcode == websocket_opcode::text ? HCWebSocketMessageType::Text : HCWebSocketMessageType::Binary;
+        HC_WEBSOCKET::MessageFragmentFunc(m_websocket, messageType, data, static_cast<uint32_t>(length), last, m_callbackContext);
+    }
+
+    if (last)
+    {
+        m_messageInProgress = false;
+        m_message.clear();
+        if (m_message.capacity() > 4 * GENERIC_WEBSOCKET_READ_BUFFER_SIZE)
+        {
+            http_internal_vector<uint8_t>{}.swap(m_message);
+        }
+    }
+}
+
+void websocket_connection::handle_frame(_In_ const websocket_frame_header& header, _In_ uint8_t* payload) noexcept
+{
+    size_t length = static_cast<size_t>(header.payloadLength);
+
+    if (!check_frame(header))
+    {
+        return;
+    }
+
+    switch (header.opcode)
+    {
+    case websocket_opcode::text:
+    case websocket_opcode::binary:
+        if (m_messageInProgress)
+        {
+            fail_connection(HCWebSocketCloseStatus::ProtocolError, "new message before the previous one finished");
+            return;
+        }
+
+        if (header.fin && !header.rsv1)
+        {
+            // Complete and uncompressed, the common case: hand it over
+            // straight from the read buffer
+            if (m_receiveBatches)
+            {
+                try
+                {
+                    if (m_lentReadBuffer == nullptr)
+                    {
+                        m_lentReadBuffer = http_allocate_shared<http_internal_vector<uint8_t>>();
+                    }
+                }
+                catch (...)
+                {
+                    finish(HCWebSocketCloseStatus::AbnormalClose, ENOMEM);
+                    return;
+                }
+                queue_message(header.opcode, payload, length, m_lentReadBuffer);
+            }
+            else
+            {
+                deliver_message(header.opcode, payload, length);
+            }
+            return;
+        }
+
+        m_messageInProgress = true;
+        m_messageCompressed = header.rsv1;
+        m_messageOpcode = header.opcode;
+        m_message.clear();
+        append_message(payload, length, header.fin);
+        return;
+
+    case websocket_opcode::continuation:
+        if (!m_messageInProgress)
+        {
+            fail_connection(HCWebSocketCloseStatus::ProtocolError, "unexpected continuation frame");
+            return;
+        }
+        append_message(payload, length, header.fin);
+        return;
+
+    case websocket_opcode::close:
+        handle_close_frame(payload, length);
+        return;
+
+    case websocket_opcode::ping:
+        queue_control(websocket_opcode::pong, payload, length);
+        return;
+
+    case websocket_opcode::pong:
+        return;
+
+    default:
+        fail_connection(HCWebSocketCloseStatus::ProtocolError, "unknown opcode");
+        return;
+    }
+}
+
+void websocket_connection::append_message(
+    _In_reads_bytes_(length) const uint8_t* data,
+    _In_ size_t length,
+    _In_ bool finalFrame
+    ) noexcept
+{
+    if (m_messageCompressed)
+    {
+        HRESULT hr = m_deflate.decompress(data, length, finalFrame, GENERIC_WEBSOCKET_MAX_MESSAGE_BYTES, m_message);
+        if (hr == E_BOUNDS)
+        {
+            fail_connection(HCWebSocketCloseStatus::TooLarge, "message too large");
+            return;
+        }
+        if (FAILED(hr))
+        {
+            fail_connection(HCWebSocketCloseStatus::InconsistentDatatype, "invalid compressed message");
+            return;
+        }
+    }
+    else
+    {
+        if (m_message.size() + length > GENERIC_WEBSOCKET_MAX_MESSAGE_BYTES)
+        {
+            fail_connection(HCWebSocketCloseStatus::TooLarge, "message too large");
+            return;
+        }
+
+        try
+        {
+            m_message.insert(m_message.end(), data, data + length);
+        }
+        catch (...)
+        {
+            finish(HCWebSocketCloseStatus::AbnormalClose, ENOMEM);
+            return;
+        }
+    }
+
+    if (finalFrame)
+    {
+        m_messageInProgress = false;
+
+        if (m_receiveBatches)
+        {
+            // Lend the message itself; the next one starts a new buffer
+            std::shared_ptr<http_internal_vector<uint8_t>> message;
+            try
+            {
+                message = http_allocate_shared<http_internal_vector<uint8_t>>(std::move(m_message));
+            }
+            catch (...)
+            {
+                finish(HCWebSocketCloseStatus::AbnormalClose, ENOMEM);
+                return;
+            }
+            m_message.clear();
+            const uint8_t* data = message->data();
+            size_t length = message->size();
+            queue_message(m_messageOpcode, data, length, std::move(message));
+            return;
+        }
+
+        try
+        {
+            m_message.push_back(0);
+        }
+        catch (...)
+        {
+            finish(HCWebSocketCloseStatus::AbnormalClose, ENOMEM);
+            return;
+        }
+
+        deliver_message(m_messageOpcode, m_message.data(), m_message.size() - 1);
+
+        m_message.clear();
+        if (m_message.capacity() > 4 * GENERIC_WEBSOCKET_READ_BUFFER_SIZE)
+        {
+            http_internal_vector<uint8_t>{}.swap(m_message);
+        }
+    }
+}
+
+void websocket_connection::deliver_message(
+    _In_ websocket_opcode opcode,
+    _Inout_updates_bytes_(length + 1) uint8_t* data,
+    _In_ size_t length
+    ) noexcept
+{
+    if (opcode == websocket_opcode::text)
+    {
+        if (!websocket_is_valid_utf8(data, length))
+        {
+            fail_connection(HCWebSocketCloseStatus::InconsistentDatatype, "invalid UTF-8 in text message");
+            return;
+        }
+
+        // The byte after the payload belongs to the next frame, or is spare;
+        // borrow it for the terminator.
+        uint8_t saved = data[length];
+        data[length] = 0;
+        m_messageFunc(m_websocket, reinterpret_cast<const char*>(data), m_callbackContext);
+        data[length] = saved;
+    }
+    else
+    {
+        m_binaryMessageFunc(m_websocket, data, static_cast<uint32_t>(length), m_callbackContext);
+    }
+}
+
+void websocket_connection::queue_message(
+    _In_ websocket_opcode opcode,
+    _In_reads_bytes_(length) const uint8_t* data,
+    _In_ size_t length,
+    _In_ std::shared_ptr<void> holder
+    ) noexcept
+{
+    if (opcode == websocket_opcode::text && !websocket_is_valid_utf8(data, length))
+    {
+        fail_connection(HCWebSocketCloseStatus::InconsistentDatatype, "invalid UTF-8 in text message");
+        return;
+    }
+
+    auto messageType = opcode == websocket_opcode::text ? HCWebSocketMessageType::Text : HCWebSocketMessageType::Binary;
+    bool pauseReceiving = false;
+    if (FAILED(m_websocket->QueueMessage(messageType, data, static_cast<uint32_t>(length), std::move(holder), &pauseReceiving)))
+    {
+        fail_connection(HCWebSocketCloseStatus::ServerTerminate, "couldn't queue a received message");
+        return;
+    }
+    if (pauseReceiving)
+    {
+        m_receivePaused = true;
+    }
+}
+
+void websocket_connection::hand_off_read_buffer() noexcept
+{
+    if (m_lentReadBuffer != nullptr)
+    {
+        m_lentReadBuffer->swap(m_readBuffer);
+        m_lentReadBuffer.reset();
+    }
+}
+
+void websocket_connection::handle_close_frame(_In_reads_bytes_(length) const uint8_t* payload, _In_ size_t length) noexcept
+{
+    auto status = HCWebSocketCloseStatus::EmptyStatus;
+    auto errorStatus = HCWebSocketCloseStatus::ProtocolError;
+    const char* error = nullptr;
+    if (length == 1)
+    {
+        error = "invalid close frame";
+    }
+    else if (length >= 2)
+    {
+        uint32_t code = (static_cast<uint32_t>(payload[0]) << 8) | payload[1];
+        if (!websocket_is_valid_close_status(code))
+        {
+            error = "invalid close status";
+        }
+        else if (!websocket_is_valid_utf8(payload + 2, length - 2))
+        {
+            errorStatus = HCWebSocketCloseStatus::InconsistentDatatype;
+            error = "invalid close reason";
+        }
+        status = static_cast<HCWebSocketCloseStatus>(code);
+    }
+
+    if (error != nullptr)
+    {
+        // The peer has closed its side already, so once our close is out
+        // there's nothing to wait for
+        fail_connection(errorStatus, error);
+        m_closeReceived = true;
+        if (m_closeSent)
+        {
+            finish(m_closeStatus, 0);
+        }
+        return;
+    }
+
+    m_closeReceived = true;
+    m_messageInProgress = false;
+
+    if (!m_closeQueued)
+    {
+        // Server initiated; echo its status and report it
+        fail_queued_sends();
+        start_close(status, false);
+    }
+    else if (m_closeSent)
+    {
+        finish(m_closeStatus, 0);
+    }
+}
+
+HRESULT websocket_connection::frame(_Inout_ websocket_send_op* op) noexcept
+{
+    bool dataFrame = op->opcode == websocket_opcode::text || op->opcode == websocket_opcode::binary;
+    if (dataFrame && m_sendFragmentInProgress && !op->fragment)
+    {
+        // Ops are framed in send order, so this message would land in the
+        // middle of the fragmented one
+        HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: send called before the final fragment of a message", m_websocket->id);
+        return E_UNEXPECTED;
+    }
+
+    // The frames of a fragmented message are sent as they are; the extension
+    // compresses whole messages
+    bool fin = !op->fragment || op->finalFragment;
+    websocket_opcode opcode = op->fragment && m_sendFragmentInProgress ? websocket_opcode::continuation : op->opcode;
+
+    bool compressed = false;
+    if (m_deflateEnabled && dataFrame && !op->fragment &&
+        op->payloadLength >= GENERIC_WEBSOCKET_MIN_COMPRESS_BYTES)
+    {
+        try
+        {
+            http_internal_vector<uint8_t> output;
+            RETURN_IF_FAILED(m_deflate.compress(op->payload, op->payloadLength, 0, output));
+            op->buffer.swap(output);
+        }
+        CATCH_RETURN();
+
+        op->payload = op->buffer.data();
+        op->payloadLength = op->buffer.size();
+        compressed = true;
+    }
+
+    if (m_maskKeysUsed == sizeof(m_maskKeys))
+    {
+        RETURN_HR_IF(E_FAIL, RAND_bytes(m_maskKeys, sizeof(m_maskKeys)) != 1);
+        m_maskKeysUsed = 0;
+    }
+    memcpy(op->maskKey, m_maskKeys + m_maskKeysUsed, WEBSOCKET_MASK_KEY_BYTES);
+    m_maskKeysUsed += WEBSOCKET_MASK_KEY_BYTES;
+
+    op->headerLength = websocket_frame_header_size(op->payloadLength, true);
+    websocket_write_frame_header(op->header, fin, compressed, opcode, op->payloadLength, op->maskKey);
+    if (op->fragment)
+    {
+        m_sendFragmentInProgress = !fin;
+    }
+
+    // A lent buffer is never written to. A large buffer of our own is masked
+    // where it is rather than copied again.
+    bool owned = op->lentBytes == nullptr || compressed;
+    if (owned && op->payloadLength >= GENERIC_WEBSOCKET_MIN_SEGMENT_BYTES)
+    {
+        websocket_mask(op->buffer.data(), op->payloadLength, op->maskKey, 0);
+        op->maskedInPlace = true;
+    }
+    return S_OK;
+}
+
+websocket_send_op* websocket_connection::make_control(
+    _In_ websocket_opcode opcode,
+    _In_reads_bytes_(length) const uint8_t* payload,
+    _In_ size_t length
+    ) noexcept
+{
+    try
+    {
+        auto op = http_allocate_unique<websocket_send_op>();
+        op->websocket = m_websocket;
+        op->opcode = opcode;
+        op->buffer.assign(payload, payload + length);
+        op->payload = op->buffer.data();
+        op->payloadLength = length;
+
+        if (FAILED(frame(op.get())))
+        {
+            return nullptr;
+        }
+        return op.release();
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void websocket_connection::queue_control(
+    _In_ websocket_opcode opcode,
+    _In_reads_bytes_(length) const uint8_t* payload,
+    _In_ size_t length
+    ) noexcept
+{
+    if (m_closeQueued)
+    {
+        return;
+    }
+
+    websocket_send_op* op = make_control(opcode, payload, length);
+    if (op == nullptr)
+    {
+        return;
+    }
+
+    try
+    {
+        m_controlQueue.push_back(op);
+    }
+    catch (...)
+    {
+        release_op(op, E_OUTOFMEMORY);
+    }
+}
+
+void websocket_connection::start_close(_In_ HCWebSocketCloseStatus status, _In_ bool failConnection) noexcept
+{
+    if (m_closeQueued)
+    {
+        return;
+    }
+
+    m_closeQueued = true;
+    m_closeStatus = status;
+    m_failAfterClose = failConnection;
+    m_state = state::closing;
+    m_closeDeadline = chrono_clock_t::now() + std::chrono::milliseconds(GENERIC_WEBSOCKET_CLOSE_TIMEOUT_MS);
+
+    // These are only ever reported locally, never sent
+    uint8_t payload[2];
+    size_t length = 0;
+    if (status != HCWebSocketCloseStatus::EmptyStatus &&
+        status != HCWebSocketCloseStatus::AbnormalClose &&
+        status != HCWebSocketCloseStatus::HandshakeError)
+    {
+        payload[0] = static_cast<uint8_t>(static_cast<uint32_t>(status) >> 8);
+        payload[1] = static_cast<uint8_t>(status);
+        length = sizeof(payload);
+    }
+
+    m_closeOp = make_control(websocket_opcode::close, payload, length);
+    if (m_closeOp == nullptr)
+    {
+        finish(status, ENOMEM);
+    }
+}
+
+void websocket_connection::fail_connection(_In_ HCWebSocketCloseStatus status, _In_z_ const char* message) noexcept
+{
+    HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: %s", m_websocket->id, message);
+
+    // Nothing more goes out but the close frame
+    fail_queued_sends();
+    m_messageInProgress = false;
+    start_close(status, true);
+}
+
+void websocket_connection::fail_queued_sends() noexcept
+{
+    while (!m_dataQueue.empty())
+    {
+        release_op(m_dataQueue.front(), E_FAIL);
+        m_dataQueue.pop_front();
+    }
+}
+
+void websocket_connection::release_op(_In_ websocket_send_op* op, _In_ HRESULT result) noexcept
+{
+    if (op->asyncBlock != nullptr)
+    {
+        complete_send(op, result, 0);
+        return;
+    }
+
+    HC_UNIQUE_PTR<websocket_send_op> reclaim{ op };
+    if (op->releaseFunc != nullptr)
+    {
+        op->releaseFunc(op->websocket, op->lentBytes, op->lentSize, result, op->releaseContext);
+    }
+}
+
+void websocket_connection::complete_send(_In_ websocket_send_op* op, _In_ HRESULT result, _In_ uint32_t platformError) noexcept
+{
+    op->result = result;
+    op->platformError = platformError;
+    XAsyncComplete(op->asyncBlock, result, sizeof(WebSocketCompletionResult));
+}
+
+void websocket_connection::complete_connect(_In_ HRESULT result, _In_ uint32_t platformError) noexcept
+{
+    XAsyncBlock* asyncBlock = m_connectAsyncBlock;
+    if (asyncBlock != nullptr)
+    {
+        m_connectAsyncBlock = nullptr;
+        m_connectResult = result;
+        m_connectPlatformError = platformError;
+        XAsyncComplete(asyncBlock, S_OK, sizeof(WebSocketCompletionResult));
+    }
+}
+
+void websocket_connection::tick(_In_ chrono_clock_t::time_point now) noexcept
+{
+    switch (m_state)
+    {
+    case state::connecting:
+    case state::tls_handshake:
+    case state::upgrading:
+        if (now >= m_connectDeadline)
+        {
+            HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: connect timed out", m_websocket->id);
+            finish(HCWebSocketCloseStatus::AbnormalClose, ETIMEDOUT);
+        }
+        return;
+
+    case state::closing:
+        if (now >= m_closeDeadline)
+        {
+            // The server never finished the close handshake
+            finish(m_closeStatus, 0);
+        }
+        return;
+
+    default:
+        return;
+    }
+}
+
+void websocket_connection::abort() noexcept
+{
+    m_connectResult = E_ABORT;
+    finish(HCWebSocketCloseStatus::AbnormalClose, 0);
+}
+
+void websocket_connection::finish(_In_ HCWebSocketCloseStatus status, _In_ int platformError) noexcept
+{
+    if (m_state == state::closed)
+    {
+        return;
+    }
+
+    auto self = shared_from_this();
+    close_socket();
+
+    // Senders check the state after pushing, so nothing is left behind in
+    // the inbox once it's been emptied here.
+    m_state = state::closed;
+    m_disconnectRequested = false;
+
+    // Everything still queued fails before the close callback, which may
+    // free the HC_WEBSOCKET.
+    release_inbox(E_FAIL);
+
+    while (m_batchHead != nullptr)
+    {
+        websocket_send_op* op = m_batchHead;
+        m_batchHead = op->next;
+        op->next = nullptr;
+        release_op(op, E_FAIL);
+    }
+    m_batchTail = nullptr;
+    reset_batch();
+
+    if (m_currentOp != nullptr)
+    {
+        release_op(m_currentOp, E_FAIL);
+        m_currentOp = nullptr;
+    }
+    if (m_closeOp != nullptr)
+    {
+        release_op(m_closeOp, E_FAIL);
+        m_closeOp = nullptr;
+    }
+    while (!m_controlQueue.empty())
+    {
+        release_op(m_controlQueue.front(), E_FAIL);
+        m_controlQueue.pop_front();
+    }
+    fail_queued_sends();
+
+    hand_off_read_buffer();
+    http_internal_vector<uint8_t>{}.swap(m_readBuffer);
+    http_internal_vector<uint8_t>{}.swap(m_message);
+    http_internal_vector<uint8_t>{}.swap(m_gather);
+    m_readStart = 0;
+    m_readEnd = 0;
+
+    if (m_connectAsyncBlock != nullptr)
+    {
+        complete_connect(FAILED(m_connectResult) ? m_connectResult : E_FAIL, static_cast<uint32_t>(platformError));
+    }
+
+    m_engine->on_connection_closed(this);
+
+    if (m_closeFunc != nullptr)
+    {
+        m_closeFunc(m_websocket, status, m_callbackContext);
+    }
+}
+
+void websocket_connection::update_interest(_In_ uint32_t events) noexcept
+{
+    if (events != m_interest && m_registered)
+    {
+        m_engine->reactor().modify(m_socket, events, m_registration);
+        m_interest = events;
+    }
+}
+
+void websocket_connection::close_socket() noexcept
+{
+    if (m_registered)
+    {
+        m_engine->reactor().remove(m_socket, m_registration);
+        m_registered = false;
+    }
+
+    if (m_ssl != nullptr)
+    {
+        if (m_closeSent && m_closeReceived)
+        {
+            // Best effort close_notify; we don't wait for the reply
+            SSL_shutdown(m_ssl);
+        }
+        SSL_free(m_ssl);
+        m_ssl = nullptr;
+    }
+
+    if (m_socket >= 0)
+    {
+        close(m_socket);
+        m_socket = -1;
+    }
+
+    m_interest = 0;
+}
+
+websocket_connection::io_result websocket_connection::do_write(
+    _In_reads_bytes_(length) const uint8_t* data,
+    _In_ size_t length,
+    _Out_ size_t* written
+    ) noexcept
+{
+    *written = 0;
+
+    if (m_ssl != nullptr)
+    {
+        ERR_clear_error();
+        int ret = SSL_write(m_ssl, data, static_cast<int>(std::min<size_t>(length, INT32_MAX)));
+        if (ret > 0)
+        {
+            *written = static_cast<size_t>(ret);
+            return io_result::ok;
+        }
+
+        switch (SSL_get_error(m_ssl, ret))
+        {
+        case SSL_ERROR_WANT_READ: m_sslWantEvents = EPOLLIN; return io_result::would_block;
+        case SSL_ERROR_WANT_WRITE: m_sslWantEvents = EPOLLOUT; return io_result::would_block;
+        case SSL_ERROR_ZERO_RETURN: return io_result::eof;
+        default: m_lastError = errno; return io_result::failed;
+        }
+    }
+
+    for (;;)
+    {
+        ssize_t ret = ::send(m_socket, data, length, MSG_NOSIGNAL);
+        if (ret >= 0)
+        {
+            *written = static_cast<size_t>(ret);
+            return io_result::ok;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            m_sslWantEvents = EPOLLOUT;
+            return io_result::would_block;
+        }
+        m_lastError = errno;
+        return io_result::failed;
+    }
+}
+
+websocket_connection::io_result websocket_connection::do_write_segments(
+    _In_reads_(count) const iovec* segments,
+    _In_ size_t count,
+    _Out_ size_t* written
+    ) noexcept
+{
+    *written = 0;
+
+    if (m_ssl != nullptr)
+    {
+        // Each SSL_write makes its own records; the gather buffer is what
+        // keeps small frames from becoming small records.
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t segmentWritten = 0;
+            io_result result = do_write(static_cast<const uint8_t*>(segments[i].iov_base), segments[i].iov_len, &segmentWritten);
+            if (result != io_result::ok)
+            {
+                // Report what did go out; the next write sees the error again
+                return *written > 0 ? io_result::ok : result;
+            }
+
+            *written += segmentWritten;
+            if (segmentWritten < segments[i].iov_len)
+            {
+                break;
+            }
+        }
+        return io_result::ok;
+    }
+
+    msghdr message{};
+    message.msg_iov = const_cast<iovec*>(segments);
+    message.msg_iovlen = std::min<size_t>(count, GENERIC_WEBSOCKET_MAX_WRITE_SEGMENTS);
+
+    for (;;)
+    {
+        ssize_t ret = sendmsg(m_socket, &message, MSG_NOSIGNAL);
+        if (ret >= 0)
+        {
+            *written = static_cast<size_t>(ret);
+            return io_result::ok;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            m_sslWantEvents = EPOLLOUT;
+            return io_result::would_block;
+        }
+        m_lastError = errno;
+        return io_result::failed;
+    }
+}
+
+websocket_connection::io_result websocket_connection::do_read(
+    _Out_writes_bytes_(length) uint8_t* data,
+    _In_ size_t length,
+    _Out_ size_t* bytesRead
+    ) noexcept
+{
+    *bytesRead = 0;
+
+    if (m_ssl != nullptr)
+    {
+        ERR_clear_error();
+        int ret = SSL_read(m_ssl, data, static_cast<int>(std::min<size_t>(length, INT32_MAX)));
+        if (ret > 0)
+        {
+            *bytesRead = static_cast<size_t>(ret);
+            return io_result::ok;
+        }
+
+        switch (SSL_get_error(m_ssl, ret))
+        {
+        case SSL_ERROR_WANT_READ: m_sslWantEvents = EPOLLIN; return io_result::would_block;
+        case SSL_ERROR_WANT_WRITE: m_sslWantEvents = EPOLLOUT; return io_result::would_block;
+        case SSL_ERROR_ZERO_RETURN: return io_result::eof;
+        case SSL_ERROR_SYSCALL:
+            if (errno == 0)
+            {
+                // Peer closed without close_notify
+                return io_result::eof;
+            }
+            m_lastError = errno;
+            return io_result::failed;
+        default: m_lastError = errno; return io_result::failed;
+        }
+    }
+
+    for (;;)
+    {
+        ssize_t ret = recv(m_socket, data, length, 0);
+        if (ret > 0)
+        {
+            *bytesRead = static_cast<size_t>(ret);
+            return io_result::ok;
+        }
+        if (ret == 0)
+        {
+            return io_result::eof;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            m_sslWantEvents = EPOLLIN;
+            return io_result::would_block;
+        }
+        m_lastError = errno;
+        return io_result::failed;
+    }
+}
+
+//
+// websocket_engine
+//
+
+websocket_engine::websocket_engine() noexcept
+{
+}
+
+websocket_engine::~websocket_engine()
+{
+    if (m_started)
+    {
+        // Connects still waiting on a lookup start, and fail, ahead of the
+        // shutdown
+        m_resolver.stop();
+
+        if (SUCCEEDED(m_reactor.post(shutdown_callback, this)))
+        {
+            m_reactor.stop();
+        }
+    }
+
+    if (m_sslContext != nullptr)
+    {
+        SSL_CTX_free(m_sslContext);
+    }
+}
+
+HRESULT websocket_engine::ensure_started() noexcept
+{
+    std::lock_guard<std::mutex> lock(m_startLock);
+    if (m_started)
+    {
+        return S_OK;
+    }
+
+    m_sslContext = SSL_CTX_new(TLS_client_method());
+    RETURN_IF_NULL_ALLOC(m_sslContext);
+
+    SSL_CTX_set_default_verify_paths(m_sslContext);
+    SSL_CTX_set_verify(m_sslContext, SSL_VERIFY_PEER, nullptr);
+    SSL_CTX_set_min_proto_version(m_sslContext, TLS1_2_VERSION);
+    SSL_CTX_set_mode(m_sslContext, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    SSL_CTX_set_options(m_sslContext, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+    RETURN_IF_FAILED(m_reactor.start(tick_callback, this, GENERIC_WEBSOCKET_TICK_INTERVAL_MS));
+
+    m_started = true;
+    return S_OK;
+}
+
+HRESULT websocket_engine::connect(
+    _In_ HCWebsocketHandle websocket,
+    _In_z_ const char* uri,
+    _In_z_ const char* subProtocol,
+    _Inout_ XAsyncBlock* asyncBlock
+    ) noexcept
+{
+    RETURN_IF_FAILED(ensure_started());
+
+    std::shared_ptr<websocket_connection> connection;
+    try
+    {
+        connection = http_allocate_shared<websocket_connection>(this, websocket);
+        websocket->impl = connection;
+    }
+    CATCH_RETURN();
+
+    return connection->connect(uri, subProtocol, asyncBlock);
+}
+
+HRESULT websocket_engine::on_connection_started(_In_ const std::shared_ptr<websocket_connection>& connection) noexcept
+{
+    try
+    {
+        m_connections[connection.get()] = connection;
+    }
+    CATCH_RETURN();
+
+    return S_OK;
+}
+
+void websocket_engine::on_connection_closed(_In_ websocket_connection* connection) noexcept
+{
+    m_connections.erase(connection);
+}
+
+void websocket_engine::tick_callback(_In_opt_ void* context) noexcept
+{
+    static_cast<websocket_engine*>(context)->tick();
+}
+
+void websocket_engine::shutdown_callback(_In_opt_ void* context) noexcept
+{
+    static_cast<websocket_engine*>(context)->shutdown();
+}
+
+void websocket_engine::tick() noexcept
+{
+    auto now = chrono_clock_t::now();
+
+    // Connections that time out leave the map
+    http_internal_vector<std::shared_ptr<websocket_connection>> connections;
+    try
+    {
+        connections.reserve(m_connections.size());
+        for (auto& entry : m_connections)
+        {
+            connections.push_back(entry.second);
+        }
+    }
+    catch (...)
+    {
+        // Try again on the next tick
+        return;
+    }
+
+    for (auto& connection : connections)
+    {
+        connection->tick(now);
+    }
+}
+
+void websocket_engine::shutdown() noexcept
+{
+    // abort() removes each connection from the map
+    while (!m_connections.empty())
+    {
+        auto connection = m_connections.begin()->second;
+        connection->abort();
+        m_connections.erase(connection.get());
+    }
+}
+
+NAMESPACE_XBOX_HTTP_CLIENT_END
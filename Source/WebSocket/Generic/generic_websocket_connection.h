@@ -0,0 +1,344 @@
+// Copyright (c) Microsoft Corporation
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <openssl/ssl.h>
+
+#include "../hcwebsocket.h"
+#include "../../HTTP/Generic/dns_resolver.h"
+#include "../../HTTP/Generic/socket_reactor.h"
+#include "websocket_frame.h"
+
+NAMESPACE_XBOX_HTTP_CLIENT_BEGIN
+
+#define GENERIC_WEBSOCKET_TICK_INTERVAL_MS 250
+#define GENERIC_WEBSOCKET_CONNECT_TIMEOUT_MS 30000
+#define GENERIC_WEBSOCKET_CLOSE_TIMEOUT_MS 5000
+#define GENERIC_WEBSOCKET_MAX_HANDSHAKE_BYTES (64 * 1024)
+#define GENERIC_WEBSOCKET_MAX_MESSAGE_BYTES (32 * 1024 * 1024)
+#define GENERIC_WEBSOCKET_READ_BUFFER_SIZE (16 * 1024)
+#define GENERIC_WEBSOCKET_MIN_COMPRESS_BYTES 128
+#define GENERIC_WEBSOCKET_GATHER_BUFFER_SIZE (64 * 1024)
+#define GENERIC_WEBSOCKET_MIN_SEGMENT_BYTES 4096
+#define GENERIC_WEBSOCKET_MAX_WRITE_SEGMENTS 64
+
+class websocket_engine;
+
+// An outgoing frame. The payload is either the caller's buffer, lent through
+// HCWebSocketSendMessageBuffer and never modified, or a buffer the op owns:
+// a copy made for the async send APIs, a control payload, or the compressed
+// message. Large owned payloads are masked in place and written from where
+// they are; everything else is masked on its way into the gather buffer.
+// Data frames complete their async block or call their release function
+// once written; control frames have neither. Fragments from
+// HCWebSocketSendMessageFragment are lent too, and go out uncompressed as the
+// frames of one message.
+struct websocket_send_op
+{
+    websocket_send_op* next = nullptr;
+    HCWebsocketHandle websocket = nullptr;
+    XAsyncBlock* asyncBlock = nullptr;
+    HCWebSocketSendBufferReleaseFunction releaseFunc = nullptr;
+    void* releaseContext = nullptr;
+    const uint8_t* lentBytes = nullptr;
+    uint32_t lentSize = 0;
+    websocket_opcode opcode = websocket_opcode::binary;
+    bool fragment = false;
+    bool finalFragment = false;
+
+    http_internal_vector<uint8_t> buffer;
+    const uint8_t* payload = nullptr;
+    size_t payloadLength = 0;
+    bool maskedInPlace = false;
+
+    uint8_t header[WEBSOCKET_MAX_FRAME_HEADER_BYTES];
+    size_t headerLength = 0;
+    uint8_t maskKey[WEBSOCKET_MASK_KEY_BYTES];
+
+    // Progress into write batches
+    bool headerQueued = false;
+    size_t payloadQueued = 0;
+    size_t batchEnd = 0;
+
+    HRESULT result = S_OK;
+    uint32_t platformError = 0;
+};
+
+// One RFC 6455 client connection. The public methods run on the caller's
+// thread and hand their work to the reactor thread, where all socket I/O and
+// protocol state live. Message and close callbacks are invoked on the
+// reactor thread, unless the app asked for batched receive; then received
+// payloads are lent to it straight from the read buffer or the reassembled
+// message. An app that asked for fragments gets each data frame's payload
+// as it arrives, without reassembly.
+class websocket_connection :
+    public hc_websocket_impl,
+    public socket_event_handler,
+    public std::enable_shared_from_this<websocket_connection>
+{
+public:
+    websocket_connection(_In_ websocket_engine* engine, _In_ HCWebsocketHandle websocket) noexcept;
+    ~websocket_connection();
+
+    HRESULT connect(_In_z_ const char* uri, _In_z_ const char* subProtocol, _Inout_ XAsyncBlock* asyncBlock) noexcept;
+    HRESULT send(
+        _Inout_ XAsyncBlock* asyncBlock,
+        _In_ websocket_opcode opcode,
+        _In_reads_bytes_(length) const uint8_t* data,
+        _In_ size_t length
+        ) noexcept;
+    HRESULT send_buffer(
+        _In_ websocket_opcode opcode,
+        _In_reads_bytes_opt_(length) const uint8_t* data,
+        _In_ uint32_t length,
+        _In_ HCWebSocketSendBufferReleaseFunction releaseFunc,
+        _In_opt_ void* releaseContext
+        ) noexcept;
+    HRESULT send_fragment(
+        _In_ websocket_opcode opcode,
+        _In_reads_bytes_opt_(length) const uint8_t* data,
+        _In_ uint32_t length,
+        _In_ bool finalFragment,
+        _In_ HCWebSocketSendBufferReleaseFunction releaseFunc,
+        _In_opt_ void* releaseContext
+        ) noexcept;
+    HRESULT disconnect(_In_ HCWebSocketCloseStatus status) noexcept;
+    void resume_receiving() noexcept override;
+
+    // Reactor thread
+    void on_socket_event(_In_ uint32_t events) noexcept override;
+    void tick(_In_ chrono_clock_t::time_point now) noexcept;
+    void abort() noexcept;
+
+private:
+    enum class state
+    {
+        created,
+        connecting,
+        tls_handshake,
+        upgrading,
+        open,
+        closing,
+        closed
+    };
+
+    enum class io_result
+    {
+        ok,
+        would_block,
+        eof,
+        failed
+    };
+
+    struct posted_call
+    {
+        std::shared_ptr<websocket_connection> connection;
+        void (websocket_connection::*method)();
+    };
+
+    HRESULT send_lent(
+        _In_ websocket_opcode opcode,
+        _In_reads_bytes_opt_(length) const uint8_t* data,
+        _In_ uint32_t length,
+        _In_ bool fragment,
+        _In_ bool finalFragment,
+        _In_ HCWebSocketSendBufferReleaseFunction releaseFunc,
+        _In_opt_ void* releaseContext
+        ) noexcept;
+    HRESULT prepare_connect(_In_z_ const char* uri, _In_z_ const char* subProtocol) noexcept;
+    HRESULT post(_In_ void (websocket_connection::*method)()) noexcept;
+    HRESULT resolve_then_post(_In_ void (websocket_connection::*method)()) noexcept;
+    static void posted_callback(_In_opt_ void* context) noexcept;
+
+    void start();
+    void enqueue(_In_ websocket_send_op* op) noexcept;
+    websocket_send_op* take_inbox() noexcept;
+    void release_inbox(_In_ HRESULT result) noexcept;
+    void flush_inbox();
+    void resume_reading();
+    bool try_next_address() noexcept;
+    void on_connected() noexcept;
+    void continue_handshake() noexcept;
+    void start_upgrade() noexcept;
+    void continue_upgrade() noexcept;
+    bool process_upgrade_response(_In_reads_(length) const char* response, _In_ size_t length) noexcept;
+    void on_open() noexcept;
+
+    void continue_sending() noexcept;
+    bool next_op() noexcept;
+    void fill_batch() noexcept;
+    bool add_segment(_In_reads_bytes_(length) const uint8_t* data, _In_ size_t length) noexcept;
+    bool add_gathered(_In_ size_t length) noexcept;
+    bool complete_written() noexcept;
+    void reset_batch() noexcept;
+    void continue_receiving() noexcept;
+    bool prepare_read_buffer() noexcept;
+    void process_frames() noexcept;
+    bool check_frame(_In_ const websocket_frame_header& header) noexcept;
+    void stream_payload(_In_reads_bytes_(length) const uint8_t* data, _In_ size_t length, _In_ bool last) noexcept;
+    void handle_frame(_In_ const websocket_frame_header& header, _In_ uint8_t* payload) noexcept;
+    void append_message(_In_reads_bytes_(length) const uint8_t* data, _In_ size_t length, _In_ bool finalFrame) noexcept;
+    void deliver_message(_In_ websocket_opcode opcode, _Inout_updates_bytes_(length + 1) uint8_t* data, _In_ size_t length) noexcept;
+    void queue_message(_In_ websocket_opcode opcode, _In_reads_bytes_(length) const uint8_t* data, _In_ size_t length, _In_ std::shared_ptr<void> holder) noexcept;
+    void hand_off_read_buffer() noexcept;
+    void handle_close_frame(_In_reads_bytes_(length) const uint8_t* payload, _In_ size_t length) noexcept;
+
+    HRESULT frame(_Inout_ websocket_send_op* op) noexcept;
+    websocket_send_op* make_control(_In_ websocket_opcode opcode, _In_reads_bytes_(length) const uint8_t* payload, _In_ size_t length) noexcept;
+    void queue_control(_In_ websocket_opcode opcode, _In_reads_bytes_(length) const uint8_t* payload, _In_ size_t length) noexcept;
+    void start_close(_In_ HCWebSocketCloseStatus status, _In_ bool failConnection) noexcept;
+    void fail_connection(_In_ HCWebSocketCloseStatus status, _In_z_ const char* message) noexcept;
+    void fail_queued_sends() noexcept;
+    void release_op(_In_ websocket_send_op* op, _In_ HRESULT result) noexcept;
+    void complete_send(_In_ websocket_send_op* op, _In_ HRESULT result, _In_ uint32_t platformError) noexcept;
+    void complete_connect(_In_ HRESULT result, _In_ uint32_t platformError) noexcept;
+    void finish(_In_ HCWebSocketCloseStatus status, _In_ int platformError) noexcept;
+    void update_interest(_In_ uint32_t events) noexcept;
+    void close_socket() noexcept;
+
+    io_result do_write(_In_reads_bytes_(length) const uint8_t* data, _In_ size_t length, _Out_ size_t* written) noexcept;
+    io_result do_write_segments(_In_reads_(count) const iovec* segments, _In_ size_t count, _Out_ size_t* written) noexcept;
+    io_result do_read(_Out_writes_bytes_(length) uint8_t* data, _In_ size_t length, _Out_ size_t* bytesRead) noexcept;
+
+    websocket_engine* const m_engine;
+    HCWebsocketHandle const m_websocket;
+    HCWebSocketMessageFunction m_messageFunc = nullptr;
+    HCWebSocketBinaryMessageFunction m_binaryMessageFunc = nullptr;
+    HCWebSocketCloseEventFunction m_closeFunc = nullptr;
+    void* m_callbackContext = nullptr;
+    bool m_receiveBatches = false;
+    bool m_receiveFragments = false;
+
+    // Caller thread to reactor thread. Senders push onto a lock free stack
+    // that the reactor takes whole and puts back in order.
+    std::atomic<state> m_state{ state::created };
+    std::atomic<websocket_send_op*> m_inbox{ nullptr };
+    std::atomic<bool> m_flushPosted{ false };
+    std::atomic<bool> m_disconnectRequested{ false };
+    std::atomic<HCWebSocketCloseStatus> m_requestedCloseStatus{ HCWebSocketCloseStatus::Normal };
+
+    // Set up by connect before the reactor takes over
+    XAsyncBlock* m_connectAsyncBlock = nullptr;
+    HRESULT m_connectResult = S_OK;
+    uint32_t m_connectPlatformError = 0;
+    http_internal_string m_host;
+    uint16_t m_port = 0;
+    bool m_secure = false;
+    http_internal_vector<resolved_address> m_addresses;
+    int m_resolveError = 0;
+    http_internal_string m_handshakeRequest;
+    http_internal_string m_expectedAccept;
+
+    // Reactor thread only
+    int m_socket = -1;
+    SSL* m_ssl = nullptr;
+    bool m_registered = false;
+    socket_registration m_registration = 0;
+    uint32_t m_interest = 0;
+    uint32_t m_sslWantEvents = 0;
+    uint32_t m_readWants = 0;
+    uint32_t m_writeWants = 0;
+    size_t m_nextAddress = 0;
+    int m_lastError = 0;
+    size_t m_handshakeSent = 0;
+    chrono_clock_t::time_point m_connectDeadline;
+    chrono_clock_t::time_point m_closeDeadline;
+
+    http_internal_dequeue<websocket_send_op*> m_dataQueue;
+    http_internal_dequeue<websocket_send_op*> m_controlQueue;
+    websocket_send_op* m_closeOp = nullptr;
+    websocket_send_op* m_currentOp = nullptr;
+    bool m_sendFragmentInProgress = false;
+
+    // The batch being written: up to GENERIC_WEBSOCKET_MAX_WRITE_SEGMENTS
+    // buffers, and the ops whose frames end in it, in order
+    iovec m_segments[GENERIC_WEBSOCKET_MAX_WRITE_SEGMENTS];
+    size_t m_segmentCount = 0;
+    size_t m_segmentIndex = 0;
+    size_t m_batchLength = 0;
+    size_t m_batchWritten = 0;
+    websocket_send_op* m_batchHead = nullptr;
+    websocket_send_op* m_batchTail = nullptr;
+    http_internal_vector<uint8_t> m_gather;
+    size_t m_gatherUsed = 0;
+    bool m_lastSegmentGathered = false;
+
+    http_internal_vector<uint8_t> m_readBuffer;
+    size_t m_readStart = 0;
+    size_t m_readEnd = 0;
+    size_t m_frameBytesNeeded = 0;
+
+    // Batched receive. Messages lent from the read buffer share a holder
+    // that takes the buffer over before it's reused. Reading stops while the
+    // app holds more than its inbound limits.
+    std::shared_ptr<http_internal_vector<uint8_t>> m_lentReadBuffer;
+    bool m_receivePaused = false;
+
+    bool m_messageInProgress = false;
+    bool m_messageCompressed = false;
+    websocket_opcode m_messageOpcode = websocket_opcode::binary;
+    http_internal_vector<uint8_t> m_message;
+
+    // Streamed receive: the payload of the current data frame still to come
+    bool m_streamingFrame = false;
+    bool m_streamFrameFin = false;
+    uint64_t m_streamFrameRemaining = 0;
+    websocket_utf8_validator m_utf8;
+
+    bool m_deflateEnabled = false;
+    websocket_deflate m_deflate;
+
+    // Mask keys are drawn from the RNG in bulk
+    uint8_t m_maskKeys[64 * WEBSOCKET_MASK_KEY_BYTES];
+    size_t m_maskKeysUsed = sizeof(m_maskKeys);
+
+    HCWebSocketCloseStatus m_closeStatus = HCWebSocketCloseStatus::Normal;
+    bool m_closeQueued = false;
+    bool m_closeSent = false;
+    bool m_closeReceived = false;
+    bool m_failAfterClose = false;
+};
+
+// Owns the reactor and TLS context that every websocket_connection shares.
+class websocket_engine
+{
+public:
+    websocket_engine() noexcept;
+    ~websocket_engine();
+
+    HRESULT connect(
+        _In_ HCWebsocketHandle websocket,
+        _In_z_ const char* uri,
+        _In_z_ const char* subProtocol,
+        _Inout_ XAsyncBlock* asyncBlock
+        ) noexcept;
+
+    socket_reactor& reactor() noexcept { return m_reactor; }
+    dns_resolver& resolver() noexcept { return m_resolver; }
+    SSL_CTX* ssl_context() noexcept { return m_sslContext; }
+
+    // Reactor thread callbacks from websocket_connection
+    HRESULT on_connection_started(_In_ const std::shared_ptr<websocket_connection>& connection) noexcept;
+    void on_connection_closed(_In_ websocket_connection* connection) noexcept;
+
+private:
+    HRESULT ensure_started() noexcept;
+
+    static void tick_callback(_In_opt_ void* context) noexcept;
+    static void shutdown_callback(_In_opt_ void* context) noexcept;
+    void tick() noexcept;
+    void shutdown() noexcept;
+
+    std::mutex m_startLock;
+    bool m_started = false;
+    socket_reactor m_reactor;
+    dns_resolver m_resolver;
+    SSL_CTX* m_sslContext = nullptr;
+
+    // Reactor thread only
+    http_internal_unordered_map<websocket_connection*, std::shared_ptr<websocket_connection>> m_connections;
+};
+
+NAMESPACE_XBOX_HTTP_CLIENT_END
@@ -0,0 +1,530 @@
+// Copyright (c) Microsoft Corporation
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+#include "pch.h"
+
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "websocket_frame.h"
+
+NAMESPACE_XBOX_HTTP_CLIENT_BEGIN
+
+// Every compressed message ends with an empty stored block, which the sender
+// strips and the receiver puts back (RFC 7692 section 7.2.1).
+static const uint8_t c_deflateTail[] = { 0x00, 0x00, 0xff, 0xff };
+
+void websocket_mask(
+    _Inout_updates_bytes_(length) uint8_t* data,
+    _In_ size_t length,
+    _In_reads_bytes_(WEBSOCKET_MASK_KEY_BYTES) const uint8_t* maskKey,
+    _In_ uint64_t offset
+    ) noexcept
+{
+    websocket_mask_copy(data, data, length, maskKey, offset);
+}
+
+void websocket_mask_copy(
+    _Out_writes_bytes_(length) uint8_t* destination,
+    _In_reads_bytes_(length) const uint8_t* source,
+    _In_ size_t length,
+    _In_reads_bytes_(WEBSOCKET_MASK_KEY_BYTES) const uint8_t* maskKey,
+    _In_ uint64_t offset
+    ) noexcept
+{
+    // Rotate the key so byte 0 of data lines up with key byte offset % 4.
+    // After that the key repeats every 4 bytes and can be applied a vector at
+    // a time.
+    uint8_t rotated[WEBSOCKET_MASK_KEY_BYTES];
+    for (size_t i = 0; i < WEBSOCKET_MASK_KEY_BYTES; i++)
+    {
+        rotated[i] = maskKey[(offset + i) % WEBSOCKET_MASK_KEY_BYTES];
+    }
+
+    uint32_t key32;
+    memcpy(&key32, rotated, sizeof(key32));
+
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i key128 = _mm_set1_epi32(static_cast<int>(key32));
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), _mm_xor_si128(block, key128));
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    const uint8x16_t key128 = vreinterpretq_u8_u32(vdupq_n_u32(key32));
+    for (; i + 16 <= length; i += 16)
+    {
+        vst1q_u8(destination + i, veorq_u8(vld1q_u8(source + i), key128));
+    }
+#endif
+
+    const uint64_t key64 = (static_cast<uint64_t>(key32) << 32) | key32;
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t block;
+        memcpy(&block, source + i, sizeof(block));
+        block ^= key64;
+        memcpy(destination + i, &block, sizeof(block));
+    }
+
+    for (; i < length; i++)
+    {
+        destination[i] = source[i] ^ rotated[i % WEBSOCKET_MASK_KEY_BYTES];
+    }
+}
+
+size_t websocket_frame_header_size(_In_ uint64_t payloadLength, _In_ bool masked) noexcept
+{
+    size_t size = 2;
+    if (payloadLength > UINT16_MAX)
+    {
+        size += 8;
+    }
+    else if (payloadLength > 125)
+    {
+        size += 2;
+    }
+    return masked ? size + WEBSOCKET_MASK_KEY_BYTES : size;
+}
+
+void websocket_write_frame_header(
+    _Out_ uint8_t* header,
+    _In_ bool fin,
+    _In_ bool rsv1,
+    _In_ websocket_opcode opcode,
+    _In_ uint64_t payloadLength,
+    _In_reads_opt_(WEBSOCKET_MASK_KEY_BYTES) const uint8_t* maskKey
+    ) noexcept
+{
+    header[0] = static_cast<uint8_t>((fin ? 0x80 : 0) | (rsv1 ? 0x40 : 0) | static_cast<uint8_t>(opcode));
+    uint8_t maskBit = maskKey != nullptr ? 0x80 : 0;
+    size_t position = 2;
+
+    if (payloadLength > UINT16_MAX)
+    {
+        header[1] = maskBit | 127;
+        for (int shift = 56; shift >= 0; shift -= 8)
+        {
+            header[position++] = static_cast<uint8_t>(payloadLength >> shift);
+        }
+    }
+    else if (payloadLength > 125)
+    {
+        header[1] = maskBit | 126;
+        header[position++] = static_cast<uint8_t>(payloadLength >> 8);
+        header[position++] = static_cast<uint8_t>(payloadLength);
+    }
+    else
+    {
+        header[1] = maskBit | static_cast<uint8_t>(payloadLength);
+    }
+
+    if (maskKey != nullptr)
+    {
+        memcpy(header + position, maskKey, WEBSOCKET_MASK_KEY_BYTES);
+    }
+}
+
+bool websocket_parse_frame_header(
+    _In_reads_bytes_(length) const uint8_t* data,
+    _In_ size_t length,
+    _Out_ websocket_frame_header* header
+    ) noexcept
+{
+    if (length < 2)
+    {
+        return false;
+    }
+
+    header->fin = (data[0] & 0x80) != 0;
+    header->rsv1 = (data[0] & 0x40) != 0;
+    header->reservedBits = (data[0] & 0x30) != 0;
+    header->opcode = static_cast<websocket_opcode>(data[0] & 0x0f);
+    header->masked = (data[1] & 0x80) != 0;
+
+    uint8_t length7 = data[1] & 0x7f;
+    size_t position = 2;
+    size_t extendedBytes = length7 == 127 ? 8 : (length7 == 126 ? 2 : 0);
+    size_t headerLength = position + extendedBytes + (header->masked ? WEBSOCKET_MASK_KEY_BYTES : 0);
+    if (length < headerLength)
+    {
+        return false;
+    }
+
+    if (extendedBytes == 0)
+    {
+        header->payloadLength = length7;
+    }
+    else
+    {
+        header->payloadLength = 0;
+        for (size_t i = 0; i < extendedBytes; i++)
+        {
+            header->payloadLength = (header->payloadLength << 8) | data[position++];
+        }
+    }
+
+    if (header->masked)
+    {
+        memcpy(header->maskKey, data + position, WEBSOCKET_MASK_KEY_BYTES);
+    }
+
+    header->headerLength = headerLength;
+    return true;
+}
+
+bool websocket_is_valid_close_status(_In_ uint32_t status) noexcept
+{
+    if (status >= 3000 && status <= 4999)
+    {
+        // Registered with IANA or private use
+        return true;
+    }
+
+    return status >= 1000 && status <= 1014 &&
+        status != 1004 && status != 1005 && status != 1006;
+}
+
+bool websocket_utf8_validator::append(_In_reads_bytes_(length) const uint8_t* data, _In_ size_t length) noexcept
+{
+    const uint8_t* end = data + length;
+    while (data < end)
+    {
+        if (m_needed == 0)
+        {
+            // Mostly ASCII; step over it a word at a time
+            while (end - data >= 8)
+            {
+                uint64_t word;
+                memcpy(&word, data, sizeof(word));
+                if ((word & 0x8080808080808080ull) != 0)
+                {
+                    break;
+                }
+                data += 8;
+            }
+            if (data == end)
+            {
+                break;
+            }
+
+            uint8_t lead = *data++;
+            m_lower = 0x80;
+            m_upper = 0xBF;
+            if (lead < 0x80)
+            {
+                continue;
+            }
+            else if (lead >= 0xC2 && lead <= 0xDF)
+            {
+                m_needed = 1;
+            }
+            else if (lead >= 0xE0 && lead <= 0xEF)
+            {
+                m_needed = 2;
+                if (lead == 0xE0)
+                {
+                    m_lower = 0xA0; // overlong
+                }
+                else if (lead == 0xED)
+                {
+                    m_upper = 0x9F; // surrogates
+                }
+            }
+            else if (lead >= 0xF0 && lead <= 0xF4)
+            {
+                m_needed = 3;
+                if (lead == 0xF0)
+                {
+                    m_lower = 0x90; // overlong
+                }
+                else if (lead == 0xF4)
+                {
+                    m_upper = 0x8F; // past U+10FFFF
+                }
+            }
+            else
+            {
+                return false;
+            }
+            continue;
+        }
+
+        uint8_t next = *data++;
+        if (next < m_lower || next > m_upper)
+        {
+            return false;
+        }
+        m_lower = 0x80;
+        m_upper = 0xBF;
+        --m_needed;
+    }
+    return true;
+}
+
+bool websocket_is_valid_utf8(_In_reads_bytes_(length) const uint8_t* data, _In_ size_t length) noexcept
+{
+    websocket_utf8_validator validator;
+    return validator.append(data, length) && validator.complete();
+}
+
+namespace
+{
+
+bool parse_window_bits(_In_ const http_internal_string& value, _Out_ int* bits)
+{
+    uint64_t parsed = 0;
+    if (value.empty() || !StringToUint4(value.data(), value.data() + value.size(), parsed, 10) || parsed < 8 || parsed > 15)
+    {
+        return false;
+    }
+    *bits = static_cast<int>(parsed);
+    return true;
+}
+
+void trim(_Inout_ http_internal_string& value)
+{
+    size_t start = value.find_first_not_of(" \t");
+    size_t end = value.find_last_not_of(" \t");
+    value = start == http_internal_string::npos ? http_internal_string{} : value.substr(start, end - start + 1);
+}
+
+} // anonymous namespace
+
+HRESULT websocket_parse_deflate_response(
+    _In_z_ const char* value,
+    _Out_ bool* negotiated,
+    _Out_ websocket_deflate_options* options
+    ) noexcept
+try
+{
+    *negotiated = false;
+    *options = websocket_deflate_options{};
+
+    // permessage-deflate; server_no_context_takeover; client_max_window_bits=10
+    http_internal_string extensions{ value };
+    size_t start = 0;
+    bool first = true;
+    while (start <= extensions.size())
+    {
+        size_t end = extensions.find(';', start);
+        if (end == http_internal_string::npos)
+        {
+            end = extensions.size();
+        }
+
+        http_internal_string parameter = extensions.substr(start, end - start);
+        trim(parameter);
+        start = end + 1;
+
+        if (parameter.empty() && !first)
+        {
+            continue;
+        }
+
+        if (first)
+        {
+            RETURN_HR_IF(E_FAIL, parameter != "permessage-deflate");
+            first = false;
+            continue;
+        }
+
+        http_internal_string name = parameter;
+        http_internal_string argument;
+        size_t equals = parameter.find('=');
+        if (equals != http_internal_string::npos)
+        {
+            name = parameter.substr(0, equals);
+            argument = parameter.substr(equals + 1);
+            trim(name);
+            trim(argument);
+            if (argument.size() >= 2 && argument.front() == '"' && argument.back() == '"')
+            {
+                argument = argument.substr(1, argument.size() - 2);
+            }
+        }
+
+        if (name == "server_no_context_takeover")
+        {
+            options->serverNoContextTakeover = true;
+        }
+        else if (name == "client_no_context_takeover")
+        {
+            options->clientNoContextTakeover = true;
+        }
+        else if (name == "server_max_window_bits")
+        {
+            RETURN_HR_IF(E_FAIL, !parse_window_bits(argument, &options->serverMaxWindowBits));
+        }
+        else if (name == "client_max_window_bits")
+        {
+            RETURN_HR_IF(E_FAIL, !parse_window_bits(argument, &options->clientMaxWindowBits));
+
+            // zlib can't produce raw deflate streams with a 256 byte window
+            RETURN_HR_IF(E_FAIL, options->clientMaxWindowBits == 8);
+        }
+        else
+        {
+            return E_FAIL;
+        }
+    }
+
+    *negotiated = !first;
+    return S_OK;
+}
+CATCH_RETURN()
+
+websocket_deflate::~websocket_deflate()
+{
+    if (m_deflateInitialized)
+    {
+        deflateEnd(&m_deflate);
+    }
+    if (m_inflateInitialized)
+    {
+        inflateEnd(&m_inflate);
+    }
+}
+
+HRESULT websocket_deflate::initialize(_In_ const websocket_deflate_options& options) noexcept
+{
+    m_options = options;
+
+    // Negative window bits select raw deflate without a zlib header
+    if (deflateInit2(&m_deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -m_options.clientMaxWindowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return E_OUTOFMEMORY;
+    }
+    m_deflateInitialized = true;
+
+    // The server's window can be smaller than 15 but never larger, so the
+    // largest window always works for inflating.
+    if (inflateInit2(&m_inflate, -15) != Z_OK)
+    {
+        return E_OUTOFMEMORY;
+    }
+    m_inflateInitialized = true;
+
+    return S_OK;
+}
+
+HRESULT websocket_deflate::compress(
+    _In_reads_bytes_(length) const uint8_t* data,
+    _In_ size_t length,
+    _In_ size_t headroom,
+    _Inout_ http_internal_vector<uint8_t>& output
+    ) noexcept
+try
+{
+    // Z_SYNC_FLUSH output can exceed deflateBound by the empty stored block
+    output.resize(headroom + deflateBound(&m_deflate, static_cast<uLong>(length)) + 16);
+
+    m_deflate.next_in = const_cast<Bytef*>(data);
+    m_deflate.avail_in = static_cast<uInt>(length);
+
+    size_t produced = headroom;
+    for (;;)
+    {
+        m_deflate.next_out = output.data() + produced;
+        m_deflate.avail_out = static_cast<uInt>(output.size() - produced);
+
+        int ret = deflate(&m_deflate, Z_SYNC_FLUSH);
+        if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+            return E_FAIL;
+        }
+
+        produced = output.size() - m_deflate.avail_out;
+        if (m_deflate.avail_in == 0 && m_deflate.avail_out != 0)
+        {
+            break;
+        }
+        output.resize(output.size() * 2);
+    }
+
+    ASSERT(produced - headroom >= sizeof(c_deflateTail));
+    output.resize(produced - sizeof(c_deflateTail));
+
+    if (m_options.clientNoContextTakeover)
+    {
+        deflateReset(&m_deflate);
+    }
+    return S_OK;
+}
+CATCH_RETURN()
+
+HRESULT websocket_deflate::decompress(
+    _In_reads_bytes_(length) const uint8_t* data,
+    _In_ size_t length,
+    _In_ bool finalFrame,
+    _In_ size_t maxOutput,
+    _Inout_ http_internal_vector<uint8_t>& output
+    ) noexcept
+{
+    RETURN_IF_FAILED(inflate_into(data, length, maxOutput, output));
+
+    if (finalFrame)
+    {
+        RETURN_IF_FAILED(inflate_into(c_deflateTail, sizeof(c_deflateTail), maxOutput, output));
+        if (m_options.serverNoContextTakeover)
+        {
+            inflateReset(&m_inflate);
+        }
+    }
+    return S_OK;
+}
+
+HRESULT websocket_deflate::inflate_into(
+    _In_reads_bytes_(length) const uint8_t* data,
+    _In_ size_t length,
+    _In_ size_t maxOutput,
+    _Inout_ http_internal_vector<uint8_t>& output
+    ) noexcept
+try
+{
+    m_inflate.next_in = const_cast<Bytef*>(data);
+    m_inflate.avail_in = static_cast<uInt>(length);
+
+    // Growing to one byte past the limit tells a message that is exactly
+    // maxOutput bytes apart from one that is too large.
+    size_t limit = maxOutput + 1;
+    size_t produced = output.size();
+    for (;;)
+    {
+        if (produced == output.size())
+        {
+            RETURN_HR_IF(E_BOUNDS, produced >= limit);
+            output.resize(std::min(limit, std::max<size_t>(produced * 2, produced + 4 * length + 256)));
+        }
+
+        m_inflate.next_out = output.data() + produced;
+        m_inflate.avail_out = static_cast<uInt>(output.size() - produced);
+
+        int ret = inflate(&m_inflate, Z_SYNC_FLUSH);
+        produced = output.size() - m_inflate.avail_out;
+        if (ret != Z_OK && ret != Z_BUF_ERROR && ret != Z_STREAM_END)
+        {
+            return E_FAIL;
+        }
+        RETURN_HR_IF(E_BOUNDS, produced > maxOutput);
+
+        // Room left over means inflate has nothing more to give for the
+        // input so far.
+        if (m_inflate.avail_out != 0 && (m_inflate.avail_in == 0 || ret != Z_OK))
+        {
+            break;
+        }
+    }
+
+    output.resize(produced);
+    return S_OK;
+}
+CATCH_RETURN()
+
+NAMESPACE_XBOX_HTTP_CLIENT_END
@@ -0,0 +1,168 @@
+// Copyright (c) Microsoft Corporation
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+#pragma once
+
+#include <zlib.h>
+
+NAMESPACE_XBOX_HTTP_CLIENT_BEGIN
+
+// RFC 6455 framing and the permessage-deflate extension (RFC 7692).
+
+#define WEBSOCKET_MAX_FRAME_HEADER_BYTES 14
+#define WEBSOCKET_MASK_KEY_BYTES 4
+#define WEBSOCKET_MAX_CONTROL_PAYLOAD_BYTES 125
+
+enum class websocket_opcode : uint8_t
+{
+    continuation = 0x0,
+    text = 0x1,
+    binary = 0x2,
+    close = 0x8,
+    ping = 0x9,
+    pong = 0xA
+};
+
+struct websocket_frame_header
+{
+    bool fin;
+    bool rsv1;
+    bool reservedBits;
+    websocket_opcode opcode;
+    bool masked;
+    uint8_t maskKey[WEBSOCKET_MASK_KEY_BYTES];
+    uint64_t payloadLength;
+    size_t headerLength;
+};
+
+// XORs length bytes at data with maskKey in place. offset is where data starts
+// within the frame payload so a payload can be masked in pieces. Masking and
+// unmasking are the same operation.
+void websocket_mask(
+    _Inout_updates_bytes_(length) uint8_t* data,
+    _In_ size_t length,
+    _In_reads_bytes_(WEBSOCKET_MASK_KEY_BYTES) const uint8_t* maskKey,
+    _In_ uint64_t offset
+    ) noexcept;
+
+// Masks length bytes from source into destination, so a payload the caller
+// still owns can be framed without changing it. source may equal destination.
+void websocket_mask_copy(
+    _Out_writes_bytes_(length) uint8_t* destination,
+    _In_reads_bytes_(length) const uint8_t* source,
+    _In_ size_t length,
+    _In_reads_bytes_(WEBSOCKET_MASK_KEY_BYTES) const uint8_t* maskKey,
+    _In_ uint64_t offset
+    ) noexcept;
+
+size_t websocket_frame_header_size(_In_ uint64_t payloadLength, _In_ bool masked) noexcept;
+
+// Writes a header of websocket_frame_header_size bytes.
+void websocket_write_frame_header(
+    _Out_ uint8_t* header,
+    _In_ bool fin,
+    _In_ bool rsv1,
+    _In_ websocket_opcode opcode,
+    _In_ uint64_t payloadLength,
+    _In_reads_opt_(WEBSOCKET_MASK_KEY_BYTES) const uint8_t* maskKey
+    ) noexcept;
+
+// Returns false if length bytes don't hold the whole header yet.
+bool websocket_parse_frame_header(
+    _In_reads_bytes_(length) const uint8_t* data,
+    _In_ size_t length,
+    _Out_ websocket_frame_header* header
+    ) noexcept;
+
+// True for a status code a peer may send in a close frame (RFC 6455 7.4).
+// 1005, 1006 and 1015 are reserved for reporting and never go on the wire.
+bool websocket_is_valid_close_status(_In_ uint32_t status) noexcept;
+
+// Checks that text is well formed UTF-8 (RFC 3629) as it arrives in pieces;
+// a character may be split across pieces. Overlong forms, surrogates and
+// code points past U+10FFFF are rejected.
+class websocket_utf8_validator
+{
+public:
+    // Returns false as soon as the bytes seen so far can't be valid.
+    bool append(_In_reads_bytes_(length) const uint8_t* data, _In_ size_t length) noexcept;
+
+    // True if the text seen so far ends on a character boundary.
+    bool complete() const noexcept { return m_needed == 0; }
+
+    void reset() noexcept { m_needed = 0; }
+
+private:
+    uint32_t m_needed = 0;
+    uint8_t m_lower = 0x80;
+    uint8_t m_upper = 0xBF;
+};
+
+bool websocket_is_valid_utf8(_In_reads_bytes_(length) const uint8_t* data, _In_ size_t length) noexcept;
+
+struct websocket_deflate_options
+{
+    bool clientNoContextTakeover = false;
+    bool serverNoContextTakeover = false;
+    int clientMaxWindowBits = 15;
+    int serverMaxWindowBits = 15;
+};
+
+// The extension offer sent with every handshake.
+#define WEBSOCKET_DEFLATE_OFFER "permessage-deflate; client_max_window_bits"
+
+// Parses the server's Sec-WebSocket-Extensions header. Fails if the server
+// accepted anything other than our offer, or parameters we can't honor.
+HRESULT websocket_parse_deflate_response(
+    _In_z_ const char* value,
+    _Out_ bool* negotiated,
+    _Out_ websocket_deflate_options* options
+    ) noexcept;
+
+// Compression state for one connection. With context takeover, which is the
+// default, each direction keeps its window across messages.
+class websocket_deflate
+{
+public:
+    websocket_deflate() noexcept = default;
+    ~websocket_deflate();
+
+    websocket_deflate(const websocket_deflate&) = delete;
+    websocket_deflate& operator=(const websocket_deflate&) = delete;
+
+    HRESULT initialize(_In_ const websocket_deflate_options& options) noexcept;
+
+    // Compresses a whole message. The result starts headroom bytes into
+    // output, leaving room for the frame header.
+    HRESULT compress(
+        _In_reads_bytes_(length) const uint8_t* data,
+        _In_ size_t length,
+        _In_ size_t headroom,
+        _Inout_ http_internal_vector<uint8_t>& output
+        ) noexcept;
+
+    // Decompresses one frame of a compressed message and appends it to
+    // output. Fails with E_BOUNDS if output would grow past maxOutput.
+    HRESULT decompress(
+        _In_reads_bytes_(length) const uint8_t* data,
+        _In_ size_t length,
+        _In_ bool finalFrame,
+        _In_ size_t maxOutput,
+        _Inout_ http_internal_vector<uint8_t>& output
+        ) noexcept;
+
+private:
+    HRESULT inflate_into(
+        _In_reads_bytes_(length) const uint8_t* data,
+        _In_ size_t length,
+        _In_ size_t maxOutput,
+        _Inout_ http_internal_vector<uint8_t>& output
+        ) noexcept;
+
+    websocket_deflate_options m_options;
+    z_stream m_deflate{};
+    z_stream m_inflate{};
+    bool m_deflateInitialized = false;
+    bool m_inflateInitialized = false;
+};
+
+NAMESPACE_XBOX_HTTP_CLIENT_END
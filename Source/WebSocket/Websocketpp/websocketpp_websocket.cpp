@@ -47,12 +47,139 @@ using namespace xbox::httpclient;
 struct websocket_outgoing_message
 {
     XAsyncBlock* async;
+    websocketpp::frame::opcode::value opcode;
     http_internal_string payload;
     http_internal_vector<uint8_t> payloadBinary;
     websocketpp::lib::error_code error;
     uint64_t id;
 };
 
+// Runs the asio event loop shared by every websocketpp connection in the
+// process, so connections are multiplexed over a few threads instead of each
+// owning one. The reactor is created by the first connect and it and its
+// threads live until the process exits, which lets endpoints finish winding
+// down after the websocket that owned them is gone.
+class wspp_reactor
+{
+public:
+    static HRESULT get(_In_ uint32_t threadCount, _Out_ wspp_reactor** reactor) noexcept
+    {
+        static std::mutex s_lock;
+        static wspp_reactor* s_reactor = nullptr;
+
+        std::lock_guard<std::mutex> lock(s_lock);
+        if (s_reactor == nullptr)
+        {
+            s_reactor = new (std::nothrow) wspp_reactor();
+            if (s_reactor == nullptr)
+            {
+                return E_OUTOFMEMORY;
+            }
+        }
+
+        RETURN_IF_FAILED(s_reactor->add_threads(threadCount));
+        *reactor = s_reactor;
+        return S_OK;
+    }
+
+    websocketpp::lib::asio::io_service* io_service() noexcept
+    {
+        return &m_ioService;
+    }
+
+private:
+#if HC_PLATFORM == HC_PLATFORM_ANDROID
+    typedef JavaVM* thread_env;
+#else
+    typedef void* thread_env;
+#endif
+
+    wspp_reactor() :
+        m_work{ m_ioService }
+    {
+    }
+
+    // Grows the pool to threadCount. The pool never shrinks.
+    HRESULT add_threads(_In_ uint32_t threadCount) noexcept
+    {
+        if (m_threadCount >= threadCount)
+        {
+            return S_OK;
+        }
+
+#if HC_PLATFORM == HC_PLATFORM_ANDROID
+        // Look the JavaVM up here, where a failure can be returned, rather
+        // than on the new threads where there is no one to report it to.
+        JavaVM* javaVm = nullptr;
+        {   // Allow our singleton to go out of scope quickly once we're done with it
+            auto httpSingleton = xbox::httpclient::get_http_singleton(false);
+            if (httpSingleton == nullptr)
+            {
+                return E_HC_NOT_INITIALISED;
+            }
+            HC_PERFORM_ENV* platformContext = reinterpret_cast<HC_PERFORM_ENV*>(httpSingleton->m_performEnv.get());
+            javaVm = platformContext != nullptr ? platformContext->GetJavaVm() : nullptr;
+        }
+
+        if (javaVm == nullptr)
+        {
+            HC_TRACE_ERROR(HTTPCLIENT, "javaVm is null");
+            return E_FAIL;
+        }
+#else
+        thread_env javaVm = nullptr;
+#endif
+
+        while (m_threadCount < threadCount)
+        {
+            try
+            {
+                std::thread([this, javaVm]() { run(javaVm); }).detach();
+            }
+            catch (std::system_error err)
+            {
+                HC_TRACE_ERROR(WEBSOCKET, "Websocket: couldn't create reactor thread (%d)", err.code().value());
+                return m_threadCount > 0 ? S_OK : E_FAIL;
+            }
+            ++m_threadCount;
+        }
+        return S_OK;
+    }
+
+    void run(_In_opt_ thread_env javaVm)
+    {
+#if HC_PLATFORM == HC_PLATFORM_ANDROID
+        // Reactor threads never exit, so they stay attached.
+        JNIEnv* jniEnv = nullptr;
+        if (javaVm->AttachCurrentThread(&jniEnv, nullptr) != 0)
+        {
+            HC_TRACE_ERROR(WEBSOCKET, "Websocket: couldn't attach reactor thread to the JavaVM");
+        }
+#else
+        UNREFERENCED_PARAMETER(javaVm);
+#endif
+
+        // m_work keeps run from returning. A handler that throws unwinds out
+        // of run, which can simply be called again.
+        while (true)
+        {
+            try
+            {
+                m_ioService.run();
+                break;
+            }
+            catch (...)
+            {
+                HC_TRACE_ERROR(WEBSOCKET, "Websocket: unhandled exception on reactor thread");
+            }
+        }
+    }
+
+    websocketpp::lib::asio::io_service m_ioService;
+    websocketpp::lib::asio::io_service::work m_work;
+    uint32_t m_threadCount{ 0 };
+};
+
 struct wspp_websocket_impl : public hc_websocket_impl, public std::enable_shared_from_this<wspp_websocket_impl>
 {
 private:
@@ -87,7 +214,7 @@ public:
     {
         if (m_uri.Scheme() == "wss")
         {
-            m_client = std::unique_ptr<websocketpp_client_base>(new websocketpp_tls_client());
+            m_client = std::shared_ptr<websocketpp_client_base>(new websocketpp_tls_client());
 
             auto sharedThis{ shared_from_this() };
 
@@ -148,7 +275,7 @@ public:
         }
         else
         {
-            m_client = std::unique_ptr<websocketpp_client_base>(new websocketpp_client());
+            m_client = std::shared_ptr<websocketpp_client_base>(new websocketpp_client());
             return connect_impl<websocketpp::config::asio_client>(async);
         }
     }
@@ -172,15 +299,12 @@ public:
             return E_HC_NOT_INITIALISED;
         }
 
-        http_internal_string payload(payloadPtr);
-        if (payload.length() == 0)
-        {
-            return E_INVALIDARG;
-        }
-
+        // Empty messages only come from the buffer send fallback; the public
+        // send functions reject them before they get here
         websocket_outgoing_message message;
         message.async = async;
-        message.payload = std::move(payload);
+        message.opcode = websocketpp::frame::opcode::text;
+        message.payload = payloadPtr;
         message.id = ++httpSingleton->m_lastId;
 
         {
@@ -199,7 +323,7 @@ public:
 
     HRESULT sendBinary(XAsyncBlock* async, const uint8_t* payloadBytes, uint32_t payloadSize)
     {
-        if (payloadBytes == nullptr)
+        if (payloadBytes == nullptr && payloadSize > 0)
         {
             return E_INVALIDARG;
         }
@@ -216,13 +340,9 @@ public:
             return E_HC_NOT_INITIALISED;
         }
 
-        if (payloadSize == 0)
-        {
-            return E_INVALIDARG;
-        }
-
         websocket_outgoing_message message;
         message.async = async;
+        message.opcode = websocketpp::frame::opcode::binary;
         message.payloadBinary.assign(payloadBytes, payloadBytes + payloadSize);
         message.id = ++httpSingleton->m_lastId;
 
@@ -240,11 +360,65 @@ public:
         return S_OK;
     }
 
+    HRESULT send_buffer(
+        HCWebSocketMessageType messageType,
+        const uint8_t* payloadBytes,
+        uint32_t payloadSize,
+        HCWebSocketSendBufferReleaseFunction releaseFunc,
+        void* releaseContext)
+    {
+        if (m_state != CONNECTED)
+        {
+            HC_TRACE_ERROR(WEBSOCKET, "Client not connected");
+            return E_UNEXPECTED;
+        }
+
+        // websocketpp frames the payload into a buffer of its own and queues
+        // it on the connection, so the send can happen right here instead of
+        // going through the outgoing queue and an async block. That copy means
+        // the caller's buffer is done with as soon as send returns, and it is
+        // handed back from within this call, outside our locks, as
+        // HCWebSocketSendMessageBuffer allows.
+        auto opcode = messageType == HCWebSocketMessageType::Text ? websocketpp::frame::opcode::text : websocketpp::frame::opcode::binary;
+        const void* payload = payloadSize > 0 ? static_cast<const void*>(payloadBytes) : "";
+        websocketpp::lib::error_code error;
+        {
+            std::lock_guard<std::recursive_mutex> lock(m_wsppClientLock);
+            if (m_client->is_tls_client())
+            {
+                m_client->client<websocketpp::config::asio_tls_client>().send(m_con, payload, payloadSize, opcode, error);
+            }
+            else
+            {
+                m_client->client<websocketpp::config::asio_client>().send(m_con, payload, payloadSize, opcode, error);
+            }
+        }
+
+        releaseFunc(m_hcWebsocketHandle, payloadBytes, payloadSize, error.value() != 0 ? E_FAIL : S_OK, releaseContext);
+        return S_OK;
+    }
+
     HRESULT close()
     {
         return close(HCWebSocketCloseStatus::Normal);
     }
 
+    void resume_receiving() noexcept override
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_wsppClientLock);
+        if (m_state == CONNECTED || m_state == CLOSING)
+        {
+            if (m_client->is_tls_client())
+            {
+                resume_reading_impl<websocketpp::config::asio_tls_client>();
+            }
+            else
+            {
+                resume_reading_impl<websocketpp::config::asio_client>();
+            }
+        }
+    }
+
     HRESULT close(HCWebSocketCloseStatus status)
     {
         websocketpp::lib::error_code ec;
@@ -272,6 +446,15 @@ private:
     template<typename WebsocketConfigType>
     HRESULT connect_impl(XAsyncBlock* async)
     {
+        auto httpSingleton = get_http_singleton(false);
+        if (httpSingleton == nullptr)
+        {
+            return E_HC_NOT_INITIALISED;
+        }
+
+        wspp_reactor* reactor = nullptr;
+        RETURN_IF_FAILED(wspp_reactor::get(httpSingleton->m_websocketReactorThreadCount, &reactor));
+
         if (async->queue)
         {
             XTaskQueueDuplicateHandle(async->queue, &m_backgroundQueue);
@@ -281,8 +464,7 @@ private:
 
         client.clear_access_channels(websocketpp::log::alevel::all);
         client.clear_error_channels(websocketpp::log::alevel::all);
-        client.init_asio();
-        client.start_perpetual();
+        client.init_asio(reactor->io_service());
 
         auto sharedThis { shared_from_this() };
 
@@ -303,31 +485,63 @@ private:
             XAsyncComplete(async, S_OK, sizeof(WebSocketCompletionResult));
         });
 
-        client.set_message_handler([sharedThis](websocketpp::connection_hdl, const websocketpp::config::asio_client::message_type::ptr &msg)
-        {
-            HCWebSocketMessageFunction messageFunc{ nullptr };
-            HCWebSocketBinaryMessageFunction binaryMessageFunc{ nullptr };
-            void* context{ nullptr };
-            HCWebSocketGetEventFunctions(sharedThis->m_hcWebsocketHandle, &messageFunc, &binaryMessageFunc, nullptr, &context);
-
-            ASSERT(messageFunc && binaryMessageFunc);
-
-            // TODO: hook up HCWebSocketCloseEventFunction handler upon unexpected disconnect 
-            // TODO: verify auto disconnect when closing client's websocket handle
+        HCWebSocketMessageFunction messageFunc{ nullptr };
+        HCWebSocketBinaryMessageFunction binaryMessageFunc{ nullptr };
+        void* context{ nullptr };
+        HCWebSocketGetEventFunctions(m_hcWebsocketHandle, &messageFunc, &binaryMessageFunc, nullptr, &context);
+        ASSERT(messageFunc && binaryMessageFunc);
 
-            if (msg->get_opcode() == websocketpp::frame::opcode::text)
+        if (m_hcWebsocketHandle->ReceivesBatches())
+        {
+            client.set_message_handler([sharedThis](websocketpp::connection_hdl hdl, const websocketpp::config::asio_client::message_type::ptr &msg)
             {
-                ASSERT(sharedThis->m_state >= CONNECTED && sharedThis->m_state < CLOSED);
+                auto opcode = msg->get_opcode();
+                if (opcode != websocketpp::frame::opcode::text && opcode != websocketpp::frame::opcode::binary)
+                {
+                    return;
+                }
+
+                // websocketpp hands each message over in a buffer of its own,
+                // so the message itself can be lent out until the app is done
                 auto& payload = msg->get_raw_payload();
-                messageFunc(sharedThis->m_hcWebsocketHandle, payload.data(), context);
-            }
-            else if (msg->get_opcode() == websocketpp::frame::opcode::binary)
+                auto messageType = opcode == websocketpp::frame::opcode::text ? HCWebSocketMessageType::Text : HCWebSocketMessageType::Binary;
+                bool pauseReceiving = false;
+                if (FAILED(sharedThis->m_hcWebsocketHandle->QueueMessage(messageType, reinterpret_cast<const uint8_t*>(payload.data()), static_cast<uint32_t>(payload.size()), msg, &pauseReceiving)))
+                {
+                    sharedThis->close(HCWebSocketCloseStatus::ServerTerminate);
+                }
+                else if (pauseReceiving)
+                {
+                    websocketpp::lib::error_code ec;
+                    auto connection = sharedThis->m_client->client<WebsocketConfigType>().get_con_from_hdl(hdl, ec);
+                    if (connection)
+                    {
+                        connection->pause_reading();
+                    }
+                }
+            });
+        }
+        else
+        {
+            client.set_message_handler([sharedThis, messageFunc, binaryMessageFunc, context](websocketpp::connection_hdl, const websocketpp::config::asio_client::message_type::ptr &msg)
             {
-                ASSERT(sharedThis->m_state >= CONNECTED && sharedThis->m_state < CLOSED);
-                auto& payload = msg->get_raw_payload();
-                binaryMessageFunc(sharedThis->m_hcWebsocketHandle, (uint8_t*)payload.data(), (uint32_t)payload.size(), context);
-            }
-        });
+                // TODO: hook up HCWebSocketCloseEventFunction handler upon unexpected disconnect 
+                // TODO: verify auto disconnect when closing client's websocket handle
+
+                if (msg->get_opcode() == websocketpp::frame::opcode::text)
+                {
+                    ASSERT(sharedThis->m_state >= CONNECTED && sharedThis->m_state < CLOSED);
+                    auto& payload = msg->get_raw_payload();
+                    messageFunc(sharedThis->m_hcWebsocketHandle, payload.c_str(), context);
+                }
+                else if (msg->get_opcode() == websocketpp::frame::opcode::binary)
+                {
+                    ASSERT(sharedThis->m_state >= CONNECTED && sharedThis->m_state < CLOSED);
+                    auto& payload = msg->get_raw_payload();
+                    binaryMessageFunc(sharedThis->m_hcWebsocketHandle, (uint8_t*)payload.data(), (uint32_t)payload.size(), context);
+                }
+            });
+        }
 
         client.set_close_handler([sharedThis](websocketpp::connection_hdl)
         {
@@ -338,10 +552,10 @@ private:
         // Set User Agent specified by the user. This needs to happen before any connection is created
         const auto& headers = m_hcWebsocketHandle->connectHeaders;
 
-        auto user_agent_it = headers.find(websocketpp::user_agent);
-        if (user_agent_it != headers.end())
+        auto userAgent = headers.find(websocketpp::user_agent);
+        if (userAgent != nullptr)
         {
-            client.set_user_agent(user_agent_it->second.data());
+            client.set_user_agent(userAgent->value);
         }
 
         // Get the connection handle to save for later, have to create temporary
@@ -355,13 +569,24 @@ private:
             return E_FAIL;
         }
 
+        // The connection can still have handlers queued on the shared reactor
+        // after our close handler has run, and the endpoint that created it
+        // has to outlive them. Holding the endpoint from the connection's
+        // termination handler frees it along with the connection. This also
+        // replaces the endpoint's own termination handler, which only logs.
+        auto endpoint = m_client;
+        con->set_termination_handler([endpoint](typename websocketpp::client<WebsocketConfigType>::connection_ptr)
+        {
+        });
+
         // Add any request headers specified by the user.
+        auto subProtocolHeader = headers.find(SUB_PROTOCOL_HEADER);
         for (const auto & header : headers)
         {
             // Subprotocols are handled separately below
-            if (str_icmp(header.first, SUB_PROTOCOL_HEADER) != 0)
+            if (&header != subProtocolHeader)
             {
-                con->append_header(header.first.data(), header.second.data());
+                con->append_header(header.name, header.value);
             }
         }
 
@@ -404,7 +629,7 @@ private:
             }
         }
 #endif
-        // Initialize the 'connect' XAsyncBlock here, but the actually work will happen on the ASIO background thread below
+        // Initialize the 'connect' XAsyncBlock here, but the actual work will happen on the shared reactor below
         auto hr = XAsyncBegin(async, shared_ptr_cache::store(shared_from_this()), (void*)HCWebSocketConnectAsync, __FUNCTION__,
             [](XAsyncOp op, const XAsyncProviderData* data)
         {
@@ -427,63 +652,6 @@ private:
         {
             m_state = CONNECTING;
             client.connect(con);
-
-            try
-            {
-                struct client_context
-                {
-                    client_context(websocketpp::client<WebsocketConfigType>& _client) : client(_client) {}
-                    websocketpp::client<WebsocketConfigType>& client;
-                };
-                auto context = http_allocate_shared<client_context>(client);
-
-                m_websocketThread = std::thread([context](){
-#if HC_PLATFORM == HC_PLATFORM_ANDROID
-                    JavaVM* javaVm = nullptr;
-                    {   // Allow our singleton to go out of scope quickly once we're done with it
-                        auto httpSingleton = xbox::httpclient::get_http_singleton(true);
-                        HC_PERFORM_ENV* platformContext = reinterpret_cast<HC_PERFORM_ENV*>(httpSingleton->m_performEnv.get());
-                        javaVm = platformContext->GetJavaVm();
-                    }
-
-                    if (javaVm == nullptr)
-                    {
-                        HC_TRACE_ERROR(HTTPCLIENT, "javaVm is null");
-                        throw std::runtime_error("JavaVm is null");
-                    }
-
-                    JNIEnv* jniEnv = nullptr;
-                    if (javaVm->AttachCurrentThread(&jniEnv, nullptr) != 0)
-                    {
-                        assert(false);
-                    }
-#endif
-
-                    context->client.run();
-                    
-                    // OpenSSL stores some per thread state that never will be cleaned up until
-                    // the dll is unloaded. If static linking, like we do, the state isn't cleaned up
-                    // at all and will be reported as leaks.
-                    // See http://www.openssl.org/support/faq.html#PROG13
-#if HC_PLATFORM == HC_PLATFORM_ANDROID || HC_PLATFORM_IS_APPLE
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wdeprecated-declarations"
-                    ERR_remove_thread_state(nullptr);
-#pragma clang diagnostic pop
-#if HC_PLATFORM == HC_PLATFORM_ANDROID
-                    javaVm->DetachCurrentThread();
-#endif // HC_PLATFORM_ANDROID
-#else
-                    ERR_remove_thread_state(nullptr);
-#endif // HC_PLATFORM_ANDROID || HC_PLATFORM_IS_APPLE
-                });
-                hr = S_OK;
-            }
-            catch (std::system_error err)
-            {
-                HC_TRACE_ERROR(WEBSOCKET, "Websocket: couldn't create background websocket thread (%d)", err.code().value());
-                hr = E_FAIL;
-            }
         }
 
         return hr;
@@ -503,34 +671,21 @@ private:
         {
             std::lock_guard<std::recursive_mutex> lock(m_wsppClientLock);
 
-            if (message.payload.empty())
+            const void* payload = message.payload.data();
+            size_t payloadLength = message.payload.length();
+            if (message.opcode == websocketpp::frame::opcode::binary && !message.payloadBinary.empty())
             {
-                if (message.payloadBinary.size() > 0)
-                {
-                    if (m_client->is_tls_client())
-                    {
-                        m_client->client<websocketpp::config::asio_tls_client>().send(m_con, message.payloadBinary.data(), message.payloadBinary.size(), websocketpp::frame::opcode::binary, message.error);
-                    }
-                    else
-                    {
-                        m_client->client<websocketpp::config::asio_client>().send(m_con, message.payloadBinary.data(), message.payloadBinary.size(), websocketpp::frame::opcode::binary, message.error);
-                    }
-                }
-                else
-                {
-                    hr = E_FAIL;
-                }
+                payload = message.payloadBinary.data();
+                payloadLength = message.payloadBinary.size();
+            }
+
+            if (m_client->is_tls_client())
+            {
+                m_client->client<websocketpp::config::asio_tls_client>().send(m_con, payload, payloadLength, message.opcode, message.error);
             }
             else
             {
-                if (m_client->is_tls_client())
-                {
-                    m_client->client<websocketpp::config::asio_tls_client>().send(m_con, message.payload.data(), message.payload.length(), websocketpp::frame::opcode::text, message.error);
-                }
-                else
-                {
-                    m_client->client<websocketpp::config::asio_client>().send(m_con, message.payload.data(), message.payload.length(), websocketpp::frame::opcode::text, message.error);
-                }
+                m_client->client<websocketpp::config::asio_client>().send(m_con, payload, payloadLength, message.opcode, message.error);
             }
 
             if (message.error.value() != 0)
@@ -624,9 +779,8 @@ private:
         auto &client = m_client->client<WebsocketConfigType>();
         const auto &connection = client.get_con_from_hdl(m_con);
         m_closeCode = connection->get_local_close_code();
-        client.stop_perpetual();
 
-        // Can't join thread directly since it is the current thread.
+        // Report the close from the background queue rather than the reactor thread.
         XAsyncBlock* async = new (xbox::httpclient::http_memory::mem_alloc(sizeof(XAsyncBlock))) XAsyncBlock {};
         async->queue = m_backgroundQueue;
         async->context = shared_ptr_cache::store(shared_from_this());
@@ -640,13 +794,9 @@ private:
         {
             auto sharedThis = shared_ptr_cache::fetch<wspp_websocket_impl>(async->context, true);
 
-            // Wait for background thread to finish
-            if (sharedThis->m_websocketThread.joinable())
-            {
-                sharedThis->m_websocketThread.join();
-            }
-
-            // Delete client to make sure Websocketpp cleans up all Boost.Asio portions.
+            // Drop our endpoint reference, which also releases the handlers that
+            // hold sharedThis. The connection keeps the endpoint alive until it
+            // is done with the reactor.
             sharedThis->m_client.reset();
 
             HCWebSocketCloseEventFunction closeFunc = nullptr;
@@ -665,6 +815,17 @@ private:
         });
     }
 
+    template <typename WebsocketConfigType>
+    void resume_reading_impl() noexcept
+    {
+        websocketpp::lib::error_code ec;
+        auto connection = m_client->client<WebsocketConfigType>().get_con_from_hdl(m_con, ec);
+        if (connection)
+        {
+            connection->resume_reading();
+        }
+    }
+
     template <typename WebsocketConfigType>
     inline void set_connection_error()
     {
@@ -722,8 +883,6 @@ private:
         websocketpp::client<websocketpp::config::asio_tls_client> m_client;
     };
 
-    // Asio client has a long running "run" task that we need to provide a thread for
-    std::thread m_websocketThread;
     XTaskQueueHandle m_backgroundQueue = nullptr;
 
     websocketpp::connection_hdl m_con;
@@ -734,7 +893,7 @@ private:
     // Used to safe guard the wspp client.
     std::recursive_mutex m_wsppClientLock;
     std::atomic<State> m_state{ State::CREATED };
-    std::unique_ptr<websocketpp_client_base> m_client;
+    std::shared_ptr<websocketpp_client_base> m_client;
 
     // Guards access to m_outgoing_msg_queue
     std::recursive_mutex m_outgoingMessageQueueLock;
@@ -803,6 +962,23 @@ HRESULT CALLBACK Internal_HCWebSocketSendBinaryMessageAsync(
     return wsppSocket->sendBinary(asyncBlock, payloadBytes, payloadSize);
 }
 
+HRESULT CALLBACK Internal_HCWebSocketSendMessageBuffer(
+    _In_ HCWebsocketHandle websocket,
+    _In_ HCWebSocketMessageType messageType,
+    _In_reads_bytes_opt_(payloadSize) const uint8_t* payloadBytes,
+    _In_ uint32_t payloadSize,
+    _In_ HCWebSocketSendBufferReleaseFunction releaseFunc,
+    _In_opt_ void* releaseContext
+    )
+{
+    std::shared_ptr<wspp_websocket_impl> wsppSocket = std::dynamic_pointer_cast<wspp_websocket_impl>(websocket->impl);
+    if (wsppSocket == nullptr)
+    {
+        return E_UNEXPECTED;
+    }
+    return wsppSocket->send_buffer(messageType, payloadBytes, payloadSize, releaseFunc, releaseContext);
+}
+
 HRESULT CALLBACK Internal_HCWebSocketDisconnect(
     _In_ HCWebsocketHandle websocket,
     _In_ HCWebSocketCloseStatus closeStatus,
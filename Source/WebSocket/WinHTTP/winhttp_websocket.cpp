@@ -118,15 +118,11 @@ public:
             return E_HC_NOT_INITIALISED;
         }
 
-        http_internal_string payload(payloadPtr);
-        if (payload.length() == 0)
-        {
-            return E_INVALIDARG;
-        }
-
+        // Empty messages only come from the buffer send fallback; the public
+        // send functions reject them before they get here
         websocket_outgoing_message message;
         message.asyncBlock = asyncBlock;
-        message.payload = std::move(payload);
+        message.payload = payloadPtr;
         message.id = ++httpSingleton->m_lastId;
 
         {
@@ -149,7 +145,7 @@ public:
         _In_reads_bytes_(payloadSize) const uint8_t* payloadBytes,
         _In_ uint32_t payloadSize)
     {
-        if (payloadBytes == nullptr)
+        if (payloadBytes == nullptr && payloadSize > 0)
         {
             return E_INVALIDARG;
         }
@@ -162,8 +158,8 @@ public:
 
         websocket_outgoing_message message;
         message.asyncBlock = asyncBlock;
-        message.binaryPayload.resize(payloadSize);
-        memcpy(&message.binaryPayload[0], payloadBytes, payloadSize);
+        message.binary = true;
+        message.binaryPayload.assign(payloadBytes, payloadBytes + payloadSize);
         message.id = ++httpSingleton->m_lastId;
 
         {
@@ -184,6 +180,7 @@ public:
     struct websocket_outgoing_message
     {
         XAsyncBlock* asyncBlock = nullptr;
+        bool binary = false;
         http_internal_string payload;
         http_internal_vector<uint8_t> binaryPayload;
         HRESULT hr = S_OK;
@@ -204,7 +201,7 @@ public:
         {
             std::lock_guard<std::recursive_mutex> lock(m_httpClientLock);
 
-            if(message->payload.length() > 0)
+            if (!message->binary)
                 message->hr = m_httpTask->send_websocket_message(WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE, reinterpret_cast<const void*>(message->payload.data()), message->payload.length());
             else
                 message->hr = m_httpTask->send_websocket_message(WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE, reinterpret_cast<const void*>(message->binaryPayload.data()), message->binaryPayload.size());
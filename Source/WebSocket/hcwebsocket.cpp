@@ -9,6 +9,216 @@
 
 using namespace xbox::httpclient;
 
+namespace
+{
+
+// HCWebSocketSendMessageBuffer for providers without a sendBuffer function.
+// The payload goes through their regular send function, which copies it, and
+// the buffer is handed back once that send completes.
+struct send_buffer_fallback
+{
+    XAsyncBlock asyncBlock{};
+    HCWebsocketHandle websocket = nullptr;
+    const uint8_t* payloadBytes = nullptr;
+    uint32_t payloadSize = 0;
+    http_internal_string text;
+    HCWebSocketSendBufferReleaseFunction releaseFunc = nullptr;
+    void* releaseContext = nullptr;
+};
+
+void CALLBACK SendBufferFallbackCompleted(_In_ XAsyncBlock* asyncBlock)
+{
+    HC_UNIQUE_PTR<send_buffer_fallback> send{ static_cast<send_buffer_fallback*>(asyncBlock->context) };
+
+    WebSocketCompletionResult result{};
+    HRESULT hr = HCGetWebSocketSendMessageResult(asyncBlock, &result);
+    if (SUCCEEDED(hr))
+    {
+        hr = result.errorCode;
+    }
+
+    send->releaseFunc(send->websocket, send->payloadBytes, send->payloadSize, hr, send->releaseContext);
+    send->websocket->DecRef();
+}
+
+HRESULT SendBufferFallback(
+    _In_ WebSocketPerformInfo const& info,
+    _In_ HCWebsocketHandle websocket,
+    _In_ HCWebSocketMessageType messageType,
+    _In_reads_bytes_opt_(payloadSize) const uint8_t* payloadBytes,
+    _In_ uint32_t payloadSize,
+    _In_ HCWebSocketSendBufferReleaseFunction releaseFunc,
+    _In_opt_ void* releaseContext
+    )
+{
+    auto send = http_allocate_unique<send_buffer_fallback>();
+    send->asyncBlock.context = send.get();
+    send->asyncBlock.callback = SendBufferFallbackCompleted;
+    send->websocket = websocket;
+    send->payloadBytes = payloadBytes;
+    send->payloadSize = payloadSize;
+    send->releaseFunc = releaseFunc;
+    send->releaseContext = releaseContext;
+
+    if (messageType == HCWebSocketMessageType::Text)
+    {
+        send->text.assign(reinterpret_cast<const char*>(payloadBytes), payloadSize);
+    }
+
+    // The completion callback owns it once the send is queued, which may be
+    // before the send function returns
+    websocket->AddRef();
+    send_buffer_fallback* pending = send.release();
+
+    HRESULT hr = S_OK;
+    if (messageType == HCWebSocketMessageType::Text)
+    {
+        hr = info.sendText(websocket, pending->text.c_str(), &pending->asyncBlock, info.context);
+    }
+    else
+    {
+        // The send functions want a buffer even for an empty message
+        static const uint8_t s_empty = 0;
+        hr = info.sendBinary(websocket, payloadSize > 0 ? payloadBytes : &s_empty, payloadSize, &pending->asyncBlock, info.context);
+    }
+    if (FAILED(hr))
+    {
+        HC_UNIQUE_PTR<send_buffer_fallback> reclaim{ pending };
+        websocket->DecRef();
+        return hr;
+    }
+    return S_OK;
+}
+
+// HCWebSocketSendMessageFragment for providers without a sendFragment function.
+// Fragments are copied and handed back as they come; the final one is held
+// until the whole message has gone through the buffer send fallback.
+struct assembled_message
+{
+    http_internal_vector<uint8_t> payload;
+    const uint8_t* finalBytes = nullptr;
+    uint32_t finalSize = 0;
+    HCWebSocketSendBufferReleaseFunction releaseFunc = nullptr;
+    void* releaseContext = nullptr;
+};
+
+void CALLBACK AssembledMessageSent(
+    _In_ HCWebsocketHandle websocket,
+    _In_reads_bytes_(payloadSize) const uint8_t* /*payloadBytes*/,
+    _In_ uint32_t /*payloadSize*/,
+    _In_ HRESULT result,
+    _In_opt_ void* releaseContext
+    )
+{
+    HC_UNIQUE_PTR<assembled_message> message{ static_cast<assembled_message*>(releaseContext) };
+    message->releaseFunc(websocket, message->finalBytes, message->finalSize, result, message->releaseContext);
+}
+
+HRESULT SendFragmentFallback(
+    _In_ WebSocketPerformInfo const& info,
+    _In_ HCWebsocketHandle websocket,
+    _In_ HCWebSocketMessageType messageType,
+    _In_reads_bytes_opt_(payloadSize) const uint8_t* payloadBytes,
+    _In_ uint32_t payloadSize,
+    _In_ bool isFinalFragment,
+    _In_ HCWebSocketSendBufferReleaseFunction releaseFunc,
+    _In_opt_ void* releaseContext
+    )
+{
+    std::unique_lock<std::mutex> lock{ websocket->sendFragmentLock };
+    if (!websocket->sendFragmentInProgress)
+    {
+        websocket->sendFragmentType = messageType;
+        websocket->sendFragments.clear();
+    }
+    websocket->sendFragments.insert(websocket->sendFragments.end(), payloadBytes, payloadBytes + payloadSize);
+
+    if (!isFinalFragment)
+    {
+        websocket->sendFragmentInProgress = true;
+        lock.unlock();
+        releaseFunc(websocket, payloadBytes, payloadSize, S_OK, releaseContext);
+        return S_OK;
+    }
+
+    websocket->sendFragmentInProgress = false;
+    auto message = http_allocate_unique<assembled_message>();
+    message->payload.swap(websocket->sendFragments);
+    messageType = websocket->sendFragmentType;
+    lock.unlock();
+
+    message->finalBytes = payloadBytes;
+    message->finalSize = payloadSize;
+    message->releaseFunc = releaseFunc;
+    message->releaseContext = releaseContext;
+
+    // Freed by AssembledMessageSent, which may run before the send returns
+    assembled_message* pending = message.release();
+    HRESULT hr = SendBufferFallback(info, websocket, messageType, pending->payload.data(), static_cast<uint32_t>(pending->payload.size()), AssembledMessageSent, pending);
+    if (FAILED(hr))
+    {
+        HC_UNIQUE_PTR<assembled_message> reclaim{ pending };
+        return hr;
+    }
+    return S_OK;
+}
+
+// Closes a connection whose received messages can no longer all reach the
+// app, the same way the app would from its message function
+void FailReceive(_In_ HC_WEBSOCKET* websocket) noexcept
+{
+    auto httpSingleton = get_http_singleton(false);
+    if (nullptr == httpSingleton)
+    {
+        return;
+    }
+
+    WebSocketPerformInfo const& info = httpSingleton->m_websocketPerform;
+    if (info.disconnect != nullptr)
+    {
+        try
+        {
+            info.disconnect(websocket, HCWebSocketCloseStatus::ServerTerminate, info.context);
+        }
+        catch (...)
+        {
+            HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: failed to close after losing a received message", websocket->id);
+        }
+    }
+}
+
+// Batched receive for providers that only lend a payload for the duration of
+// the message function call
+void QueueMessageCopy(
+    _In_ HC_WEBSOCKET* websocket,
+    _In_ HCWebSocketMessageType messageType,
+    _In_reads_bytes_(payloadSize) const uint8_t* payloadBytes,
+    _In_ uint32_t payloadSize
+    ) noexcept
+{
+    std::shared_ptr<http_internal_vector<uint8_t>> copy;
+    try
+    {
+        copy = http_allocate_shared<http_internal_vector<uint8_t>>(payloadBytes, payloadBytes + payloadSize);
+    }
+    catch (...)
+    {
+        HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: out of memory copying a received message", websocket->id);
+        FailReceive(websocket);
+        return;
+    }
+
+    // These providers can't stop reading, so the limits aren't enforced
+    const uint8_t* copyBytes = copy->data();
+    bool pauseReceiving = false;
+    if (FAILED(websocket->QueueMessage(messageType, copyBytes, payloadSize, std::move(copy), &pauseReceiving)))
+    {
+        FailReceive(websocket);
+    }
+}
+
+} // anonymous namespace
+
 HC_WEBSOCKET::HC_WEBSOCKET(
     _In_ uint64_t _id,
     _In_opt_ HCWebSocketMessageFunction messageFunc,
@@ -29,6 +239,11 @@ HC_WEBSOCKET::~HC_WEBSOCKET()
 #if !HC_NOWEBSOCKETS
     HC_TRACE_VERBOSE(WEBSOCKET, "HCWebsocketHandle dtor");
 #endif
+
+    if (m_batchQueue != nullptr)
+    {
+        XTaskQueueCloseHandle(m_batchQueue);
+    }
 }
 
 void HC_WEBSOCKET::AddClientRef()
@@ -78,6 +293,17 @@ void HC_WEBSOCKET::MessageFunc(
     void* context
 )
 {
+    if (websocket->ReceivesFragments())
+    {
+        MessageFragmentFunc(websocket, HCWebSocketMessageType::Text, reinterpret_cast<const uint8_t*>(message), static_cast<uint32_t>(strlen(message)), true, context);
+        return;
+    }
+    if (websocket->ReceivesBatches())
+    {
+        QueueMessageCopy(websocket, HCWebSocketMessageType::Text, reinterpret_cast<const uint8_t*>(message), static_cast<uint32_t>(strlen(message)));
+        return;
+    }
+
     std::lock_guard<std::recursive_mutex> lock{ websocket->m_mutex };
     if (websocket->m_clientRefCount > 0)
     {
@@ -99,6 +325,17 @@ void HC_WEBSOCKET::BinaryMessageFunc(
     void* context
 )
 {
+    if (websocket->ReceivesFragments())
+    {
+        MessageFragmentFunc(websocket, HCWebSocketMessageType::Binary, bytes, payloadSize, true, context);
+        return;
+    }
+    if (websocket->ReceivesBatches())
+    {
+        QueueMessageCopy(websocket, HCWebSocketMessageType::Binary, bytes, payloadSize);
+        return;
+    }
+
     std::lock_guard<std::recursive_mutex> lock{ websocket->m_mutex };
     if (websocket->m_clientRefCount > 0)
     {
@@ -113,9 +350,12 @@ void HC_WEBSOCKET::BinaryMessageFunc(
     }
 }
 
-void HC_WEBSOCKET::CloseFunc(
+void HC_WEBSOCKET::MessageFragmentFunc(
     HC_WEBSOCKET* websocket,
-    HCWebSocketCloseStatus status,
+    HCWebSocketMessageType messageType,
+    const uint8_t* payloadBytes,
+    uint32_t payloadSize,
+    bool isFinalFragment,
     void* context
 )
 {
@@ -124,18 +364,335 @@ void HC_WEBSOCKET::CloseFunc(
     {
         try
         {
-            websocket->m_clientCloseEventFunc(websocket, status, websocket->m_clientContext);
+            websocket->m_fragmentFunc(websocket, messageType, payloadBytes, payloadSize, isFinalFragment, websocket->m_fragmentContext);
+        }
+        catch (...)
+        {
+            HC_TRACE_WARNING(WEBSOCKET, "Caught exception in client HCWebSocketMessageFragmentFunction");
+        }
+    }
+}
+
+void HC_WEBSOCKET::CloseFunc(
+    HC_WEBSOCKET* websocket,
+    HCWebSocketCloseStatus status,
+    void* context
+)
+{
+    if (websocket->ReceivesBatches())
+    {
+        // Report the close after the messages received before it
+        bool schedule = false;
+        {
+            std::lock_guard<std::mutex> lock{ websocket->m_batchLock };
+            websocket->m_closePending = true;
+            websocket->m_pendingCloseStatus = status;
+            schedule = !websocket->m_dispatchScheduled;
+            websocket->m_dispatchScheduled = true;
+        }
+        if (schedule)
+        {
+            websocket->ScheduleDispatch();
+        }
+        return;
+    }
+
+    websocket->DeliverClose(status);
+}
+
+void HC_WEBSOCKET::DeliverClose(
+    _In_ HCWebSocketCloseStatus status
+)
+{
+    {
+        std::lock_guard<std::recursive_mutex> lock{ m_mutex };
+        if (m_clientRefCount > 0)
+        {
+            try
+            {
+                m_clientCloseEventFunc(this, status, m_clientContext);
+            }
+            catch (...)
+            {
+                HC_TRACE_WARNING(WEBSOCKET, "Caught exception in client HCWebSocketCloseEventFunction");
+            }
+        }
+        // Release the providers ref
+        disconnectCallExpected = false;
+    }
+    DecRef();
+}
+
+void HC_WEBSOCKET::SetMessageFragmentFunction(
+    _In_opt_ HCWebSocketMessageFragmentFunction fragmentFunc,
+    _In_opt_ void* context
+)
+{
+    m_fragmentFunc = fragmentFunc;
+    m_fragmentContext = context;
+}
+
+HRESULT HC_WEBSOCKET::SetMessageBatchFunction(
+    _In_opt_ XTaskQueueHandle queue,
+    _In_opt_ HCWebSocketMessageBatchFunction batchFunc,
+    _In_opt_ void* context
+)
+{
+    XTaskQueueHandle batchQueue = nullptr;
+    if (batchFunc != nullptr)
+    {
+        if (queue != nullptr)
+        {
+            RETURN_IF_FAILED(XTaskQueueDuplicateHandle(queue, &batchQueue));
+        }
+        else
+        {
+            RETURN_HR_IF(E_NO_TASK_QUEUE, !XTaskQueueGetCurrentProcessTaskQueue(&batchQueue));
+        }
+    }
+
+    if (m_batchQueue != nullptr)
+    {
+        XTaskQueueCloseHandle(m_batchQueue);
+    }
+
+    m_batchQueue = batchQueue;
+    m_batchFunc = batchFunc;
+    m_batchContext = context;
+    return S_OK;
+}
+
+void HC_WEBSOCKET::SetInboundQueueLimits(
+    _In_ uint32_t maxMessages,
+    _In_ uint64_t maxBytes
+)
+{
+    std::lock_guard<std::mutex> lock{ m_batchLock };
+    m_maxInboundMessages = maxMessages;
+    m_maxInboundBytes = maxBytes;
+}
+
+HRESULT HC_WEBSOCKET::QueueMessage(
+    _In_ HCWebSocketMessageType messageType,
+    _In_reads_bytes_(payloadSize) const uint8_t* payloadBytes,
+    _In_ uint32_t payloadSize,
+    _In_ std::shared_ptr<void> holder,
+    _Out_ bool* pauseReceiving
+) noexcept
+{
+    *pauseReceiving = false;
+
+    bool schedule = false;
+    {
+        std::lock_guard<std::mutex> lock{ m_batchLock };
+
+        // Once one message is lost, the ones after it would reach the app
+        // with a gap before them
+        RETURN_HR_IF(E_ABORT, m_receiveFailed);
+
+        try
+        {
+            if (m_pendingBatch == nullptr)
+            {
+                m_pendingBatch = m_spareBatch != nullptr ? std::move(m_spareBatch) : http_allocate_unique<HC_WEBSOCKET_MESSAGE_BATCH>();
+            }
+
+            auto& batch = *m_pendingBatch;
+            if (batch.holders.empty() || batch.holders.back() != holder)
+            {
+                batch.holders.push_back(std::move(holder));
+            }
+            batch.messages.push_back(HCWebSocketReceivedMessage{ messageType, payloadBytes, payloadSize });
+            batch.payloadBytes += payloadSize;
         }
         catch (...)
         {
-            HC_TRACE_WARNING(WEBSOCKET, "Caught exception in client HCWebSocketCloseEventFunction");
+            HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: out of memory queueing a received message", id);
+            m_receiveFailed = true;
+            return E_OUTOFMEMORY;
+        }
+
+        ++m_inboundMessages;
+        m_inboundBytes += payloadSize;
+        if ((m_maxInboundMessages != 0 && m_inboundMessages >= m_maxInboundMessages) ||
+            (m_maxInboundBytes != 0 && m_inboundBytes >= m_maxInboundBytes))
+        {
+            m_receivePaused = true;
+            *pauseReceiving = true;
         }
+
+        schedule = !m_dispatchScheduled;
+        m_dispatchScheduled = true;
+    }
+
+    if (schedule)
+    {
+        ScheduleDispatch();
     }
-    // Release the providers ref
-    websocket->disconnectCallExpected = false;
+    return S_OK;
+}
+
+// Only one dispatch is scheduled at a time, so batches reach the app in order
+// even on a queue that runs callbacks in parallel.
+HRESULT HC_WEBSOCKET::ScheduleDispatch()
+{
+    AddRef();
+    HRESULT hr = XTaskQueueSubmitCallback(m_batchQueue, XTaskQueuePort::Completion, this, DispatchBatch);
+    if (SUCCEEDED(hr))
+    {
+        return S_OK;
+    }
+
+    HC_TRACE_ERROR(WEBSOCKET, "Websocket [ID %llu]: couldn't schedule message delivery (0x%08x)", id, hr);
+
+    // Received messages wait for the next attempt, but a close can't
+    bool close = false;
+    auto closeStatus = HCWebSocketCloseStatus::Normal;
+    {
+        std::lock_guard<std::mutex> lock{ m_batchLock };
+        m_dispatchScheduled = false;
+        close = m_closePending;
+        closeStatus = m_pendingCloseStatus;
+        m_closePending = false;
+    }
+    if (close)
+    {
+        DeliverClose(closeStatus);
+    }
+    DecRef();
+    return hr;
+}
+
+void CALLBACK HC_WEBSOCKET::DispatchBatch(
+    _In_opt_ void* context,
+    _In_ bool canceled
+)
+{
+    auto websocket = static_cast<HC_WEBSOCKET*>(context);
+
+    HC_UNIQUE_PTR<HC_WEBSOCKET_MESSAGE_BATCH> batch;
+    bool close = false;
+    auto closeStatus = HCWebSocketCloseStatus::Normal;
+    {
+        std::lock_guard<std::mutex> lock{ websocket->m_batchLock };
+        batch = std::move(websocket->m_pendingBatch);
+        close = websocket->m_closePending;
+        closeStatus = websocket->m_pendingCloseStatus;
+        websocket->m_closePending = false;
+    }
+
+    if (batch != nullptr)
+    {
+        if (canceled)
+        {
+            websocket->RecycleBatch(std::move(batch));
+        }
+        else
+        {
+            websocket->DeliverBatch(std::move(batch));
+        }
+    }
+
+    if (close)
+    {
+        websocket->DeliverClose(closeStatus);
+    }
+
+    // Anything that arrived meanwhile goes in another callback rather than
+    // holding on to this thread
+    bool more = false;
+    {
+        std::lock_guard<std::mutex> lock{ websocket->m_batchLock };
+        more = websocket->m_pendingBatch != nullptr || websocket->m_closePending;
+        websocket->m_dispatchScheduled = more;
+    }
+    if (more)
+    {
+        websocket->ScheduleDispatch();
+    }
+
     websocket->DecRef();
 }
 
+void HC_WEBSOCKET::DeliverBatch(
+    _In_ HC_UNIQUE_PTR<HC_WEBSOCKET_MESSAGE_BATCH> batch
+)
+{
+    std::lock_guard<std::recursive_mutex> lock{ m_mutex };
+    if (m_clientRefCount == 0)
+    {
+        RecycleBatch(std::move(batch));
+        return;
+    }
+
+    // The batch holds a ref until the app releases it
+    AddRef();
+    batch->websocket = this;
+    HC_WEBSOCKET_MESSAGE_BATCH* lent = batch.release();
+    try
+    {
+        m_batchFunc(this, lent, lent->messages.data(), static_cast<uint32_t>(lent->messages.size()), m_batchContext);
+    }
+    catch (...)
+    {
+        HC_TRACE_WARNING(WEBSOCKET, "Caught exception in client HCWebSocketMessageBatchFunction");
+    }
+}
+
+void HC_WEBSOCKET::ReleaseBatch(
+    _In_ HC_WEBSOCKET_MESSAGE_BATCH* batch
+) noexcept
+{
+    RecycleBatch(HC_UNIQUE_PTR<HC_WEBSOCKET_MESSAGE_BATCH>{ batch });
+    DecRef();
+}
+
+void HC_WEBSOCKET::RecycleBatch(
+    _In_ HC_UNIQUE_PTR<HC_WEBSOCKET_MESSAGE_BATCH> batch
+) noexcept
+{
+    auto messageCount = static_cast<uint32_t>(batch->messages.size());
+    uint64_t payloadBytes = batch->payloadBytes;
+
+    // Drop the payloads before taking the lock
+    batch->websocket = nullptr;
+    batch->messages.clear();
+    batch->holders.clear();
+    batch->payloadBytes = 0;
+
+    bool resume = false;
+    {
+        std::lock_guard<std::mutex> lock{ m_batchLock };
+        m_inboundMessages -= messageCount;
+        m_inboundBytes -= payloadBytes;
+
+        // Resuming at half the limits keeps reading from stopping and
+        // starting again with every batch
+        if (m_receivePaused &&
+            (m_maxInboundMessages == 0 || m_inboundMessages <= m_maxInboundMessages / 2) &&
+            (m_maxInboundBytes == 0 || m_inboundBytes <= m_maxInboundBytes / 2))
+        {
+            m_receivePaused = false;
+            resume = true;
+        }
+
+        // Keep one around so steady traffic doesn't allocate a batch per dispatch
+        if (m_spareBatch == nullptr)
+        {
+            m_spareBatch = std::move(batch);
+        }
+    }
+
+    if (resume)
+    {
+        std::shared_ptr<hc_websocket_impl> provider = impl;
+        if (provider != nullptr)
+        {
+            provider->resume_receiving();
+        }
+    }
+}
+
 STDAPI
 HCWebSocketCreate(
     _Out_ HCWebsocketHandle* websocket,
@@ -211,12 +768,94 @@ try
         return E_HC_CONNECT_ALREADY_CALLED;
     }
 
-    websocket->connectHeaders[headerName] = headerValue;
+    websocket->connectHeaders.set(headerName, headerValue);
 
     return S_OK;
 }
 CATCH_RETURN()
 
+STDAPI
+HCWebSocketSetMessageFragmentFunction(
+    _In_ HCWebsocketHandle websocket,
+    _In_opt_ HCWebSocketMessageFragmentFunction fragmentFunc,
+    _In_opt_ void* functionContext
+    ) noexcept
+try
+{
+    if (websocket == nullptr)
+    {
+        return E_INVALIDARG;
+    }
+    else if (websocket->disconnectCallExpected)
+    {
+        return E_HC_CONNECT_ALREADY_CALLED;
+    }
+
+    websocket->SetMessageFragmentFunction(fragmentFunc, functionContext);
+    return S_OK;
+}
+CATCH_RETURN()
+
+STDAPI
+HCWebSocketSetMessageBatchFunction(
+    _In_ HCWebsocketHandle websocket,
+    _In_opt_ XTaskQueueHandle queue,
+    _In_opt_ HCWebSocketMessageBatchFunction batchFunc,
+    _In_opt_ void* functionContext
+    ) noexcept
+try
+{
+    if (websocket == nullptr)
+    {
+        return E_INVALIDARG;
+    }
+    else if (websocket->disconnectCallExpected)
+    {
+        return E_HC_CONNECT_ALREADY_CALLED;
+    }
+
+    return websocket->SetMessageBatchFunction(queue, batchFunc, functionContext);
+}
+CATCH_RETURN()
+
+STDAPI
+HCWebSocketSetInboundQueueLimits(
+    _In_ HCWebsocketHandle websocket,
+    _In_ uint32_t maxMessages,
+    _In_ uint64_t maxBytes
+    ) noexcept
+try
+{
+    if (websocket == nullptr)
+    {
+        return E_INVALIDARG;
+    }
+    else if (websocket->disconnectCallExpected)
+    {
+        return E_HC_CONNECT_ALREADY_CALLED;
+    }
+
+    websocket->SetInboundQueueLimits(maxMessages, maxBytes);
+    return S_OK;
+}
+CATCH_RETURN()
+
+STDAPI
+HCWebSocketReleaseMessageBatch(
+    _In_ HCWebSocketMessageBatchHandle batch
+    ) noexcept
+try
+{
+    if (batch == nullptr || batch->websocket == nullptr)
+    {
+        return E_INVALIDARG;
+    }
+
+    batch->websocket->ReleaseBatch(batch);
+    return S_OK;
+}
+CATCH_RETURN()
+
 STDAPI
 HCWebSocketConnectAsync(
     _In_z_ const char* uri,
@@ -332,6 +971,71 @@ try
 }
 CATCH_RETURN()
 
+STDAPI
+HCWebSocketSendMessageBuffer(
+    _In_ HCWebsocketHandle websocket,
+    _In_ HCWebSocketMessageType messageType,
+    _In_reads_bytes_opt_(payloadSize) const uint8_t* payloadBytes,
+    _In_ uint32_t payloadSize,
+    _In_ HCWebSocketSendBufferReleaseFunction releaseFunc,
+    _In_opt_ void* releaseContext
+    ) noexcept
+try
+{
+    if (websocket == nullptr || (payloadBytes == nullptr && payloadSize > 0) || releaseFunc == nullptr ||
+        (messageType != HCWebSocketMessageType::Text && messageType != HCWebSocketMessageType::Binary))
+    {
+        return E_INVALIDARG;
+    }
+
+    auto httpSingleton = get_http_singleton(true);
+    if (nullptr == httpSingleton)
+    {
+        return E_HC_NOT_INITIALISED;
+    }
+
+    WebSocketPerformInfo const& info = httpSingleton->m_websocketPerform;
+    if (info.sendBuffer != nullptr)
+    {
+        return info.sendBuffer(websocket, messageType, payloadBytes, payloadSize, releaseFunc, releaseContext);
+    }
+    return SendBufferFallback(info, websocket, messageType, payloadBytes, payloadSize, releaseFunc, releaseContext);
+}
+CATCH_RETURN()
+
+STDAPI
+HCWebSocketSendMessageFragment(
+    _In_ HCWebsocketHandle websocket,
+    _In_ HCWebSocketMessageType messageType,
+    _In_reads_bytes_opt_(payloadSize) const uint8_t* payloadBytes,
+    _In_ uint32_t payloadSize,
+    _In_ bool isFinalFragment,
+    _In_ HCWebSocketSendBufferReleaseFunction releaseFunc,
+    _In_opt_ void* releaseContext
+    ) noexcept
+try
+{
+    if (websocket == nullptr || (payloadBytes == nullptr && payloadSize > 0) || releaseFunc == nullptr ||
+        (messageType != HCWebSocketMessageType::Text && messageType != HCWebSocketMessageType::Binary))
+    {
+        return E_INVALIDARG;
+    }
+
+    auto httpSingleton = get_http_singleton(true);
+    if (nullptr == httpSingleton)
+    {
+        return E_HC_NOT_INITIALISED;
+    }
+
+    WebSocketPerformInfo const& info = httpSingleton->m_websocketPerform;
+    if (info.sendFragment != nullptr)
+    {
+        return info.sendFragment(websocket, messageType, payloadBytes, payloadSize, isFinalFragment, releaseFunc, releaseContext);
+    }
+    return SendFragmentFallback(info, websocket, messageType, payloadBytes, payloadSize, isFinalFragment, releaseFunc, releaseContext);
+}
+CATCH_RETURN()
+
 STDAPI
 HCWebSocketDisconnect(
     _In_ HCWebsocketHandle websocket
@@ -402,6 +1106,28 @@ try
 }
 CATCH_RETURN()
 
+STDAPI
+HCWebSocketSetReactorThreadCount(
+    _In_ uint32_t threadCount
+    ) noexcept
+try
+{
+    if (threadCount == 0)
+    {
+        return E_INVALIDARG;
+    }
+
+    auto httpSingleton = get_http_singleton(true);
+    if (nullptr == httpSingleton)
+    {
+        return E_HC_NOT_INITIALISED;
+    }
+
+    httpSingleton->m_websocketReactorThreadCount = threadCount;
+    return S_OK;
+}
+CATCH_RETURN()
+
 STDAPI
 HCSetWebSocketFunctions(
     _In_ HCWebSocketConnectFunction websocketConnectFunc,
@@ -432,6 +1158,8 @@ try
     info.sendText = websocketSendMessageFunc;
     info.sendBinary = websocketSendBinaryMessageFunc;
     info.disconnect = websocketDisconnectFunc;
+    info.sendBuffer = nullptr;
+    info.sendFragment = nullptr;
     info.context = context;
     return S_OK;
 }
@@ -497,10 +1225,10 @@ try
         return E_INVALIDARG;
     }
 
-    auto it = websocket->connectHeaders.find(headerName);
-    if (it != websocket->connectHeaders.end())
+    auto header = websocket->connectHeaders.find(headerName);
+    if (header != nullptr)
     {
-        *headerValue = it->second.c_str();
+        *headerValue = header->value;
     }
     else
     {
@@ -541,17 +1269,12 @@ try
         return E_INVALIDARG;
     }
 
-    uint32_t index = 0;
-    for (auto it = websocket->connectHeaders.cbegin(); it != websocket->connectHeaders.cend(); ++it)
+    if (headerIndex < websocket->connectHeaders.size())
     {
-        if (index == headerIndex)
-        {
-            *headerName = it->first.c_str();
-            *headerValue = it->second.c_str();
-            return S_OK;
-        }
-
-        index++;
+        auto& header = websocket->connectHeaders[headerIndex];
+        *headerName = header.name;
+        *headerValue = header.value;
+        return S_OK;
     }
 
     *headerName = nullptr;
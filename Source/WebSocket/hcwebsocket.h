@@ -11,8 +11,24 @@ struct hc_websocket_impl
 {
     hc_websocket_impl() {}
     virtual ~hc_websocket_impl() {}
+
+    // Batched receive: called on any thread once the app is back under its
+    // inbound limits, after HC_WEBSOCKET::QueueMessage told the provider to
+    // stop reading. Providers that can't stop reading ignore it.
+    virtual void resume_receiving() noexcept {}
 };
 
+// Messages handed to the app in one HCWebSocketMessageBatchFunction call.
+// holders keep the lent payloads alive until the batch is released; runs of
+// messages that share a holder store it once.
+typedef struct HC_WEBSOCKET_MESSAGE_BATCH
+{
+    HC_WEBSOCKET* websocket = nullptr;
+    http_internal_vector<HCWebSocketReceivedMessage> messages;
+    http_internal_vector<std::shared_ptr<void>> holders;
+    uint64_t payloadBytes = 0;
+} HC_WEBSOCKET_MESSAGE_BATCH;
+
 typedef struct HC_WEBSOCKET : std::enable_shared_from_this<HC_WEBSOCKET>
 {
 public:
@@ -34,6 +50,41 @@ public:
     static void CALLBACK BinaryMessageFunc(HC_WEBSOCKET* websocket, const uint8_t* bytes, uint32_t payloadSize, void* context);
     static void CALLBACK CloseFunc(HC_WEBSOCKET* websocket, HCWebSocketCloseStatus status, void* context);
 
+    // Streaming receive, see HCWebSocketSetMessageFragmentFunction. Providers
+    // that can hand over a message as it arrives check ReceivesFragments at
+    // connect and call MessageFragmentFunc; the message functions above pass
+    // the others' messages on as one final fragment.
+    void SetMessageFragmentFunction(_In_opt_ HCWebSocketMessageFragmentFunction fragmentFunc, _In_opt_ void* context);
+    bool ReceivesFragments() const { return m_fragmentFunc != nullptr; }
+    static void CALLBACK MessageFragmentFunc(
+        HC_WEBSOCKET* websocket,
+        HCWebSocketMessageType messageType,
+        const uint8_t* payloadBytes,
+        uint32_t payloadSize,
+        bool isFinalFragment,
+        void* context
+    );
+
+    // Batched receive, see HCWebSocketSetMessageBatchFunction. Providers that
+    // can keep a received payload alive check ReceivesBatches at connect and
+    // queue messages themselves, with holder owning the payload; the message
+    // functions above copy into batches for the others. QueueMessage sets
+    // pauseReceiving when the app is over its inbound limits and the provider
+    // should stop reading until hc_websocket_impl::resume_receiving. If it
+    // fails, the message is lost and so is every one after it, so the
+    // provider must fail the connection.
+    HRESULT SetMessageBatchFunction(_In_opt_ XTaskQueueHandle queue, _In_opt_ HCWebSocketMessageBatchFunction batchFunc, _In_opt_ void* context);
+    void SetInboundQueueLimits(_In_ uint32_t maxMessages, _In_ uint64_t maxBytes);
+    bool ReceivesBatches() const { return m_batchFunc != nullptr && m_fragmentFunc == nullptr; }
+    HRESULT QueueMessage(
+        _In_ HCWebSocketMessageType messageType,
+        _In_reads_bytes_(payloadSize) const uint8_t* payloadBytes,
+        _In_ uint32_t payloadSize,
+        _In_ std::shared_ptr<void> holder,
+        _Out_ bool* pauseReceiving
+    ) noexcept;
+    void ReleaseBatch(_In_ HC_WEBSOCKET_MESSAGE_BATCH* batch) noexcept;
+
     uint64_t id;
     bool disconnectCallExpected{ false };
     http_header_map connectHeaders;
@@ -42,6 +93,13 @@ public:
     http_internal_string subProtocol;
 
     std::shared_ptr<hc_websocket_impl> impl;
+
+    // HCWebSocketSendMessageFragment on providers that only send whole
+    // messages: the fragments are put together here
+    std::mutex sendFragmentLock;
+    bool sendFragmentInProgress{ false };
+    HCWebSocketMessageType sendFragmentType{ HCWebSocketMessageType::Binary };
+    http_internal_vector<uint8_t> sendFragments;
 private:
     HCWebSocketMessageFunction const m_clientMessageFunc;
     HCWebSocketBinaryMessageFunction const m_clientBinaryMessageFunc;
@@ -53,6 +111,33 @@ private:
     std::atomic<int> m_totalRefCount{ 0 };
     std::shared_ptr<HC_WEBSOCKET> m_extraRefHolder;
 
+    static void CALLBACK DispatchBatch(_In_opt_ void* context, _In_ bool canceled);
+    HRESULT ScheduleDispatch();
+    void DeliverBatch(_In_ HC_UNIQUE_PTR<HC_WEBSOCKET_MESSAGE_BATCH> batch);
+    void DeliverClose(_In_ HCWebSocketCloseStatus status);
+    void RecycleBatch(_In_ HC_UNIQUE_PTR<HC_WEBSOCKET_MESSAGE_BATCH> batch) noexcept;
+
+    HCWebSocketMessageFragmentFunction m_fragmentFunc{ nullptr };
+    void* m_fragmentContext{ nullptr };
+
+    XTaskQueueHandle m_batchQueue{ nullptr };
+    HCWebSocketMessageBatchFunction m_batchFunc{ nullptr };
+    void* m_batchContext{ nullptr };
+    uint32_t m_maxInboundMessages{ 0 };
+    uint64_t m_maxInboundBytes{ 0 };
+
+    // Guards the batch state below. Never held while calling the app.
+    std::mutex m_batchLock;
+    HC_UNIQUE_PTR<HC_WEBSOCKET_MESSAGE_BATCH> m_pendingBatch;
+    HC_UNIQUE_PTR<HC_WEBSOCKET_MESSAGE_BATCH> m_spareBatch;
+    bool m_dispatchScheduled{ false };
+    bool m_closePending{ false };
+    HCWebSocketCloseStatus m_pendingCloseStatus{ HCWebSocketCloseStatus::Normal };
+    uint32_t m_inboundMessages{ 0 };
+    uint64_t m_inboundBytes{ 0 };
+    bool m_receivePaused{ false };
+    bool m_receiveFailed{ false };
+
 } HC_WEBSOCKET;
 
 HRESULT CALLBACK Internal_HCWebSocketConnectAsync(
@@ -85,6 +170,60 @@ HRESULT CALLBACK Internal_HCWebSocketDisconnect(
     _In_opt_ void* context
 );
 
+// Sends straight from a caller's buffer, see HCWebSocketSendMessageBuffer.
+// Only providers that can do better than a copy through their send functions
+// implement it; the others leave WebSocketPerformInfo::sendBuffer null.
+typedef HRESULT
+(CALLBACK* HCWebSocketSendMessageBufferFunction)(
+    _In_ HCWebsocketHandle websocket,
+    _In_ HCWebSocketMessageType messageType,
+    _In_reads_bytes_opt_(payloadSize) const uint8_t* payloadBytes,
+    _In_ uint32_t payloadSize,
+    _In_ HCWebSocketSendBufferReleaseFunction releaseFunc,
+    _In_opt_ void* releaseContext
+    );
+
+// Sends one frame of a fragmented message, see HCWebSocketSendMessageFragment.
+// Providers that can't leave WebSocketPerformInfo::sendFragment null.
+typedef HRESULT
+(CALLBACK* HCWebSocketSendMessageFragmentFunction)(
+    _In_ HCWebsocketHandle websocket,
+    _In_ HCWebSocketMessageType messageType,
+    _In_reads_bytes_opt_(payloadSize) const uint8_t* payloadBytes,
+    _In_ uint32_t payloadSize,
+    _In_ bool isFinalFragment,
+    _In_ HCWebSocketSendBufferReleaseFunction releaseFunc,
+    _In_opt_ void* releaseContext
+    );
+
+#if !HC_UNITTEST_API && (HC_PLATFORM == HC_PLATFORM_GENERIC || \
+    (!HC_WINHTTP_WEBSOCKETS && (HC_PLATFORM == HC_PLATFORM_WIN32 || HC_PLATFORM == HC_PLATFORM_ANDROID || HC_PLATFORM_IS_APPLE)))
+#define HC_WEBSOCKET_SEND_BUFFER_PROVIDER 1
+
+HRESULT CALLBACK Internal_HCWebSocketSendMessageBuffer(
+    _In_ HCWebsocketHandle websocket,
+    _In_ HCWebSocketMessageType messageType,
+    _In_reads_bytes_opt_(payloadSize) const uint8_t* payloadBytes,
+    _In_ uint32_t payloadSize,
+    _In_ HCWebSocketSendBufferReleaseFunction releaseFunc,
+    _In_opt_ void* releaseContext
+);
+#endif
+
+#if !HC_UNITTEST_API && HC_PLATFORM == HC_PLATFORM_GENERIC
+#define HC_WEBSOCKET_SEND_FRAGMENT_PROVIDER 1
+
+HRESULT CALLBACK Internal_HCWebSocketSendMessageFragment(
+    _In_ HCWebsocketHandle websocket,
+    _In_ HCWebSocketMessageType messageType,
+    _In_reads_bytes_opt_(payloadSize) const uint8_t* payloadBytes,
+    _In_ uint32_t payloadSize,
+    _In_ bool isFinalFragment,
+    _In_ HCWebSocketSendBufferReleaseFunction releaseFunc,
+    _In_opt_ void* releaseContext
+);
+#endif
+
 struct WebSocketPerformInfo
 {
     WebSocketPerformInfo(
@@ -92,12 +231,16 @@ struct WebSocketPerformInfo
         _In_ HCWebSocketSendMessageFunction st,
         _In_ HCWebSocketSendBinaryMessageFunction sb,
         _In_ HCWebSocketDisconnectFunction dc,
-        _In_opt_ void* ctx
+        _In_opt_ void* ctx,
+        _In_opt_ HCWebSocketSendMessageBufferFunction buf = nullptr,
+        _In_opt_ HCWebSocketSendMessageFragmentFunction frag = nullptr
     ):
         connect{ conn },
         sendText{ st },
         sendBinary{ sb },
         disconnect{ dc },
+        sendBuffer{ buf },
+        sendFragment{ frag },
         context{ ctx }
     {}
 
@@ -105,5 +248,7 @@ struct WebSocketPerformInfo
     HCWebSocketSendMessageFunction sendText = nullptr;
     HCWebSocketSendBinaryMessageFunction sendBinary = nullptr;
     HCWebSocketDisconnectFunction disconnect = nullptr;
+    HCWebSocketSendMessageBufferFunction sendBuffer = nullptr;
+    HCWebSocketSendMessageFragmentFunction sendFragment = nullptr;
     void* context = nullptr;
 };
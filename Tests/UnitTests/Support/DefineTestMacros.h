@@ -75,6 +75,8 @@
     void VerifyEqualStr(Platform::String^ expected, Platform::String^ actual, std::wstring actualName, const WEX::TestExecution::ErrorInfo& errorInfo);
     void VerifyEqualStr(std::wstring expected, std::wstring actual, std::wstring actualName, const WEX::TestExecution::ErrorInfo& errorInfo);
     //#define VERIFY_ARE_EQUAL_STR(__expected, __actual) VerifyEqualStr((__expected), (__actual), (L#__actual), PRIVATE_VERIFY_ERROR_INFO)
+#elif HC_PLATFORM == HC_PLATFORM_GENERIC
+    // Generic/UnitTestIncludes_Generic.h defines the test macros for the Linux runner.
 #else 
     #define DEFINE_TEST_CLASS(x) TEST_CLASS(x)
     #define DEFINE_TEST_CLASS_PROPS(x) ;
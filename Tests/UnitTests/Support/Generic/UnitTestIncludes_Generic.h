@@ -0,0 +1,128 @@
+// Copyright (c) Microsoft Corporation
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+// A minimal stand-in for TAEF and TE on platforms that have neither. Test
+// cases register themselves as their class is compiled and are run by
+// UnitTestMain.cpp, which takes an optional "Class" or "Class::Method"
+// filter on the command line.
+
+#include <cstdio>
+#include <exception>
+#include <sstream>
+#include <string>
+
+NAMESPACE_XBOX_HTTP_CLIENT_TEST_BEGIN
+
+typedef void(*TestMethod)();
+
+struct TestRegistration
+{
+    TestRegistration(_In_z_ const char* className, _In_z_ const char* methodName, _In_ TestMethod method) noexcept;
+};
+
+// Thrown by a failed VERIFY on the thread running the test, and caught by
+// the runner. A VERIFY failing on any other thread is recorded against the
+// running test instead, since throwing there would take down the process.
+struct TestFailure : std::exception
+{
+};
+
+void FailTest(_In_z_ const char* file, _In_ int line, _In_ const std::string& message);
+
+template<typename T>
+std::string FormatValue(const T& value)
+{
+    std::ostringstream stream;
+    stream << value;
+    return stream.str();
+}
+
+inline std::string FormatValue(bool value)
+{
+    return value ? "true" : "false";
+}
+
+inline std::string FormatValue(int8_t value)
+{
+    return std::to_string(value);
+}
+
+inline std::string FormatValue(uint8_t value)
+{
+    return std::to_string(value);
+}
+
+template<typename TExpected, typename TActual>
+void VerifyAreEqual(const TExpected& expected, const TActual& actual, _In_z_ const char* expression, _In_z_ const char* file, _In_ int line)
+{
+    if (!(expected == actual))
+    {
+        FailTest(file, line, std::string(expression) + ": expected " + FormatValue(expected) + ", got " + FormatValue(actual));
+    }
+}
+
+inline void VerifyAreEqualStr(const std::string& expected, const std::string& actual, _In_z_ const char* expression, _In_z_ const char* file, _In_ int line)
+{
+    if (expected != actual)
+    {
+        FailTest(file, line, std::string(expression) + ": expected \"" + expected + "\", got \"" + actual + "\"");
+    }
+}
+
+inline void VerifyHResult(_In_ bool succeeded, _In_ HRESULT hr, _In_z_ const char* expression, _In_z_ const char* file, _In_ int line)
+{
+    if (SUCCEEDED(hr) != succeeded)
+    {
+        char code[16];
+        snprintf(code, sizeof(code), "0x%08x", static_cast<uint32_t>(hr));
+        FailTest(file, line, std::string(expression) + " returned " + code);
+    }
+}
+
+NAMESPACE_XBOX_HTTP_CLIENT_TEST_END
+
+#define DEFINE_TEST_CLASS(x) class x
+#define DEFINE_TEST_CLASS_PROPS(x) \
+    typedef x TestClass; \
+    static constexpr const char* TestClassName = #x
+#define DEFINE_TEST_CASE(x) \
+    template<typename T = TestClass> static void Run##x() { T test; test.x(); } \
+    static inline xbox::httpclienttest::TestRegistration x##Registration{ TestClassName, #x, &Run##x<> }; \
+    void x()
+#define DEFINE_TEST_CASE_PROPERTIES(x) ((void)0)
+#define DEFINE_TEST_CASE_PROPERTIES_IGNORE(x) ((void)0)
+#define DEFINE_TEST_CASE_PROPERTIES_FOCUS(x) ((void)0)
+#define DEFINE_TEST_CASE_PROPERTIES_FAILING(x) ((void)0)
+#define TEST_LOG(x) printf("%s\n", (x))
+#define LOG_COMMENT(x, ...)
+
+#define VERIFY_FAIL() \
+    xbox::httpclienttest::FailTest(__FILE__, __LINE__, "VERIFY_FAIL()")
+#define VERIFY_IS_TRUE(x) \
+    do { if (!(x)) { xbox::httpclienttest::FailTest(__FILE__, __LINE__, "VERIFY_IS_TRUE(" #x ")"); } } while (0)
+#define VERIFY_IS_FALSE(x) \
+    do { if (x) { xbox::httpclienttest::FailTest(__FILE__, __LINE__, "VERIFY_IS_FALSE(" #x ")"); } } while (0)
+#define VERIFY_IS_NULL(x) \
+    VERIFY_IS_TRUE((x) == nullptr)
+#define VERIFY_IS_NOT_NULL(x) \
+    VERIFY_IS_TRUE((x) != nullptr)
+#define VERIFY_ARE_EQUAL(expected, actual) \
+    xbox::httpclienttest::VerifyAreEqual((expected), (actual), "VERIFY_ARE_EQUAL(" #expected ", " #actual ")", __FILE__, __LINE__)
+#define VERIFY_ARE_NOT_EQUAL(expected, actual) \
+    VERIFY_IS_FALSE((expected) == (actual))
+#define VERIFY_ARE_EQUAL_STR(expected, actual) \
+    xbox::httpclienttest::VerifyAreEqualStr((expected), (actual), "VERIFY_ARE_EQUAL_STR(" #expected ", " #actual ")", __FILE__, __LINE__)
+#define VERIFY_ARE_EQUAL_INT(expected, actual) \
+    VERIFY_ARE_EQUAL(static_cast<int64_t>(expected), static_cast<int64_t>(actual))
+#define VERIFY_ARE_EQUAL_UINT(expected, actual) \
+    VERIFY_ARE_EQUAL(static_cast<uint64_t>(expected), static_cast<uint64_t>(actual))
+#define VERIFY_SUCCEEDED(x) \
+    xbox::httpclienttest::VerifyHResult(true, (x), "VERIFY_SUCCEEDED(" #x ")", __FILE__, __LINE__)
+#define VERIFY_FAILED(x) \
+    xbox::httpclienttest::VerifyHResult(false, (x), "VERIFY_FAILED(" #x ")", __FILE__, __LINE__)
+#define VERIFY_IS_LESS_THAN(expectedLess, expectedGreater) \
+    VERIFY_IS_TRUE((expectedLess) < (expectedGreater))
+#define VERIFY_IS_GREATER_THAN_OR_EQUAL(expectedGreater, expectedLess) \
+    VERIFY_IS_TRUE((expectedGreater) >= (expectedLess))
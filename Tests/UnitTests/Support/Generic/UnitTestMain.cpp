@@ -0,0 +1,117 @@
+// Copyright (c) Microsoft Corporation
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "pch.h"
+#include "UnitTestIncludes.h"
+
+NAMESPACE_XBOX_HTTP_CLIENT_TEST_BEGIN
+
+namespace
+{
+
+struct RegisteredTest
+{
+    const char* className;
+    const char* methodName;
+    TestMethod method;
+};
+
+std::vector<RegisteredTest>& RegisteredTests()
+{
+    static std::vector<RegisteredTest> tests;
+    return tests;
+}
+
+std::mutex g_failureLock;
+std::thread::id g_testThread;
+uint32_t g_failures = 0;
+
+bool Matches(const RegisteredTest& test, const std::string& filter)
+{
+    if (filter.empty() || filter == test.className)
+    {
+        return true;
+    }
+    return filter == std::string(test.className) + "::" + test.methodName;
+}
+
+}
+
+TestRegistration::TestRegistration(_In_z_ const char* className, _In_z_ const char* methodName, _In_ TestMethod method) noexcept
+{
+    RegisteredTests().push_back(RegisteredTest{ className, methodName, method });
+}
+
+void FailTest(_In_z_ const char* file, _In_ int line, _In_ const std::string& message)
+{
+    fprintf(stderr, "%s(%d): %s\n", file, line, message.c_str());
+    {
+        std::lock_guard<std::mutex> lock{ g_failureLock };
+        ++g_failures;
+    }
+
+    if (std::this_thread::get_id() == g_testThread)
+    {
+        throw TestFailure{};
+    }
+}
+
+NAMESPACE_XBOX_HTTP_CLIENT_TEST_END
+
+int main(int argc, char** argv)
+{
+    using namespace xbox::httpclienttest;
+
+    std::string filter = argc > 1 ? argv[1] : "";
+    uint32_t run = 0;
+    uint32_t failed = 0;
+    g_testThread = std::this_thread::get_id();
+
+    for (const auto& test : RegisteredTests())
+    {
+        if (!Matches(test, filter))
+        {
+            continue;
+        }
+
+        printf("[ RUN  ] %s::%s\n", test.className, test.methodName);
+        fflush(stdout);
+
+        uint32_t failuresBefore;
+        {
+            std::lock_guard<std::mutex> lock{ g_failureLock };
+            failuresBefore = g_failures;
+        }
+
+        try
+        {
+            test.method();
+        }
+        catch (const TestFailure&)
+        {
+        }
+        catch (const std::exception& e)
+        {
+            fprintf(stderr, "Unhandled exception: %s\n", e.what());
+            std::lock_guard<std::mutex> lock{ g_failureLock };
+            ++g_failures;
+        }
+
+        bool passed;
+        {
+            std::lock_guard<std::mutex> lock{ g_failureLock };
+            passed = g_failures == failuresBefore;
+        }
+
+        ++run;
+        if (!passed)
+        {
+            ++failed;
+        }
+        printf("[ %s ] %s::%s\n", passed ? "PASS" : "FAIL", test.className, test.methodName);
+        fflush(stdout);
+    }
+
+    printf("%u of %u tests passed\n", run - failed, run);
+    return run > 0 && failed == 0 ? 0 : 1;
+}
@@ -4,6 +4,8 @@
 #pragma once
 #ifdef USING_TAEF
 #include "TAEF/UnitTestIncludes_TAEF.h"
+#elif HC_PLATFORM == HC_PLATFORM_GENERIC
+#include "Generic/UnitTestIncludes_Generic.h"
 #else
 #include "TE/UnitTestIncludes_TE.h"
 #include "DefineTestMacros.h"
@@ -661,6 +661,88 @@ public:
         VERIFY_QUEUE_EMPTY(queue);
     }
 
+    DEFINE_TEST_CASE(VerifyBeginAsyncAllocLargeContext)
+    {
+        // Contexts too large for a pooled async state come from the heap
+        const size_t contextSize = 4096;
+
+        XAsyncBlock async = {};
+        async.queue = queue;
+
+        auto provider = [](XAsyncOp op, const XAsyncProviderData* data)
+        {
+            if (op == XAsyncOp::DoWork)
+            {
+                const uint8_t* bytes = static_cast<const uint8_t*>(data->context);
+                HRESULT hr = S_OK;
+                for (size_t idx = 0; idx < 4096; idx++)
+                {
+                    if (bytes[idx] != static_cast<uint8_t>(idx))
+                    {
+                        hr = E_FAIL;
+                    }
+                }
+                XAsyncComplete(data->async, hr, 0);
+            }
+            return S_OK;
+        };
+
+        void* context;
+        VERIFY_SUCCEEDED(XAsyncBeginAlloc(&async, nullptr, nullptr, provider, contextSize, &context));
+        for (size_t idx = 0; idx < contextSize; idx++)
+        {
+            static_cast<uint8_t*>(context)[idx] = static_cast<uint8_t>(idx);
+        }
+
+        VERIFY_SUCCEEDED(XAsyncSchedule(&async, 0));
+        VERIFY_SUCCEEDED(XAsyncGetStatus(&async, true));
+        VERIFY_QUEUE_EMPTY(queue);
+    }
+
+    DEFINE_TEST_CASE(VerifyMultipleWaiters)
+    {
+        WorkThunk cb([](XAsyncBlock*)
+        {
+            Sleep(200);
+            return 0;
+        });
+
+        XAsyncBlock async = {};
+        async.queue = queue;
+        async.context = &cb;
+
+        VERIFY_SUCCEEDED(XAsyncRun(&async, WorkThunk::Callback));
+
+        std::atomic<uint32_t> succeeded{ 0 };
+        std::vector<std::thread> waiters;
+        for (int idx = 0; idx < 4; idx++)
+        {
+            waiters.emplace_back([&]
+            {
+                if (SUCCEEDED(XAsyncGetStatus(&async, true)))
+                {
+                    succeeded++;
+                }
+            });
+        }
+
+        for (auto& waiter : waiters)
+        {
+            waiter.join();
+        }
+
+        VERIFY_ARE_EQUAL(4u, succeeded.load());
+        VERIFY_SUCCEEDED(XAsyncGetStatus(&async, false));
+
+        // The waiters wake before the completing thread lets go of the
+        // async state, so wait for that before the fixture checks for leaks.
+        for (int i = 0; i < 500 && s_AsyncLibGlobalStateCount != 0; i++)
+        {
+            Sleep(10);
+        }
+        VERIFY_QUEUE_EMPTY(queue);
+    }
+
     DEFINE_TEST_CASE(VerifyPeriodicPattern)
     {
         struct Controller
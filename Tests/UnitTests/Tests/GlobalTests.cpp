@@ -7,6 +7,7 @@
 #include "DefineTestMacros.h"
 #include "Utils.h"
 #include "../Common/Win/utils_win.h"
+#include "../global/global.h"
 
 using namespace xbox::httpclient;
 static bool g_gotCall = false;
@@ -33,6 +34,140 @@ public:
         VERIFY_ARE_EQUAL_STR("test", utf8.c_str());
     }
 
+    struct CachedContext
+    {
+        CachedContext(uint32_t* destroyed) : destroyed(destroyed) {}
+        ~CachedContext()
+        {
+            (*destroyed)++;
+            if (removeOnDestroy != nullptr)
+            {
+                shared_ptr_cache::remove(removeOnDestroy);
+            }
+        }
+
+        uint32_t* destroyed;
+        void* removeOnDestroy = nullptr;
+    };
+
+    DEFINE_TEST_CASE(TestSharedPtrCache)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestSharedPtrCache);
+
+        uint32_t destroyed = 0;
+
+        // Nothing can be stored until the library is initialized
+        VERIFY_IS_NULL(shared_ptr_cache::store<CachedContext>(std::make_shared<CachedContext>(&destroyed)));
+        VERIFY_ARE_EQUAL(1u, destroyed);
+        destroyed = 0;
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+
+        // Enough contexts that every shard holds several
+        const uint32_t total = 512;
+        std::vector<void*> raw;
+        for (uint32_t i = 0; i < total; i++)
+        {
+            void* ptr = shared_ptr_cache::store<CachedContext>(std::make_shared<CachedContext>(&destroyed));
+            VERIFY_IS_NOT_NULL(ptr);
+            raw.push_back(ptr);
+        }
+
+        for (uint32_t i = 0; i < total; i++)
+        {
+            auto context = shared_ptr_cache::fetch<CachedContext>(raw[i], false);
+            VERIFY_IS_TRUE(context.get() == raw[i]);
+        }
+
+        // An address that was never stored misses
+        uint32_t notStored = 0;
+        VERIFY_IS_NULL(shared_ptr_cache::fetch<CachedContext>(&notStored, false).get());
+
+        // Removing drops the cache's reference; a fetched one keeps it alive
+        auto held = shared_ptr_cache::fetch<CachedContext>(raw[0], false);
+        for (uint32_t i = 0; i < total; i += 2)
+        {
+            shared_ptr_cache::remove(raw[i]);
+        }
+        VERIFY_ARE_EQUAL(total / 2 - 1, destroyed);
+        held.reset();
+        VERIFY_ARE_EQUAL(total / 2, destroyed);
+
+        for (uint32_t i = 0; i < total; i++)
+        {
+            bool stored = (i % 2) != 0;
+            VERIFY_ARE_EQUAL(stored, shared_ptr_cache::fetch<CachedContext>(raw[i], false) != nullptr);
+        }
+
+        // A context may use the cache from its destructor
+        static_cast<CachedContext*>(raw[1])->removeOnDestroy = raw[3];
+        shared_ptr_cache::remove(raw[1]);
+        VERIFY_ARE_EQUAL(total / 2 + 2, destroyed);
+        VERIFY_IS_NULL(shared_ptr_cache::fetch<CachedContext>(raw[3], false).get());
+
+        // Cleanup evicts everything left and closes the cache
+        HCCleanup();
+        VERIFY_ARE_EQUAL(total, destroyed);
+        VERIFY_IS_NULL(shared_ptr_cache::fetch<CachedContext>(raw[5], false).get());
+    }
+
+    DEFINE_TEST_CASE(TestSingletonPinHeldAcrossCleanup)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestSingletonPinHeldAcrossCleanup);
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+
+        // Pin from a thread that exits while the pin lives on elsewhere, so
+        // its slot goes back to the list with a count still on it
+        http_singleton_ref pinned;
+        std::thread pinner([&pinned]
+        {
+            pinned = get_http_singleton(true);
+        });
+        pinner.join();
+        VERIFY_IS_TRUE(pinned != nullptr);
+        http_singleton_ref copy = pinned;
+
+        std::atomic<bool> cleanedUp{ false };
+        std::thread cleanup([&cleanedUp]
+        {
+            HCCleanup();
+            cleanedUp = true;
+        });
+
+        // Cleanup unpublishes the singleton right away but can't destroy it
+        // while it is pinned
+        for (uint32_t i = 0; i < 100 && get_http_singleton(false) != nullptr; i++)
+        {
+            Sleep(10);
+        }
+        VERIFY_IS_TRUE(get_http_singleton(false) == nullptr);
+
+        Sleep(200);
+        VERIFY_IS_FALSE(cleanedUp.load());
+        VERIFY_IS_FALSE(pinned->m_mocksEnabled);
+
+        pinned = http_singleton_ref{};
+        Sleep(200);
+        VERIFY_IS_FALSE(cleanedUp.load());
+
+        // Dropping the last pin wakes the waiting cleanup
+        UINT64 ticks = GetTickCount64();
+        copy = http_singleton_ref{};
+        cleanup.join();
+        VERIFY_IS_TRUE(cleanedUp.load());
+        VERIFY_IS_LESS_THAN(GetTickCount64() - ticks, (UINT64)1000);
+
+        // The returned slot starts clean for the next thread that pins
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        std::thread reuse([]
+        {
+            VERIFY_IS_TRUE(get_http_singleton(false) != nullptr);
+        });
+        reuse.join();
+        HCCleanup();
+    }
+
 };
 
 NAMESPACE_XBOX_HTTP_CLIENT_TEST_END
@@ -0,0 +1,457 @@
+// Copyright (c) Microsoft Corporation
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "pch.h"
+#include "UnitTestIncludes.h"
+#define TEST_CLASS_OWNER L"jasonsa"
+#include "DefineTestMacros.h"
+#include "LoopbackServer.h"
+
+#if HC_PLATFORM == HC_PLATFORM_GENERIC && !HC_UNITTEST_API
+
+NAMESPACE_XBOX_HTTP_CLIENT_TEST_BEGIN
+
+static std::string RequestPath(const std::string& request)
+{
+    size_t begin = request.find(' ') + 1;
+    return request.substr(begin, request.find(' ', begin) - begin);
+}
+
+static std::string Response(const char* status, const std::string& body, const char* headers = "")
+{
+    return std::string("HTTP/1.1 ") + status + "\r\nContent-Length: " + std::to_string(body.size()) + "\r\n" + headers + "\r\n" + body;
+}
+
+// Answers every request on a connection with a 200 whose body is the
+// request's path, for as long as the client keeps the connection open
+static void EchoPaths(LoopbackConnection& connection)
+{
+    std::string request, body;
+    while (connection.ReadRequest(request, body))
+    {
+        connection.Write(Response("200 OK", RequestPath(request)));
+    }
+}
+
+// An HTTP call with retries turned off, so each Perform is a single
+// request and any failure is reported as it happened
+class TestHttpCall
+{
+public:
+    TestHttpCall(const char* method, const std::string& url)
+    {
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallCreate(&m_call));
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallRequestSetUrl(m_call, method, url.c_str()));
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallRequestSetRetryAllowed(m_call, false));
+    }
+
+    ~TestHttpCall()
+    {
+        HCHttpCallCloseHandle(m_call);
+    }
+
+    HCCallHandle Handle() const
+    {
+        return m_call;
+    }
+
+    HRESULT Perform()
+    {
+        XAsyncBlock asyncBlock{};
+        RETURN_IF_FAILED(HCHttpCallPerformAsync(m_call, &asyncBlock));
+        return XAsyncGetStatus(&asyncBlock, true);
+    }
+
+    HRESULT NetworkError()
+    {
+        HRESULT networkError = S_OK;
+        uint32_t platformError = 0;
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallResponseGetNetworkErrorCode(m_call, &networkError, &platformError));
+        return networkError;
+    }
+
+    uint32_t PlatformError()
+    {
+        HRESULT networkError = S_OK;
+        uint32_t platformError = 0;
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallResponseGetNetworkErrorCode(m_call, &networkError, &platformError));
+        return platformError;
+    }
+
+    uint32_t StatusCode()
+    {
+        uint32_t statusCode = 0;
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallResponseGetStatusCode(m_call, &statusCode));
+        return statusCode;
+    }
+
+    std::string Body()
+    {
+        size_t size = 0;
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallResponseGetResponseBodyBytesSize(m_call, &size));
+        std::string body(size, '\0');
+        if (size > 0)
+        {
+            VERIFY_ARE_EQUAL(S_OK, HCHttpCallResponseGetResponseBodyBytes(m_call, size, reinterpret_cast<uint8_t*>(&body[0]), nullptr));
+        }
+        return body;
+    }
+
+    std::string Header(const char* name)
+    {
+        const char* value = nullptr;
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallResponseGetHeader(m_call, name, &value));
+        return value != nullptr ? value : "";
+    }
+
+private:
+    HCCallHandle m_call = nullptr;
+};
+
+DEFINE_TEST_CLASS(HttpLoopbackTests)
+{
+public:
+    DEFINE_TEST_CLASS_PROPS(HttpLoopbackTests);
+
+    DEFINE_TEST_CASE(TestContentLengthBody)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestContentLengthBody);
+
+        std::string request, requestBody;
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            connection.ReadRequest(request, requestBody);
+
+            // Headers and body split across writes, the body mid-way
+            connection.Write("HTTP/1.1 201 Created\r\nContent-Len");
+            connection.Write("gth: 11\r\nX-Test:  padded value \r\n\r\nhello");
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            connection.Write(" world");
+            connection.WaitForClose();
+        } };
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            TestHttpCall call{ "POST", server.Url("http", "/upload") };
+            VERIFY_ARE_EQUAL(S_OK, HCHttpCallRequestSetRequestBodyString(call.Handle(), "request body"));
+            VERIFY_ARE_EQUAL(S_OK, call.Perform());
+            VERIFY_ARE_EQUAL(S_OK, call.NetworkError());
+            VERIFY_ARE_EQUAL(201u, call.StatusCode());
+            VERIFY_ARE_EQUAL_STR("hello world", call.Body());
+            VERIFY_ARE_EQUAL_STR("padded value", call.Header("X-Test"));
+        }
+        HCCleanup();
+
+        VERIFY_ARE_EQUAL_STR("POST /upload HTTP/1.1", request.substr(0, request.find("\r\n")));
+        VERIFY_ARE_EQUAL_STR("127.0.0.1:" + std::to_string(server.Port()), HeaderValue(request, "Host"));
+        VERIFY_ARE_EQUAL_STR("12", HeaderValue(request, "Content-Length"));
+        VERIFY_ARE_EQUAL_STR("request body", requestBody);
+    }
+
+    DEFINE_TEST_CASE(TestChunkedBody)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestChunkedBody);
+
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            std::string request, body;
+            connection.ReadRequest(request, body);
+
+            // Upper and lower case hex, a chunk extension and a trailer,
+            // with chunk boundaries falling across writes
+            connection.Write(
+                "HTTP/1.1 200 OK\r\n"
+                "Transfer-Encoding: chunked\r\n"
+                "\r\n"
+                "4;name=value\r\nWiki\r\n"
+                "5\r\npe");
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            connection.Write(
+                "dia\r\n"
+                "E\r\n in\r\n\r\nchunks.\r\n"
+                "a\r\n0123456789\r\n"
+                "0\r\n"
+                "Trailer: value\r\n"
+                "\r\n");
+
+            // Only if the whole of the chunked body was consumed does the
+            // next response on the connection parse
+            EchoPaths(connection);
+        } };
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            TestHttpCall chunked{ "GET", server.Url("http", "/chunked") };
+            VERIFY_ARE_EQUAL(S_OK, chunked.Perform());
+            VERIFY_ARE_EQUAL(S_OK, chunked.NetworkError());
+            VERIFY_ARE_EQUAL(200u, chunked.StatusCode());
+            VERIFY_ARE_EQUAL_STR("Wikipedia in\r\n\r\nchunks.0123456789", chunked.Body());
+
+            TestHttpCall next{ "GET", server.Url("http", "/next") };
+            VERIFY_ARE_EQUAL(S_OK, next.Perform());
+            VERIFY_ARE_EQUAL(S_OK, next.NetworkError());
+            VERIFY_ARE_EQUAL_STR("/next", next.Body());
+        }
+        HCCleanup();
+
+        VERIFY_ARE_EQUAL(1u, server.AcceptedCount());
+    }
+
+    DEFINE_TEST_CASE(TestBodyUntilClose)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestBodyUntilClose);
+
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            std::string request, body;
+            connection.ReadRequest(request, body);
+            connection.Write("HTTP/1.0 200 OK\r\n\r\nno length");
+        } };
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            // Without a length the body runs to the end of the connection,
+            // which then can't be reused
+            for (int i = 0; i < 2; ++i)
+            {
+                TestHttpCall call{ "GET", server.Url("http", "/") };
+                VERIFY_ARE_EQUAL(S_OK, call.Perform());
+                VERIFY_ARE_EQUAL(S_OK, call.NetworkError());
+                VERIFY_ARE_EQUAL_STR("no length", call.Body());
+            }
+        }
+        HCCleanup();
+
+        VERIFY_ARE_EQUAL(2u, server.AcceptedCount());
+    }
+
+    DEFINE_TEST_CASE(TestKeepAliveReuse)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestKeepAliveReuse);
+
+        LoopbackServer server{ EchoPaths };
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            for (int i = 0; i < 5; ++i)
+            {
+                std::string path = "/call" + std::to_string(i);
+                TestHttpCall call{ "GET", server.Url("http", path.c_str()) };
+                VERIFY_ARE_EQUAL(S_OK, call.Perform());
+                VERIFY_ARE_EQUAL(S_OK, call.NetworkError());
+                VERIFY_ARE_EQUAL_STR(path, call.Body());
+            }
+            VERIFY_ARE_EQUAL(1u, server.AcceptedCount());
+
+            // A call asking for the connection to be closed gets a fresh one
+            // after it
+            TestHttpCall closing{ "GET", server.Url("http", "/closing") };
+            VERIFY_ARE_EQUAL(S_OK, HCHttpCallRequestSetHeader(closing.Handle(), "Connection", "close", true));
+            VERIFY_ARE_EQUAL(S_OK, closing.Perform());
+            VERIFY_ARE_EQUAL_STR("/closing", closing.Body());
+
+            TestHttpCall after{ "GET", server.Url("http", "/after") };
+            VERIFY_ARE_EQUAL(S_OK, after.Perform());
+            VERIFY_ARE_EQUAL_STR("/after", after.Body());
+        }
+        HCCleanup();
+
+        VERIFY_ARE_EQUAL(2u, server.AcceptedCount());
+    }
+
+    DEFINE_TEST_CASE(TestKeepAliveServerClose)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestKeepAliveServerClose);
+
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            std::string request, body;
+            connection.ReadRequest(request, body);
+            std::string path = RequestPath(request);
+            if (path == "/close")
+            {
+                connection.Write(Response("200 OK", path, "Connection: close\r\n"));
+            }
+            else
+            {
+                // Lets the client keep the connection, then drops it anyway
+                connection.Write(Response("200 OK", path));
+            }
+        } };
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            // Whether the client sees the pooled connection close before or
+            // after it reuses it, each call gets through on a connection of
+            // its own
+            const char* paths[] = { "/close", "/dropped", "/dropped", "/close" };
+            for (const char* path : paths)
+            {
+                TestHttpCall call{ "GET", server.Url("http", path) };
+                VERIFY_ARE_EQUAL(S_OK, call.Perform());
+                VERIFY_ARE_EQUAL(S_OK, call.NetworkError());
+                VERIFY_ARE_EQUAL_STR(path, call.Body());
+            }
+        }
+        HCCleanup();
+
+        VERIFY_ARE_EQUAL(4u, server.AcceptedCount());
+    }
+
+    DEFINE_TEST_CASE(TestRedirect)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestRedirect);
+
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            std::string request, body;
+            while (connection.ReadRequest(request, body))
+            {
+                std::string path = RequestPath(request);
+                if (path == "/old")
+                {
+                    connection.Write(Response("302 Found", "moved", "Location: /new\r\n"));
+                }
+                else if (path == "/not-modified")
+                {
+                    // No body follows a 304, whatever its headers say
+                    connection.Write("HTTP/1.1 304 Not Modified\r\nContent-Length: 10\r\n\r\n");
+                }
+                else
+                {
+                    connection.Write(Response("200 OK", path));
+                }
+            }
+        } };
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            // Redirects are handed back to the caller to follow
+            TestHttpCall old{ "GET", server.Url("http", "/old") };
+            VERIFY_ARE_EQUAL(S_OK, old.Perform());
+            VERIFY_ARE_EQUAL(S_OK, old.NetworkError());
+            VERIFY_ARE_EQUAL(302u, old.StatusCode());
+            VERIFY_ARE_EQUAL_STR("/new", old.Header("Location"));
+            VERIFY_ARE_EQUAL_STR("moved", old.Body());
+
+            TestHttpCall redirected{ "GET", server.Url("http", old.Header("Location").c_str()) };
+            VERIFY_ARE_EQUAL(S_OK, redirected.Perform());
+            VERIFY_ARE_EQUAL(200u, redirected.StatusCode());
+            VERIFY_ARE_EQUAL_STR("/new", redirected.Body());
+
+            TestHttpCall notModified{ "GET", server.Url("http", "/not-modified") };
+            VERIFY_ARE_EQUAL(S_OK, notModified.Perform());
+            VERIFY_ARE_EQUAL(S_OK, notModified.NetworkError());
+            VERIFY_ARE_EQUAL(304u, notModified.StatusCode());
+            VERIFY_ARE_EQUAL_STR("", notModified.Body());
+
+            TestHttpCall after{ "GET", server.Url("http", "/after") };
+            VERIFY_ARE_EQUAL(S_OK, after.Perform());
+            VERIFY_ARE_EQUAL_STR("/after", after.Body());
+        }
+        HCCleanup();
+
+        VERIFY_ARE_EQUAL(1u, server.AcceptedCount());
+    }
+
+    DEFINE_TEST_CASE(TestTimeout)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestTimeout);
+
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            std::string request, body;
+            connection.ReadRequest(request, body);
+            if (RequestPath(request) == "/partial")
+            {
+                connection.Write("HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nabc");
+            }
+            connection.WaitForClose();
+        } };
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            // Stalled before the response starts and part way into the body
+            const char* paths[] = { "/silent", "/partial" };
+            for (const char* path : paths)
+            {
+                TestHttpCall call{ "GET", server.Url("http", path) };
+                VERIFY_ARE_EQUAL(S_OK, HCHttpCallRequestSetTimeout(call.Handle(), 1));
+                auto start = std::chrono::steady_clock::now();
+                VERIFY_ARE_EQUAL(S_OK, call.Perform());
+                auto elapsed = std::chrono::steady_clock::now() - start;
+                VERIFY_ARE_EQUAL(E_FAIL, call.NetworkError());
+                VERIFY_ARE_EQUAL(static_cast<uint32_t>(ETIMEDOUT), call.PlatformError());
+                VERIFY_IS_TRUE(elapsed >= std::chrono::seconds(1));
+                VERIFY_IS_TRUE(elapsed < std::chrono::seconds(LOOPBACK_TIMEOUT_SECONDS));
+            }
+        }
+        HCCleanup();
+    }
+
+    DEFINE_TEST_CASE(TestMalformedResponses)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestMalformedResponses);
+
+        const char* responses[] =
+        {
+            "garbage\r\n\r\n",
+            "HTTP/2.0 200 OK\r\nContent-Length: 0\r\n\r\n",
+            "HTTP/1.1 2OO OK\r\nContent-Length: 0\r\n\r\n",
+            "HTTP/1.1 200OK\r\nContent-Length: 0\r\n\r\n",
+            "HTTP/1.1 099 Low\r\nContent-Length: 0\r\n\r\n",
+            "HTTP/1.1 +20 OK\r\nContent-Length: 0\r\n\r\n",
+            "HTTP/1.1 200 OK\r\nNo colon here\r\nContent-Length: 0\r\n\r\n",
+            "HTTP/1.1 200 OK\r\n: no name\r\nContent-Length: 0\r\n\r\n",
+            "HTTP/1.1 200 OK\r\nContent-Length: -1\r\n\r\nbody",
+            "HTTP/1.1 200 OK\r\nContent-Length: +5\r\n\r\nbody!",
+            "HTTP/1.1 200 OK\r\nContent-Length: 0x5\r\n\r\nbody!",
+            "HTTP/1.1 200 OK\r\nContent-Length: 5 5\r\n\r\nbody!",
+            "HTTP/1.1 200 OK\r\nContent-Length: \r\n\r\n",
+            "HTTP/1.1 200 OK\r\nContent-Length: 18446744073709551616\r\n\r\n",
+            "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\nbody\r\n0\r\n\r\n",
+            "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n-1\r\nbody\r\n0\r\n\r\n",
+            "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\ncut short",
+        };
+        const size_t responseCount = sizeof(responses) / sizeof(responses[0]);
+
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            std::string request, body;
+            connection.ReadRequest(request, body);
+            size_t index = strtoul(RequestPath(request).c_str() + 1, nullptr, 10);
+            if (index < responseCount)
+            {
+                connection.Write(responses[index]);
+            }
+            else
+            {
+                connection.Write("HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok");
+            }
+        } };
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            for (size_t i = 0; i < responseCount; ++i)
+            {
+                std::string path = "/" + std::to_string(i);
+                TestHttpCall call{ "GET", server.Url("http", path.c_str()) };
+                VERIFY_ARE_EQUAL(S_OK, call.Perform());
+                VERIFY_ARE_EQUAL(E_FAIL, call.NetworkError());
+            }
+
+            // None of that spoils the next, well formed, response
+            std::string path = "/" + std::to_string(responseCount);
+            TestHttpCall wellFormed{ "GET", server.Url("http", path.c_str()) };
+            VERIFY_ARE_EQUAL(S_OK, wellFormed.Perform());
+            VERIFY_ARE_EQUAL(S_OK, wellFormed.NetworkError());
+            VERIFY_ARE_EQUAL(200u, wellFormed.StatusCode());
+            VERIFY_ARE_EQUAL_STR("ok", wellFormed.Body());
+        }
+        HCCleanup();
+    }
+};
+
+NAMESPACE_XBOX_HTTP_CLIENT_TEST_END
+
+#endif
@@ -222,6 +222,50 @@ public:
         HCCleanup();
     }
 
+    DEFINE_TEST_CASE(TestCallPool)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestCallPool);
+
+        VERIFY_ARE_EQUAL(E_HC_NOT_INITIALISED, HCHttpCallSetPoolLimits(1, 0));
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallSetPoolLimits(1, 4096));
+
+        HCCallHandle call = nullptr;
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallCreate(&call));
+        uint64_t firstId = HCHttpCallGetId(call);
+        http_internal_string url(1024, 'a');
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallRequestSetUrl(call, "GET", url.c_str()));
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallRequestSetHeader(call, "testHeader", "testValue", true));
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallResponseSetStatusCode(call, 404));
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallCloseHandle(call));
+
+        // The recycled call comes back clean but keeps its buffers
+        HCCallHandle reused = nullptr;
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallCreate(&reused));
+        VERIFY_ARE_EQUAL(call, reused);
+        VERIFY_ARE_NOT_EQUAL(firstId, HCHttpCallGetId(reused));
+        VERIFY_IS_TRUE(reused->url.empty());
+        VERIFY_IS_TRUE(reused->url.capacity() >= url.size());
+        VERIFY_IS_TRUE(reused->requestHeaders.empty());
+        VERIFY_ARE_EQUAL(0u, reused->statusCode);
+        VERIFY_ARE_EQUAL(1, reused->refCount.load());
+
+        // Buffers beyond the retained byte limit are released
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallSetPoolLimits(1, 16));
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallRequestSetUrl(reused, "GET", url.c_str()));
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallCloseHandle(reused));
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallCreate(&call));
+        VERIFY_ARE_EQUAL(reused, call);
+        VERIFY_IS_TRUE(call->url.capacity() < url.size());
+
+        // Disabled pools hand out fresh calls
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallSetPoolLimits(0, 0));
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallCloseHandle(call));
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallCreate(&call));
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallCloseHandle(call));
+        HCCleanup();
+    }
+
     DEFINE_TEST_CASE(TestRequest)
     {
         DEFINE_TEST_CASE_PROPERTIES(TestRequest);
@@ -272,6 +316,74 @@ public:
     }
 
 
+    static HRESULT CALLBACK ReadRequestBody(
+        _In_ HCCallHandle call,
+        _In_ uint64_t offset,
+        _In_ size_t bytesAvailable,
+        _In_opt_ void* context,
+        _Out_writes_bytes_to_(bytesAvailable, *bytesWritten) uint8_t* destination,
+        _Out_ size_t* bytesWritten
+        )
+    {
+        UNREFERENCED_PARAMETER(call);
+        auto body = static_cast<const std::string*>(context);
+        *bytesWritten = 0;
+        if (offset < body->size())
+        {
+            // Hand the body out a byte at a time to exercise partial reads
+            *destination = static_cast<uint8_t>((*body)[static_cast<size_t>(offset)]);
+            *bytesWritten = 1;
+        }
+        return S_OK;
+    }
+
+    DEFINE_TEST_CASE(TestRequestBodyReadFunction)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestRequestBodyReadFunction);
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        HCCallHandle call = nullptr;
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallCreate(&call));
+
+        HCHttpCallRequestBodyReadFunction readFunction = nullptr;
+        uint64_t bodySize = 0;
+        void* context = nullptr;
+        uint8_t buffer[8] = {};
+        size_t bytesWritten = 0;
+
+        // Byte bodies are exposed to providers through a built-in read function
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallRequestSetRequestBodyString(call, "abc"));
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallRequestGetRequestBodyReadFunction(call, &readFunction, &bodySize, &context));
+        VERIFY_IS_NOT_NULL(readFunction);
+        VERIFY_ARE_EQUAL(3, bodySize);
+        VERIFY_ARE_EQUAL(S_OK, readFunction(call, 1, sizeof(buffer), context, buffer, &bytesWritten));
+        VERIFY_ARE_EQUAL(2, bytesWritten);
+        VERIFY_ARE_EQUAL('b', buffer[0]);
+        VERIFY_ARE_EQUAL(S_OK, readFunction(call, 3, sizeof(buffer), context, buffer, &bytesWritten));
+        VERIFY_ARE_EQUAL(0, bytesWritten);
+
+        std::string body = "hello world";
+        VERIFY_ARE_EQUAL(E_INVALIDARG, HCHttpCallRequestSetRequestBodyReadFunction(call, nullptr, 0, nullptr));
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallRequestSetRequestBodyReadFunction(call, ReadRequestBody, HC_HTTP_REQUEST_BODY_SIZE_UNKNOWN, &body));
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallRequestGetRequestBodyReadFunction(call, &readFunction, &bodySize, &context));
+        VERIFY_ARE_EQUAL(ReadRequestBody, readFunction);
+        VERIFY_ARE_EQUAL(HC_HTTP_REQUEST_BODY_SIZE_UNKNOWN, bodySize);
+        VERIFY_ARE_EQUAL(&body, context);
+
+        // Providers that need a buffer get the body read into one
+        const CHAR* bodyString = nullptr;
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallRequestGetRequestBodyString(call, &bodyString));
+        VERIFY_ARE_EQUAL_STR("hello world", bodyString);
+
+        // A body shorter than its declared size is an error
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallRequestSetRequestBodyReadFunction(call, ReadRequestBody, 20, &body));
+        const BYTE* bodyBytes = nullptr;
+        uint32_t bodyBytesSize = 0;
+        VERIFY_ARE_EQUAL(E_UNEXPECTED, HCHttpCallRequestGetRequestBodyBytes(call, &bodyBytes, &bodyBytesSize));
+
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallCloseHandle(call));
+        HCCleanup();
+    }
+
     DEFINE_TEST_CASE(TestRequestHeaders)
     {
         DEFINE_TEST_CASE_PROPERTIES(TestRequestHeaders);
@@ -394,6 +506,17 @@ public:
         VERIFY_ARE_EQUAL_STR("testHeader2", hn1);
         VERIFY_ARE_EQUAL_STR("testValue2", hv1);
 
+        // Lookups ignore case and headers keep the order they were added in
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallResponseSetHeader(call, "ETag", "1"));
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallResponseSetHeader(call, "Age", "2"));
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallResponseGetHeader(call, "TESTHEADER2", &t1));
+        VERIFY_ARE_EQUAL_STR("testValue2", t1);
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallResponseGetHeaderAtIndex(call, 3, &hn0, &hv0));
+        VERIFY_ARE_EQUAL_STR("Age", hn0);
+        VERIFY_ARE_EQUAL_STR("2", hv0);
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallResponseGetHeaderAtIndex(call, 4, &hn0, &hv0));
+        VERIFY_IS_NULL(hn0);
+
         VERIFY_ARE_EQUAL(S_OK, HCHttpCallCloseHandle(call));
         HCCleanup();
     }
@@ -0,0 +1,255 @@
+// Copyright (c) Microsoft Corporation
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#pragma once
+
+#if HC_PLATFORM == HC_PLATFORM_GENERIC && !HC_UNITTEST_API
+
+#include <functional>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <strings.h>
+#include <unistd.h>
+
+NAMESPACE_XBOX_HTTP_CLIENT_TEST_BEGIN
+
+#define LOOPBACK_TIMEOUT_SECONDS 10
+
+// The value of the first header called name in an HTTP request or response
+// head, or an empty string if there isn't one
+inline std::string HeaderValue(const std::string& head, const char* name)
+{
+    std::string field = std::string("\r\n") + name + ":";
+    for (size_t i = 0; i + field.size() <= head.size(); ++i)
+    {
+        if (strncasecmp(head.c_str() + i, field.c_str(), field.size()) == 0)
+        {
+            size_t begin = head.find_first_not_of(' ', i + field.size());
+            return head.substr(begin, head.find("\r\n", begin) - begin);
+        }
+    }
+    return std::string();
+}
+
+// One connection accepted by a LoopbackServer, read and written with
+// blocking calls from the test's handler. Reads give up after
+// LOOPBACK_TIMEOUT_SECONDS so a test waiting on traffic that never comes
+// fails rather than hangs.
+class LoopbackConnection
+{
+public:
+    explicit LoopbackConnection(int socket) : m_socket(socket)
+    {
+    }
+
+    bool Read(void* data, size_t length)
+    {
+        auto out = static_cast<char*>(data);
+        size_t buffered = std::min(length, m_buffered.size());
+        memcpy(out, m_buffered.data(), buffered);
+        m_buffered.erase(0, buffered);
+
+        for (size_t done = buffered; done < length;)
+        {
+            ssize_t received = recv(m_socket, out + done, length - done, 0);
+            if (received <= 0)
+            {
+                return false;
+            }
+            done += static_cast<size_t>(received);
+        }
+        return true;
+    }
+
+    // Reads up to and including terminator. Whatever arrived after it is
+    // kept for the next read.
+    bool ReadUntil(const char* terminator, std::string& data)
+    {
+        size_t terminatorLength = strlen(terminator);
+        for (;;)
+        {
+            size_t end = m_buffered.find(terminator);
+            if (end != std::string::npos)
+            {
+                data = m_buffered.substr(0, end + terminatorLength);
+                m_buffered.erase(0, end + terminatorLength);
+                return true;
+            }
+
+            char chunk[4096];
+            ssize_t received = recv(m_socket, chunk, sizeof(chunk), 0);
+            if (received <= 0)
+            {
+                return false;
+            }
+            m_buffered.append(chunk, static_cast<size_t>(received));
+        }
+    }
+
+    // Reads an HTTP request: its head, and the body its Content-Length
+    // announces
+    bool ReadRequest(std::string& head, std::string& body)
+    {
+        if (!ReadUntil("\r\n\r\n", head))
+        {
+            return false;
+        }
+        body.resize(strtoul(HeaderValue(head, "Content-Length").c_str(), nullptr, 10));
+        return body.empty() || Read(&body[0], body.size());
+    }
+
+    bool Write(const void* data, size_t length)
+    {
+        auto in = static_cast<const char*>(data);
+        for (size_t done = 0; done < length;)
+        {
+            ssize_t sent = send(m_socket, in + done, length - done, MSG_NOSIGNAL);
+            if (sent <= 0)
+            {
+                return false;
+            }
+            done += static_cast<size_t>(sent);
+        }
+        return true;
+    }
+
+    bool Write(const std::string& data)
+    {
+        return Write(data.data(), data.size());
+    }
+
+    // True once the client has closed its end, with nothing more sent
+    bool WaitForClose()
+    {
+        if (!m_buffered.empty())
+        {
+            return false;
+        }
+        char byte;
+        return recv(m_socket, &byte, 1, 0) == 0;
+    }
+
+    void Close()
+    {
+        shutdown(m_socket, SHUT_RDWR);
+    }
+
+private:
+    int const m_socket;
+    std::string m_buffered;
+};
+
+// Listens on an ephemeral 127.0.0.1 port and runs handler on a thread of its
+// own for each accepted connection, so tests can drive the real Generic
+// providers against a server whose every byte they control. Destroying the
+// server shuts down the connections still open and waits for the handlers.
+class LoopbackServer
+{
+public:
+    typedef std::function<void(LoopbackConnection&)> Handler;
+
+    explicit LoopbackServer(Handler handler) : m_handler(std::move(handler))
+    {
+        m_listener = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addressLength = sizeof(address);
+        if (m_listener < 0 ||
+            bind(m_listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            listen(m_listener, 16) != 0 ||
+            getsockname(m_listener, reinterpret_cast<sockaddr*>(&address), &addressLength) != 0)
+        {
+            VERIFY_FAIL();
+        }
+        m_port = ntohs(address.sin_port);
+        m_acceptThread = std::thread([this]() { AcceptLoop(); });
+    }
+
+    ~LoopbackServer()
+    {
+        shutdown(m_listener, SHUT_RDWR);
+        m_acceptThread.join();
+        close(m_listener);
+
+        std::vector<std::thread> handlers;
+        {
+            std::lock_guard<std::mutex> lock{ m_lock };
+            m_stopping = true;
+            for (int socket : m_sockets)
+            {
+                shutdown(socket, SHUT_RDWR);
+            }
+            handlers.swap(m_handlers);
+        }
+        for (auto& handler : handlers)
+        {
+            handler.join();
+        }
+        for (int socket : m_sockets)
+        {
+            close(socket);
+        }
+    }
+
+    uint16_t Port() const
+    {
+        return m_port;
+    }
+
+    std::string Url(const char* scheme, const char* path) const
+    {
+        return std::string(scheme) + "://127.0.0.1:" + std::to_string(m_port) + path;
+    }
+
+    uint32_t AcceptedCount()
+    {
+        std::lock_guard<std::mutex> lock{ m_lock };
+        return static_cast<uint32_t>(m_sockets.size());
+    }
+
+private:
+    void AcceptLoop()
+    {
+        for (;;)
+        {
+            int socket = accept(m_listener, nullptr, nullptr);
+            if (socket < 0)
+            {
+                return;
+            }
+
+            timeval timeout{ LOOPBACK_TIMEOUT_SECONDS, 0 };
+            setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+            std::lock_guard<std::mutex> lock{ m_lock };
+            m_sockets.push_back(socket);
+            if (m_stopping)
+            {
+                shutdown(socket, SHUT_RDWR);
+            }
+            m_handlers.emplace_back([this, socket]()
+            {
+                LoopbackConnection connection{ socket };
+                m_handler(connection);
+                connection.Close();
+            });
+        }
+    }
+
+    Handler const m_handler;
+    int m_listener = -1;
+    uint16_t m_port = 0;
+    std::thread m_acceptThread;
+
+    std::mutex m_lock;
+    bool m_stopping = false;
+    std::vector<int> m_sockets;
+    std::vector<std::thread> m_handlers;
+};
+
+NAMESPACE_XBOX_HTTP_CLIENT_TEST_END
+
+#endif
@@ -496,6 +496,242 @@ public:
         HCCleanup();
     }
 
+    DEFINE_TEST_CASE(StreamedResponseBodyMock)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(StreamedResponseBodyMock);
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+
+        HCCallHandle mockCall = CreateMockCall("Mock1", false, false);
+        VERIFY_ARE_EQUAL(S_OK, HCMockAddMock(mockCall, "", "", nullptr, 0));
+
+        HCCallHandle call = nullptr;
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallCreate(&call));
+
+        static std::string s_streamedBody;
+        s_streamedBody.clear();
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallResponseSetResponseBodyWriteFunction(call,
+            [](HCCallHandle, const uint8_t* source, size_t bytesAvailable, void*)
+            {
+                s_streamedBody.append(reinterpret_cast<const char*>(source), bytesAvailable);
+                return S_OK;
+            },
+            nullptr));
+        g_gotCall = false;
+
+        XTaskQueueHandle queue;
+        XTaskQueueCreate(
+            XTaskQueueDispatchMode::Manual,
+            XTaskQueueDispatchMode::Manual,
+            &queue);
+
+        XAsyncBlock* asyncBlock = new XAsyncBlock;
+        ZeroMemory(asyncBlock, sizeof(XAsyncBlock));
+        asyncBlock->context = call;
+        asyncBlock->queue = queue;
+        asyncBlock->callback = [](XAsyncBlock* asyncBlock)
+        {
+            HCCallHandle call = static_cast<HCCallHandle>(asyncBlock->context);
+            size_t bodySize = 0;
+            VERIFY_ARE_EQUAL(S_OK, HCHttpCallResponseGetResponseBodyBytesSize(call, &bodySize));
+            VERIFY_ARE_EQUAL(0u, bodySize);
+            VERIFY_ARE_EQUAL_STR("Mock1", s_streamedBody.c_str());
+            VERIFY_ARE_EQUAL(S_OK, HCHttpCallCloseHandle(call));
+            g_gotCall = true;
+            delete asyncBlock;
+        };
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallPerformAsync(call, asyncBlock));
+        VERIFY_ARE_EQUAL(E_HC_PERFORM_ALREADY_CALLED, HCHttpCallResponseSetResponseBodyWriteFunction(call,
+            [](HCCallHandle, const uint8_t*, size_t, void*) { return S_OK; }, nullptr));
+
+        while (true)
+        {
+            if (!XTaskQueueDispatch(queue, XTaskQueuePort::Work, 0)) break;
+        }
+        VERIFY_ARE_EQUAL(true, XTaskQueueDispatch(queue, XTaskQueuePort::Completion, 0));
+        VERIFY_ARE_EQUAL(true, g_gotCall);
+
+        XTaskQueueCloseHandle(queue);
+
+        // With an immediate work port the body is written out from inside
+        // the provider's write, which must not be holding the stream's lock
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallCreate(&call));
+        s_streamedBody.clear();
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallResponseSetResponseBodyWriteFunction(call,
+            [](HCCallHandle, const uint8_t* source, size_t bytesAvailable, void*)
+            {
+                s_streamedBody.append(reinterpret_cast<const char*>(source), bytesAvailable);
+                return S_OK;
+            },
+            nullptr));
+        g_gotCall = false;
+
+        XTaskQueueCreate(
+            XTaskQueueDispatchMode::Immediate,
+            XTaskQueueDispatchMode::Immediate,
+            &queue);
+
+        asyncBlock = new XAsyncBlock;
+        ZeroMemory(asyncBlock, sizeof(XAsyncBlock));
+        asyncBlock->context = call;
+        asyncBlock->queue = queue;
+        asyncBlock->callback = [](XAsyncBlock* asyncBlock)
+        {
+            HCCallHandle call = static_cast<HCCallHandle>(asyncBlock->context);
+            VERIFY_ARE_EQUAL_STR("Mock1", s_streamedBody.c_str());
+            VERIFY_ARE_EQUAL(S_OK, HCHttpCallCloseHandle(call));
+            g_gotCall = true;
+            delete asyncBlock;
+        };
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallPerformAsync(call, asyncBlock));
+        VERIFY_ARE_EQUAL(true, g_gotCall);
+
+        XTaskQueueCloseHandle(queue);
+        HCCleanup();
+    }
+
+    HCCallHandle CreateStatusMock(uint32_t statusCode)
+    {
+        HCCallHandle mockCall;
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallCreate(&mockCall));
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallResponseSetStatusCode(mockCall, statusCode));
+        return mockCall;
+    }
+
+    static void PumpUntil(XTaskQueueHandle queue, bool const& done, uint32_t timeoutMs)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        while (!done && std::chrono::steady_clock::now() < deadline)
+        {
+            XTaskQueueDispatch(queue, XTaskQueuePort::Work, 50);
+            XTaskQueueDispatch(queue, XTaskQueuePort::Completion, 0);
+        }
+    }
+
+    DEFINE_TEST_CASE(RetryBackoffMock)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(RetryBackoffMock);
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+
+        // Mocks are handed out in order, so the call sees two 503s and then a 200
+        VERIFY_ARE_EQUAL(S_OK, HCMockAddMock(CreateStatusMock(503), "", "", nullptr, 0));
+        VERIFY_ARE_EQUAL(S_OK, HCMockAddMock(CreateStatusMock(503), "", "", nullptr, 0));
+        VERIFY_ARE_EQUAL(S_OK, HCMockAddMock(CreateStatusMock(200), "", "", nullptr, 0));
+
+        static std::vector<uint32_t> s_retriedStatus;
+        s_retriedStatus.clear();
+        int32_t handlerId = HCAddCallRoutedHandler([](HCCallHandle call, void*)
+        {
+            uint32_t statusCode = 0;
+            VERIFY_ARE_EQUAL(S_OK, HCHttpCallResponseGetStatusCode(call, &statusCode));
+            s_retriedStatus.push_back(statusCode);
+        }, nullptr);
+
+        HCCallHandle call = nullptr;
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallCreate(&call));
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallRequestSetRetryDelay(call, 1));
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallRequestSetTimeoutWindow(call, 60));
+        g_gotCall = false;
+
+        XTaskQueueHandle queue;
+        XTaskQueueCreate(
+            XTaskQueueDispatchMode::Manual,
+            XTaskQueueDispatchMode::Manual,
+            &queue);
+
+        XAsyncBlock* asyncBlock = new XAsyncBlock;
+        ZeroMemory(asyncBlock, sizeof(XAsyncBlock));
+        asyncBlock->context = call;
+        asyncBlock->queue = queue;
+        asyncBlock->callback = [](XAsyncBlock* asyncBlock)
+        {
+            HCCallHandle call = static_cast<HCCallHandle>(asyncBlock->context);
+            uint32_t statusCode = 0;
+            VERIFY_ARE_EQUAL(S_OK, XAsyncGetStatus(asyncBlock, false));
+            VERIFY_ARE_EQUAL(S_OK, HCHttpCallResponseGetStatusCode(call, &statusCode));
+            VERIFY_ARE_EQUAL(200u, statusCode);
+            VERIFY_ARE_EQUAL(S_OK, HCHttpCallCloseHandle(call));
+            g_gotCall = true;
+            delete asyncBlock;
+        };
+
+        auto start = std::chrono::steady_clock::now();
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallPerformAsync(call, asyncBlock));
+
+        // The first attempt runs right away; the retry waits out its delay
+        while (XTaskQueueDispatch(queue, XTaskQueuePort::Work, 0));
+        VERIFY_ARE_EQUAL(1u, (uint32_t)s_retriedStatus.size());
+        VERIFY_ARE_EQUAL(503u, s_retriedStatus[0]);
+        VERIFY_IS_FALSE(XTaskQueueDispatch(queue, XTaskQueuePort::Work, 0));
+        VERIFY_IS_FALSE(g_gotCall);
+
+        PumpUntil(queue, g_gotCall, 10000);
+        VERIFY_ARE_EQUAL(true, g_gotCall);
+        VERIFY_ARE_EQUAL(2u, (uint32_t)s_retriedStatus.size());
+        VERIFY_ARE_EQUAL(503u, s_retriedStatus[1]);
+
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        VERIFY_IS_GREATER_THAN_OR_EQUAL((uint64_t)elapsed.count(), (uint64_t)2000);
+
+        HCRemoveCallRoutedHandler(handlerId);
+        XTaskQueueCloseHandle(queue);
+        HCCleanup();
+    }
+
+    DEFINE_TEST_CASE(CancelDuringRetryBackoffMock)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(CancelDuringRetryBackoffMock);
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        VERIFY_ARE_EQUAL(S_OK, HCMockAddMock(CreateStatusMock(503), "", "", nullptr, 0));
+
+        HCCallHandle call = nullptr;
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallCreate(&call));
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallRequestSetRetryDelay(call, 1));
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallRequestSetTimeoutWindow(call, 60));
+        g_gotCall = false;
+
+        XTaskQueueHandle queue;
+        XTaskQueueCreate(
+            XTaskQueueDispatchMode::Manual,
+            XTaskQueueDispatchMode::Manual,
+            &queue);
+
+        XAsyncBlock* asyncBlock = new XAsyncBlock;
+        ZeroMemory(asyncBlock, sizeof(XAsyncBlock));
+        asyncBlock->context = call;
+        asyncBlock->queue = queue;
+        asyncBlock->callback = [](XAsyncBlock* asyncBlock)
+        {
+            VERIFY_ARE_EQUAL(E_ABORT, XAsyncGetStatus(asyncBlock, false));
+            g_gotCall = true;
+        };
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallPerformAsync(call, asyncBlock));
+
+        // Run the first attempt so the retry is sitting out its delay
+        while (XTaskQueueDispatch(queue, XTaskQueuePort::Work, 0));
+        VERIFY_IS_FALSE(g_gotCall);
+
+        // Canceling completes the call without waiting for the delay
+        auto start = std::chrono::steady_clock::now();
+        XAsyncCancel(asyncBlock);
+        VERIFY_ARE_EQUAL(true, XTaskQueueDispatch(queue, XTaskQueuePort::Completion, 0));
+        VERIFY_ARE_EQUAL(true, g_gotCall);
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        VERIFY_IS_LESS_THAN((uint64_t)elapsed.count(), (uint64_t)1000);
+
+        // The pending attempt still runs once; it must not complete the call again
+        g_gotCall = false;
+        bool never = false;
+        PumpUntil(queue, never, 1500);
+        VERIFY_IS_FALSE(g_gotCall);
+
+        delete asyncBlock;
+        VERIFY_ARE_EQUAL(S_OK, HCHttpCallCloseHandle(call));
+        XTaskQueueCloseHandle(queue);
+        HCCleanup();
+    }
 };
 
 NAMESPACE_XBOX_HTTP_CLIENT_TEST_END
@@ -3,9 +3,16 @@
 #include "pch.h"
 #include "UnitTestIncludes.h"
 #include "XTaskQueue.h"
+#include "XAsync.h"
 #include "CallbackThunk.h"
 #include "PumpedTaskQueue.h"
 #include "XTaskQueuePriv.h"
+#include "WaitTimer.h"
+
+#if !defined(_WIN32)
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
 
 #define TEST_CLASS_OWNER L"brianpe"
 
@@ -522,6 +529,48 @@ public:
     }
 
 
+    DEFINE_TEST_CASE(VerifyManyMonitors)
+    {
+        AutoQueueHandle queue;
+        const uint32_t count = 100;
+        XTaskQueueRegistrationToken tokens[count];
+        uint32_t calls[count];
+
+        VERIFY_SUCCEEDED(XTaskQueueCreate(XTaskQueueDispatchMode::Manual, XTaskQueueDispatchMode::Manual, &queue));
+
+        auto cb = [](void* context, XTaskQueueHandle, XTaskQueuePort)
+        {
+            uint32_t* p = static_cast<uint32_t*>(context);
+            (*p)++;
+        };
+
+        auto dummy = [](void*, bool) { };
+
+        for (uint32_t idx = 0; idx < count; idx++)
+        {
+            calls[idx] = 0;
+            VERIFY_SUCCEEDED(XTaskQueueRegisterMonitor(queue, &(calls[idx]), cb, &tokens[idx]));
+        }
+
+        VERIFY_SUCCEEDED(XTaskQueueSubmitCallback(queue, XTaskQueuePort::Work, nullptr, dummy));
+
+        for (uint32_t idx = 0; idx < count; idx++)
+        {
+            VERIFY_ARE_EQUAL(1u, calls[idx]);
+            XTaskQueueUnregisterMonitor(queue, tokens[idx]);
+        }
+
+        // With every monitor gone submits should not call any of them
+        VERIFY_SUCCEEDED(XTaskQueueSubmitCallback(queue, XTaskQueuePort::Work, nullptr, dummy));
+
+        for (uint32_t idx = 0; idx < count; idx++)
+        {
+            VERIFY_ARE_EQUAL(1u, calls[idx]);
+        }
+
+        while(XTaskQueueDispatch(queue, XTaskQueuePort::Work, 0));
+    }
+
     DEFINE_TEST_CASE(VerifyImmediateDispatch)
     {
         AutoQueueHandle queue;
@@ -609,6 +658,481 @@ public:
         }
     }
 
+    DEFINE_TEST_CASE(VerifySerializedThreadPoolBatching)
+    {
+        // A small batch forces the port to reschedule itself many
+        // times; callbacks must still run in order, one at a time.
+        XTaskQueueThreadPoolOptions options = {};
+        options.minThreads = 4;
+        options.maxBatchSize = 3;
+        options.batchTimeSliceMs = 1;
+
+        AutoQueueHandle queue;
+        VERIFY_SUCCEEDED(XTaskQueueCreateWithOptions(XTaskQueueDispatchMode::SerializedThreadPool, XTaskQueueDispatchMode::SerializedThreadPool, &options, &queue));
+
+        struct Context
+        {
+            std::atomic<uint32_t> inside;
+            std::atomic<uint32_t> overlaps;
+            uint32_t next;
+            uint32_t outOfOrder;
+        };
+
+        struct PerCallData
+        {
+            uint32_t Index;
+            Context* C;
+        };
+
+        const uint32_t total = 1000;
+        Context context;
+        context.inside = 0;
+        context.overlaps = 0;
+        context.next = 0;
+        context.outOfOrder = 0;
+
+        std::unique_ptr<PerCallData[]> callData(new PerCallData[total]);
+
+        auto callback = [](void* ptr, bool)
+        {
+            PerCallData* pdata = (PerCallData*)ptr;
+            Context* c = pdata->C;
+            if (c->inside++ != 0)
+            {
+                c->overlaps++;
+            }
+            if (pdata->Index != c->next)
+            {
+                c->outOfOrder++;
+            }
+            c->next = pdata->Index + 1;
+            c->inside--;
+        };
+
+        for (uint32_t i = 0; i < total; i++)
+        {
+            callData[i].Index = i;
+            callData[i].C = &context;
+            VERIFY_SUCCEEDED(XTaskQueueSubmitCallback(queue, XTaskQueuePort::Work, &callData[i], callback));
+        }
+
+        UINT64 ticks = GetTickCount64();
+        while (context.next != total && GetTickCount64() - ticks < 5000)
+        {
+            Sleep(10);
+        }
+
+        VERIFY_ARE_EQUAL(total, context.next);
+        VERIFY_ARE_EQUAL(0u, context.overlaps.load());
+        VERIFY_ARE_EQUAL(0u, context.outOfOrder);
+
+        VERIFY_SUCCEEDED(XTaskQueueTerminate(queue, true, nullptr, nullptr));
+    }
+
+    DEFINE_TEST_CASE(VerifySharedThreadPoolOptions)
+    {
+        XTaskQueueThreadPoolOptions options = {};
+        options.poolName = "VerifySharedThreadPoolOptions";
+        options.minThreads = 1;
+        options.maxThreads = 2;
+
+        AutoQueueHandle queue1;
+        AutoQueueHandle queue2;
+        VERIFY_SUCCEEDED(XTaskQueueCreateWithOptions(XTaskQueueDispatchMode::ThreadPool, XTaskQueueDispatchMode::ThreadPool, &options, &queue1));
+        VERIFY_SUCCEEDED(XTaskQueueCreateWithOptions(XTaskQueueDispatchMode::ThreadPool, XTaskQueueDispatchMode::SerializedThreadPool, &options, &queue2));
+
+        const uint32_t total = 100;
+        std::atomic<uint32_t> count(0);
+
+        auto callback = [](void* context, bool)
+        {
+            std::atomic<uint32_t>* c = static_cast<std::atomic<uint32_t>*>(context);
+            (*c)++;
+        };
+
+        for (uint32_t i = 0; i < total; i++)
+        {
+            VERIFY_SUCCEEDED(XTaskQueueSubmitCallback(queue1, XTaskQueuePort::Work, &count, callback));
+            VERIFY_SUCCEEDED(XTaskQueueSubmitCallback(queue2, XTaskQueuePort::Completion, &count, callback));
+        }
+
+        UINT64 ticks = GetTickCount64();
+        while (count != total * 2 && GetTickCount64() - ticks < 5000)
+        {
+            Sleep(10);
+        }
+
+        VERIFY_ARE_EQUAL(total * 2, count.load());
+
+        // Closing one queue must leave the shared pool running for the other.
+        XTaskQueueCloseHandle(queue1.Release());
+
+        VERIFY_SUCCEEDED(XTaskQueueSubmitCallback(queue2, XTaskQueuePort::Work, &count, callback));
+
+        ticks = GetTickCount64();
+        while (count != total * 2 + 1 && GetTickCount64() - ticks < 5000)
+        {
+            Sleep(10);
+        }
+
+        VERIFY_ARE_EQUAL(total * 2 + 1, count.load());
+    }
+
+    DEFINE_TEST_CASE(VerifyAllocatorStats)
+    {
+        AutoQueueHandle queue;
+        VERIFY_SUCCEEDED(XTaskQueueCreate(XTaskQueueDispatchMode::Manual, XTaskQueueDispatchMode::Manual, &queue));
+
+        const uint32_t total = 1000;
+        uint32_t count = 0;
+
+        for (uint32_t i = 0; i < total; i++)
+        {
+            VERIFY_SUCCEEDED(XTaskQueueSubmitCallback(queue, XTaskQueuePort::Work, &count, [](void* context, bool)
+            {
+                (*static_cast<uint32_t*>(context))++;
+            }));
+        }
+
+        XTaskQueueAllocatorStats stats;
+        XTaskQueueGetAllocatorStats(&stats);
+
+        // Each pending callback holds an entry and a list node
+        VERIFY_IS_TRUE(stats.blockSize >= sizeof(void*) * 8);
+        VERIFY_IS_TRUE(stats.blocksHighWater >= total * 2);
+        VERIFY_IS_TRUE(stats.blocksOutstanding <= stats.blocksHighWater);
+
+        while (XTaskQueueDispatch(queue, XTaskQueuePort::Work, 0));
+        VERIFY_ARE_EQUAL(total, count);
+
+        // Freed blocks are cached, not returned to the heap, so a second
+        // round of the same size doesn't raise the high water mark.
+        uint64_t highWater = stats.blocksHighWater;
+
+        for (uint32_t i = 0; i < total; i++)
+        {
+            VERIFY_SUCCEEDED(XTaskQueueSubmitCallback(queue, XTaskQueuePort::Work, &count, [](void* context, bool)
+            {
+                (*static_cast<uint32_t*>(context))++;
+            }));
+        }
+
+        while (XTaskQueueDispatch(queue, XTaskQueuePort::Work, 0));
+        VERIFY_ARE_EQUAL(total * 2, count);
+
+        XTaskQueueGetAllocatorStats(&stats);
+        VERIFY_ARE_EQUAL(highWater, stats.blocksHighWater);
+    }
+
+    DEFINE_TEST_CASE(VerifySubmitCallbacksBatch)
+    {
+        AutoQueueHandle queue;
+        VERIFY_SUCCEEDED(XTaskQueueCreate(XTaskQueueDispatchMode::Manual, XTaskQueueDispatchMode::Manual, &queue));
+
+        uint32_t monitorCount = 0;
+        XTaskQueueRegistrationToken token;
+        VERIFY_SUCCEEDED(XTaskQueueRegisterMonitor(queue, &monitorCount, [](void* context, XTaskQueueHandle, XTaskQueuePort)
+        {
+            (*static_cast<uint32_t*>(context))++;
+        }, &token));
+
+        const uint32_t total = 100;
+        uint32_t order[total];
+        uint32_t next = 0;
+
+        struct CallData
+        {
+            uint32_t Index;
+            uint32_t* Order;
+            uint32_t* Next;
+        };
+
+        CallData callData[total];
+        void* contexts[total];
+        XTaskQueueCallback* callbacks[total];
+
+        for (uint32_t i = 0; i < total; i++)
+        {
+            callData[i] = { i, order, &next };
+            contexts[i] = &callData[i];
+            callbacks[i] = [](void* context, bool)
+            {
+                CallData* data = static_cast<CallData*>(context);
+                data->Order[(*data->Next)++] = data->Index;
+            };
+        }
+
+        VERIFY_SUCCEEDED(XTaskQueueSubmitCallbacks(queue, XTaskQueuePort::Work, total, contexts, callbacks));
+
+        // One notification for the whole batch
+        VERIFY_ARE_EQUAL(1u, monitorCount);
+
+        while (XTaskQueueDispatch(queue, XTaskQueuePort::Work, 0));
+
+        VERIFY_ARE_EQUAL(total, next);
+        for (uint32_t i = 0; i < total; i++)
+        {
+            VERIFY_ARE_EQUAL(i, order[i]);
+        }
+
+        callbacks[total / 2] = nullptr;
+        VERIFY_ARE_EQUAL(E_INVALIDARG, XTaskQueueSubmitCallbacks(queue, XTaskQueuePort::Work, total, contexts, callbacks));
+        VERIFY_IS_FALSE(XTaskQueueDispatch(queue, XTaskQueuePort::Work, 0));
+
+        XTaskQueueUnregisterMonitor(queue, token);
+    }
+
+    DEFINE_TEST_CASE(VerifyManyDelayedCallbacks)
+    {
+        AutoQueueHandle queue;
+        VERIFY_SUCCEEDED(XTaskQueueCreate(XTaskQueueDispatchMode::Manual, XTaskQueueDispatchMode::Manual, &queue));
+
+        const uint32_t total = 200;
+        uint32_t order[total];
+        uint32_t next = 0;
+
+        struct CallData
+        {
+            uint32_t Index;
+            uint32_t* Order;
+            uint32_t* Next;
+        };
+
+        CallData callData[total];
+
+        // Later submissions are due sooner, so they must come out in
+        // reverse order.
+        for (uint32_t i = 0; i < total; i++)
+        {
+            callData[i] = { i, order, &next };
+            VERIFY_SUCCEEDED(XTaskQueueSubmitDelayedCallback(queue, XTaskQueuePort::Work, 100 + (total - i) * 2, &callData[i], [](void* context, bool canceled)
+            {
+                VERIFY_IS_FALSE(canceled);
+                CallData* data = static_cast<CallData*>(context);
+                data->Order[(*data->Next)++] = data->Index;
+            }));
+        }
+
+        VERIFY_IS_FALSE(XTaskQueueDispatch(queue, XTaskQueuePort::Work, 0));
+        Sleep(100 + total * 2 + 200);
+
+        // Everything is due, so nothing should need a wait
+        while (XTaskQueueDispatch(queue, XTaskQueuePort::Work, 0));
+
+        VERIFY_ARE_EQUAL(total, next);
+        for (uint32_t i = 0; i < total; i++)
+        {
+            VERIFY_ARE_EQUAL(total - 1 - i, order[i]);
+        }
+    }
+
+    DEFINE_TEST_CASE(VerifyWaitTimerOrderAcrossWheelLevels)
+    {
+        // Due times straddle the 256ms level 0 span, so the later timers
+        // have to cascade down a level before they fire.
+        const uint32_t delays[] = { 600, 20, 330, 150, 470, 60, 260, 900 };
+        const uint32_t expected[] = { 1, 5, 3, 6, 2, 4, 0, 7 };
+        const uint32_t total = _countof(delays);
+
+        struct State
+        {
+            std::mutex Lock;
+            std::vector<uint32_t> Order;
+        };
+
+        struct TimerData
+        {
+            uint32_t Index;
+            State* Owner;
+            WaitTimer Timer;
+        };
+
+        auto cb = [](void* context)
+        {
+            TimerData* data = static_cast<TimerData*>(context);
+            std::lock_guard<std::mutex> lock(data->Owner->Lock);
+            data->Owner->Order.push_back(data->Index);
+        };
+
+        State state;
+        TimerData timers[total];
+        for (uint32_t i = 0; i < total; i++)
+        {
+            timers[i].Index = i;
+            timers[i].Owner = &state;
+            VERIFY_SUCCEEDED(timers[i].Timer.Initialize(&timers[i], cb));
+        }
+
+        for (uint32_t i = 0; i < total; i++)
+        {
+            timers[i].Timer.Start(timers[i].Timer.GetAbsoluteTime(delays[i]));
+        }
+
+        // A timer far enough out to sit on level 2, canceled before it fires,
+        // and one pulled in from level 1 to level 0 by restarting it.
+        TimerData canceled;
+        canceled.Index = total;
+        canceled.Owner = &state;
+        VERIFY_SUCCEEDED(canceled.Timer.Initialize(&canceled, cb));
+        canceled.Timer.Start(canceled.Timer.GetAbsoluteTime(70000));
+
+        TimerData restarted;
+        restarted.Index = total + 1;
+        restarted.Owner = &state;
+        VERIFY_SUCCEEDED(restarted.Timer.Initialize(&restarted, cb));
+        restarted.Timer.Start(restarted.Timer.GetAbsoluteTime(2000));
+        restarted.Timer.Start(restarted.Timer.GetAbsoluteTime(100));
+
+        Sleep(1200);
+        canceled.Timer.Cancel();
+
+        std::lock_guard<std::mutex> lock(state.Lock);
+        VERIFY_ARE_EQUAL(total + 1, (uint32_t)state.Order.size());
+
+        // The restarted timer lands between the 60ms and 150ms timers
+        uint32_t pos = 0;
+        for (uint32_t i = 0; i < total; i++)
+        {
+            if (i == 2)
+            {
+                VERIFY_ARE_EQUAL(total + 1, state.Order[pos++]);
+            }
+            VERIFY_ARE_EQUAL(expected[i], state.Order[pos++]);
+        }
+    }
+
+    DEFINE_TEST_CASE(VerifyWaitTimerNotEarly)
+    {
+        struct TimerData
+        {
+            std::chrono::steady_clock::time_point Fired;
+            HANDLE Event;
+        };
+
+        TimerData data;
+        data.Event = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+
+        WaitTimer timer;
+        VERIFY_SUCCEEDED(timer.Initialize(&data, [](void* context)
+        {
+            TimerData* d = static_cast<TimerData*>(context);
+            d->Fired = std::chrono::steady_clock::now();
+            SetEvent(d->Event);
+        }));
+
+        // Long enough to start on level 1 and cascade down before firing
+        const uint32_t delay = 300;
+        auto start = std::chrono::steady_clock::now();
+        timer.Start(timer.GetAbsoluteTime(delay));
+
+        VERIFY_ARE_EQUAL((DWORD)WAIT_OBJECT_0, WaitForSingleObject(data.Event, 5000));
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(data.Fired - start);
+        VERIFY_IS_GREATER_THAN_OR_EQUAL((uint64_t)elapsed.count(), (uint64_t)delay);
+
+        CloseHandle(data.Event);
+    }
+
+    DEFINE_TEST_CASE(VerifyDispatchWaitWakesAndTimesOut)
+    {
+        AutoQueueHandle queue;
+        VERIFY_SUCCEEDED(XTaskQueueCreate(XTaskQueueDispatchMode::Manual, XTaskQueueDispatchMode::Manual, &queue));
+
+        // With nothing submitted the wait should last the full timeout
+        UINT64 ticks = GetTickCount64();
+        VERIFY_IS_FALSE(XTaskQueueDispatch(queue, XTaskQueuePort::Work, 200));
+        VERIFY_IS_GREATER_THAN_OR_EQUAL(GetTickCount64() - ticks, (UINT64)190);
+
+        // A submit from another thread should end the wait right away
+        uint32_t calls = 0;
+        std::thread submitter([&]
+        {
+            Sleep(50);
+            VERIFY_SUCCEEDED(XTaskQueueSubmitCallback(queue, XTaskQueuePort::Work, &calls, [](void* context, bool)
+            {
+                (*static_cast<uint32_t*>(context))++;
+            }));
+        });
+
+        ticks = GetTickCount64();
+        VERIFY_IS_TRUE(XTaskQueueDispatch(queue, XTaskQueuePort::Work, 5000));
+        VERIFY_IS_LESS_THAN(GetTickCount64() - ticks, (UINT64)1000);
+        VERIFY_ARE_EQUAL(1u, calls);
+
+        submitter.join();
+    }
+
+    DEFINE_TEST_CASE(VerifyPriorityDispatchOrder)
+    {
+        AutoQueueHandle queue;
+        VERIFY_SUCCEEDED(XTaskQueueCreate(XTaskQueueDispatchMode::Manual, XTaskQueueDispatchMode::Manual, &queue));
+
+        struct Context
+        {
+            char order[64];
+            uint32_t count;
+        };
+
+        Context context = {};
+
+        auto high = [](void* cxt, bool) { Context* c = (Context*)cxt; c->order[c->count++] = 'h'; };
+        auto normal = [](void* cxt, bool) { Context* c = (Context*)cxt; c->order[c->count++] = 'n'; };
+        auto background = [](void* cxt, bool) { Context* c = (Context*)cxt; c->order[c->count++] = 'b'; };
+
+        for (uint32_t idx = 0; idx < 4; idx++)
+        {
+            VERIFY_SUCCEEDED(XTaskQueueSubmitCallbackWithPriority(queue, XTaskQueuePort::Work, XTaskQueuePriority::Background, &context, background));
+        }
+
+        for (uint32_t idx = 0; idx < 12; idx++)
+        {
+            VERIFY_SUCCEEDED(XTaskQueueSubmitCallback(queue, XTaskQueuePort::Work, &context, normal));
+        }
+
+        for (uint32_t idx = 0; idx < 2; idx++)
+        {
+            VERIFY_SUCCEEDED(XTaskQueueSubmitCallbackWithPriority(queue, XTaskQueuePort::Work, XTaskQueuePriority::High, &context, high));
+        }
+
+        VERIFY_ARE_EQUAL(E_INVALIDARG, XTaskQueueSubmitCallbackWithPriority(queue, XTaskQueuePort::Work, (XTaskQueuePriority)3, &context, high));
+
+        while (XTaskQueueDispatch(queue, XTaskQueuePort::Work, 0));
+
+        // High first, then normal, with the background lane getting
+        // a turn each time it has been passed over eight times.
+        VERIFY_ARE_EQUAL(18u, context.count);
+        VERIFY_ARE_EQUAL(0, memcmp(context.order, "hhnnnnnnbnnnnnnbbb", 18));
+
+        // A composite queue carries its priority to async calls
+        // that use it.
+        XTaskQueuePortHandle workPort;
+        XTaskQueuePortHandle completionPort;
+        VERIFY_SUCCEEDED(XTaskQueueGetPort(queue, XTaskQueuePort::Work, &workPort));
+        VERIFY_SUCCEEDED(XTaskQueueGetPort(queue, XTaskQueuePort::Completion, &completionPort));
+
+        AutoQueueHandle highQueue;
+        VERIFY_SUCCEEDED(XTaskQueueCreateCompositeWithPriority(workPort, completionPort, XTaskQueuePriority::High, &highQueue));
+
+        context = {};
+        VERIFY_SUCCEEDED(XTaskQueueSubmitCallback(queue, XTaskQueuePort::Completion, &context, normal));
+
+        XAsyncBlock async = {};
+        async.queue = highQueue;
+        async.context = &context;
+        async.callback = [](XAsyncBlock* asyncBlock)
+        {
+            Context* c = (Context*)asyncBlock->context;
+            c->order[c->count++] = 'h';
+        };
+
+        VERIFY_SUCCEEDED(XAsyncRun(&async, [](XAsyncBlock*) { return S_OK; }));
+        VERIFY_IS_TRUE(XTaskQueueDispatch(queue, XTaskQueuePort::Work, 0));
+
+        while (XTaskQueueDispatch(queue, XTaskQueuePort::Completion, 0));
+
+        VERIFY_ARE_EQUAL(2u, context.count);
+        VERIFY_ARE_EQUAL(0, memcmp(context.order, "hn", 2));
+    }
+
     DEFINE_TEST_CASE(VerifyRegisterWithAutoReset)
     {
         AutoQueueHandle queue;
@@ -679,6 +1203,84 @@ public:
         CloseHandle(completionEvent);
     }
 
+#if !defined(_WIN32)
+    DEFINE_TEST_CASE(VerifyManyFileDescriptorWaiters)
+    {
+        // Well past the 120 waits a queue used to be limited to
+        const uint32_t waitCount = 300;
+
+        AutoQueueHandle queue;
+        VERIFY_SUCCEEDED(XTaskQueueCreate(XTaskQueueDispatchMode::ThreadPool, XTaskQueueDispatchMode::ThreadPool, &queue));
+
+        struct Wait
+        {
+            int fd;
+            std::atomic<uint32_t> fired;
+            XTaskQueueRegistrationToken token;
+        };
+
+        std::unique_ptr<Wait[]> waits(new Wait[waitCount]);
+
+        auto cb = [](void* cxt, bool)
+        {
+            Wait* w = static_cast<Wait*>(cxt);
+            uint64_t value;
+            VERIFY_ARE_EQUAL((ssize_t)sizeof(value), read(w->fd, &value, sizeof(value)));
+            w->fired++;
+        };
+
+        for (uint32_t idx = 0; idx < waitCount; idx++)
+        {
+            waits[idx].fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            VERIFY_IS_TRUE(waits[idx].fd >= 0);
+            waits[idx].fired = 0;
+
+            XTaskQueuePort port = (idx % 2) == 0 ? XTaskQueuePort::Work : XTaskQueuePort::Completion;
+            VERIFY_SUCCEEDED(XTaskQueueRegisterFileDescriptorWaiter(queue, port, waits[idx].fd, &waits[idx], cb, &waits[idx].token));
+        }
+
+        uint64_t one = 1;
+        for (uint32_t idx = 0; idx < waitCount; idx++)
+        {
+            VERIFY_ARE_EQUAL((ssize_t)sizeof(one), write(waits[idx].fd, &one, sizeof(one)));
+        }
+
+        for (uint32_t attempt = 0; attempt < 500; attempt++)
+        {
+            uint32_t fired = 0;
+            for (uint32_t idx = 0; idx < waitCount; idx++)
+            {
+                fired += waits[idx].fired == 0 ? 0 : 1;
+            }
+            if (fired == waitCount)
+            {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        for (uint32_t idx = 0; idx < waitCount; idx++)
+        {
+            VERIFY_ARE_EQUAL(1u, waits[idx].fired.load());
+            XTaskQueueUnregisterWaiter(queue, waits[idx].token);
+        }
+
+        // Nothing fires once unregistered
+        for (uint32_t idx = 0; idx < waitCount; idx++)
+        {
+            VERIFY_ARE_EQUAL((ssize_t)sizeof(one), write(waits[idx].fd, &one, sizeof(one)));
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+        for (uint32_t idx = 0; idx < waitCount; idx++)
+        {
+            VERIFY_ARE_EQUAL(1u, waits[idx].fired.load());
+            close(waits[idx].fd);
+        }
+    }
+#endif
+
     DEFINE_TEST_CASE(VerifyQueueTermination)
     {
         AutoQueueHandle queue;
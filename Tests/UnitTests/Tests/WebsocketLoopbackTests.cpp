@@ -0,0 +1,1490 @@
+// Copyright (c) Microsoft Corporation
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "pch.h"
+#include "UnitTestIncludes.h"
+#define TEST_CLASS_OWNER L"jasonsa"
+#include "DefineTestMacros.h"
+#include "LoopbackServer.h"
+#include "../WebSocket/hcwebsocket.h"
+
+#if HC_PLATFORM == HC_PLATFORM_GENERIC && !HC_UNITTEST_API
+
+#include <set>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <zlib.h>
+#include "../WebSocket/Generic/generic_websocket_connection.h"
+
+NAMESPACE_XBOX_HTTP_CLIENT_TEST_BEGIN
+
+#define WS_OPCODE_CONTINUATION 0x0
+#define WS_OPCODE_TEXT 0x1
+#define WS_OPCODE_BINARY 0x2
+#define WS_OPCODE_CLOSE 0x8
+#define WS_OPCODE_PING 0x9
+#define WS_OPCODE_PONG 0xA
+
+#define WS_DEFLATE_RESPONSE "permessage-deflate; client_max_window_bits=15"
+
+struct WsFrame
+{
+    bool fin = false;
+    bool rsv1 = false;
+    uint8_t opcode = 0;
+    bool masked = false;
+    std::string payload;
+};
+
+static std::string AcceptKey(const std::string& key)
+{
+    std::string input = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const unsigned char*>(input.data()), input.size(), digest);
+    char encoded[4 * ((SHA_DIGEST_LENGTH + 2) / 3) + 1];
+    EVP_EncodeBlock(reinterpret_cast<unsigned char*>(encoded), digest, SHA_DIGEST_LENGTH);
+    return encoded;
+}
+
+// Server side of the opening handshake. extensions, if set, is sent back
+// as the negotiated Sec-WebSocket-Extensions.
+static bool AcceptUpgrade(LoopbackConnection& connection, const char* extensions = nullptr, std::string* request = nullptr)
+{
+    std::string upgrade;
+    if (!connection.ReadUntil("\r\n\r\n", upgrade))
+    {
+        return false;
+    }
+    if (request != nullptr)
+    {
+        *request = upgrade;
+    }
+
+    std::string response =
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: " + AcceptKey(HeaderValue(upgrade, "Sec-WebSocket-Key")) + "\r\n";
+    if (extensions != nullptr)
+    {
+        response += std::string("Sec-WebSocket-Extensions: ") + extensions + "\r\n";
+    }
+    std::string subProtocol = HeaderValue(upgrade, "Sec-WebSocket-Protocol");
+    if (!subProtocol.empty())
+    {
+        response += "Sec-WebSocket-Protocol: " + subProtocol + "\r\n";
+    }
+    response += "\r\n";
+    return connection.Write(response);
+}
+
+// Reads a frame from the client and unmasks its payload
+static bool ReadFrame(LoopbackConnection& connection, WsFrame& frame)
+{
+    uint8_t header[2];
+    if (!connection.Read(header, sizeof(header)))
+    {
+        return false;
+    }
+    frame.fin = (header[0] & 0x80) != 0;
+    frame.rsv1 = (header[0] & 0x40) != 0;
+    frame.opcode = header[0] & 0x0F;
+    frame.masked = (header[1] & 0x80) != 0;
+
+    uint64_t length = header[1] & 0x7F;
+    if (length >= 126)
+    {
+        uint8_t extended[8];
+        size_t extendedLength = length == 126 ? 2 : 8;
+        if (!connection.Read(extended, extendedLength))
+        {
+            return false;
+        }
+        length = 0;
+        for (size_t i = 0; i < extendedLength; ++i)
+        {
+            length = (length << 8) | extended[i];
+        }
+    }
+
+    uint8_t maskKey[4] = {};
+    if (frame.masked && !connection.Read(maskKey, sizeof(maskKey)))
+    {
+        return false;
+    }
+
+    frame.payload.resize(static_cast<size_t>(length));
+    if (length > 0 && !connection.Read(&frame.payload[0], frame.payload.size()))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < frame.payload.size(); ++i)
+    {
+        frame.payload[i] ^= maskKey[i % 4];
+    }
+    return true;
+}
+
+// Reads frames until the next data or close frame, answering pings
+static bool ReadDataFrame(LoopbackConnection& connection, WsFrame& frame)
+{
+    while (ReadFrame(connection, frame))
+    {
+        if (frame.opcode != WS_OPCODE_PING && frame.opcode != WS_OPCODE_PONG)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// An unmasked frame, as a server sends them
+static std::string MakeFrame(uint8_t opcode, const std::string& payload, bool fin = true, bool rsv1 = false)
+{
+    std::string frame;
+    frame += static_cast<char>((fin ? 0x80 : 0) | (rsv1 ? 0x40 : 0) | opcode);
+    if (payload.size() < 126)
+    {
+        frame += static_cast<char>(payload.size());
+    }
+    else if (payload.size() <= 0xFFFF)
+    {
+        frame += static_cast<char>(126);
+        frame += static_cast<char>(payload.size() >> 8);
+        frame += static_cast<char>(payload.size());
+    }
+    else
+    {
+        frame += static_cast<char>(127);
+        for (int shift = 56; shift >= 0; shift -= 8)
+        {
+            frame += static_cast<char>(static_cast<uint64_t>(payload.size()) >> shift);
+        }
+    }
+    return frame + payload;
+}
+
+static std::string CloseFrame(uint16_t status)
+{
+    std::string payload;
+    payload += static_cast<char>(status >> 8);
+    payload += static_cast<char>(status);
+    return MakeFrame(WS_OPCODE_CLOSE, payload);
+}
+
+static uint32_t CloseStatus(const WsFrame& frame)
+{
+    if (frame.opcode != WS_OPCODE_CLOSE || frame.payload.size() < 2)
+    {
+        return 0;
+    }
+    return (static_cast<uint32_t>(static_cast<uint8_t>(frame.payload[0])) << 8) | static_cast<uint8_t>(frame.payload[1]);
+}
+
+// Waits for the client's close frame, echoes it and returns its status
+static uint32_t FinishCloseHandshake(LoopbackConnection& connection)
+{
+    WsFrame frame;
+    while (ReadDataFrame(connection, frame))
+    {
+        if (frame.opcode == WS_OPCODE_CLOSE)
+        {
+            connection.Write(MakeFrame(WS_OPCODE_CLOSE, frame.payload));
+            return CloseStatus(frame);
+        }
+    }
+    return 0;
+}
+
+// permessage-deflate payloads: raw deflate with the trailing empty block
+// stripped (RFC 7692 7.2.1)
+static std::string Deflate(const std::string& data)
+{
+    z_stream stream{};
+    deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    std::string out(deflateBound(&stream, static_cast<uLong>(data.size())) + 16, '\0');
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    stream.avail_in = static_cast<uInt>(data.size());
+    stream.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    stream.avail_out = static_cast<uInt>(out.size());
+    deflate(&stream, Z_SYNC_FLUSH);
+    out.resize(out.size() - stream.avail_out - 4);
+    deflateEnd(&stream);
+    return out;
+}
+
+static std::string Inflate(const std::string& data)
+{
+    std::string input = data + std::string("\x00\x00\xff\xff", 4);
+    z_stream stream{};
+    inflateInit2(&stream, -15);
+    std::string out;
+    stream.next_in = reinterpret_cast<Bytef*>(&input[0]);
+    stream.avail_in = static_cast<uInt>(input.size());
+    do
+    {
+        char chunk[4096];
+        stream.next_out = reinterpret_cast<Bytef*>(chunk);
+        stream.avail_out = sizeof(chunk);
+        if (inflate(&stream, Z_SYNC_FLUSH) < 0)
+        {
+            break;
+        }
+        out.append(chunk, sizeof(chunk) - stream.avail_out);
+    } while (stream.avail_out == 0);
+    inflateEnd(&stream);
+    return out;
+}
+
+// A websocket on the Generic provider whose callbacks record what they
+// report, for tests to wait on
+class TestWebSocket
+{
+public:
+    struct Message
+    {
+        HCWebSocketMessageType type;
+        std::string payload;
+    };
+
+    TestWebSocket()
+    {
+        VERIFY_ARE_EQUAL(S_OK, HCWebSocketCreate(&m_handle, OnMessage, OnBinaryMessage, OnClose, this));
+    }
+
+    ~TestWebSocket()
+    {
+        HCWebSocketCloseHandle(m_handle);
+    }
+
+    HCWebsocketHandle Handle() const
+    {
+        return m_handle;
+    }
+
+    HRESULT Connect(const std::string& uri, const char* subProtocol = "")
+    {
+        XAsyncBlock asyncBlock{};
+        RETURN_IF_FAILED(HCWebSocketConnectAsync(uri.c_str(), subProtocol, m_handle, &asyncBlock));
+        XAsyncGetStatus(&asyncBlock, true);
+        WebSocketCompletionResult result{};
+        RETURN_IF_FAILED(HCGetWebSocketConnectResult(&asyncBlock, &result));
+        return result.errorCode;
+    }
+
+    HRESULT Send(const char* message)
+    {
+        XAsyncBlock asyncBlock{};
+        RETURN_IF_FAILED(HCWebSocketSendMessageAsync(m_handle, message, &asyncBlock));
+        return WaitForSend(asyncBlock);
+    }
+
+    HRESULT SendBinary(const std::string& payload)
+    {
+        XAsyncBlock asyncBlock{};
+        RETURN_IF_FAILED(HCWebSocketSendBinaryMessageAsync(m_handle, reinterpret_cast<const uint8_t*>(payload.data()), static_cast<uint32_t>(payload.size()), &asyncBlock));
+        return WaitForSend(asyncBlock);
+    }
+
+    bool WaitForMessages(size_t count)
+    {
+        return WaitUntil([&]() { return m_messages.size() >= count; });
+    }
+
+    bool WaitForClose()
+    {
+        return WaitUntil([&]() { return m_closed; });
+    }
+
+    bool WaitUntil(std::function<bool()> condition)
+    {
+        std::unique_lock<std::mutex> lock{ m_lock };
+        return m_changed.wait_for(lock, std::chrono::seconds(LOOPBACK_TIMEOUT_SECONDS), condition);
+    }
+
+    std::vector<Message> Messages()
+    {
+        std::lock_guard<std::mutex> lock{ m_lock };
+        return m_messages;
+    }
+
+    HCWebSocketCloseStatus CloseStatus()
+    {
+        std::lock_guard<std::mutex> lock{ m_lock };
+        return m_closeStatus;
+    }
+
+    std::set<std::thread::id> CallbackThreads()
+    {
+        std::lock_guard<std::mutex> lock{ m_lock };
+        return m_callbackThreads;
+    }
+
+protected:
+    void Record(HCWebSocketMessageType type, const uint8_t* bytes, size_t size)
+    {
+        std::lock_guard<std::mutex> lock{ m_lock };
+        m_messages.push_back(Message{ type, std::string(reinterpret_cast<const char*>(bytes), size) });
+        m_callbackThreads.insert(std::this_thread::get_id());
+        m_changed.notify_all();
+    }
+
+    std::mutex m_lock;
+    std::condition_variable m_changed;
+
+private:
+    static HRESULT WaitForSend(XAsyncBlock& asyncBlock)
+    {
+        XAsyncGetStatus(&asyncBlock, true);
+        WebSocketCompletionResult result{};
+        RETURN_IF_FAILED(HCGetWebSocketSendMessageResult(&asyncBlock, &result));
+        return result.errorCode;
+    }
+
+    static void CALLBACK OnMessage(HCWebsocketHandle, const char* message, void* context)
+    {
+        static_cast<TestWebSocket*>(context)->Record(HCWebSocketMessageType::Text, reinterpret_cast<const uint8_t*>(message), strlen(message));
+    }
+
+    static void CALLBACK OnBinaryMessage(HCWebsocketHandle, const uint8_t* bytes, uint32_t size, void* context)
+    {
+        static_cast<TestWebSocket*>(context)->Record(HCWebSocketMessageType::Binary, bytes, size);
+    }
+
+    static void CALLBACK OnClose(HCWebsocketHandle, HCWebSocketCloseStatus status, void* context)
+    {
+        auto pThis = static_cast<TestWebSocket*>(context);
+        std::lock_guard<std::mutex> lock{ pThis->m_lock };
+        pThis->m_closed = true;
+        pThis->m_closeStatus = status;
+        pThis->m_changed.notify_all();
+    }
+
+    HCWebsocketHandle m_handle = nullptr;
+    std::vector<Message> m_messages;
+    std::set<std::thread::id> m_callbackThreads;
+    bool m_closed = false;
+    HCWebSocketCloseStatus m_closeStatus = HCWebSocketCloseStatus::Normal;
+};
+
+// Records the buffers HCWebSocketSendMessageBuffer hands back
+struct ReleasedBuffers
+{
+    struct Release
+    {
+        const uint8_t* bytes;
+        uint32_t size;
+        HRESULT result;
+    };
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::vector<Release> releases;
+
+    static void CALLBACK OnRelease(HCWebsocketHandle, const uint8_t* bytes, uint32_t size, HRESULT result, void* context)
+    {
+        auto pThis = static_cast<ReleasedBuffers*>(context);
+        std::lock_guard<std::mutex> lock{ pThis->lock };
+        pThis->releases.push_back(Release{ bytes, size, result });
+        pThis->changed.notify_all();
+    }
+
+    bool WaitFor(size_t count)
+    {
+        std::unique_lock<std::mutex> lock{ this->lock };
+        return changed.wait_for(lock, std::chrono::seconds(LOOPBACK_TIMEOUT_SECONDS), [&]() { return releases.size() >= count; });
+    }
+};
+
+// A websocket in batched receive that holds on to its batches until the test
+// releases them, as an app working through messages at its own pace would
+class BatchedTestWebSocket : public TestWebSocket
+{
+public:
+    BatchedTestWebSocket(uint32_t maxMessages = 0, uint64_t maxBytes = 0)
+    {
+        VERIFY_SUCCEEDED(XTaskQueueCreate(XTaskQueueDispatchMode::ThreadPool, XTaskQueueDispatchMode::ThreadPool, &m_queue));
+        VERIFY_ARE_EQUAL(S_OK, HCWebSocketSetMessageBatchFunction(Handle(), m_queue, OnBatch, this));
+        VERIFY_ARE_EQUAL(S_OK, HCWebSocketSetInboundQueueLimits(Handle(), maxMessages, maxBytes));
+    }
+
+    ~BatchedTestWebSocket()
+    {
+        ReleaseBatches();
+        XTaskQueueCloseHandle(m_queue);
+    }
+
+    void ReleaseBatches()
+    {
+        std::vector<HCWebSocketMessageBatchHandle> batches;
+        {
+            std::lock_guard<std::mutex> lock{ m_lock };
+            batches.swap(m_batches);
+            m_heldMessageViews.clear();
+            m_heldMessages = 0;
+        }
+        for (auto batch : batches)
+        {
+            VERIFY_ARE_EQUAL(S_OK, HCWebSocketReleaseMessageBatch(batch));
+        }
+    }
+
+    size_t HeldMessages()
+    {
+        std::lock_guard<std::mutex> lock{ m_lock };
+        return m_heldMessages;
+    }
+
+    bool WaitForHeldMessages(size_t count)
+    {
+        return WaitUntil([&]() { return m_heldMessages >= count; });
+    }
+
+    size_t MostHeldMessages()
+    {
+        std::lock_guard<std::mutex> lock{ m_lock };
+        return m_mostHeldMessages;
+    }
+
+    // Payloads as they are now, while lent, rather than as they were when
+    // they arrived
+    std::vector<std::string> HeldPayloads()
+    {
+        std::lock_guard<std::mutex> lock{ m_lock };
+        std::vector<std::string> payloads;
+        for (const auto& message : m_heldMessageViews)
+        {
+            payloads.emplace_back(reinterpret_cast<const char*>(message.payloadBytes), message.payloadSize);
+        }
+        return payloads;
+    }
+
+private:
+    static void CALLBACK OnBatch(HCWebsocketHandle, HCWebSocketMessageBatchHandle batch, const HCWebSocketReceivedMessage* messages, uint32_t messageCount, void* context)
+    {
+        auto pThis = static_cast<BatchedTestWebSocket*>(context);
+        {
+            std::lock_guard<std::mutex> lock{ pThis->m_lock };
+            pThis->m_batches.push_back(batch);
+            pThis->m_heldMessageViews.insert(pThis->m_heldMessageViews.end(), messages, messages + messageCount);
+            pThis->m_heldMessages += messageCount;
+            pThis->m_mostHeldMessages = std::max(pThis->m_mostHeldMessages, pThis->m_heldMessages);
+        }
+
+        // Wakes the waiters, which see the batch above already held
+        for (uint32_t i = 0; i < messageCount; ++i)
+        {
+            pThis->Record(messages[i].messageType, messages[i].payloadBytes, messages[i].payloadSize);
+        }
+    }
+
+    XTaskQueueHandle m_queue = nullptr;
+    std::vector<HCWebSocketMessageBatchHandle> m_batches;
+    std::vector<HCWebSocketReceivedMessage> m_heldMessageViews;
+    size_t m_heldMessages = 0;
+    size_t m_mostHeldMessages = 0;
+};
+
+// A websocket that receives messages piece by piece. Pieces are recorded
+// as they come and put back together into Messages().
+class FragmentTestWebSocket : public TestWebSocket
+{
+public:
+    struct Fragment
+    {
+        HCWebSocketMessageType type;
+        std::string payload;
+        bool isFinal;
+    };
+
+    FragmentTestWebSocket()
+    {
+        VERIFY_ARE_EQUAL(S_OK, HCWebSocketSetMessageFragmentFunction(Handle(), OnFragment, this));
+    }
+
+    std::vector<Fragment> Fragments()
+    {
+        std::lock_guard<std::mutex> lock{ m_lock };
+        return m_fragments;
+    }
+
+private:
+    static void CALLBACK OnFragment(HCWebsocketHandle, HCWebSocketMessageType type, const uint8_t* bytes, uint32_t size, bool isFinal, void* context)
+    {
+        auto pThis = static_cast<FragmentTestWebSocket*>(context);
+        std::string message;
+        {
+            std::lock_guard<std::mutex> lock{ pThis->m_lock };
+            pThis->m_fragments.push_back(Fragment{ type, std::string(reinterpret_cast<const char*>(bytes), size), isFinal });
+
+            // Large messages are only tallied, not kept
+            if (pThis->m_fragments.size() > 1000)
+            {
+                pThis->m_fragments.erase(pThis->m_fragments.begin());
+            }
+            pThis->m_assembledBytes += size;
+            if (pThis->m_assembled.size() < 1024 * 1024)
+            {
+                pThis->m_assembled.append(reinterpret_cast<const char*>(bytes), size);
+            }
+            if (!isFinal)
+            {
+                return;
+            }
+            message.swap(pThis->m_assembled);
+            if (pThis->m_assembledBytes != message.size())
+            {
+                message = std::to_string(pThis->m_assembledBytes) + " bytes";
+            }
+            pThis->m_assembledBytes = 0;
+        }
+        pThis->Record(type, reinterpret_cast<const uint8_t*>(message.data()), message.size());
+    }
+
+    std::vector<Fragment> m_fragments;
+    std::string m_assembled;
+    size_t m_assembledBytes = 0;
+};
+
+// Fails the next library allocation of failSize bytes once armed
+static std::atomic<size_t> g_failAllocSize{ 0 };
+static std::atomic<uint32_t> g_failedAllocs{ 0 };
+
+static _Ret_maybenull_ _Post_writable_byte_size_(size) void* STDAPIVCALLTYPE FailingMemAlloc(
+    _In_ size_t size,
+    _In_ HCMemoryType
+    )
+{
+    size_t failSize = size;
+    if (g_failAllocSize.compare_exchange_strong(failSize, 0))
+    {
+        ++g_failedAllocs;
+        return nullptr;
+    }
+    return malloc(size);
+}
+
+static void STDAPIVCALLTYPE FailingMemFree(
+    _In_ _Post_invalid_ void* pointer,
+    _In_ HCMemoryType
+    )
+{
+    free(pointer);
+}
+
+DEFINE_TEST_CLASS(WebsocketLoopbackTests)
+{
+public:
+    DEFINE_TEST_CLASS_PROPS(WebsocketLoopbackTests);
+
+    DEFINE_TEST_CASE(TestHandshake)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestHandshake);
+
+        std::string request;
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            AcceptUpgrade(connection, nullptr, &request);
+            FinishCloseHandshake(connection);
+        } };
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            TestWebSocket websocket;
+            VERIFY_ARE_EQUAL(S_OK, HCWebSocketSetHeader(websocket.Handle(), "X-Test", "loopback"));
+            VERIFY_ARE_EQUAL(S_OK, websocket.Connect(server.Url("ws", "/chat?room=1"), "chat"));
+
+            VERIFY_ARE_EQUAL(0u, request.find("GET /chat?room=1 HTTP/1.1\r\n"));
+            VERIFY_ARE_EQUAL_STR("127.0.0.1:" + std::to_string(server.Port()), HeaderValue(request, "Host"));
+            VERIFY_ARE_EQUAL_STR("websocket", HeaderValue(request, "Upgrade"));
+            VERIFY_ARE_EQUAL_STR("Upgrade", HeaderValue(request, "Connection"));
+            VERIFY_ARE_EQUAL_STR("13", HeaderValue(request, "Sec-WebSocket-Version"));
+            VERIFY_ARE_EQUAL_STR("chat", HeaderValue(request, "Sec-WebSocket-Protocol"));
+            VERIFY_ARE_EQUAL_STR("loopback", HeaderValue(request, "X-Test"));
+
+            // A base64 encoded 16 byte nonce
+            std::string key = HeaderValue(request, "Sec-WebSocket-Key");
+            VERIFY_ARE_EQUAL(24u, key.size());
+            VERIFY_ARE_EQUAL_STR("==", key.substr(22));
+
+            VERIFY_ARE_EQUAL(S_OK, HCWebSocketDisconnect(websocket.Handle()));
+            VERIFY_IS_TRUE(websocket.WaitForClose());
+        }
+        HCCleanup();
+    }
+
+    DEFINE_TEST_CASE(TestHandshakeRejected)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestHandshakeRejected);
+
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            std::string request;
+            connection.ReadUntil("\r\n\r\n", request);
+            if (request.find("GET /forbidden") == 0)
+            {
+                connection.Write("HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\n\r\n");
+            }
+            else
+            {
+                // Right status, wrong accept key
+                connection.Write(
+                    "HTTP/1.1 101 Switching Protocols\r\n"
+                    "Upgrade: websocket\r\n"
+                    "Connection: Upgrade\r\n"
+                    "Sec-WebSocket-Accept: " + AcceptKey("not the client's key") + "\r\n\r\n");
+            }
+            connection.WaitForClose();
+        } };
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            TestWebSocket forbidden;
+            VERIFY_FAILED(forbidden.Connect(server.Url("ws", "/forbidden")));
+
+            TestWebSocket badAccept;
+            VERIFY_FAILED(badAccept.Connect(server.Url("ws", "/")));
+        }
+        HCCleanup();
+    }
+
+    DEFINE_TEST_CASE(TestMaskedEcho)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestMaskedEcho);
+
+        std::vector<WsFrame> received;
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            AcceptUpgrade(connection);
+            WsFrame frame;
+            while (ReadDataFrame(connection, frame) && frame.opcode != WS_OPCODE_CLOSE)
+            {
+                received.push_back(frame);
+                connection.Write(MakeFrame(frame.opcode, frame.payload));
+            }
+            connection.Write(MakeFrame(WS_OPCODE_CLOSE, frame.payload));
+        } };
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            TestWebSocket websocket;
+            VERIFY_ARE_EQUAL(S_OK, websocket.Connect(server.Url("ws", "/")));
+
+            // Payload lengths that take each of the three length encodings
+            std::string binary;
+            for (uint32_t i = 0; i < 70000; ++i)
+            {
+                binary += static_cast<char>(i * 7);
+            }
+            std::string medium(300, 'm');
+
+            VERIFY_ARE_EQUAL(S_OK, websocket.Send("hello"));
+            VERIFY_ARE_EQUAL(S_OK, websocket.SendBinary(binary));
+            VERIFY_ARE_EQUAL(S_OK, websocket.Send(medium.c_str()));
+            VERIFY_ARE_EQUAL(S_OK, websocket.SendBinary(std::string("\0\1\2", 3)));
+            VERIFY_IS_TRUE(websocket.WaitForMessages(4));
+
+            VERIFY_ARE_EQUAL(S_OK, HCWebSocketDisconnect(websocket.Handle()));
+            VERIFY_IS_TRUE(websocket.WaitForClose());
+
+            // Every client frame is masked, and arrives whole and unchanged
+            VERIFY_ARE_EQUAL(4u, received.size());
+            for (const auto& frame : received)
+            {
+                VERIFY_IS_TRUE(frame.masked);
+                VERIFY_IS_TRUE(frame.fin);
+                VERIFY_IS_FALSE(frame.rsv1);
+            }
+            VERIFY_ARE_EQUAL(WS_OPCODE_TEXT, received[0].opcode);
+            VERIFY_ARE_EQUAL_STR("hello", received[0].payload);
+            VERIFY_ARE_EQUAL(WS_OPCODE_BINARY, received[1].opcode);
+            VERIFY_IS_TRUE(binary == received[1].payload);
+            VERIFY_ARE_EQUAL(WS_OPCODE_TEXT, received[2].opcode);
+            VERIFY_IS_TRUE(medium == received[2].payload);
+            VERIFY_ARE_EQUAL(WS_OPCODE_BINARY, received[3].opcode);
+            VERIFY_IS_TRUE(std::string("\0\1\2", 3) == received[3].payload);
+
+            auto messages = websocket.Messages();
+            VERIFY_ARE_EQUAL(4u, messages.size());
+            VERIFY_IS_TRUE(messages[0].type == HCWebSocketMessageType::Text);
+            VERIFY_ARE_EQUAL_STR("hello", messages[0].payload);
+            VERIFY_IS_TRUE(messages[1].type == HCWebSocketMessageType::Binary);
+            VERIFY_IS_TRUE(binary == messages[1].payload);
+            VERIFY_IS_TRUE(medium == messages[2].payload);
+            VERIFY_IS_TRUE(std::string("\0\1\2", 3) == messages[3].payload);
+        }
+        HCCleanup();
+    }
+
+    DEFINE_TEST_CASE(TestFragmentedReceive)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestFragmentedReceive);
+
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            AcceptUpgrade(connection);
+
+            // A text message whose fragments split a character, then a
+            // binary one, all in one write
+            connection.Write(
+                MakeFrame(WS_OPCODE_TEXT, "frag \xE2\x82", false) +
+                MakeFrame(WS_OPCODE_CONTINUATION, "\xAC ", false) +
+                MakeFrame(WS_OPCODE_CONTINUATION, "", false) +
+                MakeFrame(WS_OPCODE_CONTINUATION, "done") +
+                MakeFrame(WS_OPCODE_BINARY, "a", false) +
+                MakeFrame(WS_OPCODE_CONTINUATION, "b"));
+            FinishCloseHandshake(connection);
+        } };
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            TestWebSocket websocket;
+            VERIFY_ARE_EQUAL(S_OK, websocket.Connect(server.Url("ws", "/")));
+            VERIFY_IS_TRUE(websocket.WaitForMessages(2));
+
+            auto messages = websocket.Messages();
+            VERIFY_ARE_EQUAL(2u, messages.size());
+            VERIFY_IS_TRUE(messages[0].type == HCWebSocketMessageType::Text);
+            VERIFY_ARE_EQUAL_STR("frag \xE2\x82\xAC done", messages[0].payload);
+            VERIFY_IS_TRUE(messages[1].type == HCWebSocketMessageType::Binary);
+            VERIFY_ARE_EQUAL_STR("ab", messages[1].payload);
+
+            VERIFY_ARE_EQUAL(S_OK, HCWebSocketDisconnect(websocket.Handle()));
+            VERIFY_IS_TRUE(websocket.WaitForClose());
+        }
+        HCCleanup();
+    }
+
+    DEFINE_TEST_CASE(TestPingPong)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestPingPong);
+
+        std::vector<WsFrame> pongs;
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            AcceptUpgrade(connection);
+            connection.Write(MakeFrame(WS_OPCODE_PING, "") + MakeFrame(WS_OPCODE_PING, "abc"));
+
+            WsFrame frame;
+            while (pongs.size() < 2 && ReadFrame(connection, frame))
+            {
+                pongs.push_back(frame);
+            }
+
+            // An unsolicited pong is ignored
+            connection.Write(MakeFrame(WS_OPCODE_PONG, "xyz") + MakeFrame(WS_OPCODE_TEXT, "after"));
+            FinishCloseHandshake(connection);
+        } };
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            TestWebSocket websocket;
+            VERIFY_ARE_EQUAL(S_OK, websocket.Connect(server.Url("ws", "/")));
+            VERIFY_IS_TRUE(websocket.WaitForMessages(1));
+            VERIFY_ARE_EQUAL_STR("after", websocket.Messages()[0].payload);
+
+            VERIFY_ARE_EQUAL(2u, pongs.size());
+            for (const auto& pong : pongs)
+            {
+                VERIFY_ARE_EQUAL(WS_OPCODE_PONG, pong.opcode);
+                VERIFY_IS_TRUE(pong.masked);
+                VERIFY_IS_TRUE(pong.fin);
+            }
+            VERIFY_ARE_EQUAL_STR("", pongs[0].payload);
+            VERIFY_ARE_EQUAL_STR("abc", pongs[1].payload);
+
+            VERIFY_ARE_EQUAL(S_OK, HCWebSocketDisconnect(websocket.Handle()));
+            VERIFY_IS_TRUE(websocket.WaitForClose());
+        }
+        HCCleanup();
+    }
+
+    DEFINE_TEST_CASE(TestCloseHandshake)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestCloseHandshake);
+
+        uint32_t clientCloseStatus = 0;
+        WsFrame echoedClose;
+        bool closedAfterEcho = false;
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            std::string request;
+            AcceptUpgrade(connection, nullptr, &request);
+            if (request.find("GET /server-close") == 0)
+            {
+                // The client echoes the server's status and waits for the
+                // server to drop the connection
+                connection.Write(CloseFrame(4001));
+                ReadDataFrame(connection, echoedClose);
+                return;
+            }
+
+            clientCloseStatus = FinishCloseHandshake(connection);
+            closedAfterEcho = connection.WaitForClose();
+        } };
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            TestWebSocket websocket;
+            VERIFY_ARE_EQUAL(S_OK, websocket.Connect(server.Url("ws", "/")));
+            VERIFY_ARE_EQUAL(S_OK, HCWebSocketDisconnect(websocket.Handle()));
+            VERIFY_IS_TRUE(websocket.WaitForClose());
+            VERIFY_IS_TRUE(websocket.CloseStatus() == HCWebSocketCloseStatus::Normal);
+        }
+        {
+            TestWebSocket websocket;
+            VERIFY_ARE_EQUAL(S_OK, websocket.Connect(server.Url("ws", "/server-close")));
+            VERIFY_IS_TRUE(websocket.WaitForClose());
+            VERIFY_ARE_EQUAL(4001u, static_cast<uint32_t>(websocket.CloseStatus()));
+        }
+        HCCleanup();
+
+        // The client closes the TCP connection once its close is answered
+        VERIFY_ARE_EQUAL(1000u, clientCloseStatus);
+        VERIFY_IS_TRUE(closedAfterEcho);
+        VERIFY_ARE_EQUAL(WS_OPCODE_CLOSE, echoedClose.opcode);
+        VERIFY_IS_TRUE(echoedClose.masked);
+        VERIFY_ARE_EQUAL(4001u, CloseStatus(echoedClose));
+    }
+
+    DEFINE_TEST_CASE(TestDeflateAccepted)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestDeflateAccepted);
+
+        std::string offer;
+        std::vector<WsFrame> received;
+        std::string text;
+        for (int i = 0; i < 200; ++i)
+        {
+            text += "compressible text " + std::to_string(i % 10) + " ";
+        }
+
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            std::string request;
+            AcceptUpgrade(connection, WS_DEFLATE_RESPONSE, &request);
+            offer = HeaderValue(request, "Sec-WebSocket-Extensions");
+
+            connection.Write(MakeFrame(WS_OPCODE_TEXT, Deflate(text), true, true));
+
+            WsFrame frame;
+            while (ReadDataFrame(connection, frame) && frame.opcode != WS_OPCODE_CLOSE)
+            {
+                received.push_back(frame);
+            }
+            connection.Write(MakeFrame(WS_OPCODE_CLOSE, frame.payload));
+        } };
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            TestWebSocket websocket;
+            VERIFY_ARE_EQUAL(S_OK, websocket.Connect(server.Url("ws", "/")));
+            VERIFY_IS_TRUE(websocket.WaitForMessages(1));
+            VERIFY_IS_TRUE(text == websocket.Messages()[0].payload);
+
+            // Large enough to compress, and too small to be worth it
+            VERIFY_ARE_EQUAL(S_OK, websocket.Send(text.c_str()));
+            VERIFY_ARE_EQUAL(S_OK, websocket.Send("tiny"));
+
+            VERIFY_ARE_EQUAL(S_OK, HCWebSocketDisconnect(websocket.Handle()));
+            VERIFY_IS_TRUE(websocket.WaitForClose());
+        }
+        HCCleanup();
+
+        VERIFY_ARE_EQUAL(0u, offer.find("permessage-deflate"));
+        VERIFY_ARE_EQUAL(2u, received.size());
+        VERIFY_IS_TRUE(received[0].rsv1);
+        VERIFY_IS_TRUE(received[0].payload.size() < text.size());
+        VERIFY_IS_TRUE(text == Inflate(received[0].payload));
+        VERIFY_IS_FALSE(received[1].rsv1);
+        VERIFY_ARE_EQUAL_STR("tiny", received[1].payload);
+    }
+
+    DEFINE_TEST_CASE(TestDeflateRejected)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestDeflateRejected);
+
+        WsFrame sent;
+        uint32_t failStatus = 0;
+        std::string text(1000, 'x');
+
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            AcceptUpgrade(connection);
+            ReadDataFrame(connection, sent);
+
+            // Compressed data wasn't negotiated, so this fails the connection
+            connection.Write(MakeFrame(WS_OPCODE_TEXT, Deflate(text), true, true));
+            failStatus = FinishCloseHandshake(connection);
+        } };
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            TestWebSocket websocket;
+            VERIFY_ARE_EQUAL(S_OK, websocket.Connect(server.Url("ws", "/")));
+            VERIFY_ARE_EQUAL(S_OK, websocket.Send(text.c_str()));
+            VERIFY_IS_TRUE(websocket.WaitForClose());
+            VERIFY_IS_TRUE(websocket.CloseStatus() == HCWebSocketCloseStatus::ProtocolError);
+            VERIFY_ARE_EQUAL(0u, websocket.Messages().size());
+        }
+        HCCleanup();
+
+        VERIFY_IS_FALSE(sent.rsv1);
+        VERIFY_IS_TRUE(text == sent.payload);
+        VERIFY_ARE_EQUAL(1002u, failStatus);
+    }
+
+    DEFINE_TEST_CASE(TestConnectionsShareReactorThreads)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestConnectionsShareReactorThreads);
+
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            AcceptUpgrade(connection);
+            connection.Write(MakeFrame(WS_OPCODE_TEXT, "first") + MakeFrame(WS_OPCODE_TEXT, "second"));
+            FinishCloseHandshake(connection);
+        } };
+
+        const uint32_t threadCount = 2;
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        VERIFY_ARE_EQUAL(S_OK, HCWebSocketSetReactorThreadCount(threadCount));
+        {
+            // Many more connections than threads, all open at once. Their
+            // callbacks come from the shared reactor threads, never one
+            // thread per connection.
+            std::vector<std::unique_ptr<TestWebSocket>> websockets;
+            for (int i = 0; i < 8; ++i)
+            {
+                websockets.emplace_back(new TestWebSocket());
+                VERIFY_ARE_EQUAL(S_OK, websockets.back()->Connect(server.Url("ws", "/")));
+            }
+
+            std::set<std::thread::id> callbackThreads;
+            for (auto& websocket : websockets)
+            {
+                VERIFY_IS_TRUE(websocket->WaitForMessages(2));
+                auto threads = websocket->CallbackThreads();
+                callbackThreads.insert(threads.begin(), threads.end());
+            }
+            VERIFY_IS_TRUE(callbackThreads.size() <= threadCount);
+            VERIFY_ARE_EQUAL(0u, callbackThreads.count(std::this_thread::get_id()));
+
+            for (auto& websocket : websockets)
+            {
+                VERIFY_ARE_EQUAL(S_OK, HCWebSocketDisconnect(websocket->Handle()));
+                VERIFY_IS_TRUE(websocket->WaitForClose());
+            }
+        }
+        HCCleanup();
+
+        VERIFY_ARE_EQUAL(8u, server.AcceptedCount());
+    }
+
+    DEFINE_TEST_CASE(TestSendLentBuffers)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestSendLentBuffers);
+
+        std::vector<WsFrame> received;
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            AcceptUpgrade(connection);
+            WsFrame frame;
+            while (ReadDataFrame(connection, frame) && frame.opcode != WS_OPCODE_CLOSE)
+            {
+                received.push_back(frame);
+            }
+            connection.Write(MakeFrame(WS_OPCODE_CLOSE, frame.payload));
+        } };
+
+        // Larger than a gather buffer, so it goes out over several writes,
+        // between runs of small messages that share one
+        std::string large(300 * 1024, '\0');
+        for (size_t i = 0; i < large.size(); ++i)
+        {
+            large[i] = static_cast<char>(i % 251);
+        }
+        std::vector<std::string> small;
+        for (int i = 0; i < 16; ++i)
+        {
+            small.push_back("small " + std::to_string(i));
+        }
+
+        ReleasedBuffers released;
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            TestWebSocket websocket;
+
+            // Nothing is sent, or handed back, before the connection is up
+            VERIFY_ARE_EQUAL(E_UNEXPECTED, HCWebSocketSendMessageBuffer(websocket.Handle(), HCWebSocketMessageType::Text, reinterpret_cast<const uint8_t*>("x"), 1, ReleasedBuffers::OnRelease, &released));
+            VERIFY_ARE_EQUAL(S_OK, websocket.Connect(server.Url("ws", "/")));
+            VERIFY_ARE_EQUAL(E_INVALIDARG, HCWebSocketSendMessageBuffer(websocket.Handle(), HCWebSocketMessageType::Text, reinterpret_cast<const uint8_t*>("x"), 1, nullptr, nullptr));
+            VERIFY_ARE_EQUAL(E_INVALIDARG, HCWebSocketSendMessageBuffer(websocket.Handle(), HCWebSocketMessageType::Text, nullptr, 1, ReleasedBuffers::OnRelease, &released));
+
+            for (size_t i = 0; i < small.size() / 2; ++i)
+            {
+                VERIFY_ARE_EQUAL(S_OK, HCWebSocketSendMessageBuffer(websocket.Handle(), HCWebSocketMessageType::Text, reinterpret_cast<const uint8_t*>(small[i].data()), static_cast<uint32_t>(small[i].size()), ReleasedBuffers::OnRelease, &released));
+            }
+            VERIFY_ARE_EQUAL(S_OK, HCWebSocketSendMessageBuffer(websocket.Handle(), HCWebSocketMessageType::Binary, reinterpret_cast<const uint8_t*>(large.data()), static_cast<uint32_t>(large.size()), ReleasedBuffers::OnRelease, &released));
+            VERIFY_ARE_EQUAL(S_OK, HCWebSocketSendMessageBuffer(websocket.Handle(), HCWebSocketMessageType::Binary, nullptr, 0, ReleasedBuffers::OnRelease, &released));
+            for (size_t i = small.size() / 2; i < small.size(); ++i)
+            {
+                VERIFY_ARE_EQUAL(S_OK, HCWebSocketSendMessageBuffer(websocket.Handle(), HCWebSocketMessageType::Text, reinterpret_cast<const uint8_t*>(small[i].data()), static_cast<uint32_t>(small[i].size()), ReleasedBuffers::OnRelease, &released));
+            }
+
+            size_t sent = small.size() + 2;
+            VERIFY_IS_TRUE(released.WaitFor(sent));
+            VERIFY_ARE_EQUAL(S_OK, HCWebSocketDisconnect(websocket.Handle()));
+            VERIFY_IS_TRUE(websocket.WaitForClose());
+
+            // Each buffer comes back once, in send order, untouched: frames
+            // are masked on their way out rather than in the caller's buffer
+            VERIFY_ARE_EQUAL(sent, released.releases.size());
+            for (size_t i = 0; i < sent; ++i)
+            {
+                VERIFY_ARE_EQUAL(S_OK, released.releases[i].result);
+            }
+            VERIFY_IS_TRUE(released.releases[small.size() / 2].bytes == reinterpret_cast<const uint8_t*>(large.data()));
+            VERIFY_ARE_EQUAL(static_cast<uint32_t>(large.size()), released.releases[small.size() / 2].size);
+            VERIFY_ARE_EQUAL(0u, released.releases[small.size() / 2 + 1].size);
+            for (size_t i = 0; i < large.size(); ++i)
+            {
+                if (large[i] != static_cast<char>(i % 251))
+                {
+                    VERIFY_FAIL();
+                }
+            }
+        }
+        HCCleanup();
+
+        VERIFY_ARE_EQUAL(small.size() + 2, received.size());
+        size_t next = 0;
+        for (size_t i = 0; i < received.size(); ++i)
+        {
+            VERIFY_IS_TRUE(received[i].masked);
+            VERIFY_IS_TRUE(received[i].fin);
+            if (i == small.size() / 2)
+            {
+                VERIFY_ARE_EQUAL(WS_OPCODE_BINARY, received[i].opcode);
+                VERIFY_IS_TRUE(large == received[i].payload);
+            }
+            else if (i == small.size() / 2 + 1)
+            {
+                VERIFY_ARE_EQUAL(WS_OPCODE_BINARY, received[i].opcode);
+                VERIFY_ARE_EQUAL(0u, received[i].payload.size());
+            }
+            else
+            {
+                VERIFY_ARE_EQUAL(WS_OPCODE_TEXT, received[i].opcode);
+                VERIFY_ARE_EQUAL_STR(small[next++], received[i].payload);
+            }
+        }
+    }
+
+    DEFINE_TEST_CASE(TestBatchedReceiveLendsStableBuffers)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestBatchedReceiveLendsStableBuffers);
+
+        // Enough traffic in one write to fill and reuse the read buffer many
+        // times over, with reassembled and compressed messages mixed in
+        std::vector<std::string> expected;
+        std::string burst;
+        for (int i = 0; i < 200; ++i)
+        {
+            std::string payload = std::to_string(i) + ":" + std::string(700 + i, static_cast<char>('a' + i % 26));
+            expected.push_back(payload);
+            if (i % 25 == 7)
+            {
+                burst += MakeFrame(WS_OPCODE_BINARY, payload.substr(0, 300), false) + MakeFrame(WS_OPCODE_CONTINUATION, payload.substr(300));
+            }
+            else if (i % 25 == 19)
+            {
+                burst += MakeFrame(WS_OPCODE_TEXT, Deflate(payload), true, true);
+            }
+            else
+            {
+                burst += MakeFrame(i % 2 == 0 ? WS_OPCODE_TEXT : WS_OPCODE_BINARY, payload);
+            }
+        }
+
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            AcceptUpgrade(connection, WS_DEFLATE_RESPONSE);
+            connection.Write(burst);
+            FinishCloseHandshake(connection);
+        } };
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            BatchedTestWebSocket websocket;
+            VERIFY_ARE_EQUAL(S_OK, websocket.Connect(server.Url("ws", "/")));
+            VERIFY_IS_TRUE(websocket.WaitForMessages(expected.size()));
+
+            // Nothing released yet, so every lent payload must still hold
+            // what arrived, though the read buffer has moved on since
+            auto held = websocket.HeldPayloads();
+            VERIFY_ARE_EQUAL(expected.size(), held.size());
+            for (size_t i = 0; i < expected.size(); ++i)
+            {
+                VERIFY_ARE_EQUAL_STR(expected[i], held[i]);
+            }
+            auto messages = websocket.Messages();
+            for (size_t i = 0; i < expected.size(); ++i)
+            {
+                bool binary = i % 25 == 7 || (i % 2 == 1 && i % 25 != 19);
+                VERIFY_IS_TRUE(messages[i].type == (binary ? HCWebSocketMessageType::Binary : HCWebSocketMessageType::Text));
+            }
+
+            websocket.ReleaseBatches();
+            VERIFY_ARE_EQUAL(S_OK, HCWebSocketDisconnect(websocket.Handle()));
+            VERIFY_IS_TRUE(websocket.WaitForClose());
+        }
+        HCCleanup();
+    }
+
+    DEFINE_TEST_CASE(TestInboundQueueLimits)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestInboundQueueLimits);
+
+        const size_t messageCount = 40;
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            std::string request;
+            AcceptUpgrade(connection, nullptr, &request);
+            bool bytes = request.find("GET /bytes") == 0;
+            std::string burst;
+            for (size_t i = 0; i < messageCount; ++i)
+            {
+                burst += MakeFrame(WS_OPCODE_BINARY, std::to_string(i) + std::string(bytes ? 1000 : 10, '.'));
+            }
+            connection.Write(burst);
+            FinishCloseHandshake(connection);
+        } };
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            // Held to 4 messages, or to 3000 bytes
+            BatchedTestWebSocket byCount{ 4, 0 };
+            BatchedTestWebSocket byBytes{ 0, 3000 };
+            VERIFY_ARE_EQUAL(S_OK, byCount.Connect(server.Url("ws", "/count")));
+            VERIFY_ARE_EQUAL(S_OK, byBytes.Connect(server.Url("ws", "/bytes")));
+
+            for (auto websocket : { &byCount, &byBytes })
+            {
+                size_t limit = websocket == &byCount ? 4 : 3;
+                size_t received = 0;
+                while (received < messageCount)
+                {
+                    // Reading stops at the limit, however long the app
+                    // takes, and starts again once it lets go
+                    VERIFY_IS_TRUE(websocket->WaitForHeldMessages(std::min(limit, messageCount - received)));
+                    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                    VERIFY_IS_TRUE(websocket->HeldMessages() <= limit);
+                    received += websocket->HeldMessages();
+                    websocket->ReleaseBatches();
+                }
+                VERIFY_ARE_EQUAL(messageCount, websocket->Messages().size());
+                VERIFY_ARE_EQUAL(limit, websocket->MostHeldMessages());
+
+                auto messages = websocket->Messages();
+                for (size_t i = 0; i < messageCount; ++i)
+                {
+                    VERIFY_ARE_EQUAL(0u, messages[i].payload.find(std::to_string(i) + "."));
+                }
+
+                VERIFY_ARE_EQUAL(S_OK, HCWebSocketDisconnect(websocket->Handle()));
+                VERIFY_IS_TRUE(websocket->WaitForClose());
+            }
+        }
+        HCCleanup();
+    }
+
+    DEFINE_TEST_CASE(TestQueueFailureFailsConnection)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestQueueFailureFailsConnection);
+
+        std::mutex lock;
+        std::condition_variable changed;
+        bool armed = false;
+        uint32_t failStatus = 0;
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            AcceptUpgrade(connection);
+            connection.Write(MakeFrame(WS_OPCODE_TEXT, "kept"));
+            {
+                std::unique_lock<std::mutex> waitLock{ lock };
+                changed.wait_for(waitLock, std::chrono::seconds(LOOPBACK_TIMEOUT_SECONDS), [&]() { return armed; });
+            }
+            connection.Write(MakeFrame(WS_OPCODE_TEXT, "lost") + MakeFrame(WS_OPCODE_TEXT, "after"));
+            failStatus = FinishCloseHandshake(connection);
+        } };
+
+        g_failedAllocs = 0;
+        VERIFY_ARE_EQUAL(S_OK, HCMemSetFunctions(FailingMemAlloc, FailingMemFree));
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            BatchedTestWebSocket websocket;
+            VERIFY_ARE_EQUAL(S_OK, websocket.Connect(server.Url("ws", "/")));
+            VERIFY_IS_TRUE(websocket.WaitForMessages(1));
+
+            // With the first batch still held, the next message needs a new
+            // one. Failing to allocate it must not drop the message quietly.
+            g_failAllocSize = sizeof(HC_WEBSOCKET_MESSAGE_BATCH);
+            {
+                std::lock_guard<std::mutex> armLock{ lock };
+                armed = true;
+                changed.notify_all();
+            }
+
+            VERIFY_IS_TRUE(websocket.WaitForClose());
+            VERIFY_IS_TRUE(websocket.CloseStatus() == HCWebSocketCloseStatus::ServerTerminate);
+            VERIFY_ARE_EQUAL(1u, websocket.Messages().size());
+            VERIFY_ARE_EQUAL(1u, g_failedAllocs.load());
+        }
+        HCCleanup();
+        g_failAllocSize = 0;
+        VERIFY_ARE_EQUAL(S_OK, HCMemSetFunctions(nullptr, nullptr));
+
+        VERIFY_ARE_EQUAL(1011u, failStatus);
+    }
+
+    DEFINE_TEST_CASE(TestFragmentReceiveOrdering)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestFragmentReceiveOrdering);
+
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            AcceptUpgrade(connection);
+            connection.Write(
+                MakeFrame(WS_OPCODE_TEXT, "ab", false) +
+                MakeFrame(WS_OPCODE_CONTINUATION, "cd", false) +
+                MakeFrame(WS_OPCODE_CONTINUATION, "ef") +
+                MakeFrame(WS_OPCODE_BINARY, "single") +
+                MakeFrame(WS_OPCODE_BINARY, "", false) +
+                MakeFrame(WS_OPCODE_CONTINUATION, ""));
+
+            // A continuation with no message to continue fails the connection
+            connection.Write(MakeFrame(WS_OPCODE_CONTINUATION, "stray"));
+            connection.Write(CloseFrame(1000));
+            FinishCloseHandshake(connection);
+        } };
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            FragmentTestWebSocket websocket;
+            VERIFY_ARE_EQUAL(S_OK, websocket.Connect(server.Url("ws", "/")));
+            VERIFY_IS_TRUE(websocket.WaitForMessages(3));
+            VERIFY_IS_TRUE(websocket.WaitForClose());
+            VERIFY_IS_TRUE(websocket.CloseStatus() == HCWebSocketCloseStatus::ProtocolError);
+
+            auto messages = websocket.Messages();
+            VERIFY_ARE_EQUAL(3u, messages.size());
+            VERIFY_IS_TRUE(messages[0].type == HCWebSocketMessageType::Text);
+            VERIFY_ARE_EQUAL_STR("abcdef", messages[0].payload);
+            VERIFY_IS_TRUE(messages[1].type == HCWebSocketMessageType::Binary);
+            VERIFY_ARE_EQUAL_STR("single", messages[1].payload);
+            VERIFY_IS_TRUE(messages[2].type == HCWebSocketMessageType::Binary);
+            VERIFY_ARE_EQUAL_STR("", messages[2].payload);
+
+            // Pieces of a message keep its type, and only its last is final
+            auto fragments = websocket.Fragments();
+            size_t message = 0;
+            for (size_t i = 0; i < fragments.size(); ++i)
+            {
+                VERIFY_IS_TRUE(fragments[i].type == messages[message].type);
+                if (fragments[i].isFinal)
+                {
+                    ++message;
+                }
+            }
+            VERIFY_ARE_EQUAL(3u, message);
+            VERIFY_IS_TRUE(fragments.back().isFinal);
+        }
+        HCCleanup();
+    }
+
+    DEFINE_TEST_CASE(TestFragmentSendOrdering)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestFragmentSendOrdering);
+
+        std::vector<WsFrame> received;
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            AcceptUpgrade(connection, WS_DEFLATE_RESPONSE);
+            WsFrame frame;
+            while (ReadDataFrame(connection, frame) && frame.opcode != WS_OPCODE_CLOSE)
+            {
+                received.push_back(frame);
+            }
+            connection.Write(MakeFrame(WS_OPCODE_CLOSE, frame.payload));
+        } };
+
+        std::string large(1000, 'L');
+        ReleasedBuffers released;
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            TestWebSocket websocket;
+            VERIFY_ARE_EQUAL(S_OK, websocket.Connect(server.Url("ws", "/")));
+
+            auto sendFragment = [&](HCWebSocketMessageType type, const std::string& payload, bool isFinal)
+            {
+                return HCWebSocketSendMessageFragment(websocket.Handle(), type, reinterpret_cast<const uint8_t*>(payload.data()), static_cast<uint32_t>(payload.size()), isFinal, ReleasedBuffers::OnRelease, &released);
+            };
+            std::string he("he"), ll("ll"), o("o"), interloper("interloper");
+
+            // Only the first fragment's type counts, large fragments aren't
+            // compressed, and a whole message can't cut in
+            VERIFY_ARE_EQUAL(S_OK, sendFragment(HCWebSocketMessageType::Text, he, false));
+            VERIFY_ARE_EQUAL(S_OK, sendFragment(HCWebSocketMessageType::Binary, large, false));
+            VERIFY_ARE_EQUAL(S_OK, HCWebSocketSendMessageBuffer(websocket.Handle(), HCWebSocketMessageType::Text, reinterpret_cast<const uint8_t*>(interloper.data()), static_cast<uint32_t>(interloper.size()), ReleasedBuffers::OnRelease, &released));
+            VERIFY_ARE_EQUAL(S_OK, sendFragment(HCWebSocketMessageType::Binary, ll, false));
+            VERIFY_ARE_EQUAL(S_OK, sendFragment(HCWebSocketMessageType::Binary, o, true));
+
+            // A whole message after the final fragment goes out as usual
+            VERIFY_ARE_EQUAL(S_OK, sendFragment(HCWebSocketMessageType::Binary, interloper, true));
+
+            VERIFY_IS_TRUE(released.WaitFor(6));
+            VERIFY_ARE_EQUAL(S_OK, HCWebSocketDisconnect(websocket.Handle()));
+            VERIFY_IS_TRUE(websocket.WaitForClose());
+
+            // Every buffer comes back, and only the interloper unsent
+            VERIFY_ARE_EQUAL(6u, released.releases.size());
+            for (const auto& release : released.releases)
+            {
+                if (release.bytes == reinterpret_cast<const uint8_t*>(interloper.data()) && release.result != S_OK)
+                {
+                    VERIFY_ARE_EQUAL(E_UNEXPECTED, release.result);
+                }
+                else
+                {
+                    VERIFY_ARE_EQUAL(S_OK, release.result);
+                }
+            }
+            VERIFY_ARE_EQUAL(1u, static_cast<uint32_t>(std::count_if(released.releases.begin(), released.releases.end(), [](const ReleasedBuffers::Release& release) { return release.result != S_OK; })));
+        }
+        HCCleanup();
+
+        VERIFY_ARE_EQUAL(5u, received.size());
+        uint8_t opcodes[] = { WS_OPCODE_TEXT, WS_OPCODE_CONTINUATION, WS_OPCODE_CONTINUATION, WS_OPCODE_CONTINUATION, WS_OPCODE_BINARY };
+        bool fins[] = { false, false, false, true, true };
+        std::string payloads[] = { "he", large, "ll", "o", "interloper" };
+        for (size_t i = 0; i < received.size(); ++i)
+        {
+            VERIFY_ARE_EQUAL(opcodes[i], received[i].opcode);
+            VERIFY_ARE_EQUAL(fins[i], received[i].fin);
+            VERIFY_IS_FALSE(received[i].rsv1);
+            VERIFY_IS_TRUE(received[i].masked);
+            VERIFY_ARE_EQUAL_STR(payloads[i], received[i].payload);
+        }
+    }
+
+    DEFINE_TEST_CASE(TestControlFrameMidMessage)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestControlFrameMidMessage);
+
+        std::vector<WsFrame> pongs;
+        std::mutex lock;
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            AcceptUpgrade(connection);
+
+            // The pong has to come back while the message is still open
+            for (int i = 0; i < 2; ++i)
+            {
+                connection.Write(MakeFrame(WS_OPCODE_TEXT, "first ", false) + MakeFrame(WS_OPCODE_PING, "mid"));
+                WsFrame pong;
+                ReadFrame(connection, pong);
+                {
+                    std::lock_guard<std::mutex> pongLock{ lock };
+                    pongs.push_back(pong);
+                }
+                connection.Write(MakeFrame(WS_OPCODE_CONTINUATION, "second ", false) + MakeFrame(WS_OPCODE_PONG, "") + MakeFrame(WS_OPCODE_CONTINUATION, "third"));
+            }
+            FinishCloseHandshake(connection);
+        } };
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            TestWebSocket whole;
+            FragmentTestWebSocket pieces;
+            for (TestWebSocket* websocket : { &whole, static_cast<TestWebSocket*>(&pieces) })
+            {
+                VERIFY_ARE_EQUAL(S_OK, websocket->Connect(server.Url("ws", "/")));
+                VERIFY_IS_TRUE(websocket->WaitForMessages(2));
+                auto messages = websocket->Messages();
+                VERIFY_ARE_EQUAL(2u, messages.size());
+                for (const auto& message : messages)
+                {
+                    VERIFY_IS_TRUE(message.type == HCWebSocketMessageType::Text);
+                    VERIFY_ARE_EQUAL_STR("first second third", message.payload);
+                }
+                VERIFY_ARE_EQUAL(S_OK, HCWebSocketDisconnect(websocket->Handle()));
+                VERIFY_IS_TRUE(websocket->WaitForClose());
+            }
+        }
+        HCCleanup();
+
+        VERIFY_ARE_EQUAL(4u, pongs.size());
+        for (const auto& pong : pongs)
+        {
+            VERIFY_ARE_EQUAL(WS_OPCODE_PONG, pong.opcode);
+            VERIFY_ARE_EQUAL_STR("mid", pong.payload);
+        }
+    }
+
+    DEFINE_TEST_CASE(TestOversizedFragmentedMessage)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestOversizedFragmentedMessage);
+
+        // Each frame is well under the size limit; the message they make up
+        // is just over it
+        const size_t fragmentSize = 1024 * 1024;
+        const size_t fragmentCount = GENERIC_WEBSOCKET_MAX_MESSAGE_BYTES / fragmentSize + 1;
+        std::vector<uint32_t> closeStatuses;
+        std::mutex lock;
+        LoopbackServer server{ [&](LoopbackConnection& connection)
+        {
+            AcceptUpgrade(connection);
+            std::string fragment(fragmentSize, 'x');
+            bool written = true;
+            for (size_t i = 0; i < fragmentCount && written; ++i)
+            {
+                written = connection.Write(MakeFrame(i == 0 ? WS_OPCODE_BINARY : WS_OPCODE_CONTINUATION, fragment, i + 1 == fragmentCount));
+            }
+            connection.Write(MakeFrame(WS_OPCODE_TEXT, "after"));
+
+            uint32_t status = FinishCloseHandshake(connection);
+            std::lock_guard<std::mutex> statusLock{ lock };
+            closeStatuses.push_back(status);
+        } };
+
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        {
+            // Put together whole, it's refused
+            TestWebSocket whole;
+            VERIFY_ARE_EQUAL(S_OK, whole.Connect(server.Url("ws", "/")));
+            VERIFY_IS_TRUE(whole.WaitForClose());
+            VERIFY_IS_TRUE(whole.CloseStatus() == HCWebSocketCloseStatus::TooLarge);
+            VERIFY_ARE_EQUAL(0u, whole.Messages().size());
+
+            // Streamed, the limit doesn't apply
+            FragmentTestWebSocket pieces;
+            VERIFY_ARE_EQUAL(S_OK, pieces.Connect(server.Url("ws", "/")));
+            VERIFY_IS_TRUE(pieces.WaitForMessages(2));
+            auto messages = pieces.Messages();
+            VERIFY_ARE_EQUAL_STR(std::to_string(fragmentSize * fragmentCount) + " bytes", messages[0].payload);
+            VERIFY_ARE_EQUAL_STR("after", messages[1].payload);
+            VERIFY_ARE_EQUAL(S_OK, HCWebSocketDisconnect(pieces.Handle()));
+            VERIFY_IS_TRUE(pieces.WaitForClose());
+        }
+        HCCleanup();
+
+        std::sort(closeStatuses.begin(), closeStatuses.end());
+        VERIFY_ARE_EQUAL(2u, closeStatuses.size());
+        VERIFY_ARE_EQUAL(1000u, closeStatuses[0]);
+        VERIFY_ARE_EQUAL(1009u, closeStatuses[1]);
+    }
+};
+
+NAMESPACE_XBOX_HTTP_CLIENT_TEST_END
+
+#endif
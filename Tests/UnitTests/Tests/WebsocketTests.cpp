@@ -122,6 +122,83 @@ HRESULT Test_Internal_HCWebSocketSendBinaryMessageAsync(
     return S_OK;
 }
 
+HRESULT CALLBACK Test_Completing_HCWebSocketSendBinaryMessageAsync(
+    _In_ HCWebsocketHandle websocket,
+    _In_reads_bytes_(payloadSize) const uint8_t* payloadBytes,
+    _In_ uint32_t payloadSize,
+    _Inout_ XAsyncBlock* asyncBlock,
+    _In_opt_ void* context
+)
+{
+    g_HCWebSocketSendBinaryMessage_Called = true;
+    HRESULT hr = XAsyncBegin(asyncBlock, websocket, (void*)HCWebSocketSendMessageAsync, __FUNCTION__,
+        [](XAsyncOp op, const XAsyncProviderData* data)
+    {
+        if (op == XAsyncOp::GetResult)
+        {
+            auto result = reinterpret_cast<WebSocketCompletionResult*>(data->buffer);
+            result->websocket = static_cast<HCWebsocketHandle>(data->context);
+            result->errorCode = S_OK;
+            result->platformErrorCode = 0;
+        }
+        return S_OK;
+    });
+    if (SUCCEEDED(hr))
+    {
+        XAsyncComplete(asyncBlock, S_OK, sizeof(WebSocketCompletionResult));
+    }
+    return hr;
+}
+
+std::atomic<int> g_SendBufferReleaseCount{ 0 };
+HRESULT g_SendBufferReleaseResult = E_PENDING;
+void CALLBACK Test_SendBufferRelease(
+    _In_ HCWebsocketHandle websocket,
+    _In_reads_bytes_(payloadSize) const uint8_t* payloadBytes,
+    _In_ uint32_t payloadSize,
+    _In_ HRESULT result,
+    _In_opt_ void* context
+)
+{
+    g_SendBufferReleaseResult = result;
+    ++g_SendBufferReleaseCount;
+}
+
+uint32_t g_MessageBatchCount = 0;
+uint32_t g_MessageBatchSize = 0;
+HCWebSocketReceivedMessage g_MessageBatchFirst{};
+void CALLBACK Test_MessageBatch(
+    _In_ HCWebsocketHandle websocket,
+    _In_ HCWebSocketMessageBatchHandle batch,
+    _In_reads_(messageCount) const HCWebSocketReceivedMessage* messages,
+    _In_ uint32_t messageCount,
+    _In_opt_ void* context
+)
+{
+    ++g_MessageBatchCount;
+    g_MessageBatchSize = messageCount;
+    g_MessageBatchFirst = messages[0];
+    VERIFY_ARE_EQUAL(0, memcmp(messages[0].payloadBytes, "first", messages[0].payloadSize));
+    VERIFY_ARE_EQUAL(S_OK, HCWebSocketReleaseMessageBatch(batch));
+}
+
+uint32_t g_MessageFragmentCount = 0;
+uint32_t g_MessageFragmentSize = 0;
+bool g_MessageFragmentFinal = false;
+void CALLBACK Test_MessageFragment(
+    _In_ HCWebsocketHandle websocket,
+    _In_ HCWebSocketMessageType messageType,
+    _In_reads_bytes_(payloadSize) const uint8_t* payloadBytes,
+    _In_ uint32_t payloadSize,
+    _In_ bool isFinalFragment,
+    _In_opt_ void* context
+)
+{
+    ++g_MessageFragmentCount;
+    g_MessageFragmentSize = payloadSize;
+    g_MessageFragmentFinal = isFinalFragment;
+}
+
 bool g_HCWebSocketDisconnect_Called = false;
 HRESULT CALLBACK Test_Internal_HCWebSocketDisconnect(
     _In_ HCWebsocketHandle websocket,
@@ -233,6 +310,153 @@ public:
         HCCleanup();
     }
 
+    DEFINE_TEST_CASE(TestSendMessageBuffer)
+    {
+        VERIFY_ARE_EQUAL(S_OK, HCSetWebSocketFunctions(Test_Internal_HCWebSocketConnectAsync, Test_Internal_HCWebSocketSendMessageAsync, Test_Completing_HCWebSocketSendBinaryMessageAsync, Test_Internal_HCWebSocketDisconnect, nullptr));
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+
+        HCWebsocketHandle websocket;
+        VERIFY_ARE_EQUAL(S_OK, HCWebSocketCreate(&websocket, nullptr, nullptr, nullptr, nullptr));
+
+        const uint8_t payload[] = { 1, 2, 3, 4 };
+        VERIFY_ARE_EQUAL(E_INVALIDARG, HCWebSocketSendMessageBuffer(nullptr, HCWebSocketMessageType::Binary, payload, sizeof(payload), Test_SendBufferRelease, nullptr));
+        VERIFY_ARE_EQUAL(E_INVALIDARG, HCWebSocketSendMessageBuffer(websocket, HCWebSocketMessageType::Binary, nullptr, sizeof(payload), Test_SendBufferRelease, nullptr));
+        VERIFY_ARE_EQUAL(E_INVALIDARG, HCWebSocketSendMessageBuffer(websocket, HCWebSocketMessageType::Binary, payload, sizeof(payload), nullptr, nullptr));
+
+        // An empty message is valid, and its buffer is released like any other
+        g_SendBufferReleaseCount = 0;
+        g_SendBufferReleaseResult = E_PENDING;
+        VERIFY_ARE_EQUAL(S_OK, HCWebSocketSendMessageBuffer(websocket, HCWebSocketMessageType::Binary, payload, 0, Test_SendBufferRelease, nullptr));
+        for (int i = 0; i < 500 && g_SendBufferReleaseCount == 0; i++)
+        {
+            Sleep(10);
+        }
+        VERIFY_ARE_EQUAL(1, g_SendBufferReleaseCount.load());
+        VERIFY_ARE_EQUAL(S_OK, g_SendBufferReleaseResult);
+
+        // Custom providers have no buffer send; the regular send function is used
+        // and the buffer comes back once it completes
+        g_HCWebSocketSendBinaryMessage_Called = false;
+        g_SendBufferReleaseCount = 0;
+        g_SendBufferReleaseResult = E_PENDING;
+        VERIFY_ARE_EQUAL(S_OK, HCWebSocketSendMessageBuffer(websocket, HCWebSocketMessageType::Binary, payload, sizeof(payload), Test_SendBufferRelease, nullptr));
+        VERIFY_ARE_EQUAL(true, g_HCWebSocketSendBinaryMessage_Called);
+        for (int i = 0; i < 500 && g_SendBufferReleaseCount == 0; i++)
+        {
+            Sleep(10);
+        }
+        VERIFY_ARE_EQUAL(1, g_SendBufferReleaseCount.load());
+        VERIFY_ARE_EQUAL(S_OK, g_SendBufferReleaseResult);
+
+        VERIFY_ARE_EQUAL(S_OK, HCWebSocketCloseHandle(websocket));
+        HCCleanup();
+    }
+
+    DEFINE_TEST_CASE(TestMessageBatches)
+    {
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+
+        HCWebsocketHandle websocket;
+        VERIFY_ARE_EQUAL(S_OK, HCWebSocketCreate(&websocket, Internal_HCWebSocketMessage, Internal_HCWebSocketBinaryMessage, nullptr, nullptr));
+
+        XTaskQueueHandle queue;
+        VERIFY_ARE_EQUAL(S_OK, XTaskQueueCreate(XTaskQueueDispatchMode::Manual, XTaskQueueDispatchMode::Manual, &queue));
+        VERIFY_ARE_EQUAL(E_INVALIDARG, HCWebSocketSetMessageBatchFunction(nullptr, queue, Test_MessageBatch, nullptr));
+        VERIFY_ARE_EQUAL(E_INVALIDARG, HCWebSocketSetInboundQueueLimits(nullptr, 16, 0));
+        VERIFY_ARE_EQUAL(E_INVALIDARG, HCWebSocketReleaseMessageBatch(nullptr));
+        VERIFY_ARE_EQUAL(S_OK, HCWebSocketSetMessageBatchFunction(websocket, queue, Test_MessageBatch, nullptr));
+        VERIFY_ARE_EQUAL(S_OK, HCWebSocketSetInboundQueueLimits(websocket, 16, 1024));
+
+        // Messages from the provider are held until the app's queue runs, and
+        // then arrive together
+        HCWebSocketMessageFunction messageFunc = nullptr;
+        HCWebSocketBinaryMessageFunction binaryMessageFunc = nullptr;
+        void* context = nullptr;
+        VERIFY_ARE_EQUAL(S_OK, HCWebSocketGetEventFunctions(websocket, &messageFunc, &binaryMessageFunc, nullptr, &context));
+        const uint8_t payload[] = { 1, 2, 3, 4 };
+        messageFunc(websocket, "first", context);
+        binaryMessageFunc(websocket, payload, sizeof(payload), context);
+
+        g_MessageBatchCount = 0;
+        VERIFY_ARE_EQUAL(true, XTaskQueueDispatch(queue, XTaskQueuePort::Completion, 0));
+        VERIFY_ARE_EQUAL(1u, g_MessageBatchCount);
+        VERIFY_ARE_EQUAL(2u, g_MessageBatchSize);
+        VERIFY_ARE_EQUAL(true, g_MessageBatchFirst.messageType == HCWebSocketMessageType::Text);
+        VERIFY_ARE_EQUAL(5u, g_MessageBatchFirst.payloadSize);
+
+        VERIFY_ARE_EQUAL(S_OK, HCWebSocketCloseHandle(websocket));
+        XTaskQueueCloseHandle(queue);
+        HCCleanup();
+    }
+
+    DEFINE_TEST_CASE(TestMessageFragments)
+    {
+        VERIFY_ARE_EQUAL(S_OK, HCSetWebSocketFunctions(Test_Internal_HCWebSocketConnectAsync, Test_Internal_HCWebSocketSendMessageAsync, Test_Completing_HCWebSocketSendBinaryMessageAsync, Test_Internal_HCWebSocketDisconnect, nullptr));
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+
+        HCWebsocketHandle websocket;
+        VERIFY_ARE_EQUAL(S_OK, HCWebSocketCreate(&websocket, Internal_HCWebSocketMessage, Internal_HCWebSocketBinaryMessage, nullptr, nullptr));
+        VERIFY_ARE_EQUAL(E_INVALIDARG, HCWebSocketSetMessageFragmentFunction(nullptr, Test_MessageFragment, nullptr));
+        VERIFY_ARE_EQUAL(S_OK, HCWebSocketSetMessageFragmentFunction(websocket, Test_MessageFragment, nullptr));
+
+        // Providers that only deliver whole messages pass them on as one final
+        // fragment
+        HCWebSocketMessageFunction messageFunc = nullptr;
+        HCWebSocketBinaryMessageFunction binaryMessageFunc = nullptr;
+        void* context = nullptr;
+        VERIFY_ARE_EQUAL(S_OK, HCWebSocketGetEventFunctions(websocket, &messageFunc, &binaryMessageFunc, nullptr, &context));
+        g_MessageFragmentCount = 0;
+        messageFunc(websocket, "whole", context);
+        VERIFY_ARE_EQUAL(1u, g_MessageFragmentCount);
+        VERIFY_ARE_EQUAL(5u, g_MessageFragmentSize);
+        VERIFY_ARE_EQUAL(true, g_MessageFragmentFinal);
+
+        const uint8_t payload[] = { 1, 2, 3, 4 };
+        VERIFY_ARE_EQUAL(E_INVALIDARG, HCWebSocketSendMessageFragment(nullptr, HCWebSocketMessageType::Binary, payload, sizeof(payload), false, Test_SendBufferRelease, nullptr));
+        VERIFY_ARE_EQUAL(E_INVALIDARG, HCWebSocketSendMessageFragment(websocket, HCWebSocketMessageType::Binary, nullptr, sizeof(payload), false, Test_SendBufferRelease, nullptr));
+        VERIFY_ARE_EQUAL(E_INVALIDARG, HCWebSocketSendMessageFragment(websocket, HCWebSocketMessageType::Binary, payload, sizeof(payload), false, nullptr, nullptr));
+
+        // Custom providers only send whole messages, so fragments are handed
+        // back as they're copied and the message goes out with the last one
+        g_HCWebSocketSendBinaryMessage_Called = false;
+        g_SendBufferReleaseCount = 0;
+        g_SendBufferReleaseResult = E_PENDING;
+        VERIFY_ARE_EQUAL(S_OK, HCWebSocketSendMessageFragment(websocket, HCWebSocketMessageType::Binary, payload, sizeof(payload), false, Test_SendBufferRelease, nullptr));
+        VERIFY_ARE_EQUAL(false, g_HCWebSocketSendBinaryMessage_Called);
+        VERIFY_ARE_EQUAL(1, g_SendBufferReleaseCount.load());
+        VERIFY_ARE_EQUAL(S_OK, HCWebSocketSendMessageFragment(websocket, HCWebSocketMessageType::Binary, payload, sizeof(payload), true, Test_SendBufferRelease, nullptr));
+        VERIFY_ARE_EQUAL(true, g_HCWebSocketSendBinaryMessage_Called);
+        for (int i = 0; i < 500 && g_SendBufferReleaseCount < 2; i++)
+        {
+            Sleep(10);
+        }
+        VERIFY_ARE_EQUAL(2, g_SendBufferReleaseCount.load());
+        VERIFY_ARE_EQUAL(S_OK, g_SendBufferReleaseResult);
+
+        VERIFY_ARE_EQUAL(S_OK, HCWebSocketCloseHandle(websocket));
+        HCCleanup();
+    }
+
+    DEFINE_TEST_CASE(TestReactorThreadCount)
+    {
+        DEFINE_TEST_CASE_PROPERTIES(TestReactorThreadCount);
+
+        VERIFY_ARE_EQUAL(E_HC_NOT_INITIALISED, HCWebSocketSetReactorThreadCount(2));
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        VERIFY_ARE_EQUAL(1u, get_http_singleton(false)->m_websocketReactorThreadCount.load());
+
+        VERIFY_ARE_EQUAL(E_INVALIDARG, HCWebSocketSetReactorThreadCount(0));
+        VERIFY_ARE_EQUAL(1u, get_http_singleton(false)->m_websocketReactorThreadCount.load());
+        VERIFY_ARE_EQUAL(S_OK, HCWebSocketSetReactorThreadCount(4));
+        VERIFY_ARE_EQUAL(4u, get_http_singleton(false)->m_websocketReactorThreadCount.load());
+
+        HCCleanup();
+
+        // HCCleanup puts the default back
+        VERIFY_ARE_EQUAL(S_OK, HCInitialize(nullptr));
+        VERIFY_ARE_EQUAL(1u, get_http_singleton(false)->m_websocketReactorThreadCount.load());
+        HCCleanup();
+    }
 
     DEFINE_TEST_CASE(TestRequestHeaders)
     {